@@ -0,0 +1,252 @@
+/*
+ ============================================================================
+ Name        : agregador.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Estadisticas por ventanas de las muestras de cada segundo
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "agregador.h"
+
+const char *nombres_series[NUM_SERIES]={"power", "limit", "import", "dcv", "dci"};
+const char *unidades_series[NUM_SERIES]={"W", "%", "W", "V", "A"};
+
+/*
+ * Cubeta del histograma de un valor. Las cubetas van de menor a mayor valor
+ */
+static int cubeta(float valor){
+	float absoluto=fabsf(valor), mantisa;
+	int exponente, octava, sub, i;
+
+	if (!(absoluto>=ldexpf(1, OCTAVA_MINIMA_AGREGADO))){
+		return CUBETAS_SIGNO_AGREGADO; // cerca de 0 (o NaN)
+	}
+	mantisa=frexpf(absoluto, &exponente); // absoluto=mantisa*2^exponente, mantisa en [0.5, 1)
+	octava=exponente-1;
+	sub=(int)((2*mantisa-1)*SUBCUBETAS_AGREGADO);
+	if (octava>OCTAVA_MAXIMA_AGREGADO){
+		octava=OCTAVA_MAXIMA_AGREGADO;
+		sub=SUBCUBETAS_AGREGADO-1;
+	}
+	i=(octava-OCTAVA_MINIMA_AGREGADO)*SUBCUBETAS_AGREGADO+sub;
+	return valor>0?CUBETAS_SIGNO_AGREGADO+1+i:CUBETAS_SIGNO_AGREGADO-1-i;
+}
+
+/*
+ * Valores entre los que esta una cubeta
+ */
+static void limites_cubeta(int c, float *inferior, float *superior){
+	float cero=ldexpf(1, OCTAVA_MINIMA_AGREGADO);
+	int i, octava, sub;
+
+	if (c==CUBETAS_SIGNO_AGREGADO){
+		*inferior=-cero;
+		*superior=cero;
+		return;
+	}
+	i=c>CUBETAS_SIGNO_AGREGADO?c-CUBETAS_SIGNO_AGREGADO-1:CUBETAS_SIGNO_AGREGADO-1-c;
+	octava=i/SUBCUBETAS_AGREGADO+OCTAVA_MINIMA_AGREGADO;
+	sub=i%SUBCUBETAS_AGREGADO;
+	*inferior=ldexpf(1+(float)sub/SUBCUBETAS_AGREGADO, octava);
+	*superior=ldexpf(1+(float)(sub+1)/SUBCUBETAS_AGREGADO, octava);
+	if (c<CUBETAS_SIGNO_AGREGADO){
+		float inferior_positivo=*inferior;
+
+		*inferior=-*superior;
+		*superior=-inferior_positivo;
+	}
+}
+
+/*
+ * Valor por debajo del cual queda la fraccion p de las muestras, interpolando dentro de la cubeta
+ * y sin salir del minimo y maximo anotados
+ */
+static float percentil(const struct acumulado_serie *a, double p){
+	double objetivo=p*a->n, acumulado=0;
+	float inferior, superior, valor;
+	int c;
+
+	if (a->n==0){
+		return 0;
+	}
+	for (c=0; c<CUBETAS_AGREGADO-1; c++){
+		if (acumulado+a->cubeta[c]>=objetivo && a->cubeta[c]){
+			break;
+		}
+		acumulado+=a->cubeta[c];
+	}
+	limites_cubeta(c, &inferior, &superior);
+	valor=inferior+(superior-inferior)*(objetivo-acumulado)/(a->cubeta[c]?a->cubeta[c]:1);
+	return valor<a->minimo?a->minimo:valor>a->maximo?a->maximo:valor;
+}
+
+static void pon_percentiles(const struct ventana *v, struct resumen_ventana *r){
+	int s;
+
+	for (s=0; s<NUM_SERIES; s++){
+		r->serie[s].p50=percentil(&v->acumulado[s], 0.50);
+		r->serie[s].p90=percentil(&v->acumulado[s], 0.90);
+		r->serie[s].p99=percentil(&v->acumulado[s], 0.99);
+	}
+}
+
+static void empieza_ventana(struct ventana *v, int64_t minuto){
+	int s;
+
+	memset(v->acumulado, 0, sizeof(v->acumulado));
+	memset(&v->en_curso, 0, sizeof(v->en_curso));
+	for (s=0; s<NUM_SERIES; s++){
+		v->acumulado[s].minimo=FLT_MAX;
+		v->acumulado[s].maximo=-FLT_MAX;
+	}
+	v->inicio=minuto-minuto%v->minutos;
+	v->en_curso.minutos=v->minutos;
+	v->en_curso.inicio=v->inicio;
+}
+
+/*
+ * Configura las ventanas a partir de la opcion -w (NULL: VENTANAS_DEFECTO), p.e. "5m,15m,1h,1d".
+ * Cada ventana debe dividir el dia para quedar alineada con la medianoche local.
+ * minuto es el minuto local en curso. Devuelve -1 si la opcion no es valida
+ */
+int ag_inicia(struct agregador *ag, const char *opcion, int64_t minuto){
+	const char *p=opcion!=NULL?opcion:VENTANAS_DEFECTO;
+	char *fin;
+	long minutos;
+	int v;
+
+	memset(ag, 0, sizeof(*ag));
+	while (*p){
+		minutos=strtol(p, &fin, 10);
+		if (fin==p){
+			return -1;
+		}
+		p=fin;
+		switch (*p){
+		case 'd':
+			minutos*=24;
+			/* fall through */
+		case 'h':
+			minutos*=60;
+			/* fall through */
+		case 'm':
+			p++;
+			break;
+		}
+		if (minutos<=0 || minutos>1440 || 1440%minutos || ag->num_ventanas==MAX_VENTANAS){
+			return -1;
+		}
+		ag->ventana[ag->num_ventanas++].minutos=minutos;
+		if (*p==',') p++;
+		else if (*p) return -1;
+	}
+	if (ag->num_ventanas==0){
+		return -1;
+	}
+	ag->minuto=minuto;
+	for (v=0; v<ag->num_ventanas; v++){
+		empieza_ventana(&ag->ventana[v], minuto);
+		ag->ventana[v].cerrada.minutos=ag->ventana[v].minutos;
+	}
+	return 0;
+}
+
+/*
+ * Pasa al minuto local indicado (el de reloj.minuto, que no retrocede por un ajuste de NTP):
+ * cierra las ventanas que han terminado y actualiza los percentiles de las que siguen.
+ * Se llama en cada ciclo antes de anotar su muestra. Devuelve un bit por ventana cerrada
+ */
+int ag_avanza(struct agregador *ag, int64_t minuto){
+	struct ventana *v;
+	int i, cerradas=0;
+
+	if (minuto==ag->minuto){
+		return 0;
+	}
+	for (i=0; i<ag->num_ventanas; i++){
+		v=&ag->ventana[i];
+		pon_percentiles(v, &v->en_curso);
+		if (minuto-minuto%v->minutos!=v->inicio){
+			v->cerrada=v->en_curso;
+			empieza_ventana(v, minuto);
+			cerradas|=1<<i;
+		}
+	}
+	ag->minuto=minuto;
+	return cerradas;
+}
+
+/*
+ * Anota la muestra del ciclo en todas las ventanas
+ */
+void ag_anota(struct agregador *ag, const struct muestra_bin *muestra){
+	float valor[NUM_SERIES];
+	struct acumulado_serie *a;
+	struct resultado_serie *r;
+	double delta;
+	int i, s, series;
+
+	valor[SE_POTENCIA]=muestra->potencia_generada;
+	valor[SE_LIMITE]=muestra->limite;
+	valor[SE_IMPORTADA]=muestra->potencia_importada;
+	valor[SE_TENSION_DC]=muestra->tension_dc/10.0f;
+	valor[SE_CORRIENTE_DC]=muestra->corriente_dc/100.0f;
+	// los valores DC de un ciclo sin respuesta no son medidas
+	series=muestra->estado & ESTADO_MUESTRA_VALIDA?NUM_SERIES:SE_TENSION_DC;
+
+	for (i=0; i<ag->num_ventanas; i++){
+		for (s=0; s<series; s++){
+			a=&ag->ventana[i].acumulado[s];
+			r=&ag->ventana[i].en_curso.serie[s];
+			a->n++;
+			if (valor[s]<a->minimo){
+				a->minimo=valor[s];
+			}
+			if (valor[s]>a->maximo){
+				a->maximo=valor[s];
+			}
+			delta=valor[s]-a->media;
+			a->media+=delta/a->n;
+			a->m2+=delta*(valor[s]-a->media);
+			a->cubeta[cubeta(valor[s])]++;
+			r->n=a->n;
+			r->minimo=a->minimo;
+			r->maximo=a->maximo;
+			r->media=a->media;
+			r->desviacion=sqrt(a->m2/a->n);
+		}
+	}
+}
+
+/*
+ * Indice de la ventana de la duracion indicada o -1 si no se ha configurado
+ */
+int ag_busca(const struct agregador *ag, int minutos){
+	int i;
+
+	for (i=0; i<ag->num_ventanas && ag->ventana[i].minutos!=minutos; i++);
+	return i<ag->num_ventanas?i:-1;
+}
+
+/*
+ * Nombre de una ventana como en la opcion -w: 15m, 1h, 1d...
+ */
+const char *ag_nombre_ventana(int minutos, char *buf, int longitud){
+	if (minutos%1440==0){
+		snprintf(buf, longitud, "%dd", minutos/1440);
+	}
+	else if (minutos%60==0){
+		snprintf(buf, longitud, "%dh", minutos/60);
+	}
+	else {
+		snprintf(buf, longitud, "%dm", minutos);
+	}
+	return buf;
+}
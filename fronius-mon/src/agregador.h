@@ -0,0 +1,98 @@
+/*
+ ============================================================================
+ Name        : agregador.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Estadisticas de las muestras de cada segundo (potencia,
+               limite, potencia importada, tension y corriente DC) en
+               varias ventanas alineadas con el reloj local (por defecto
+               1 minuto, 15 minutos, 1 hora y 1 dia; opcion -w).
+               Cada muestra cuesta lo mismo sea cual sea la ventana:
+               minimo, maximo, media y desviacion tipica incrementales
+               (Welford) y un histograma log-lineal del que se sacan los
+               percentiles aproximados (error relativo por debajo del 4%)
+               solo al cerrar la ventana y una vez por minuto.
+               No hace ninguna operacion de E/S.
+ ============================================================================
+ */
+
+#ifndef AGREGADOR_H_
+#define AGREGADOR_H_
+
+#include <stdint.h>
+
+#include "registro_bin.h"
+
+#define MAX_VENTANAS 6
+#define VENTANAS_DEFECTO "1m,15m,1h,1d"
+
+enum serie{
+	SE_POTENCIA,       // potencia generada (W)
+	SE_LIMITE,         // limite de potencia (%)
+	SE_IMPORTADA,      // potencia importada (W, negativa si se exporta)
+	SE_TENSION_DC,     // tension DC media (V), solo de los ciclos en que responde algun inversor
+	SE_CORRIENTE_DC,   // corriente DC total (A), idem
+	NUM_SERIES
+};
+
+extern const char *nombres_series[NUM_SERIES];
+extern const char *unidades_series[NUM_SERIES];
+
+/*
+ * Histograma log-lineal: SUBCUBETAS_AGREGADO cubetas por potencia de 2 del valor absoluto entre
+ * 2^OCTAVA_MINIMA_AGREGADO y 2^(OCTAVA_MAXIMA_AGREGADO+1), una cubeta para los valores cercanos a 0
+ * y las mismas cubetas para los negativos
+ */
+#define SUBCUBETAS_AGREGADO 16
+#define OCTAVA_MINIMA_AGREGADO -8
+#define OCTAVA_MAXIMA_AGREGADO 16
+#define CUBETAS_SIGNO_AGREGADO ((OCTAVA_MAXIMA_AGREGADO-OCTAVA_MINIMA_AGREGADO+1)*SUBCUBETAS_AGREGADO)
+#define CUBETAS_AGREGADO (2*CUBETAS_SIGNO_AGREGADO+1)
+
+/*
+ * Resultado de una serie en una ventana (publicado en memoria compartida)
+ */
+struct resultado_serie{
+	uint32_t n;        // muestras
+	float minimo;
+	float maximo;
+	float media;
+	float desviacion;  // desviacion tipica
+	float p50, p90, p99;
+};
+
+struct resumen_ventana{
+	int32_t minutos;   // duracion de la ventana
+	int32_t reservado;
+	int64_t inicio;    // comienzo, en minutos desde 1970 de la hora local (minuto*60 con gmtime() da la hora local)
+	struct resultado_serie serie[NUM_SERIES];
+};
+
+struct acumulado_serie{
+	uint32_t n;
+	float minimo, maximo;
+	double media, m2;  // media y suma de cuadrados de las desviaciones (Welford)
+	uint32_t cubeta[CUBETAS_AGREGADO];
+};
+
+struct ventana{
+	int minutos;
+	int64_t inicio;                        // minuto local de comienzo de la ventana en curso
+	struct acumulado_serie acumulado[NUM_SERIES];
+	struct resumen_ventana en_curso;       // percentiles actualizados cada minuto, el resto en cada muestra
+	struct resumen_ventana cerrada;        // ultima ventana completa (n=0 si todavia no hay)
+};
+
+struct agregador{
+	int num_ventanas;
+	int64_t minuto;                        // ultimo minuto local visto
+	struct ventana ventana[MAX_VENTANAS];
+};
+
+int ag_inicia(struct agregador *ag, const char *opcion, int64_t minuto);
+int ag_avanza(struct agregador *ag, int64_t minuto);
+void ag_anota(struct agregador *ag, const struct muestra_bin *muestra);
+int ag_busca(const struct agregador *ag, int minutos);
+const char *ag_nombre_ventana(int minutos, char *buf, int longitud);
+
+#endif /* AGREGADOR_H_ */
@@ -0,0 +1,163 @@
+/*
+ ============================================================================
+ Name        : anillo.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Anillo en memoria compartida (SHM_KEY_MUESTRAS) con las
+               ultimas HUECOS_ANILLO muestras de cada segundo, para los
+               procesos que no pueden perder ninguna aunque lean con
+               menos frecuencia que el ciclo o se queden parados un rato.
+               Un productor (fronius-mon) y cualquier numero de lectores.
+               Cada lector lleva su propio cursor en su memoria y se
+               conecta en solo lectura: el productor no sabe cuantos hay
+               y su coste es el mismo con ninguno que con muchos.
+               Cada hueco lleva la posicion de la muestra que contiene
+               (impar mientras se escribe), con lo que el lector detecta
+               si el productor le ha adelantado una vuelta y cuantas
+               muestras ha perdido.
+ ============================================================================
+ */
+
+#ifndef ANILLO_H_
+#define ANILLO_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "registro_bin.h"
+
+#define SHM_KEY_MUESTRAS 0x00465233 // anillo de muestras de cada segundo
+
+#define VERSION_ANILLO 1
+#define HUECOS_ANILLO  4096 // algo mas de una hora de muestras (potencia de 2)
+
+struct hueco_anillo{
+	uint64_t secuencia;         // 2*posicion+2 con la muestra de posicion escrita; impar mientras se escribe
+	struct muestra_bin muestra;
+};
+
+struct anillo_muestras{
+	uint32_t version;           // VERSION_ANILLO
+	uint32_t tamano;            // sizeof(struct anillo_muestras)
+	uint32_t huecos;            // HUECOS_ANILLO
+	uint32_t reservado;
+	uint64_t escritas;          // muestras escritas desde el arranque; la siguiente va en escritas % huecos
+	uint8_t relleno[40];        // escritas en su propia linea de cache
+	struct hueco_anillo hueco[HUECOS_ANILLO];
+};
+
+/*
+ * Cursor de un lector
+ */
+struct lector_anillo{
+	const struct anillo_muestras *anillo;
+	uint64_t posicion;          // posicion de la siguiente muestra a leer
+	uint64_t perdidas;          // muestras sobrescritas antes de leerlas
+};
+
+/*
+ * Prepara el anillo recien creado. Si ya tiene muestras de esta version (reinicio de fronius-mon)
+ * se conservan, y los lectores conectados siguen sin notar el reinicio
+ */
+static inline void an_inicia(struct anillo_muestras *a){
+	if (a->version==VERSION_ANILLO && a->tamano==sizeof(*a) && a->huecos==HUECOS_ANILLO){
+		return;
+	}
+	memset(a, 0, sizeof(*a));
+	a->version=VERSION_ANILLO;
+	a->tamano=sizeof(*a);
+	a->huecos=HUECOS_ANILLO;
+}
+
+/*
+ * Añade una muestra. Nunca espera: si un lector se queda atras se le sobrescriben las muestras
+ */
+static inline void an_escribe(struct anillo_muestras *a, const struct muestra_bin *muestra){
+	uint64_t posicion=a->escritas;
+	struct hueco_anillo *h=&a->hueco[posicion%HUECOS_ANILLO];
+
+	__atomic_store_n(&h->secuencia, 2*posicion+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	h->muestra=*muestra;
+	__atomic_store_n(&h->secuencia, 2*posicion+2, __ATOMIC_RELEASE);
+	__atomic_store_n(&a->escritas, posicion+1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Prepara un lector. Con desde_principio empieza por la muestra mas antigua que queda en el anillo;
+ * si no, por la siguiente que se escriba
+ */
+static inline void an_lector(struct lector_anillo *l, const struct anillo_muestras *a, int desde_principio){
+	uint64_t escritas=__atomic_load_n(&a->escritas, __ATOMIC_ACQUIRE);
+
+	l->anillo=a;
+	l->perdidas=0;
+	l->posicion=escritas;
+	if (desde_principio){
+		l->posicion=escritas>HUECOS_ANILLO?escritas-HUECOS_ANILLO:0;
+	}
+}
+
+/*
+ * Lee la siguiente muestra del lector. Devuelve 1 si hay una nueva, 0 si esta al dia.
+ * Si el productor le ha adelantado, suma a l->perdidas las muestras perdidas y sigue por
+ * la mas antigua que queda
+ */
+static inline int an_lee(struct lector_anillo *l, struct muestra_bin *muestra){
+	const struct anillo_muestras *a=l->anillo;
+	const struct hueco_anillo *h;
+	uint64_t escritas, antes, despues, minima;
+
+	while (1){
+		escritas=__atomic_load_n(&a->escritas, __ATOMIC_ACQUIRE);
+		if (l->posicion>=escritas){
+			return 0;
+		}
+		// se deja un hueco de margen: el siguiente al ultimo puede estar escribiendose
+		minima=escritas>HUECOS_ANILLO-1?escritas-(HUECOS_ANILLO-1):0;
+		if (l->posicion<minima){
+			l->perdidas+=minima-l->posicion;
+			l->posicion=minima;
+		}
+		h=&a->hueco[l->posicion%HUECOS_ANILLO];
+		antes=__atomic_load_n(&h->secuencia, __ATOMIC_ACQUIRE);
+		if (antes==2*l->posicion+2){
+			*muestra=h->muestra;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			despues=__atomic_load_n(&h->secuencia, __ATOMIC_RELAXED);
+			if (despues==antes){
+				l->posicion++;
+				return 1;
+			}
+		}
+		// sobrescrita mientras se leia: se vuelve a calcular la mas antigua que queda
+		l->perdidas++;
+		l->posicion++;
+	}
+}
+
+/*
+ * Conecta en modo solo lectura con el anillo de fronius-mon. Devuelve NULL si no existe o es de otra version
+ */
+static inline const struct anillo_muestras *an_conecta(void){
+	int shmid;
+	const struct anillo_muestras *a;
+
+	shmid=shmget(SHM_KEY_MUESTRAS, 0, 0);
+	if (shmid==-1){
+		return NULL;
+	}
+	a=shmat(shmid, NULL, SHM_RDONLY);
+	if (a==(void *)-1){
+		return NULL;
+	}
+	if (a->version!=VERSION_ANILLO || a->tamano!=sizeof(*a) || a->huecos!=HUECOS_ANILLO){
+		shmdt(a);
+		return NULL;
+	}
+	return a;
+}
+
+#endif /* ANILLO_H_ */
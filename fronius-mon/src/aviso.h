@@ -0,0 +1,109 @@
+/*
+ ============================================================================
+ Name        : aviso.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Avisos de nueva lectura de consumo del proceso medidor a
+               fronius-mon por un socket Unix de datagramas (opcion -n).
+               El medidor sigue escribiendo potencia_consumo en
+               datos_publicados; ademas envia cada lectura con av_envia()
+               para que el limitador reaccione sin esperar al segundo.
+               El envio nunca bloquea al medidor: si fronius-mon no
+               esta escuchando o no da abasto el aviso se pierde.
+ ============================================================================
+ */
+
+#ifndef AVISO_H_
+#define AVISO_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct aviso_consumo{
+	uint32_t secuencia;      // numero de lectura del medidor
+	float potencia_consumo;  // W
+	int64_t instante_ns;     // CLOCK_MONOTONIC del medidor al enviar el aviso
+};
+
+static inline int64_t av_instante_ns(void){
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec*1000000000+t.tv_nsec;
+}
+
+static inline int av_direccion(const char *ruta, struct sockaddr_un *direccion){
+	memset(direccion, 0, sizeof(*direccion));
+	direccion->sun_family=AF_UNIX;
+	if (strlen(ruta)>=sizeof(direccion->sun_path)){
+		return -1;
+	}
+	strcpy(direccion->sun_path, ruta);
+	return 0;
+}
+
+/*
+ * Socket no bloqueante en el que fronius-mon recibe los avisos. Devuelve -1 si no es posible
+ */
+static inline int av_abre_receptor(const char *ruta){
+	struct sockaddr_un direccion;
+	int fd;
+
+	if (av_direccion(ruta, &direccion)){
+		return -1;
+	}
+	fd=socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd==-1){
+		return -1;
+	}
+	unlink(ruta);
+	if (bind(fd, (struct sockaddr *)&direccion, sizeof(direccion))){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Socket con el que el medidor envia los avisos
+ */
+static inline int av_abre_emisor(void){
+	return socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+}
+
+static inline int av_envia(int fd, const char *ruta, uint32_t secuencia, float potencia_consumo){
+	struct sockaddr_un direccion;
+	struct aviso_consumo aviso;
+
+	if (av_direccion(ruta, &direccion)){
+		return -1;
+	}
+	aviso.secuencia=secuencia;
+	aviso.potencia_consumo=potencia_consumo;
+	aviso.instante_ns=av_instante_ns();
+	return sendto(fd, &aviso, sizeof(aviso), MSG_DONTWAIT, (struct sockaddr *)&direccion, sizeof(direccion))==sizeof(aviso)?0:-1;
+}
+
+/*
+ * Lee todos los avisos pendientes sin bloquear y deja el ultimo en *aviso.
+ * Devuelve el numero de avisos leidos
+ */
+static inline int av_recibe(int fd, struct aviso_consumo *aviso){
+	struct aviso_consumo recibido;
+	ssize_t rc;
+	int n=0;
+
+	while ((rc=recv(fd, &recibido, sizeof(recibido), 0))>=0){
+		if (rc==sizeof(recibido)){ // los datagramas de otro tamaño se ignoran
+			*aviso=recibido;
+			n++;
+		}
+	}
+	return n;
+}
+
+#endif /* AVISO_H_ */
@@ -0,0 +1,152 @@
+/*
+ ============================================================================
+ Name        : bus.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Hilo del bus: ordenes del ciclo por prioridad
+ ============================================================================
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "bus.h"
+#include "aviso.h"
+
+#define MASCARA_ORDENES    (HUECOS_ORDENES-1)
+#define MASCARA_RESULTADOS (HUECOS_RESULTADOS-1)
+
+/*
+ * Hilo del bus: toma la orden de mayor prioridad, la hace con la funcion ejecuta (o la devuelve sin
+ * hacer si su plazo ha vencido) y pone el resultado en la cola que le corresponde. Las consultas de
+ * telemetria de un inversor que acaba de fallar una se devuelven sin hacer hasta que se vacia su cola,
+ * para no esperar un plazo de respuesta por cada una
+ */
+static void *hilo_bus(void *arg){
+	struct bus *b=arg;
+	struct resultado_bus *r;
+	enum cola_resultados c;
+	uint32_t cabeza[NUM_PRIORIDADES];
+	uint64_t uno=1;
+	int p, q, esperan;
+
+	while (1){
+		while (sem_wait(&b->ordenes) && errno==EINTR);
+
+		for (p=0; p<NUM_PRIORIDADES; p++){
+			cabeza[p]=__atomic_load_n(&b->cabeza_orden[p], __ATOMIC_ACQUIRE);
+		}
+		for (p=0; p<NUM_PRIORIDADES && b->cola_orden[p]==cabeza[p]; p++);
+		if (p==NUM_PRIORIDADES){
+			if (b->terminar){
+				return NULL;
+			}
+			continue;
+		}
+		for (q=p+1, esperan=0; q<NUM_PRIORIDADES; q++){
+			if (b->cola_orden[q]!=cabeza[q]){
+				esperan=1;
+			}
+		}
+
+		c=p==PO_TELEMETRIA?CR_PUBLICACION:CR_CONTROL;
+		r=&b->resultado[c][b->cabeza_resultado[c] & MASCARA_RESULTADOS];
+		memset(r, 0, offsetof(struct resultado_bus, mensaje)+1);
+		r->orden=b->orden[p][b->cola_orden[p] & MASCARA_ORDENES];
+		__atomic_store_n(&b->cola_orden[p], b->cola_orden[p]+1, __ATOMIC_RELEASE);
+
+		if (b->terminar || (r->orden.plazo_ns && av_instante_ns()>r->orden.plazo_ns) ||
+				(p==PO_TELEMETRIA && (b->descartados & (1u<<r->orden.inversor)))){
+			r->rc=-1;
+			r->vencida=1;
+			b->vencidas++;
+		}
+		else {
+			if (esperan){
+				b->adelantos++;
+			}
+			b->ejecuta(b, &r->orden, r);
+			b->hechas++;
+			if (r->descarta){
+				b->descartados|=1u<<r->orden.inversor;
+			}
+		}
+		if (p==PO_TELEMETRIA && b->cola_orden[p]==cabeza[p]){
+			b->descartados=0;
+		}
+
+		__atomic_store_n(&b->cabeza_resultado[c], b->cabeza_resultado[c]+1, __ATOMIC_RELEASE);
+		while (write(b->fd_resultados, &uno, sizeof(uno))<0 && errno==EINTR);
+	}
+}
+
+/*
+ * Arranca el hilo del bus sobre el puerto serie fd. Devuelve -1 si no es posible
+ */
+int bs_inicia(struct bus *b, int fd, ejecuta_orden_bus ejecuta){
+	memset(b, 0, sizeof(*b));
+	b->fd=fd;
+	b->ejecuta=ejecuta;
+	b->fd_resultados=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (b->fd_resultados==-1){
+		return -1;
+	}
+	if (sem_init(&b->ordenes, 0, 0)){
+		close(b->fd_resultados);
+		return -1;
+	}
+	if (pthread_create(&b->hilo, NULL, hilo_bus, b)){
+		sem_destroy(&b->ordenes);
+		close(b->fd_resultados);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Pone una orden en la cola de su prioridad sin bloquear nunca. Devuelve -1 si la cola esta llena
+ * o hay demasiados resultados sin recoger
+ */
+int bs_encarga(struct bus *b, const struct orden_bus *o){
+	uint32_t cabeza=b->cabeza_orden[o->prioridad];
+
+	if (cabeza-__atomic_load_n(&b->cola_orden[o->prioridad], __ATOMIC_ACQUIRE)>=HUECOS_ORDENES ||
+			bs_pendientes(b)>=HUECOS_RESULTADOS){
+		return -1;
+	}
+	b->orden[o->prioridad][cabeza & MASCARA_ORDENES]=*o;
+	__atomic_store_n(&b->cabeza_orden[o->prioridad], cabeza+1, __ATOMIC_RELEASE);
+	b->encargadas++;
+	sem_post(&b->ordenes);
+	return 0;
+}
+
+/*
+ * Saca el resultado mas antiguo de la cola c. Devuelve 0 si no hay ninguno
+ */
+int bs_resultado(struct bus *b, enum cola_resultados c, struct resultado_bus *r){
+	uint32_t cola=b->cola_resultado[c];
+
+	if (cola==__atomic_load_n(&b->cabeza_resultado[c], __ATOMIC_ACQUIRE)){
+		return 0;
+	}
+	*r=b->resultado[c][cola & MASCARA_RESULTADOS];
+	__atomic_store_n(&b->cola_resultado[c], cola+1, __ATOMIC_RELEASE);
+	b->recogidas++;
+	return 1;
+}
+
+/*
+ * Termina el hilo: las ordenes que quedan se devuelven sin hacer. Sus resultados siguen en las colas
+ */
+void bs_termina(struct bus *b){
+	b->terminar=1;
+	sem_post(&b->ordenes);
+	pthread_join(b->hilo, NULL);
+	sem_destroy(&b->ordenes);
+	close(b->fd_resultados);
+	b->fd_resultados=-1;
+}
@@ -0,0 +1,124 @@
+/*
+ ============================================================================
+ Name        : bus.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Hilo del bus: en el ciclo de control el puerto serie solo lo
+               usa este hilo, que atiende las ordenes del ciclo (consultas
+               de medidas y limites de potencia) por prioridad, de modo
+               que un 0x9F pasa por delante de la telemetria pendiente y
+               el hilo principal sigue atendiendo los avisos del medidor
+               mientras el bus esta ocupado.
+               Cada prioridad tiene su cola circular sin bloqueos de un
+               productor (el hilo principal) y un consumidor (el hilo del
+               bus). Una orden cuyo plazo ha vencido antes de empezar se
+               devuelve sin hacerla. Los resultados vuelven por dos colas
+               del mismo tipo: la del control (potencia y limites) y la
+               de la publicacion (telemetria), y cada uno se señala en un
+               eventfd, que el hilo principal espera con poll() junto con
+               el socket de avisos.
+               Un frame en la linea no se puede interrumpir: lo que se
+               adelanta es el siguiente.
+ ============================================================================
+ */
+
+#ifndef BUS_H_
+#define BUS_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "publicacion.h"
+#include "captura.h"
+
+#define HUECOS_ORDENES    64  // ordenes de cada prioridad (potencia de 2)
+#define HUECOS_RESULTADOS 256 // resultados de cada cola (potencia de 2, al menos NUM_PRIORIDADES*HUECOS_ORDENES)
+#define TAMANO_MENSAJE_BUS 256
+
+enum prioridad_orden{
+	PO_LIMITE,      // 0x9F: la mas alta
+	PO_POTENCIA,    // potencia de cada inversor, la entrada del limitador
+	PO_TELEMETRIA,  // resto de medidas (planificador.h)
+	NUM_PRIORIDADES
+};
+
+enum cola_resultados{
+	CR_CONTROL,     // potencia y limites
+	CR_PUBLICACION, // telemetria
+	NUM_COLAS_RESULTADOS
+};
+
+enum tipo_orden{
+	OB_MEDIDA,      // consulta de una medida a un inversor
+	OB_LIMITE       // limite de potencia a varios inversores en una trama (n puede ser 0: solo se anota el calculo)
+};
+
+struct orden_bus{
+	enum tipo_orden tipo;
+	enum prioridad_orden prioridad;
+	int inversor;                          // OB_MEDIDA: indice del inversor en inversores[]
+	unsigned char numero;                  // OB_MEDIDA: numero del inversor
+	int medida;                            // OB_MEDIDA: enum medida
+	int limite;                            // OB_LIMITE: porcentaje
+	int n;                                 // OB_LIMITE: inversores a los que se envia
+	unsigned char numeros[MAX_INVERSORES]; // OB_LIMITE
+	struct calculo_captura calculo;        // OB_LIMITE: calculo que lo ha decidido, para la captura
+	int64_t decidido_ns;                   // OB_LIMITE: instante de la decision
+	int64_t aviso_ns;                      // OB_LIMITE: aviso con exportacion que atiende (0: ninguno)
+	int64_t plazo_ns;                      // si no ha empezado en este instante se devuelve sin hacer (0: sin plazo)
+};
+
+struct resultado_bus{
+	struct orden_bus orden;
+	int rc;                                // -1: error
+	int clase;                             // clase del error (enum clase_error de fronius-mon.c)
+	int vencida;                           // no se ha hecho: plazo vencido, inversor descartado o hilo terminado
+	int descarta;                          // OB_MEDIDA: la telemetria pendiente del inversor se devuelve sin hacer
+	float valor;                           // OB_MEDIDA
+	double rtt_ms;                         // duracion de la orden en el bus
+	int64_t inicio_ns;                     // comienzo de la orden en el bus
+	int64_t transmitido_ns;                // OB_LIMITE: fin de la trama 0x9F en la linea (tras tcdrain())
+	unsigned int sin_respuesta;            // OB_LIMITE: bit k: numeros[k] no ha respondido a la trama
+	char mensaje[TAMANO_MENSAJE_BUS];      // texto del error
+};
+
+struct bus;
+typedef void (*ejecuta_orden_bus)(struct bus *b, const struct orden_bus *o, struct resultado_bus *r);
+
+struct bus{
+	struct orden_bus orden[NUM_PRIORIDADES][HUECOS_ORDENES];
+	uint32_t cabeza_orden[NUM_PRIORIDADES];  // ordenes puestas por el hilo principal (sin enmascarar)
+	uint32_t cola_orden[NUM_PRIORIDADES];    // ordenes tomadas por el hilo del bus (sin enmascarar)
+	struct resultado_bus resultado[NUM_COLAS_RESULTADOS][HUECOS_RESULTADOS];
+	uint32_t cabeza_resultado[NUM_COLAS_RESULTADOS];
+	uint32_t cola_resultado[NUM_COLAS_RESULTADOS];
+	sem_t ordenes;                // una señal por orden puesta
+	int fd_resultados;            // eventfd: una señal por resultado
+	pthread_t hilo;
+	ejecuta_orden_bus ejecuta;
+	int fd;                       // puerto serie
+	volatile int terminar;
+	unsigned int descartados;     // inversores con la telemetria pendiente descartada (hilo del bus)
+	uint32_t encargadas;          // ordenes puestas (hilo principal)
+	uint32_t recogidas;           // resultados recogidos (hilo principal)
+
+	// contadores (los escribe solo el hilo del bus)
+	unsigned long hechas;         // ordenes hechas
+	unsigned long vencidas;       // ordenes devueltas sin hacer
+	unsigned long adelantos;      // ordenes servidas con otras de menor prioridad esperando
+};
+
+int bs_inicia(struct bus *b, int fd, ejecuta_orden_bus ejecuta);
+int bs_encarga(struct bus *b, const struct orden_bus *o);
+int bs_resultado(struct bus *b, enum cola_resultados c, struct resultado_bus *r);
+void bs_termina(struct bus *b);
+
+/*
+ * Ordenes encargadas cuyo resultado no se ha recogido todavia
+ */
+static inline uint32_t bs_pendientes(const struct bus *b){
+	return b->encargadas-b->recogidas;
+}
+
+#endif /* BUS_H_ */
@@ -0,0 +1,176 @@
+/*
+ ============================================================================
+ Name        : captura.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Captura del trafico del puerto serie y su lectura
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "captura.h"
+
+static int64_t instante_ns(clockid_t reloj){
+	struct timespec t;
+
+	clock_gettime(reloj, &t);
+	return (int64_t)t.tv_sec*1000000000+t.tv_nsec;
+}
+
+/*
+ * Crea el fichero de captura (si existe se sobrescribe) con su cabecera. Los bloques se entregan
+ * al escritor e, que los escribe en su descriptor de captura (el que devuelve esta funcion).
+ * Devuelve el descriptor o -1 si no se puede crear
+ */
+int cp_abre(struct captura *c, const char *fichero, struct escritor *e){
+	struct cabecera_captura cabecera;
+
+	memset(c, 0, sizeof(*c));
+	c->fd=open(fichero, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (c->fd<0){
+		return -1;
+	}
+	memset(&cabecera, 0, sizeof(cabecera));
+	memcpy(cabecera.magic, MAGIC_CAPTURA, sizeof(cabecera.magic));
+	cabecera.version=VERSION_CAPTURA;
+	cabecera.tamano_cabecera=sizeof(cabecera);
+	cabecera.tamano_bloque=sizeof(struct bloque_captura);
+	cabecera.inicio_ns=instante_ns(CLOCK_REALTIME);
+	if (write(c->fd, &cabecera, sizeof(cabecera))!=sizeof(cabecera)){
+		close(c->fd);
+		c->fd=-1;
+		return -1;
+	}
+	c->escritor=e;
+	c->anterior_ns=c->escrito_ns=instante_ns(CLOCK_MONOTONIC);
+	return c->fd;
+}
+
+/*
+ * Entrega al escritor los bloques acumulados. Si su cola esta llena se pierden, y el siguiente
+ * bloque cuenta su desfase desde el ultimo entregado para que no se desplacen los instantes
+ */
+void cp_vacia(struct captura *c){
+	if (c->fd<0 || c->usado==0){
+		return;
+	}
+	if (es_pon(c->escritor, ES_CAPTURA, c->bufer, c->usado)==0){
+		c->escrito_ns=c->anterior_ns;
+	}
+	else {
+		c->anterior_ns=c->escrito_ns;
+		c->descartes++;
+	}
+	c->usado=0;
+}
+
+/*
+ * Anota un bloque con el instante actual. Solo copia en el bufer; un bloque mayor que lo que
+ * cabe en una entrada del escritor se parte en varios con el mismo instante
+ */
+void cp_anota(struct captura *c, int tipo, const void *datos, size_t longitud){
+	struct bloque_captura bloque;
+	int64_t ahora, desfase;
+	size_t trozo;
+
+	if (c->fd<0){
+		return;
+	}
+	ahora=instante_ns(CLOCK_MONOTONIC);
+	desfase=(ahora-c->anterior_ns)/1000;
+	c->anterior_ns=ahora;
+	do {
+		if (c->usado+sizeof(bloque)+(longitud?1:0)>sizeof(c->bufer)){
+			cp_vacia(c);
+			desfase=(ahora-c->anterior_ns)/1000; // desde el ultimo entregado si se ha perdido el trozo
+			c->anterior_ns=ahora;
+		}
+		trozo=sizeof(c->bufer)-c->usado-sizeof(bloque);
+		if (trozo>longitud){
+			trozo=longitud;
+		}
+		bloque.desfase_us=desfase>UINT32_MAX?UINT32_MAX:(uint32_t)desfase;
+		bloque.longitud=(uint16_t)trozo;
+		bloque.tipo=(uint8_t)tipo;
+		bloque.reservado=0;
+		memcpy(c->bufer+c->usado, &bloque, sizeof(bloque));
+		memcpy(c->bufer+c->usado+sizeof(bloque), datos, trozo);
+		c->usado+=sizeof(bloque)+trozo;
+		c->bloques++;
+		datos=(const char *)datos+trozo;
+		longitud-=trozo;
+		desfase=0;
+	} while (longitud>0);
+}
+
+/*
+ * Mapea en memoria para lectura un fichero de captura. Un bloque incompleto al final
+ * (captura interrumpida) no se lee
+ */
+int cp_mapea(const char *fichero, struct mapa_captura *mapa){
+	int fd;
+	struct stat info;
+	void *base;
+
+	memset(mapa, 0, sizeof(*mapa));
+	fd=open(fichero, O_RDONLY);
+	if (fd<0){
+		return -1;
+	}
+	fstat(fd, &info);
+	if ((size_t)info.st_size<sizeof(struct cabecera_captura)){
+		close(fd);
+		return -1;
+	}
+	base=mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base==MAP_FAILED){
+		return -1;
+	}
+	mapa->cabecera=base;
+	if (memcmp(mapa->cabecera->magic, MAGIC_CAPTURA, sizeof(mapa->cabecera->magic))!=0 ||
+			mapa->cabecera->version!=VERSION_CAPTURA ||
+			mapa->cabecera->tamano_bloque!=sizeof(struct bloque_captura)){
+		munmap(base, info.st_size);
+		memset(mapa, 0, sizeof(*mapa));
+		return -1;
+	}
+	mapa->tamano=info.st_size;
+	mapa->datos=(const unsigned char *)base+mapa->cabecera->tamano_cabecera;
+	mapa->longitud=info.st_size-mapa->cabecera->tamano_cabecera;
+	return 0;
+}
+
+void cp_desmapea(struct mapa_captura *mapa){
+	if (mapa->cabecera){
+		munmap((void *)mapa->cabecera, mapa->tamano);
+	}
+	memset(mapa, 0, sizeof(*mapa));
+}
+
+/*
+ * Lee el bloque que empieza en *posicion (0 para el primero) y avanza al siguiente.
+ * Devuelve sus datos, o NULL al final de la captura
+ */
+const unsigned char *cp_siguiente(const struct mapa_captura *mapa, size_t *posicion, struct bloque_captura *bloque){
+	const unsigned char *datos;
+
+	if (*posicion+sizeof(*bloque)>mapa->longitud){
+		return NULL;
+	}
+	memcpy(bloque, mapa->datos+*posicion, sizeof(*bloque));
+	if (*posicion+sizeof(*bloque)+bloque->longitud>mapa->longitud){
+		return NULL;
+	}
+	datos=mapa->datos+*posicion+sizeof(*bloque);
+	*posicion+=sizeof(*bloque)+bloque->longitud;
+	return datos;
+}
@@ -0,0 +1,101 @@
+/*
+ ============================================================================
+ Name        : captura.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Captura del trafico del puerto serie (opcion -C): los bytes
+               enviados y recibidos tal cual, con su instante, y en cada
+               ciclo las entradas del limitador y la muestra del registro,
+               en un fichero binario compacto que fronius-util replay
+               vuelve a pasar por el analizador de tramas, el limitador
+               y el registro.
+               Cada bloque lleva una cabecera de 8 bytes con los
+               microsegundos desde el bloque anterior. Los bloques se
+               acumulan en memoria y pasan al hilo escritor de 2 KB en
+               2 KB y al final de cada ciclo: el ciclo nunca escribe en
+               el fichero.
+ ============================================================================
+ */
+
+#ifndef CAPTURA_H_
+#define CAPTURA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "escritor.h"
+
+#define MAGIC_CAPTURA   "FRMONCAP"
+#define VERSION_CAPTURA 1
+
+enum tipo_bloque_captura{
+	BC_TX=1,          // bytes escritos en el puerto serie
+	BC_RX,            // bytes leidos del puerto serie (tambien los vaciados antes de una peticion)
+	BC_APERTURA,      // puerto serie abierto o cambio de velocidad. Datos: uint32_t baudios
+	BC_CALCULO,       // calculo del limite. Datos: struct calculo_captura
+	BC_MUESTRA,       // muestra del ciclo escrita en el registro binario. Datos: struct muestra_bin
+	BC_CONFIGURACION  // texto "nominal=W k=opciones" del limitador
+};
+
+/*
+ * Cabecera del fichero (32 bytes)
+ */
+struct cabecera_captura{
+	char magic[8];            // "FRMONCAP"
+	uint16_t version;         // VERSION_CAPTURA
+	uint16_t tamano_cabecera; // sizeof(struct cabecera_captura)
+	uint16_t tamano_bloque;   // sizeof(struct bloque_captura)
+	uint16_t reservado;
+	int64_t inicio_ns;        // instante del comienzo (ns desde 1970 UTC), del que cuenta el desfase del primer bloque
+	uint8_t relleno[8];
+};
+
+/*
+ * Cabecera de cada bloque (8 bytes), seguida de longitud bytes de datos
+ */
+struct bloque_captura{
+	uint32_t desfase_us;      // microsegundos desde el bloque anterior (saturado a UINT32_MAX)
+	uint16_t longitud;
+	uint8_t tipo;             // BC_*
+	uint8_t reservado;
+};
+
+/*
+ * Datos de un bloque BC_CALCULO: entradas y resultado de lm_calcula()
+ */
+struct calculo_captura{
+	float consumo;
+	float generada;
+	float dt;
+	int32_t limite;
+};
+
+struct captura{
+	int fd;                   // -1: sin captura
+	struct escritor *escritor;
+	int64_t anterior_ns;      // instante del ultimo bloque anotado
+	int64_t escrito_ns;       // instante del ultimo bloque entregado al escritor
+	size_t usado;
+	char bufer[TAMANO_HUECO_ESCRITOR];
+	unsigned long bloques;    // bloques anotados
+	unsigned long descartes;  // trozos de bufer perdidos por cola del escritor llena
+};
+
+/*
+ * Captura abierta para lectura
+ */
+struct mapa_captura{
+	const struct cabecera_captura *cabecera;
+	const unsigned char *datos;  // primer bloque
+	size_t longitud;             // bytes de bloques
+	size_t tamano;               // bytes mapeados
+};
+
+int cp_abre(struct captura *c, const char *fichero, struct escritor *e);
+void cp_anota(struct captura *c, int tipo, const void *datos, size_t longitud);
+void cp_vacia(struct captura *c);
+int cp_mapea(const char *fichero, struct mapa_captura *mapa);
+void cp_desmapea(struct mapa_captura *mapa);
+const unsigned char *cp_siguiente(const struct mapa_captura *mapa, size_t *posicion, struct bloque_captura *bloque);
+
+#endif /* CAPTURA_H_ */
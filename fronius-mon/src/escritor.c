@@ -0,0 +1,217 @@
+/*
+ ============================================================================
+ Name        : escritor.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Hilo de escritura diferida
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "escritor.h"
+
+#define MASCARA_HUECOS (HUECOS_ESCRITOR-1)
+
+/*
+ * Escribe todo el bufer aunque write() lo acepte en varios trozos
+ */
+static int escribe_todo(int fd, const char *datos, size_t longitud){
+	ssize_t rc;
+
+	while (longitud>0){
+		rc=write(fd, datos, longitud);
+		if (rc<0){
+			if (errno==EINTR){
+				continue;
+			}
+			return -1;
+		}
+		datos+=rc;
+		longitud-=rc;
+	}
+	return 0;
+}
+
+/*
+ * Hilo escritor: saca de la cola todo lo pendiente copiandolo a los lotes de cada destino,
+ * libera la cola y despues escribe cada lote de una vez. Asi un bloqueo del terminal o de la
+ * tarjeta solo retrasa a este hilo
+ */
+static void *hilo_escritor(void *arg){
+	struct escritor *e=arg;
+	struct{
+		void *direccion;
+		size_t longitud;
+	} zonas[HUECOS_ESCRITOR];
+	struct hueco_escritor *h;
+	struct timespec espera, t0, t1;
+	time_t ultimo_fsync=time(NULL);
+	size_t n_texto, n_captura, n_muestras, n_zonas, z;
+	uint32_t cola, cabeza;
+	uintptr_t pagina=(uintptr_t)sysconf(_SC_PAGESIZE), inicio;
+	int pendiente_fsync=0;
+	double ms;
+
+	while (1){
+		clock_gettime(CLOCK_REALTIME, &espera);
+		espera.tv_sec++;
+		sem_timedwait(&e->avisos, &espera);
+
+		cola=e->cola;
+		cabeza=__atomic_load_n(&e->cabeza, __ATOMIC_ACQUIRE);
+		n_texto=n_captura=n_muestras=n_zonas=0;
+		for (; cola!=cabeza; cola++){
+			h=&e->hueco[cola & MASCARA_HUECOS];
+			switch (h->tipo){
+			case ES_CONSOLA:
+				memcpy(e->texto+n_texto, h->datos.texto, h->longitud);
+				n_texto+=h->longitud;
+				break;
+			case ES_CAPTURA:
+				memcpy(e->captura+n_captura, h->datos.texto, h->longitud);
+				n_captura+=h->longitud;
+				break;
+			case ES_MUESTRA:
+				e->muestras[n_muestras++]=h->datos.muestra;
+				break;
+			case ES_SINCRONIZA:
+				zonas[n_zonas].direccion=h->datos.zona.direccion;
+				zonas[n_zonas++].longitud=h->datos.zona.longitud;
+				break;
+			}
+		}
+		__atomic_store_n(&e->cola, cola, __ATOMIC_RELEASE);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (n_texto && escribe_todo(STDOUT_FILENO, e->texto, n_texto)){
+			e->errores++;
+		}
+		if (n_captura && escribe_todo(e->fd_captura, e->captura, n_captura)){
+			e->errores++;
+		}
+		if (n_muestras){
+			if (rb_escribe(e->fd_muestras, &e->codificador, e->muestras, n_muestras)){
+				e->errores++;
+			}
+			pendiente_fsync=1;
+		}
+		for (z=0; z<n_zonas; z++){
+			inicio=(uintptr_t)zonas[z].direccion & ~(pagina-1);
+			if (msync((void *)inicio, (uintptr_t)zonas[z].direccion+zonas[z].longitud-inicio, MS_SYNC)){
+				e->errores++;
+			}
+		}
+		if (pendiente_fsync && e->segundos_fsync>0 && time(NULL)-ultimo_fsync>=e->segundos_fsync){
+			if (fsync(e->fd_muestras)){
+				e->errores++;
+			}
+			ultimo_fsync=time(NULL);
+			pendiente_fsync=0;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ms=(t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6;
+		if (ms>e->max_ms){
+			e->max_ms=ms;
+		}
+
+		if (e->terminar && cola==__atomic_load_n(&e->cabeza, __ATOMIC_ACQUIRE)){
+			if (pendiente_fsync && e->segundos_fsync>0){
+				fsync(e->fd_muestras);
+			}
+			return NULL;
+		}
+	}
+}
+
+/*
+ * Arranca el hilo escritor. codificador es el que ha dejado rb_abre() para fd_muestras (NULL si
+ * no hay registro binario). Devuelve -1 si no es posible
+ */
+int es_inicia(struct escritor *e, int fd_muestras, const struct codificador_registro_bin *codificador,
+		int fd_captura, int segundos_fsync){
+	memset(e, 0, sizeof(*e));
+	e->fd_muestras=fd_muestras;
+	if (codificador){
+		e->codificador=*codificador;
+	}
+	e->fd_captura=fd_captura;
+	e->segundos_fsync=segundos_fsync;
+	if (sem_init(&e->avisos, 0, 0)){
+		return -1;
+	}
+	if (pthread_create(&e->hilo, NULL, hilo_escritor, e)){
+		sem_destroy(&e->avisos);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Pone una escritura en la cola sin bloquear nunca. Para ES_SINCRONIZA datos es la direccion
+ * de la zona y longitud su tamaño; el texto que no cabe en una entrada se recorta.
+ * Devuelve -1 si la cola esta llena y la escritura se descarta
+ */
+int es_pon(struct escritor *e, enum tipo_escritura tipo, const void *datos, size_t longitud){
+	struct hueco_escritor *h;
+	uint32_t cabeza=e->cabeza;
+	uint32_t pendientes=cabeza-__atomic_load_n(&e->cola, __ATOMIC_ACQUIRE);
+
+	if (pendientes>=HUECOS_ESCRITOR){
+		e->descartes++;
+		return -1;
+	}
+	if (pendientes+1>e->max_pendientes){
+		e->max_pendientes=pendientes+1;
+	}
+	h=&e->hueco[cabeza & MASCARA_HUECOS];
+	h->tipo=tipo;
+	switch (tipo){
+	case ES_CONSOLA:
+	case ES_CAPTURA:
+		h->longitud=longitud<TAMANO_HUECO_ESCRITOR?longitud:TAMANO_HUECO_ESCRITOR;
+		memcpy(h->datos.texto, datos, h->longitud);
+		break;
+	case ES_MUESTRA:
+		h->longitud=sizeof(struct muestra_bin);
+		memcpy(&h->datos.muestra, datos, sizeof(struct muestra_bin));
+		break;
+	case ES_SINCRONIZA:
+		h->datos.zona.direccion=(void *)datos;
+		h->datos.zona.longitud=longitud;
+		break;
+	}
+	__atomic_store_n(&e->cabeza, cabeza+1, __ATOMIC_RELEASE);
+	sem_post(&e->avisos);
+	return 0;
+}
+
+int es_texto(struct escritor *e, const char *formato, ...){
+	char texto[TAMANO_HUECO_ESCRITOR];
+	va_list argumentos;
+	int n;
+
+	va_start(argumentos, formato);
+	n=vsnprintf(texto, sizeof(texto), formato, argumentos);
+	va_end(argumentos);
+	if (n<0){
+		return -1;
+	}
+	return es_pon(e, ES_CONSOLA, texto, (size_t)n<sizeof(texto)?(size_t)n:sizeof(texto)-1);
+}
+
+/*
+ * Espera a que el hilo escriba lo pendiente y lo termina
+ */
+void es_termina(struct escritor *e){
+	e->terminar=1;
+	sem_post(&e->avisos);
+	pthread_join(e->hilo, NULL);
+	sem_destroy(&e->avisos);
+}
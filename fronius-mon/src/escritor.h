@@ -0,0 +1,82 @@
+/*
+ ============================================================================
+ Name        : escritor.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Escritura diferida en un hilo propio de la salida por
+               consola, del registro binario, de la captura del puerto
+               serie y de la sincronizacion del historico, para que el
+               ciclo de control nunca espere a la tarjeta SD ni al
+               terminal.
+               El ciclo deja cada escritura en una cola circular sin
+               bloqueos de un productor y un consumidor; si la cola esta
+               llena la escritura se descarta y se cuenta.
+               El hilo escritor vacia la cola por lotes: una sola
+               escritura por destino y lote.
+ ============================================================================
+ */
+
+#ifndef ESCRITOR_H_
+#define ESCRITOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "registro_bin.h"
+
+#define HUECOS_ESCRITOR      64   // entradas de la cola (potencia de 2)
+#define TAMANO_HUECO_ESCRITOR 2048 // bytes de datos de cada entrada
+
+enum tipo_escritura{
+	ES_CONSOLA,     // texto para la salida estandar
+	ES_MUESTRA,     // struct muestra_bin para el registro binario
+	ES_SINCRONIZA,  // msync() de una zona de un fichero mapeado
+	ES_CAPTURA      // bloques de la captura del puerto serie (captura.h)
+};
+
+struct hueco_escritor{
+	enum tipo_escritura tipo;
+	size_t longitud;
+	union{
+		char texto[TAMANO_HUECO_ESCRITOR];
+		struct muestra_bin muestra;
+		struct{
+			void *direccion;
+			size_t longitud;
+		} zona;
+	} datos;
+};
+
+struct escritor{
+	struct hueco_escritor hueco[HUECOS_ESCRITOR];
+	uint32_t cabeza;              // entradas puestas por el ciclo (sin enmascarar)
+	uint32_t cola;                // entradas escritas por el hilo (sin enmascarar)
+	sem_t avisos;                 // una señal por entrada puesta
+	pthread_t hilo;
+	int fd_muestras;              // registro binario
+	struct codificador_registro_bin codificador; // ultima muestra escrita en el registro binario (la usa solo el hilo)
+	int fd_captura;               // captura del puerto serie (-1: sin captura)
+	int segundos_fsync;           // 0: nunca; n: fsync del registro binario cada n segundos como mucho
+	volatile int terminar;
+
+	// contadores (los escribe solo su hilo)
+	unsigned long descartes;      // entradas perdidas por cola llena (ciclo)
+	unsigned long max_pendientes; // maximo de entradas en la cola al poner una (ciclo)
+	unsigned long errores;        // escrituras fallidas (hilo)
+	double max_ms;                // lote mas lento en escribirse (hilo)
+
+	// lotes de cada destino, propios de cada escritor (hilo)
+	char texto[HUECOS_ESCRITOR*TAMANO_HUECO_ESCRITOR];
+	char captura[HUECOS_ESCRITOR*TAMANO_HUECO_ESCRITOR];
+	struct muestra_bin muestras[HUECOS_ESCRITOR];
+};
+
+int es_inicia(struct escritor *e, int fd_muestras, const struct codificador_registro_bin *codificador,
+		int fd_captura, int segundos_fsync);
+int es_pon(struct escritor *e, enum tipo_escritura tipo, const void *datos, size_t longitud);
+int es_texto(struct escritor *e, const char *formato, ...) __attribute__((format(printf, 2, 3)));
+void es_termina(struct escritor *e);
+
+#endif /* ESCRITOR_H_ */
@@ -0,0 +1,176 @@
+/*
+ ============================================================================
+ Name        : estadisticas.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Contadores e histogramas de tiempo de respuesta de cada
+               comando y cada inversor, en un area de memoria compartida
+               (SHM_KEY_ESTADISTICAS) que fronius-util stats vuelca sin
+               detener a fronius-mon.
+               Solo escribe fronius-mon; cada contador solo crece, de modo
+               que los lectores no necesitan una copia coherente del area
+               completa.
+ ============================================================================
+ */
+
+#ifndef ESTADISTICAS_H_
+#define ESTADISTICAS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "publicacion.h"
+
+#define SHM_KEY_ESTADISTICAS 0x00465232 // area de estadisticas del bus
+
+#define VERSION_ESTADISTICAS 3
+#define CUBETAS_TIEMPO       24 // cubeta b: tiempos de [2^b, 2^(b+1)) us (la 0 incluye 0 us); la ultima, 8 s o mas
+#define MAX_COMANDOS_ESTADISTICA 16 // codigos de comando distintos que se anotan
+#define RANURA_DIFUSION MAX_INVERSORES // ranura de las peticiones al numero 0
+
+struct estadistica_comando{
+	uint64_t peticiones;          // tramas enviadas (con los reintentos)
+	uint64_t reintentos;          // reenvios inmediatos tras un plazo vencido o una trama corrupta
+	uint64_t respuestas;          // respuestas correctas
+	uint64_t errores_0e;          // respuestas de error 0x0E
+	uint64_t plazos;              // plazos vencidos sin respuesta completa
+	uint64_t errores_cabecera;    // tramas de otro dispositivo o comando descartadas esperando la respuesta
+	uint64_t errores_checksum;    // tramas descartadas por checksum esperando la respuesta
+	uint64_t errores_longitud;    // tramas descartadas por longitud esperando la respuesta
+	uint64_t errores_dispositivo; // errores de escritura, lectura o poll() del puerto serie
+	uint64_t tiempo_total_us;     // suma de los tiempos de respuesta (respuestas y 0x0E)
+	uint32_t tiempo_max_us;
+	uint32_t tiempo[CUBETAS_TIEMPO]; // histograma del tiempo desde el envio hasta la respuesta
+};
+
+struct estadisticas{
+	uint32_t version;             // VERSION_ESTADISTICAS
+	uint32_t tamano;              // sizeof(struct estadisticas)
+	int64_t inicio;               // arranque de fronius-mon (s desde 1970 UTC)
+	uint64_t reconexiones;        // cierres y reaperturas del puerto serie
+	uint64_t ciclos;              // ciclos de 1 s
+	uint64_t ciclos_excedidos;    // ciclos que no han cabido en el segundo
+	uint64_t bytes_vaciados;      // bytes pendientes en el puerto serie antes de enviar una peticion
+	uint64_t ciclo_total_us;
+	uint32_t ciclo_max_us;
+	uint32_t ciclo[CUBETAS_TIEMPO]; // histograma de la duracion de las consultas de cada ciclo
+	uint64_t tics;                // tics de 1 s atendidos
+	uint64_t tics_perdidos;       // vencimientos agrupados por un ciclo largo
+	uint64_t realineaciones;      // reprogramaciones del tic por salto o deriva del reloj de tiempo real
+	uint64_t minutos_saltados;    // minutos sin tic
+	uint64_t retraso_tic_total_us;
+	uint32_t retraso_tic_max_us;
+	uint32_t retraso_tic[CUBETAS_TIEMPO]; // histograma del retraso de cada tic respecto a su vencimiento
+	uint8_t numero[MAX_INVERSORES+1];           // numero de inversor de cada ranura (la ultima, difusion)
+	uint8_t comando[MAX_COMANDOS_ESTADISTICA];  // codigo de cada columna; 0 columna libre
+	struct estadistica_comando e[MAX_INVERSORES+1][MAX_COMANDOS_ESTADISTICA];
+};
+
+static inline int est_cubeta(uint32_t us){
+	int b=us<2?0:31-__builtin_clz(us);
+
+	return b<CUBETAS_TIEMPO?b:CUBETAS_TIEMPO-1;
+}
+
+static inline void est_anota_tiempo(uint32_t *histograma, uint32_t *maximo, uint32_t us){
+	histograma[est_cubeta(us)]++;
+	if (us>*maximo){
+		*maximo=us;
+	}
+}
+
+/*
+ * Tiempo en us por debajo del cual queda la fraccion p (0..1) de un histograma,
+ * interpolando dentro de la cubeta y sin pasar del maximo anotado
+ */
+static inline uint32_t est_percentil(const uint32_t *histograma, uint32_t maximo, double p){
+	uint64_t total=0, acumulado=0;
+	double inicio, valor;
+	int b;
+
+	for (b=0; b<CUBETAS_TIEMPO; b++){
+		total+=histograma[b];
+	}
+	if (total==0){
+		return 0;
+	}
+	for (b=0; b<CUBETAS_TIEMPO-1; b++){
+		if (acumulado+histograma[b]>=p*total){
+			break;
+		}
+		acumulado+=histograma[b];
+	}
+	inicio=b?1u<<b:0;
+	valor=inicio+((2u<<b)-inicio)*(p*total-acumulado)/(histograma[b]?histograma[b]:1);
+	return valor<maximo?(uint32_t)valor:maximo;
+}
+
+/*
+ * Pone a cero el area y asigna una ranura a cada inversor
+ */
+static inline void est_inicia(struct estadisticas *e, const unsigned char *numeros, int n, int64_t inicio){
+	int i;
+
+	memset(e, 0, sizeof(*e));
+	e->version=VERSION_ESTADISTICAS;
+	e->tamano=sizeof(*e);
+	e->inicio=inicio;
+	for (i=0; i<n && i<MAX_INVERSORES; i++){
+		e->numero[i]=numeros[i];
+	}
+}
+
+/*
+ * Contadores de un comando a un inversor. La columna del comando se asigna la primera vez.
+ * Devuelve NULL si el inversor no tiene ranura o no quedan columnas libres
+ */
+static inline struct estadistica_comando *est_entrada(struct estadisticas *e, unsigned char numero, unsigned char comando){
+	int i, c;
+
+	if (numero==0){
+		i=RANURA_DIFUSION;
+	}
+	else {
+		for (i=0; i<MAX_INVERSORES && e->numero[i]!=numero; i++);
+		if (i==MAX_INVERSORES){
+			return NULL;
+		}
+	}
+	for (c=0; c<MAX_COMANDOS_ESTADISTICA; c++){
+		if (e->comando[c]==comando){
+			return &e->e[i][c];
+		}
+		if (e->comando[c]==0){
+			e->comando[c]=comando;
+			return &e->e[i][c];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Conecta en modo solo lectura con el area de estadisticas de fronius-mon. Devuelve NULL si no existe
+ * o es de otra version
+ */
+static inline const struct estadisticas *est_conecta(void){
+	int shmid;
+	const struct estadisticas *area;
+
+	shmid=shmget(SHM_KEY_ESTADISTICAS, 0, 0);
+	if (shmid==-1){
+		return NULL;
+	}
+	area=shmat(shmid, NULL, SHM_RDONLY);
+	if (area==(void *)-1){
+		return NULL;
+	}
+	if (area->version!=VERSION_ESTADISTICAS || area->tamano!=sizeof(*area)){
+		shmdt(area);
+		return NULL;
+	}
+	return area;
+}
+
+#endif /* ESTADISTICAS_H_ */
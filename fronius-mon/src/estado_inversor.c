@@ -0,0 +1,101 @@
+/*
+ ============================================================================
+ Name        : estado_inversor.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Estado de cada inversor y sondeo de los inversores dormidos
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "estado_inversor.h"
+
+const char *nombres_estados_inversor[NUM_ESTADOS_INVERSOR]={"producing", "waking", "standby", "offline"};
+
+/*
+ * Al arrancar no se sabe si es de dia: el inversor empieza despertando, de modo que si no da
+ * valores pasa a dormir en la primera consulta
+ */
+void ei_inicia(struct vigilancia_inversor *v, time_t ahora){
+	memset(v, 0, sizeof(*v));
+	v->estado=EI_DESPERTANDO;
+	v->espera=1;
+	v->desde=ahora;
+}
+
+/*
+ * 1 si hay que consultar al inversor en el ciclo: siempre salvo cuando duerme y no le toca sondeo
+ */
+int ei_toca(const struct vigilancia_inversor *v, unsigned long ciclo){
+	return !ei_dormido(v) || ciclo>=v->proximo;
+}
+
+static void cambia(struct vigilancia_inversor *v, enum estado_inversor estado, time_t ahora){
+	v->estado=estado;
+	v->desde=ahora;
+	v->fallos=0;
+	v->lecturas=0;
+}
+
+/*
+ * Se duerme (o se sigue durmiendo) hasta el proximo sondeo, que se espacia el doble cada vez
+ */
+static void duerme(struct vigilancia_inversor *v, enum estado_inversor estado, unsigned long ciclo, time_t ahora){
+	int maxima=estado==EI_REPOSO?ESPERA_MAXIMA_REPOSO:ESPERA_MAXIMA_DESCONECTADO;
+
+	if (v->estado!=estado){
+		cambia(v, estado, ahora);
+	}
+	if (v->espera>maxima){
+		v->espera=maxima;
+	}
+	v->proximo=ciclo+v->espera;
+	v->espera=v->espera*2<maxima?v->espera*2:maxima;
+}
+
+/*
+ * Anota el resultado de la consulta del ciclo. Devuelve 1 si el inversor cambia de estado
+ */
+int ei_anota(struct vigilancia_inversor *v, enum resultado_consulta r, unsigned long ciclo, time_t ahora){
+	enum estado_inversor anterior=v->estado;
+
+	switch (r){
+	case RC_VALOR:
+		if (ei_dormido(v)){
+			cambia(v, EI_DESPERTANDO, ahora);
+		}
+		v->fallos=0;
+		if (v->estado==EI_DESPERTANDO && ++v->lecturas>=LECTURAS_DESPERTAR){
+			cambia(v, EI_PRODUCIENDO, ahora);
+			v->espera=1;
+		}
+		break;
+	case RC_SIN_DATOS:
+		duerme(v, EI_REPOSO, ciclo, ahora);
+		break;
+	case RC_SIN_RESPUESTA:
+		if (v->estado==EI_PRODUCIENDO && ++v->fallos<FALLOS_DESCONEXION){
+			break;
+		}
+		duerme(v, EI_DESCONECTADO, ciclo, ahora);
+		break;
+	case RC_ERROR:
+		if (ei_dormido(v)){
+			v->proximo=ciclo+1; // algo ha respondido: se vuelve a sondear en el ciclo siguiente
+		}
+		break;
+	}
+	return v->estado!=anterior;
+}
+
+/*
+ * Otro inversor del bus ha despertado (p.e. al amanecer): si este duerme se le sondea en el
+ * ciclo siguiente con la espera minima
+ */
+void ei_adelanta(struct vigilancia_inversor *v, unsigned long ciclo){
+	if (ei_dormido(v)){
+		v->proximo=ciclo+1;
+		v->espera=1;
+	}
+}
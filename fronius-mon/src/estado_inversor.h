@@ -0,0 +1,74 @@
+/*
+ ============================================================================
+ Name        : estado_inversor.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Estado de cada inversor segun sus respuestas a la consulta
+               de potencia de cada ciclo: produciendo, despertando, en
+               reposo (responde sin datos, como de noche) o desconectado
+               (no responde).
+               En reposo y desconectado no se le consulta en cada ciclo
+               sino con sondeos cada vez mas espaciados (1, 2, 4... hasta
+               ESPERA_MAXIMA_REPOSO o ESPERA_MAXIMA_DESCONECTADO
+               segundos), que vuelven al primero en cuanto despierta
+               cualquier inversor del bus. La respuesta sin datos de un
+               inversor en reposo cuesta unos 12 ms de bus y se puede
+               sondear a menudo; un inversor desconectado ocupa el bus
+               todo el plazo de respuesta. Un inversor
+               que vuelve a dar valores pasa por despertando hasta que
+               los da LECTURAS_DESPERTAR ciclos seguidos; si antes falla,
+               vuelve a dormir sin reiniciar la espera entre sondeos.
+               Con el inversor produciendo un fallo aislado no cambia el
+               estado: hacen falta FALLOS_DESCONEXION seguidos.
+ ============================================================================
+ */
+
+#ifndef ESTADO_INVERSOR_H_
+#define ESTADO_INVERSOR_H_
+
+#include <time.h>
+
+#define ESPERA_MAXIMA_REPOSO       4  // segundos entre sondeos de un inversor en reposo como mucho
+#define ESPERA_MAXIMA_DESCONECTADO 16 // segundos entre sondeos de un inversor desconectado como mucho
+#define LECTURAS_DESPERTAR         3  // lecturas correctas seguidas para pasar de despertando a produciendo
+#define FALLOS_DESCONEXION         3  // consultas sin respuesta seguidas para dar por desconectado un inversor que producia
+
+enum estado_inversor{
+	EI_PRODUCIENDO,
+	EI_DESPERTANDO,   // vuelve a dar valores (o recien arrancado fronius-mon)
+	EI_REPOSO,        // responde con tramas sin datos
+	EI_DESCONECTADO,  // no responde
+	NUM_ESTADOS_INVERSOR
+};
+
+extern const char *nombres_estados_inversor[NUM_ESTADOS_INVERSOR];
+
+/*
+ * Resultado de la consulta de potencia de un ciclo
+ */
+enum resultado_consulta{
+	RC_VALOR,         // respuesta con valor
+	RC_SIN_DATOS,     // respuesta de longitud 0
+	RC_SIN_RESPUESTA, // plazo vencido
+	RC_ERROR          // trama erronea o respuesta de error 0x0E: el inversor esta ahi, pero no se sabe mas
+};
+
+struct vigilancia_inversor{
+	enum estado_inversor estado;
+	int fallos;                  // consultas sin respuesta seguidas
+	int lecturas;                // lecturas correctas seguidas
+	int espera;                  // segundos entre sondeos mientras duerme
+	unsigned long proximo;       // ciclo del proximo sondeo
+	time_t desde;                // instante del ultimo cambio de estado
+};
+
+void ei_inicia(struct vigilancia_inversor *v, time_t ahora);
+int ei_toca(const struct vigilancia_inversor *v, unsigned long ciclo);
+int ei_anota(struct vigilancia_inversor *v, enum resultado_consulta r, unsigned long ciclo, time_t ahora);
+void ei_adelanta(struct vigilancia_inversor *v, unsigned long ciclo);
+
+static inline int ei_dormido(const struct vigilancia_inversor *v){
+	return v->estado==EI_REPOSO || v->estado==EI_DESCONECTADO;
+}
+
+#endif /* ESTADO_INVERSOR_H_ */
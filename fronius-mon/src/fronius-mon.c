@@ -25,24 +25,39 @@
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <linux/serial.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
-#include <sys/timerfd.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <limits.h>
 #include <float.h>
 
 #include "registro.h"
-
-
-#define SIZE_HEADER_FRAME               7 // tamaño de la trama sin el campo de datos y sin checksum
-#define SIZE_HEADER_FRAME_PLUS_CHECKSUM 8 // tamaño de la trama sin el campo de datos
-#define MAX_SIZE_DATA_FIELD 127 // tamaño maximo del campo de datos (sin checksum)
-
-#define WAIT_TIME_AFTER_REQUEST    100000 // tiempo de espera microsegundo a que llegen datos tras el envio de una peticion
-#define RETRIES_TO_RECEIVE_EXPECTED_BYTES 3 //
+#include "trama.h"
+#include "publicacion.h"
+#include "medidas.h"
+#include "planificador.h"
+#include "limitador.h"
+#include "reparto.h"
+#include "bus.h"
+#include "aviso.h"
+#include "registro_bin.h"
+#include "historico.h"
+#include "escritor.h"
+#include "estadisticas.h"
+#include "reloj.h"
+#include "servidor.h"
+#include "anillo.h"
+#include "agregador.h"
+#include "captura.h"
+#include "estado_inversor.h"
+
+#define TIMEOUT_RESPONSE_MS        400 // plazo maximo en milisegundos para recibir la respuesta completa tras el envio de una peticion
+#define SILENCIO_RECOGIDA_MS        20 // en modo de recogida, silencio tras la ultima respuesta (ademas de lo que tarda otra igual en la linea) que la cierra
 
 
 /* VARIABLES GLOBALES */
@@ -51,33 +66,88 @@ char *portname1 = "/dev/ttyUSB0";
 //char *portname1 = "/dev/rs422-fronius";
 
 int velocidad_puerto=B19200; //(Macros definidas en termios.h) B1200->0000011; B1800->0000012;B2400->0000013;B4800->0000014;B9600->0000015; B19200->0000016
-unsigned char num_inversor=0x01;
+int baudios_puerto=19200; // velocidad del puerto en baudios (la misma que velocidad_puerto)
+int baja_latencia=0; // opcion -u: perfil de baja latencia del driver del puerto serie
+unsigned char inversores[MAX_INVERSORES]={0x01}; // numeros de los inversores a consultar en la red RS422
+int num_inversores=1;
+int inversores_bus=0; // inversores que responden a las peticiones de difusion (los encontrados en la busqueda; 0: num_inversores)
 char msgerror[1024]; //string para mensaje de error
-int potencia_nominal_inversor=4000;
+struct captura captura={-1}; // captura del trafico del puerto serie (opcion -C)
+
+/*
+ * Clase del ultimo error de intercambio de tramas, para decidir si se reintenta en el momento,
+ * si basta esperar al siguiente ciclo o si hay que volver a abrir el puerto serie
+ */
+enum clase_error{
+	CE_NINGUNO,
+	CE_PLAZO,       // sin respuesta completa en el plazo (ruido, inversor ocupado o apagado)
+	CE_TRAMA,       // respuesta con checksum, longitud o datos erroneos
+	CE_INVERSOR,    // el inversor responde con error 0x0E
+	CE_SIN_DATOS,   // respuesta de longitud 0 a una consulta de medida: el inversor esta en reposo (de noche)
+	CE_DISPOSITIVO  // error de escritura, lectura o poll() del puerto serie
+};
+enum clase_error clase_error;
+#define REINTENTOS_TRANSITORIOS 1 // reintentos inmediatos de un plazo vencido o una trama erronea
+#define RECUPERACION_MAXIMA_MS 300000 // una falta de respuesta mas larga no es un fallo sino una caida (p.e. la noche)
+#define PLAZO_LIMITE_MS 1000 // un 0x9F que el hilo del bus no ha empezado en este tiempo se descarta y se decide de nuevo
+int potencias_nominales[MAX_INVERSORES]; // potencia nominal de cada inversor (W), en el orden de inversores[]
+int potencia_nominal_total=0;            // suma de las potencias nominales
 int flag_d=0; // opcion de linea de comando para pintar tramas para depuracion
 
 
-void configura_puerto_serie(int fd){
+/*
+ * Velocidades de la tarjeta de interfaz, de la mas rapida a la mas lenta
+ */
+static const struct{
+	int baudios;
+	speed_t velocidad;
+} velocidades[]={{19200, B19200}, {9600, B9600}, {4800, B4800}, {2400, B2400}};
+#define NUM_VELOCIDADES (int)(sizeof(velocidades)/sizeof(velocidades[0]))
+
+int pon_velocidad(int baudios){
+	int v;
+
+	for (v=0; v<NUM_VELOCIDADES && velocidades[v].baudios!=baudios; v++);
+	if (v==NUM_VELOCIDADES){
+		return -1;
+	}
+	baudios_puerto=baudios;
+	velocidad_puerto=velocidades[v].velocidad;
+	return 0;
+}
+
+/*
+ * Configura el puerto en modo raw a velocidad_puerto. read() vuelve en cuanto hay un byte (VMIN 1,
+ * VTIME 0): la espera la hace poll() con su plazo. Con la opcion -u ademas se pide al driver el modo
+ * ASYNC_LOW_LATENCY, que en los adaptadores USB (ftdi_sio, cp210x...) baja el temporizador de
+ * latencia de 16 ms a 1 ms. Devuelve 1 si el driver ha aceptado el modo de baja latencia
+ */
+int configura_puerto_serie(int fd){
   	struct termios tp;
+	struct serial_struct serie;
+	int latencia=0;
+
 	tcgetattr(fd, &tp); /* se obtiene la actual configuración del puerto */
 	cfmakeraw(&tp); /* modo raw */
 	tp.c_cflag =  CS8|CREAD|CLOCAL;
+	tp.c_cc[VMIN]=1;
+	tp.c_cc[VTIME]=0;
 	cfsetspeed(&tp, velocidad_puerto); /* velocidad del puerto serie */
     tcsetattr(fd, TCSANOW, &tp);
+	if (baja_latencia && ioctl(fd, TIOCGSERIAL, &serie)==0){
+		serie.flags|=ASYNC_LOW_LATENCY;
+		latencia=ioctl(fd, TIOCSSERIAL, &serie)==0;
+	}
 	tcflush(fd, TCIOFLUSH);
+	return latencia;
 }
 
-struct fronius_frame{
-		unsigned char start[3];  // start sequence  - 3 times 0x80
-		unsigned char lenght; // number  of bytes in data field
-		unsigned char device; // type device, eg  inverter, sensor box, etc
-		unsigned char number; // number of relevant device
-		unsigned char command;// Query, commnadd to be carried out
-		unsigned char data_plus_checksum[MAX_SIZE_DATA_FIELD+1]; 	//variable lenght value of queried command (max. 127 bytes)
-												//last byte is the checksum of all byes in frame except
-												//start and checksum
-
-} ff_request= {{0x80,0x80,0x80}}, ff_response;
+struct fronius_frame ff_request= {{0x80,0x80,0x80}}, ff_response;
+static struct fronius_frame respuestas_difusion[MAX_INVERSORES]; // respuestas recogidas de una peticion de difusion
+static int64_t fin_envio_ns; // instante en que la ultima peticion ha terminado de salir por el puerto serie (tcdrain())
+struct parser_trama parser; // analizador de la secuencia de bytes recibida del puerto serie
+static struct estadisticas estadisticas_propias; // hasta tener el area compartida (y si no se puede crear)
+static struct estadisticas *estadisticas=&estadisticas_propias;
 
 /*
  * Possible Values for the "Device/Option" Byte
@@ -146,14 +216,87 @@ void desplazar(char * buffer, int n){
 }
 
 /*
- * Vacia la cola de entrada
+ * Calcula el instante (CLOCK_MONOTONIC) en que vence un plazo de ms milisegundos a partir de ahora
+ */
+void calcula_plazo(struct timespec *plazo, int ms){
+	clock_gettime(CLOCK_MONOTONIC, plazo);
+	plazo->tv_sec+=ms/1000;
+	plazo->tv_nsec+=(long)(ms%1000)*1000000L;
+	if (plazo->tv_nsec>=1000000000L){
+		plazo->tv_sec++;
+		plazo->tv_nsec-=1000000000L;
+	}
+}
+
+/*
+ * Milisegundos que faltan hasta el vencimiento del plazo (0 si ya ha vencido)
+ */
+int ms_hasta_plazo(const struct timespec *plazo){
+	struct timespec ahora;
+	long ms;
+	clock_gettime(CLOCK_MONOTONIC, &ahora);
+	ms=(plazo->tv_sec-ahora.tv_sec)*1000L + (plazo->tv_nsec-ahora.tv_nsec+999999L)/1000000L;
+	return ms>0?(int)ms:0;
+}
+
+/*
+ * Espera con poll() a que lleguen bytes del puerto serie y los lee directamente en el bufer
+ * circular del analizador de tramas. En lugar de dormir un tiempo fijo se despierta en cuanto
+ * llegan bytes, de modo que el coste de cada comando es el tiempo que tarda la trama en la linea.
+ * Devuelve el numero de bytes leidos, 0 si vence el plazo o -1 si hay error de lectura
+ */
+int recibe_con_plazo(int fd, struct parser_trama *p, const struct timespec *plazo){
+	struct pollfd pfd;
+	unsigned char *hueco;
+	int libre;
+	int rc;
+
+	pfd.fd=fd;
+	pfd.events=POLLIN;
+	while (1){
+		rc=poll(&pfd, 1, ms_hasta_plazo(plazo));
+		if (rc==-1){
+			if (errno==EINTR) continue;
+			sprintf(msgerror, "Error %d en poll() del puerto serie: %s", errno, strerror(errno));
+			return -1;
+		}
+		if (rc==0){
+			return 0; // vencido el plazo
+		}
+		if (pfd.revents & (POLLERR|POLLHUP|POLLNVAL)){
+			sprintf(msgerror, "Error en dispositivo puerto serie (revents 0x%x)", pfd.revents);
+			return -1;
+		}
+		hueco=pt_hueco(p, &libre);
+		rc=read(fd, hueco, libre);
+		if (rc==-1){
+			if (errno==EINTR || errno==EAGAIN) continue;
+			sprintf(msgerror, "Error %d en lectura del puerto serie: %s", errno, strerror(errno));
+			return -1;
+		}
+		if (rc==0){
+			sprintf(msgerror, "Fin de fichero en dispositivo puerto serie");
+			return -1;
+		}
+		pt_confirma(p, rc);
+		cp_anota(&captura, BC_RX, hueco, rc);
+		return rc;
+	}
+}
+
+/*
+ * Vacia la cola de entrada. Los bytes vaciados se cuentan en las estadisticas del bus; el mensaje solo
+ * sale con -d, porque en el ciclo de control lo llama el hilo del bus, que no escribe en la consola
  */
 int vacia_cola(int fd){
 	int bytes_en_cola;
 	int rc;
 	ioctl(fd, FIONREAD, &bytes_en_cola);
 	if (bytes_en_cola>0){
-		printf("Bytes en cola de lectura antes de enviar comando: %d\n", bytes_en_cola);
+		if (flag_d){
+			printf("Bytes en cola de lectura antes de enviar comando: %d\n", bytes_en_cola);
+		}
+		estadisticas->bytes_vaciados+=bytes_en_cola;
 	}
 	while(bytes_en_cola>0){
 		//se lee sin superar el tamaño del buffer
@@ -162,8 +305,13 @@ int vacia_cola(int fd){
 			sprintf(msgerror, "vaciado incompleto de cola de entrada del driver puerto serie");
 			return -1;
 		}
+		if (rc>0){
+			cp_anota(&captura, BC_RX, &ff_response, rc);
+		}
 		bytes_en_cola-=rc;
 	}
+	// los bytes pendientes de analizar pertenecen a respuestas anteriores
+	pt_descarta(&parser);
 	return 0;
 }
 
@@ -192,45 +340,60 @@ void pintartrama(struct fronius_frame *trama){
  *  Manda un comando  en la trama apuntada por pff_resquest a través del interfaz RS422 a una cadena de inversores
  *  y recibe los resultados de la trama en un buffer apuntado por pff_resquest
  *
- *  Calcula el checksum y lo pone como ultimo byte de la trama
- *
- *  Antes de enviar el comando comprueba que no hay caracteres en la cola de entrada del puerto serie
- *  y en caso contrario los lee para eliminarlos
- *
- *
+ *  Calcula el checksum y lo pone como ultimo byte de la trama (ver intercambia_tramas())
  */
+static int intercambia_tramas(int fd, const struct fronius_frame *pff_request,struct fronius_frame *pff_response);
+static int intercambio(int fd, const struct fronius_frame *pff_request,struct fronius_frame *pff_response);
+int64_t ns_transmision(int n);
+
 int static send_command(int fd, struct fronius_frame *pff_request,struct fronius_frame *pff_response)
 {
+	//se pone el checksum calculado en el último byte que la trama de envío
+	pff_request->data_plus_checksum[pff_request->lenght]=fi_checksum(pff_request);
+
+	return intercambia_tramas(fd, pff_request, pff_response);
+}
+
+/*
+ * Anota en las estadisticas del comando las tramas descartadas por el analizador desde el envio
+ * y, si ha llegado respuesta, el tiempo desde el envio
+ */
+static void cierra_estadistica(struct estadistica_comando *ec, unsigned long checksum, unsigned long longitud,
+		const struct timespec *envio, int respondido){
+	struct timespec ahora;
+	uint32_t us;
+
+	ec->errores_checksum+=parser.errores_checksum-checksum;
+	ec->errores_longitud+=parser.errores_longitud-longitud;
+	if (respondido){
+		clock_gettime(CLOCK_MONOTONIC, &ahora);
+		us=(ahora.tv_sec-envio->tv_sec)*1000000+(ahora.tv_nsec-envio->tv_nsec)/1000;
+		ec->tiempo_total_us+=us;
+		est_anota_tiempo(ec->tiempo, &ec->tiempo_max_us, us);
+	}
+}
 
+/*
+ * Envia la trama apuntada por pff_request, que ya lleva el checksum, anotando la peticion en sus
+ * estadisticas y el instante de envio. Espera a que la trama salga del puerto y anota ese instante en
+ * fin_envio_ns: la respuesta no puede empezar antes en la linea semiduplex.
+ *
+ * Antes de enviar el comando comprueba que no hay caracteres en la cola de entrada del puerto serie
+ * y en caso contrario los lee para eliminarlos
+ */
+static int envia_peticion(int fd, const struct fronius_frame *pff_request, struct estadistica_comando *ec,
+		struct timespec *envio)
+{
 	int rc;
 	int i;
-	int	bytes_a_sumar;
 	int bytes_a_escribir;
-	int bytes_a_leer;
-	int bytes_en_cola; //byte existentes en la cola de recepción antes de enviar el comando
-	int reintentos;
-	unsigned char checksum;
-	unsigned char *puntero;
-
-	puntero=&pff_request->lenght;
-
-	//el checksum es la suma a 8bits de todos los campos del frame
-	//menos los 3 bytes de start y el propio checksum
-	checksum=0;
-	for(bytes_a_sumar=(pff_request->lenght + 4);bytes_a_sumar>0; bytes_a_sumar--)
-	{
-		checksum+=*puntero;
-		puntero++;
-	}
-	//se pone el checksum calculado en el último byte que la trama de envío
-	pff_request->data_plus_checksum[pff_request->lenght]=checksum;
 
 	// tamaño de los datos + resto de datos
 	bytes_a_escribir=SIZE_HEADER_FRAME_PLUS_CHECKSUM + pff_request->lenght;
 
 	if (flag_d){
-		unsigned char* tramaw;
-		tramaw=(unsigned char *)pff_request;
+		const unsigned char* tramaw;
+		tramaw=(const unsigned char *)pff_request;
 		for (i=0;i<bytes_a_escribir;i++){
 			printf("trama Peticion: TRAMA-W[%d]--> %d\n",i, tramaw[i]);
 		}
@@ -245,12 +408,19 @@ int static send_command(int fd, struct fronius_frame *pff_request,struct fronius
 	}
 
 	// se manda la orden
+	clock_gettime(CLOCK_MONOTONIC, envio);
+	ec->peticiones++;
 	rc= write(fd, pff_request,bytes_a_escribir);
 	if (rc!=bytes_a_escribir){
 		// No se puede escribir todos los bytes de la petición
 		sprintf(msgerror, "Escritura incompleta en dispositivo puerto serie");
+		ec->errores_dispositivo++;
+		clase_error=CE_DISPOSITIVO;
 		return -1;
 	}
+	cp_anota(&captura, BC_TX, pff_request, bytes_a_escribir);
+	while (tcdrain(fd) && errno==EINTR);
+	fin_envio_ns=av_instante_ns();
 
 	if (flag_d){
 	  	printf("Enviados %d de %d\n",rc,bytes_a_escribir);
@@ -263,135 +433,102 @@ int static send_command(int fd, struct fronius_frame *pff_request,struct fronius
 		}
 		printf("Petición: checksum (DATA[%d]) --> %d\n",i,pff_request->data_plus_checksum[i]);
 	}
+	return 0;
+}
 
-	// tras esperar hasta que haya, al menos, 7 bytes (justo hasta donde empiezan los datos)
-	bytes_a_leer=SIZE_HEADER_FRAME;
-
-	reintentos=0;
-	do{
-	  usleep(WAIT_TIME_AFTER_REQUEST); // espera un tiempo a que llegen tras la orden
-	  ioctl(fd, FIONREAD, &bytes_en_cola);
-
-
-	  if (flag_d){
-		  printf ("Bytes recibidos en cola: %d\n",bytes_en_cola);
-	  }
-
-	  reintentos++;
-	  /* to_do:
-	   * retirar este printf
-	   */
-	  if (reintentos>1){
-		  printf (".");
-		  fflush(stdout);
-	  }
-
-	  if (reintentos>RETRIES_TO_RECEIVE_EXPECTED_BYTES){
-		  sprintf (msgerror,"Too many retries to receive header frame");
-		  return -1; // error de lectura
-	  }
-
-	}while (bytes_en_cola < bytes_a_leer);
-
-
-	// se leen los 7 bytes (justo hasta donde empiezan los datos)
-	rc= read(fd, pff_response, bytes_a_leer);
-	if (rc!=bytes_a_leer){
-			sprintf(msgerror, "Lectura incompleta en dispositivo puerto serie");
-			return -1;
-	}
-	// se comprueba el inicio de trama y en caso contrario se alinea leyendo nuevos caracteres;
-	int n=0;
-	while(n>2){
-		if (pff_response->start[n]!=0x80){
-			sprintf(msgerror, "Trama erronea: No inicia por 0x80 0x80 0x80");
-			return -1;
-		}
-		else{
-			// va bien la cosa comprueba siguiete byte de cabecera
-			n++;
-		}
-	}
-
+/*
+ *  Envia la trama apuntada por pff_request, que ya lleva el checksum, y espera su respuesta
+ *
+ *  Antes de enviar el comando comprueba que no hay caracteres en la cola de entrada del puerto serie
+ *  y en caso contrario los lee para eliminarlos
+ *
+ *  La respuesta se obtiene del analizador incremental de tramas: las tramas con longitud o checksum
+ *  erroneos y las que no corresponden al dispositivo o comando solicitado se descartan y se sigue
+ *  esperando hasta que venza el plazo. Si vence, msgerror explica el ultimo motivo de descarte.
+ *
+ */
+static int intercambio(int fd, const struct fronius_frame *pff_request,struct fronius_frame *pff_response)
+{
 
-	if (flag_d){
-		unsigned char* tramar;
-		tramar=(unsigned char *)pff_response;
-		for (i=0;i<SIZE_HEADER_FRAME;i++){
-			printf("trama respuesta: TRAMA-R[%d]--> %d\n",i, tramar[i]);
-		}
+	int rc;
+	int i;
+	struct timespec plazo; //instante en que vence el plazo de recepcion de la respuesta
+	struct timespec envio;
+	static struct estadistica_comando sin_columna; // comandos sin columna en las estadisticas
+	struct estadistica_comando *ec;
+	unsigned long checksum, longitud;
+
+	ec=est_entrada(estadisticas, pff_request->number, pff_request->command);
+	if (ec==NULL){
+		ec=&sin_columna;
 	}
 
-	if (pff_response->lenght>MAX_SIZE_DATA_FIELD){
-		sprintf (msgerror,"Error longitud excesiva de trama recibida");
+	checksum=parser.errores_checksum;
+	longitud=parser.errores_longitud;
+	if (envia_peticion(fd, pff_request, ec, &envio)){
 		return -1;
 	}
 
-#if 1  // control de que la trama viene del dispositivo solicitado y responde al comando solicitado
-	if ((pff_response->device!=pff_request->device) || (pff_response->number!=pff_request->number)){
-	 /*
-	  * la trama no viene del dispositivo solicitado
-	  *
-	  * Ojo que en caso de Broadcast pff_request->number=0 y sin embargo responderá cada uno de los inversores
-	  * Posiblemente sea necesario poner un parametro a la función que indique de que inversor se espera la respuesta.
-	  */
-		sprintf (msgerror,"Trama no procedente del inversor solicitado %d", pff_request->number  );
-		return -1; // error de lectura
-	}
+	// el plazo para recibir la respuesta completa cuenta desde el envio de la peticion
+	calcula_plazo(&plazo, TIMEOUT_RESPONSE_MS);
+	sprintf (msgerror,"Plazo vencido sin recibir trama de respuesta completa");
 
-	if (pff_response->command != pff_request->command){ //la trama de respuesta no corresponde al comando solicitado
-		if (pff_response->command==0x0e){ 				//este es un caso especial
-			// hay que leer el resto de datos de trama
-		}
-		else {
-			sprintf (msgerror,"La trama de respuesta no corresponde al comando solicitado %d", pff_request->command);
-			return -1;
+	while (1){
+		rc=pt_extrae(&parser, pff_response);
+		if (rc==-1){
+			// trama descartada; el analizador ya se ha resincronizado con la siguiente secuencia de inicio
+			sprintf (msgerror,"Error de checksum o longitud, datos recibidos no fiables");
+			continue;
 		}
-	}
-#endif
-
-
-	// luego se leen tantos como lo que indica el campo del frame pff_response->lenght + un byte para checksum
-	bytes_a_leer=(pff_response->lenght)+1; //se pretende leer todos los bytes de datos + el byte de checksum
-
-	ioctl(fd, FIONREAD, &bytes_en_cola);
-	reintentos=0;
-	while (bytes_en_cola < bytes_a_leer){
-		usleep(WAIT_TIME_AFTER_REQUEST ); // espera un tiempo para reintentar
-		ioctl(fd, FIONREAD, &bytes_en_cola);
-		reintentos++;
-		/* to_do:
-		 * retirar este printf
-		 */
-		if (reintentos>1){
-			printf (" %d/%d",bytes_en_cola, bytes_a_leer);
-			fflush(stdout);
+		if (rc==0){
+			if (parser.errores_checksum!=checksum || parser.errores_longitud!=longitud){
+				// la respuesta ha llegado corrupta y no va a repetirse: no se espera al plazo
+				clase_error=CE_TRAMA;
+				cierra_estadistica(ec, checksum, longitud, &envio, 0);
+				return -1;
+			}
+			// faltan bytes: se espera a que lleguen mas o venza el plazo
+			rc=recibe_con_plazo(fd, &parser, &plazo);
+			if (rc<=0){
+				if (rc==0){
+					ec->plazos++;
+					clase_error=CE_PLAZO;
+				}
+				else {
+					ec->errores_dispositivo++;
+					clase_error=CE_DISPOSITIVO;
+				}
+				cierra_estadistica(ec, checksum, longitud, &envio, 0);
+				return -1;
+			}
+			continue;
 		}
 
-		if (reintentos>RETRIES_TO_RECEIVE_EXPECTED_BYTES){
-			rc= read(fd, ((unsigned char*)pff_response)+SIZE_HEADER_FRAME, bytes_en_cola);
-			sprintf (msgerror,"Excesivos reintentos para recepcion completa de datos indicados en cabecera");
-			//pintartrama(pff_response);
-			return -1; // error de lectura
+#if 1  // control de que la trama viene del dispositivo solicitado y responde al comando solicitado
+		if ((pff_response->device!=pff_request->device) || (pff_response->number!=pff_request->number)){
+		 /*
+		  * la trama no viene del dispositivo solicitado
+		  *
+		  * Ojo que en caso de Broadcast pff_request->number=0 y sin embargo responderá cada uno de los inversores
+		  * Posiblemente sea necesario poner un parametro a la función que indique de que inversor se espera la respuesta.
+		  */
+			sprintf (msgerror,"Trama no procedente del inversor solicitado %d", pff_request->number  );
+			ec->errores_cabecera++;
+			continue;
 		}
-	}
-	rc= read(fd, ((unsigned char*)pff_response)+SIZE_HEADER_FRAME, bytes_a_leer);
-	if (rc!=bytes_a_leer){
-		sprintf(msgerror, "Lectura incompleta en dispositivo puerto serie");
-		return -1;
-	}
-
 
-	if (flag_d){
-		unsigned char* tramar;
-		tramar=(unsigned char *)pff_response;
-		for (i=SIZE_HEADER_FRAME;i<18;i++){
-			printf("trama respuesta: TRAMA-R[%d]--> %d\n",i, tramar[i]);
+		if (pff_response->command != pff_request->command && pff_response->command!=0x0e){
+			//la trama de respuesta no corresponde al comando solicitado (0x0e es la respuesta de error)
+			sprintf (msgerror,"La trama de respuesta no corresponde al comando solicitado %d", pff_request->command);
+			ec->errores_cabecera++;
+			continue;
 		}
+#endif
+		break;
 	}
+	cierra_estadistica(ec, checksum, longitud, &envio, 1);
 
 	if (flag_d){
-		printf("Leidos %d de %d\n",rc,bytes_a_leer);
 		printf("Respuesta: lenght data        --> %d\n",pff_response->lenght);
 		printf("Respuesta: device             --> %d\n",pff_response->device);
 		printf("Respuesta: number             --> %d\n",pff_response->number);
@@ -402,32 +539,134 @@ int static send_command(int fd, struct fronius_frame *pff_request,struct fronius
 		printf("Respuesta: checksum (DATA[%d]) --> %d\n",i,pff_response->data_plus_checksum[i]);
 	}
 
-		// Verificacion del checksum
-	 	puntero=&pff_response->lenght;
-		checksum=0;
-		//el checksum es la suma a 8bits de todos los campos del frame
-		//menos los 3 bytes de start y el propio checksum
-
-		for(bytes_a_sumar=(pff_response->lenght + 4);bytes_a_sumar>0; bytes_a_sumar--)
-		{
-			checksum+=*puntero;
-			puntero++;
-		}
-		//se comprueba con el checksum de la trama
-		if (pff_response->data_plus_checksum[pff_response->lenght]!=checksum){
-			sprintf (msgerror,"Error de checksum, datos recibidos no fiables");
-			return -1;
-		}
-
 		// trtatamiento del caso especial de error de comando
 		if (pff_response->command==0x0e){
 			sprintf(msgerror, "Error 0x%x en comando 0x%x\n", pff_response->data_plus_checksum[1],pff_response->data_plus_checksum[0]);
+			ec->errores_0e++;
+			clase_error=CE_INVERSOR;
 			return -1;
 		}
+	ec->respuestas++;
+	clase_error=CE_NINGUNO;
 
 	return EXIT_SUCCESS;
 }
 
+/*
+ * Intercambio con reintento inmediato de los errores transitorios (plazo vencido o trama corrupta).
+ * Un plazo vencido solo se reintenta si el inversor respondio a la peticion anterior,
+ * para no duplicar la espera con un inversor apagado
+ */
+static int intercambia_tramas(int fd, const struct fronius_frame *pff_request,struct fronius_frame *pff_response)
+{
+	static unsigned char respondio[256]; // el inversor respondio a la ultima peticion
+	struct estadistica_comando *ec;
+	int rc, intento;
+
+	for (intento=0; ; intento++){
+		rc=intercambio(fd, pff_request, pff_response);
+		if (rc==0 || intento>=REINTENTOS_TRANSITORIOS ||
+				(clase_error!=CE_TRAMA && (clase_error!=CE_PLAZO || !respondio[pff_request->number]))){
+			break;
+		}
+		ec=est_entrada(estadisticas, pff_request->number, pff_request->command);
+		if (ec!=NULL){
+			ec->reintentos++;
+		}
+	}
+	respondio[pff_request->number]=clase_error==CE_NINGUNO || clase_error==CE_INVERSOR;
+	return rc;
+}
+
+/*
+ * Modo de recogida de una peticion de difusion (numero 0), a la que responde cada inversor: envia la
+ * trama una vez, que ya lleva el checksum, y deja en respuestas[] las respuestas al comando de cualquier
+ * numero de inversor (hasta max). La recogida termina al llegar esperadas respuestas (0: sin numero
+ * conocido), tras un silencio de SILENCIO_RECOGIDA_MS mas el tiempo en la linea de otra respuesta como
+ * la ultima, o al vencer TIMEOUT_RESPONSE_MS sin ninguna. Las tramas corruptas se descartan sin cortar
+ * la recogida, y las respuestas de error 0x0E se cuentan pero no se devuelven.
+ * Devuelve el numero de respuestas recogidas o -1 si no llega ninguna (msgerror explica el motivo)
+ */
+static int recoge_respuestas(int fd, const struct fronius_frame *pff_request, struct fronius_frame *respuestas,
+		int max, int esperadas)
+{
+	struct timespec plazo; // fin de la recogida: plazo de la primera respuesta o silencio tras la ultima
+	struct timespec envio;
+	static struct estadistica_comando sin_columna;
+	struct estadistica_comando *ec;
+	struct fronius_frame trama;
+	unsigned long checksum, longitud;
+	int recogidas=0, errores_0e=0, rc;
+
+	ec=est_entrada(estadisticas, pff_request->number, pff_request->command);
+	if (ec==NULL){
+		ec=&sin_columna;
+	}
+	checksum=parser.errores_checksum;
+	longitud=parser.errores_longitud;
+	if (envia_peticion(fd, pff_request, ec, &envio)){
+		return -1;
+	}
+	calcula_plazo(&plazo, TIMEOUT_RESPONSE_MS);
+	sprintf (msgerror,"Plazo vencido sin recibir trama de respuesta completa");
+
+	while (esperadas==0 || recogidas+errores_0e<esperadas){
+		rc=pt_extrae(&parser, &trama);
+		if (rc==-1){
+			sprintf (msgerror,"Error de checksum o longitud, datos recibidos no fiables");
+			continue;
+		}
+		if (rc==0){
+			rc=recibe_con_plazo(fd, &parser, &plazo);
+			if (rc==-1){
+				ec->errores_dispositivo++;
+				clase_error=CE_DISPOSITIVO;
+				cierra_estadistica(ec, checksum, longitud, &envio, 0);
+				return -1;
+			}
+			if (rc==0){
+				break;
+			}
+			continue;
+		}
+		if (trama.device!=pff_request->device || (pff_request->number!=0 && trama.number!=pff_request->number) ||
+				(trama.command!=pff_request->command && trama.command!=0x0e)){
+			sprintf (msgerror,"Trama no procedente de la peticion de difusion 0x%02x", pff_request->command);
+			ec->errores_cabecera++;
+			continue;
+		}
+		if (flag_d){
+			printf("Respuesta %d: device %d number %d command 0x%02x lenght %d\n", recogidas+errores_0e+1,
+					trama.device, trama.number, trama.command, trama.lenght);
+		}
+		if (trama.command==0x0e){
+			sprintf(msgerror, "Error 0x%x en comando 0x%x del inversor %d", trama.data_plus_checksum[1],
+					trama.data_plus_checksum[0], trama.number);
+			ec->errores_0e++;
+			errores_0e++;
+		}
+		else {
+			if (recogidas<max){
+				respuestas[recogidas]=trama;
+			}
+			recogidas++;
+			ec->respuestas++;
+		}
+		// las respuestas de los demas inversores llegan seguidas: se espera poco mas de lo que tarda otra
+		calcula_plazo(&plazo, SILENCIO_RECOGIDA_MS+ns_transmision(SIZE_HEADER_FRAME_PLUS_CHECKSUM+trama.lenght)/1000000);
+	}
+	cierra_estadistica(ec, checksum, longitud, &envio, recogidas+errores_0e>0);
+	if (recogidas==0){
+		clase_error=errores_0e?CE_INVERSOR:parser.errores_checksum!=checksum || parser.errores_longitud!=longitud?CE_TRAMA:CE_PLAZO;
+		if (clase_error==CE_PLAZO){
+			ec->plazos++;
+		}
+		return -1;
+	}
+	clase_error=CE_NINGUNO;
+	return recogidas<max?recogidas:max;
+}
+
 int fi_get_version(int fd, unsigned char n_inverter, struct data_response_get_version *versions)
 {
 
@@ -468,64 +707,87 @@ int fi_get_version(int fd, unsigned char n_inverter, struct data_response_get_ve
 	return 0;
 }
 
-int fi_get_power(int fd, unsigned char n_inverter, float *power){
+/*
+ * Tramas de peticion de cada medida, construidas una sola vez por fi_inicia_medidas().
+ * Para cada consulta solo cambia el numero de inversor, y el checksum es el de la trama
+ * con numero 0 mas el numero de inversor
+ */
+static struct fronius_frame peticiones_medida[NUM_MEDIDAS];
+static unsigned char checksum_medida[NUM_MEDIDAS];
+
+void fi_inicia_medidas(void){
+	int m;
+
+	for (m=0; m<NUM_MEDIDAS; m++){
+		memset(&peticiones_medida[m], 0, sizeof(peticiones_medida[m]));
+		peticiones_medida[m].start[0]=peticiones_medida[m].start[1]=peticiones_medida[m].start[2]=START_BYTE;
+		peticiones_medida[m].lenght=0x00;
+		peticiones_medida[m].device=0x01;
+		peticiones_medida[m].number=0x00;
+		peticiones_medida[m].command=medidas[m].comando;
+		checksum_medida[m]=fi_checksum(&peticiones_medida[m]);
+	}
+}
+
+/*
+ * Lee la medida m del inversor n_inverter segun su descriptor de la tabla medidas[]
+ * y la deja en *valor ya escalada. Si la lectura falla *valor conserva el ultimo valor leido,
+ * que queda como antiguo (inversor no valido, con el instante de su ultima lectura)
+ */
+int fi_get_medida(int fd, unsigned char n_inverter, enum medida m, float *valor){
 
 	int rc;
-	struct data_response_get_power {
-		unsigned char msb;
-		unsigned char lsb;
-		signed   char exp;
-	} *datos_devueltos;
-
-	// se limpia el buffer para la trama de respuesta
-	ff_response.lenght=0x00;
-	ff_response.device=0x00;
-	ff_response.number=0x00;
-	ff_response.command=0x00;
-	memset(ff_response.data_plus_checksum, 0x00, sizeof(ff_response.data_plus_checksum));
+	float leido;
+	struct fronius_frame *peticion=&peticiones_medida[m];
 
-	// se ajusta y limpia el buffer para la trama de petición
-	ff_request.lenght=0x00;
-	ff_request.device=0x01;
-	ff_request.number=n_inverter;
-	ff_request.command=0x10;
-	memset(ff_request.data_plus_checksum, 0x00, sizeof(ff_request.data_plus_checksum));
+	peticion->number=n_inverter;
+	peticion->data_plus_checksum[0]=(unsigned char)(checksum_medida[m]+n_inverter);
 
 	// envio de comando y respuesta
-	rc=send_command(fd, &ff_request, &ff_response);
+	rc=intercambia_tramas(fd, peticion, &ff_response);
 	if (rc==-1){
-			insstr("Error en función fi_get_power: ", msgerror);
-			return -1;
+		sprintf(msgerror+strlen(msgerror), " (comando 0x%02x %s)", medidas[m].comando, medidas[m].nombre);
+		insstr("Error en función fi_get_medida: ", msgerror);
+		return -1;
 	}
-	// se verifica que la longitud de la respuesta es correcta
-	// de noche el inversor se despierta unos segundos y responde a este comando pero con longitud de datos = 0
-	// por ejemplo: 128128128 0 1 1 16  18
-	// por tanto el checksum (18) se interpreta como el msb de la potencia y se devuelve
-	// una potencia erronea de 4608W
-
-	if (ff_response.lenght!=sizeof(struct data_response_get_power)){
-		insstr("Error en longitud de datos de la respuesta del comando 0x10", msgerror);
-		*power=0;
+	if (ff_response.lenght==0){
+		sprintf(msgerror, "Respuesta sin datos del comando 0x%02x %s (inversor en reposo)", medidas[m].comando, medidas[m].nombre);
+		clase_error=CE_SIN_DATOS;
 		return -1;
 	}
 
-	datos_devueltos= (struct data_response_get_power *)&ff_response.data_plus_checksum;
-	*power=(256*datos_devueltos->msb+datos_devueltos->lsb)*
-			pow(10,datos_devueltos->exp);
+	rc=medidas[m].decodifica(ff_response.data_plus_checksum, ff_response.lenght, &leido);
+	if (rc==-1){
+		sprintf(msgerror, "Error en longitud de datos (%d) de la respuesta del comando 0x%02x %s",
+				ff_response.lenght, medidas[m].comando, medidas[m].nombre);
+		clase_error=CE_TRAMA;
+		return -1;
+	}
+	*valor=leido*medidas[m].escala;
 
 	return EXIT_SUCCESS;
 }
 
+/*
+ * Lee del inversor n_inverter las medidas cuyo bit esta a 1 en conjunto (bit m para la medida m)
+ * dejandolas en valores[m]. Devuelve el conjunto de las medidas leidas correctamente;
+ * msgerror explica el ultimo fallo
+ */
+unsigned int fi_get_medidas(int fd, unsigned char n_inverter, unsigned int conjunto, float *valores){
+	unsigned int leidas=0;
+	int m;
+
+	for (m=0; m<NUM_MEDIDAS; m++){
+		if ((conjunto & (1u<<m)) && fi_get_medida(fd, n_inverter, m, &valores[m])==0){
+			leidas|=1u<<m;
+		}
+	}
+	return leidas;
+}
 
-int fi_get_day_energy(int fd, unsigned char n_inverter, float *daily_energy){
 
+int fi_get_inverter_caps(int fd, unsigned char n_inverter, unsigned char *inverter_caps){
 	int rc;
-	struct data_response_get_parameter {
-		unsigned char msb;
-		unsigned char lsb;
-		signed   char exp;
-	} *datos_devueltos;
-
 	// se limpia el buffer para la trama de respuesta
 	ff_response.lenght=0x00;
 	ff_response.device=0x00;
@@ -535,44 +797,64 @@ int fi_get_day_energy(int fd, unsigned char n_inverter, float *daily_energy){
 
 	// se ajusta y limpia el buffer para la trama de petición
 	ff_request.lenght=0x00;
+
 	ff_request.device=0x01;
 	ff_request.number=n_inverter;
-	ff_request.command=0x12; //Get daily energy command
+	ff_request.command=0xBD; // comando para pedir la capacidades de ajustar la potencia del inversor
 	memset(ff_request.data_plus_checksum, 0x00, sizeof(ff_request.data_plus_checksum));
 
-	// envio de comando y respuesta
-	rc=send_command(fd, &ff_request, &ff_response);
+   	// envio de comando y respuesta
+	rc= send_command(fd, &ff_request, &ff_response);
 	if (rc==-1){
-			insstr("Error en función fi_get_power: ", msgerror);
-			return -1;
-	}
-	// se verifica que la longitud de la respuesta es correcta
-	// de noche el inversor se despierta unos segundos y responde a este comando pero con longitud de datos = 0
-	// por ejemplo: 128128128 0 1 1 16  18
-	// por tanto el checksum (18) se interpreta como el msb de la potencia y se devuelve
-	// una potencia erronea de 4608W
-
-	if (ff_response.lenght!=sizeof(struct data_response_get_parameter)){
-		insstr("Error en longitud de datos de la respuesta del comando 0x10", msgerror);
-		*daily_energy=0;
+		insstr("Error en función fi_get_inverter_caps: ", msgerror);
 		return -1;
 	}
 
-	datos_devueltos= (struct data_response_get_parameter *)&ff_response.data_plus_checksum;
-	*daily_energy=(256*datos_devueltos->msb+datos_devueltos->lsb)*
-			pow(10,datos_devueltos->exp);
-
+	// se apuntan las estructuras al area de datos conrrespondientes de los bufferes de trama
+	*inverter_caps= ff_response.data_plus_checksum[0];
 	return EXIT_SUCCESS;
+
 }
 
-int fi_get_dc_voltage(int fd, unsigned char n_inverter, float *dc_voltage){
 
-	int rc;
-	struct data_response_get_parameter {
-		unsigned char msb;
-		unsigned char lsb;
-		signed   char exp;
-	} *datos_devueltos;
+/*
+ * Pone el limite p_rel (% de la potencia nominal de cada uno) a los n inversores de la lista con una sola
+ * trama 0x9F de difusion: el porcentaje seguido de los numeros de inversor. En sin_respuesta (si no es
+ * NULL) deja un bit por cada inversor de la lista que no ha respondido (bit k: n_inverters[k]), que
+ * sigue con el limite que tenia. Devuelve p_rel o -1
+ */
+int fi_set_powerlimit(int fd, const unsigned char *n_inverters, int n_inversores, unsigned char p_rel,
+		unsigned int *sin_respuesta){
+
+	struct data_request_set_powerlimit {
+			unsigned char cmd_id;// codigo de comando de "remote control". Para poner limite de potencia es 0x01
+			unsigned char sep1;  // separador =0x7F
+			unsigned char p_rel; // porcentaje de la potencia total del inversor donde se pone el limite
+			unsigned char res1; // reservado =0x00
+			unsigned char sep2; // separador =0x7F
+			unsigned char res2; // reservado =0x00
+			unsigned char res3; // reservado =0x00
+			unsigned char sep3; // separador =0x7F
+			unsigned char res4; // reservado =0x00
+			unsigned char n_inverter[MAX_INVERSORES]; //numeros de los inversores a los que se dirige el comando
+
+		} *datos_enviados;
+
+	struct data_response_set_powerlimit {
+			unsigned char cmd_id; // codigo de comando de "remote control". Para poner limite de potencia es 0x01
+			unsigned char sep1; // separador =0x7F
+			unsigned char p_rel; // porcentaje de la potencia total del inversor donde se pone el limite
+			unsigned char res1; // reservado =0x00
+			unsigned char sep2; // separador =0x7F
+			unsigned char res2; // reservado =0x00
+			unsigned char res3; // reservado =0x00
+			unsigned char sep3; // separador =0x7F
+			unsigned char res4; // reservado =0x00
+			unsigned char n_inverter; //numero del inversor al que se ha dirigido el comando
+		} *datos_devueltos=NULL;
+	struct estadistica_comando *ec;
+	unsigned int faltan;
+	int i, k, n, intento, anonimas=0;
 
 	// se limpia el buffer para la trama de respuesta
 	ff_response.lenght=0x00;
@@ -582,188 +864,875 @@ int fi_get_dc_voltage(int fd, unsigned char n_inverter, float *dc_voltage){
 	memset(ff_response.data_plus_checksum, 0x00, sizeof(ff_response.data_plus_checksum));
 
 	// se ajusta y limpia el buffer para la trama de petición
-	ff_request.lenght=0x00;
-	ff_request.device=0x01;
-	ff_request.number=n_inverter;
-	ff_request.command=0x18; //Get DC voltage command
+	if (n_inversores<1 || n_inversores>MAX_INVERSORES){
+		sprintf(msgerror, "Error en función fi_set_powerlimit: %d inversores", n_inversores);
+		return -1;
+	}
+	ff_request.lenght=0x09+n_inversores; // 0x09 + el numero de inversores a los que se dirige el comando
+	ff_request.device=0x00; //
+	ff_request.number=0x00; // El comando 0x9F es de broadcast
+	ff_request.command=0x9F; // comando para ajustar el limite del inversor
 	memset(ff_request.data_plus_checksum, 0x00, sizeof(ff_request.data_plus_checksum));
 
-	// envio de comando y respuesta
-	rc=send_command(fd, &ff_request, &ff_response);
-	if (rc==-1){
-			insstr("Error en función fi_get_power: ", msgerror);
+	// se apuntan las estructuras al area de datos conrrespondientes de los bufferes de trama
+	datos_enviados = (struct data_request_set_powerlimit *)&ff_request.data_plus_checksum;
+
+	datos_enviados->cmd_id=0x01;
+	datos_enviados->sep1=0x7F;
+	datos_enviados->p_rel=p_rel>100?100:p_rel; // carga valor porcentaje con límite en 100
+	datos_enviados->res1=0x00;
+	datos_enviados->sep2=0x7F;
+	datos_enviados->res2=0x00;
+	datos_enviados->res3=0x00;
+	datos_enviados->sep3=0x7F;
+	datos_enviados->res4=0x00;
+	memcpy(datos_enviados->n_inverter, n_inverters, n_inversores);
+
+	// envio de comando y recogida de la respuesta de cada inversor, para que no queden en la cola
+	// hasta el siguiente comando. Una respuesta corrupta se reintenta como en intercambia_tramas()
+	ff_request.data_plus_checksum[ff_request.lenght]=fi_checksum(&ff_request);
+	for (intento=0; ; intento++){
+		n=recoge_respuestas(fd, &ff_request, respuestas_difusion, MAX_INVERSORES, inversores_bus?inversores_bus:num_inversores);
+		if (n>0 || intento>=REINTENTOS_TRANSITORIOS || clase_error!=CE_TRAMA){
+			break;
+		}
+		ec=est_entrada(estadisticas, ff_request.number, ff_request.command);
+		if (ec!=NULL){
+			ec->reintentos++;
+		}
+	}
+	if (n==-1){
+		insstr("Error en función fi_set_powerlimit: ", msgerror);
+		return -1;
+	}
+	ff_response=respuestas_difusion[0];
+	faltan=(1u<<n_inversores)-1;
+	for (i=0; i<n; i++){
+		datos_devueltos=(struct data_response_set_powerlimit *)&respuestas_difusion[i].data_plus_checksum;
+		if (datos_devueltos->n_inverter!=0xFF){
+			sprintf(msgerror, "Error en función fi_set_powerlimit devolvió valor n_inverter distinto de 0xFF");
 			return -1;
+		}
+		if (respuestas_difusion[i].number==0){
+			anonimas++;
+		}
+		for (k=0; k<n_inversores; k++){
+			if (n_inverters[k]==respuestas_difusion[i].number){
+				faltan&=~(1u<<k);
+			}
+		}
+	}
+	if (anonimas>=__builtin_popcount(faltan)){
+		faltan=0; // respuestas sin el numero del inversor: solo se puede contar cuantas han llegado
+	}
+	if (sin_respuesta!=NULL){
+		*sin_respuesta=faltan;
 	}
-	// se verifica que la longitud de la respuesta es correcta
-	// de noche el inversor se despierta unos segundos y responde a este comando pero con longitud de datos = 0
-	// por ejemplo: 128128128 0 1 1 16  18
-	// por tanto el checksum (18) se interpreta como el msb de la potencia y se devuelve
-	// una potencia erronea de 4608W
+	return datos_devueltos->p_rel;
+}
+
+void pinta_version(unsigned char numero, const struct data_response_get_version *versions, struct escritor *escritor){
+	es_texto(escritor, "Inversor %d: Serie inversor: %d, version IFC:%d.%d.%d Version SW:%d.%d.%d.%d\n",
+			numero,
+			versions->type_inverter,
+			versions->IFC_Major, versions->IFC_Minor,versions->IFC_Release,
+			versions->SW_Major, versions->SW_Minor, versions->SW_Release, versions->SW_Build);
+}
 
-	if (ff_response.lenght!=sizeof(struct data_response_get_parameter)){
-		insstr("Error en longitud de datos de la respuesta del comando 0x10", msgerror);
-		*dc_voltage=0;
+/*
+ * Inversor encontrado en el bus por descubre_inversores()
+ */
+struct inversor_descubierto{
+	unsigned char numero;
+	unsigned char caps;      // capacidades (comando 0xBD)
+	unsigned char con_caps;  // ha respondido al 0xBD
+	struct data_response_get_version version;
+};
+
+/*
+ * Busca los inversores que hay en el bus con solo dos peticiones de difusion (numero 0) en modo de
+ * recogida, la de version y la de capacidades, en lugar de consultar uno a uno los numeros posibles.
+ * Cada inversor responde con su numero. Deja en encontrados[] como mucho max inversores ordenados por
+ * numero y devuelve cuantos son, o -1 si no responde ninguno a la peticion de version
+ */
+int descubre_inversores(int fd, struct inversor_descubierto *encontrados, int max){
+	struct data_response_get_version *version;
+	int n, i, j, k, num=0;
+
+	memset(&ff_request.lenght, 0, sizeof(ff_request)-sizeof(ff_request.start));
+	ff_request.device=0x01;
+	ff_request.number=0x00;
+	ff_request.command=0x01;
+	ff_request.data_plus_checksum[0]=fi_checksum(&ff_request);
+	n=recoge_respuestas(fd, &ff_request, respuestas_difusion, MAX_INVERSORES, 0);
+	if (n==-1){
+		insstr("Error en la busqueda de inversores: ", msgerror);
 		return -1;
 	}
+	for (i=0; i<n && num<max; i++){
+		if (respuestas_difusion[i].number==0 || respuestas_difusion[i].lenght<sizeof(struct data_response_get_version)-1){
+			continue;
+		}
+		// insercion ordenada por numero, sin repetidos
+		for (j=0; j<num && encontrados[j].numero<respuestas_difusion[i].number; j++);
+		if (j<num && encontrados[j].numero==respuestas_difusion[i].number){
+			continue;
+		}
+		for (k=num; k>j; k--){
+			encontrados[k]=encontrados[k-1];
+		}
+		memset(&encontrados[j], 0, sizeof(encontrados[j]));
+		encontrados[j].numero=respuestas_difusion[i].number;
+		version=(struct data_response_get_version *)respuestas_difusion[i].data_plus_checksum;
+		encontrados[j].version=*version;
+		num++;
+	}
 
-	datos_devueltos= (struct data_response_get_parameter *)&ff_response.data_plus_checksum;
-	*dc_voltage=(float)(256*datos_devueltos->msb+datos_devueltos->lsb)*
-			pow(10,datos_devueltos->exp);
+	ff_request.command=0xBD;
+	ff_request.data_plus_checksum[0]=fi_checksum(&ff_request);
+	n=recoge_respuestas(fd, &ff_request, respuestas_difusion, MAX_INVERSORES, num);
+	for (i=0; i<n; i++){
+		for (j=0; j<num; j++){
+			if (encontrados[j].numero==respuestas_difusion[i].number && respuestas_difusion[i].lenght>=1){
+				encontrados[j].caps=respuestas_difusion[i].data_plus_checksum[0];
+				encontrados[j].con_caps=1;
+			}
+		}
+	}
+	return num;
+}
 
-	return EXIT_SUCCESS;
+/*
+ * Presenta el resultado de la busqueda de inversores (opcion -D)
+ */
+void pinta_descubiertos(const struct inversor_descubierto *encontrados, int n, struct escritor *escritor){
+	int i;
+
+	if (n<=0){
+		es_texto(escritor, "No inverter answers the broadcast version query: %s\n", msgerror);
+		return;
+	}
+	es_texto(escritor, "%d inverter(s) on the bus:\n", n);
+	for (i=0; i<n; i++){
+		pinta_version(encontrados[i].numero, &encontrados[i].version, escritor);
+		if (encontrados[i].con_caps){
+			es_texto(escritor, "Inversor %d: caps 0x%02x (%s)\n", encontrados[i].numero, encontrados[i].caps,
+					encontrados[i].caps & 0x01?"power limitation":"no power limitation");
+		}
+		else {
+			es_texto(escritor, "Inversor %d: no answer to the broadcast caps query\n", encontrados[i].numero);
+		}
+	}
 }
 
-int fi_get_dc_current(int fd, unsigned char n_inverter, float *dc_current){
+/*
+ * Modo de medida (opcion -B): repite ciclos completos de consultas al inversor sin esperar al temporizador
+ * y presenta los percentiles del tiempo de ida y vuelta de cada comando, los comandos por segundo
+ * y la fraccion del segundo de ciclo que consume cada ciclo.
+ */
+#define NUM_COMANDOS_MEDIDA 5
 
-	int rc;
-	struct data_response_get_parameter {
-		unsigned char msb;
-		unsigned char lsb;
-		signed   char exp;
-	} *datos_devueltos;
+int compara_double(const void *a, const void *b){
+	double x=*(const double *)a, y=*(const double *)b;
+	return x<y?-1:x>y?1:0;
+}
 
-	// se limpia el buffer para la trama de respuesta
-	ff_response.lenght=0x00;
-	ff_response.device=0x00;
-	ff_response.number=0x00;
-	ff_response.command=0x00;
-	memset(ff_response.data_plus_checksum, 0x00, sizeof(ff_response.data_plus_checksum));
+double percentil(double *valores, int n, double p){
+	if (n==0) return 0;
+	return valores[(int)(p*(n-1)+0.5)];
+}
 
-	// se ajusta y limpia el buffer para la trama de petición
-	ff_request.lenght=0x00;
-	ff_request.device=0x01;
-	ff_request.number=n_inverter;
-	ff_request.command=0x17; //Get DC current command
-	memset(ff_request.data_plus_checksum, 0x00, sizeof(ff_request.data_plus_checksum));
+int medida_rendimiento(int fd, int ciclos){
+	const char *nombres[NUM_COMANDOS_MEDIDA]={"0x10 potencia", "0x9F limite", "0x12 energia dia", "0x18 tension DC", "0x17 corriente DC"};
+	double *rtt[NUM_COMANDOS_MEDIDA];
+	double *t_ciclo;
+	double *lim_cada, *lim_una; // limite a todos los inversores: una trama 0x9F por inversor y una para todos
+	int n_cada=0, n_una=0;
+	int n_ok[NUM_COMANDOS_MEDIDA]={0};
+	int errores[NUM_COMANDOS_MEDIDA]={0};
+	struct timespec t0, t1, c0, c1, i0, i1;
+	float valor;
+	int ciclo, c, i, rc, limites_ok;
+	unsigned char n_inverter;
+	double total;
+
+	for (c=0; c<NUM_COMANDOS_MEDIDA; c++){
+		rtt[c]=malloc(ciclos*num_inversores*sizeof(double));
+	}
+	t_ciclo=malloc(ciclos*sizeof(double));
+	lim_cada=malloc(ciclos*sizeof(double));
+	lim_una=malloc(ciclos*sizeof(double));
+
+	clock_gettime(CLOCK_MONOTONIC, &i0);
+	for (ciclo=0; ciclo<ciclos; ciclo++){
+		clock_gettime(CLOCK_MONOTONIC, &c0);
+		lim_cada[n_cada]=0;
+		limites_ok=0;
+		for (i=0; i<num_inversores; i++)
+		for (c=0; c<NUM_COMANDOS_MEDIDA; c++){
+			n_inverter=inversores[i];
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			switch (c){
+			case 0: rc=fi_get_medida(fd, n_inverter, MED_POTENCIA, &valor); break;
+			case 1: rc=fi_set_powerlimit(fd, &n_inverter, 1, 100, NULL); break;
+			case 2: rc=fi_get_medida(fd, n_inverter, MED_ENERGIA_DIA, &valor); break;
+			case 3: rc=fi_get_medida(fd, n_inverter, MED_TENSION_DC, &valor); break;
+			default: rc=fi_get_medida(fd, n_inverter, MED_CORRIENTE_DC, &valor); break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			if (rc==-1){
+				errores[c]++;
+				if (flag_d){
+					printf("%s\n", msgerror);
+				}
+				continue;
+			}
+			rtt[c][n_ok[c]++]=(t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6;
+			if (c==1){
+				lim_cada[n_cada]+=rtt[c][n_ok[c]-1];
+				limites_ok++;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &c1);
+		t_ciclo[ciclo]=(c1.tv_sec-c0.tv_sec)*1e3+(c1.tv_nsec-c0.tv_nsec)/1e6;
+		if (limites_ok==num_inversores){
+			n_cada++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &i1);
+	total=(i1.tv_sec-i0.tv_sec)+(i1.tv_nsec-i0.tv_nsec)/1e9;
+
+	// el mismo limite a todos los inversores en una sola trama, para comparar
+	for (ciclo=0; ciclo<ciclos; ciclo++){
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		rc=fi_set_powerlimit(fd, inversores, num_inversores, 100, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (rc!=-1){
+			lim_una[n_una++]=(t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6;
+		}
+		else if (flag_d){
+			printf("%s\n", msgerror);
+		}
+	}
 
-	// envio de comando y respuesta
-	rc=send_command(fd, &ff_request, &ff_response);
-	if (rc==-1){
-			insstr("Error en función fi_get_power: ", msgerror);
-			return -1;
+	printf("\n%-18s %6s %6s %8s %8s %8s %8s (ms)\n", "comando", "ok", "error", "p50", "p90", "p99", "max");
+	for (c=0; c<NUM_COMANDOS_MEDIDA; c++){
+		qsort(rtt[c], n_ok[c], sizeof(double), compara_double);
+		printf("%-18s %6d %6d %8.2f %8.2f %8.2f %8.2f\n", nombres[c], n_ok[c], errores[c],
+				percentil(rtt[c], n_ok[c], 0.50), percentil(rtt[c], n_ok[c], 0.90),
+				percentil(rtt[c], n_ok[c], 0.99), n_ok[c]?rtt[c][n_ok[c]-1]:0);
+		free(rtt[c]);
 	}
-	// se verifica que la longitud de la respuesta es correcta
-	// de noche el inversor se despierta unos segundos y responde a este comando pero con longitud de datos = 0
-	// por ejemplo: 128128128 0 1 1 16  18
-	// por tanto el checksum (18) se interpreta como el msb de la potencia y se devuelve
-	// una potencia erronea de 4608W
+	qsort(t_ciclo, ciclos, sizeof(double), compara_double);
+	printf("comandos/s: %.1f  inversores por ciclo: %d\n", ciclos*num_inversores*NUM_COMANDOS_MEDIDA/total, num_inversores);
+	printf("ciclo: p50 %.2fms (%.1f%% del segundo)  p99 %.2fms (%.1f%%)  max %.2fms (%.1f%%)\n",
+			percentil(t_ciclo, ciclos, 0.50), percentil(t_ciclo, ciclos, 0.50)/10,
+			percentil(t_ciclo, ciclos, 0.99), percentil(t_ciclo, ciclos, 0.99)/10,
+			t_ciclo[ciclos-1], t_ciclo[ciclos-1]/10);
+	free(t_ciclo);
+	qsort(lim_cada, n_cada, sizeof(double), compara_double);
+	qsort(lim_una, n_una, sizeof(double), compara_double);
+	printf("limite a los %d inversores: una trama 0x9F por inversor p50 %.2fms p99 %.2fms (%d)  una trama para todos p50 %.2fms p99 %.2fms (%d)\n",
+			num_inversores, percentil(lim_cada, n_cada, 0.50), percentil(lim_cada, n_cada, 0.99), n_cada,
+			percentil(lim_una, n_una, 0.50), percentil(lim_una, n_una, 0.99), n_una);
+	free(lim_cada);
+	free(lim_una);
+	return 0;
+}
 
-	if (ff_response.lenght!=sizeof(struct data_response_get_parameter)){
-		insstr("Error en longitud de datos de la respuesta del comando 0x10", msgerror);
-		*dc_current=0;
-		return -1;
+/*
+ * Accede o crea un area de memoria compartida propia de fronius-mon.
+ * Si ya existe con otro tamaño (version anterior del programa) se elimina y se vuelve a crear.
+ * Devuelve NULL si no es posible
+ */
+void *abre_shm(key_t clave, size_t tamano){
+	int shmid;
+	void *area;
+
+	shmid=shmget(clave, tamano, IPC_CREAT | 0666);
+	if (shmid==-1 && errno==EINVAL){
+		shmid=shmget(clave, 0, 0666);
+		if (shmid!=-1){
+			shmctl(shmid, IPC_RMID, NULL);
+		}
+		shmid=shmget(clave, tamano, IPC_CREAT | 0666);
+	}
+	if (shmid==-1){
+		sprintf(msgerror, "Error %d en shmget(0x%x): %s", errno, (unsigned int)clave, strerror(errno));
+		return NULL;
 	}
+	area=shmat(shmid, NULL, 0);
+	if (area==(void *)-1){
+		sprintf(msgerror, "Error %d en shmat(0x%x): %s", errno, (unsigned int)clave, strerror(errno));
+		return NULL;
+	}
+	return area;
+}
 
-	datos_devueltos= (struct data_response_get_parameter *)&ff_response.data_plus_checksum;
-	*dc_current=(float)(256*datos_devueltos->msb+datos_devueltos->lsb)*
-			pow(10,datos_devueltos->exp);
+/*
+ * Compone la muestra del registro binario con los valores del ciclo
+ */
+void compone_muestra(struct muestra_bin *muestra, time_t instante, const struct datos_publicados *datos_publicados,
+		const struct datos_inversores *datos_inversores, int lim_pot, int control_potencia){
+	const struct datos_inversor *inv;
+	float tension=0, corriente=0, importada;
+	int i, validos=0;
+
+	for (i=0; i<datos_inversores->num_inversores; i++){
+		inv=&datos_inversores->inversor[i];
+		if (inv->valido){
+			tension+=inv->medida[MED_TENSION_DC];
+			corriente+=inv->medida[MED_CORRIENTE_DC];
+			validos++;
+		}
+	}
+	if (validos){
+		tension/=validos;
+	}
+	importada=datos_publicados->potencia_consumo-datos_publicados->potencia_generada;
+
+	memset(muestra, 0, sizeof(*muestra));
+	muestra->instante=(uint32_t)instante;
+	muestra->energia_dia=(uint32_t)(datos_publicados->energia_generada_dia*10+0.5);
+	muestra->potencia_generada=datos_publicados->potencia_generada>UINT16_MAX?UINT16_MAX:(uint16_t)(datos_publicados->potencia_generada+0.5);
+	muestra->potencia_importada=importada>INT16_MAX?INT16_MAX:importada<INT16_MIN?INT16_MIN:(int16_t)lrintf(importada);
+	muestra->tension_dc=(uint16_t)(tension*10+0.5);
+	muestra->corriente_dc=corriente*100>UINT16_MAX?UINT16_MAX:(uint16_t)(corriente*100+0.5);
+	muestra->limite=lim_pot;
+	muestra->estado=(validos?ESTADO_MUESTRA_VALIDA:0)|(control_potencia?ESTADO_MUESTRA_LIMITADA:0);
+}
 
-	return EXIT_SUCCESS;
+/*
+ * Interpreta la lista de inversores de la opcion -i, p.e. 1,3-5
+ */
+int lee_lista_inversores(const char *lista){
+	const char *p=lista;
+	char *fin;
+	long desde, hasta, n;
+	int i;
+
+	num_inversores=0;
+	while (*p){
+		desde=strtol(p, &fin, 10);
+		if (fin==p) return -1;
+		hasta=desde;
+		p=fin;
+		if (*p=='-'){
+			p++;
+			hasta=strtol(p, &fin, 10);
+			if (fin==p) return -1;
+			p=fin;
+		}
+		if (desde<1 || hasta>254 || desde>hasta) return -1;
+		for (n=desde; n<=hasta; n++){
+			for (i=0; i<num_inversores; i++){
+				if (inversores[i]==n) return -1; // repetido
+			}
+			if (num_inversores==MAX_INVERSORES) return -1;
+			inversores[num_inversores++]=(unsigned char)n;
+		}
+		if (*p==',') p++;
+		else if (*p) return -1;
+	}
+	return num_inversores>0?0:-1;
 }
 
+/*
+ * Interpreta la potencia nominal de la opcion -p: un valor para todos los inversores o una lista
+ * con el de cada uno en el orden de -i, p.e. 4000,4000,2500. Sin -p cada inversor tiene 4000 W
+ */
+int lee_potencias_nominales(const char *lista){
+	const char *p=lista?lista:"4000";
+	char *fin;
+	long potencia;
+	int i, n=0;
+
+	while (*p){
+		potencia=strtol(p, &fin, 10);
+		if (fin==p || potencia<=0 || potencia>1000000 || n==MAX_INVERSORES) return -1;
+		potencias_nominales[n++]=(int)potencia;
+		p=fin;
+		if (*p==',') p++;
+		else if (*p) return -1;
+	}
+	if (n==1){
+		for (i=1; i<num_inversores; i++){
+			potencias_nominales[i]=potencias_nominales[0];
+		}
+	}
+	else if (n!=num_inversores){
+		return -1;
+	}
+	potencia_nominal_total=0;
+	for (i=0; i<num_inversores; i++){
+		potencia_nominal_total+=potencias_nominales[i];
+	}
+	return 0;
+}
 
-int fi_get_inverter_caps(int fd, unsigned char n_inverter, unsigned char *inverter_caps){
-	int rc;
-	// se limpia el buffer para la trama de respuesta
-	ff_response.lenght=0x00;
-	ff_response.device=0x00;
-	ff_response.number=0x00;
-	ff_response.command=0x00;
-	memset(ff_response.data_plus_checksum, 0x00, sizeof(ff_response.data_plus_checksum));
+/*
+ * Avisos de nueva lectura de consumo del medidor (opcion -n o -N)
+ */
+struct avisos{
+	int fd;                 // socket de avisos (-1 si no se usan)
+	int inmediato;          // 1: se reacciona al aviso (-n); 0: solo se mide el retardo y se reacciona en el ciclo (-N)
+	int recibido;           // se ha recibido algun aviso: el limitador usa su consumo
+	float consumo;          // potencia consumida del ultimo aviso
+	float generada;         // potencia generada estimada: la medida en el ciclo acotada por los limites enviados despues
+	int64_t pendiente_ns;   // instante de envio del primer aviso con exportacion sin 0x9F todavia (0: ninguno)
+	int64_t calculo_ns;     // instante del ultimo calculo del limitador
+};
 
-	// se ajusta y limpia el buffer para la trama de petición
-	ff_request.lenght=0x00;
+/*
+ * Tiempo de transmision de n bytes por el puerto serie (1 bit de start, 8 de datos y 1 de stop)
+ */
+int64_t ns_transmision(int n){
+	return (int64_t)n*10*1000000000/baudios_puerto;
+}
 
-	ff_request.device=0x01;
-	ff_request.number=n_inverter;
-	ff_request.command=0xBD; // comando para pedir la capacidades de ajustar la potencia del inversor
-	memset(ff_request.data_plus_checksum, 0x00, sizeof(ff_request.data_plus_checksum));
+/*
+ * Encarga al hilo del bus el limite lim_pot para los inversores que responden, admiten limitacion y no
+ * lo tienen ya aplicado, a todos en una sola trama 0x9F que pasa por delante de la telemetria pendiente.
+ * La orden lleva el calculo que lo ha decidido (se anota en la captura justo antes de la trama), el
+ * instante de la decision y, si el limite baja, el aviso con exportacion pendiente que atiende.
+ * El limite de los inversores se da por aplicado; atiende_limite() lo corrige si no se envia
+ */
+void aplica_limite(struct bus *bus, struct datos_inversores *datos_inversores, struct avisos *av, int lim_pot,
+		const struct calculo_captura *calculo, int64_t decidido_ns){
+	struct orden_bus orden;
+	struct datos_inversor *inv;
+	int i, baja=0;
+
+	memset(&orden, 0, sizeof(orden));
+	for (i=0; i<datos_inversores->num_inversores; i++){
+		inv=&datos_inversores->inversor[i];
+		if (!inv->valido || (inv->caps & 0x01)==0 || inv->lim_pot==lim_pot){
+			continue;
+		}
+		if (lim_pot<inv->lim_pot){
+			baja=1;
+		}
+		orden.numeros[orden.n++]=inv->numero;
+	}
+	if (orden.n==0 && captura.fd<0){
+		return;
+	}
+	orden.tipo=OB_LIMITE;
+	orden.prioridad=PO_LIMITE;
+	orden.limite=lim_pot;
+	orden.calculo=*calculo;
+	orden.decidido_ns=decidido_ns;
+	orden.plazo_ns=decidido_ns+PLAZO_LIMITE_MS*1000000LL;
+	if (av->pendiente_ns && baja){
+		orden.aviso_ns=av->pendiente_ns;
+	}
+	if (bs_encarga(bus, &orden)){
+		return; // cola llena: los inversores no cambian de limite y se vuelve a intentar en el siguiente calculo
+	}
+	if (orden.aviso_ns){
+		av->pendiente_ns=0;
+	}
+	if (orden.n){
+		datos_inversores->tramas_limite++;
+	}
+	for (i=0; i<datos_inversores->num_inversores; i++){
+		inv=&datos_inversores->inversor[i];
+		if (memchr(orden.numeros, inv->numero, orden.n)){
+			inv->lim_pot=lim_pot;
+		}
+	}
+}
 
-   	// envio de comando y respuesta
-	rc= send_command(fd, &ff_request, &ff_response);
-	if (rc==-1){
-		insstr("Error en función fi_get_inverter_caps: ", msgerror);
-		return -1;
+/*
+ * Recoge el resultado de un 0x9F encargado por aplica_limite(): anota el retardo desde la decision del
+ * limite hasta el final de la trama en la linea y, si atendia un aviso con exportacion, el retardo desde
+ * el aviso. Si no se ha enviado, el limite de sus inversores pasa a desconocido y se vuelve a enviar en
+ * el siguiente calculo; si se ha enviado, solo el de los inversores que no han respondido
+ */
+void atiende_limite(struct datos_inversores *datos_inversores, struct avisos *av, const struct resultado_bus *r,
+		struct escritor *escritor){
+	struct datos_inversor *inv;
+	float retardo_ms;
+	int i, k;
+
+	if (r->orden.n==0){
+		return;
 	}
+	if (r->rc==-1){
+		if (!r->vencida){
+			es_texto(escritor, "\nError en fi_set_powerlimit a %d inversor(es):%s\n", r->orden.n, r->mensaje);
+		}
+		for (i=0; i<datos_inversores->num_inversores; i++){
+			inv=&datos_inversores->inversor[i];
+			if (memchr(r->orden.numeros, inv->numero, r->orden.n)){
+				inv->lim_pot=-1;
+				if (!r->vencida){
+					inv->valido=0;
+				}
+			}
+		}
+		if (r->orden.aviso_ns && av->pendiente_ns==0){
+			av->pendiente_ns=r->orden.aviso_ns;
+		}
+		return;
+	}
+	for (i=0; i<datos_inversores->num_inversores && r->sin_respuesta; i++){
+		inv=&datos_inversores->inversor[i];
+		for (k=0; k<r->orden.n; k++){
+			if ((r->sin_respuesta & (1u<<k)) && r->orden.numeros[k]==inv->numero){
+				inv->lim_pot=-1;
+			}
+		}
+	}
+	retardo_ms=(r->transmitido_ns-r->orden.decidido_ns)/1e6;
+	datos_inversores->limites_transmitidos++;
+	datos_inversores->retardo_limite_ms=retardo_ms;
+	datos_inversores->retardo_limite_total_ms+=retardo_ms;
+	if (retardo_ms>datos_inversores->retardo_limite_max_ms){
+		datos_inversores->retardo_limite_max_ms=retardo_ms;
+	}
+	if (r->orden.aviso_ns){
+		retardo_ms=(r->transmitido_ns-r->orden.aviso_ns)/1e6;
+		datos_inversores->avisos_exportacion++;
+		datos_inversores->retardo_aviso_ms=retardo_ms;
+		datos_inversores->retardo_aviso_total_ms+=retardo_ms;
+		if (retardo_ms>datos_inversores->retardo_aviso_max_ms){
+			datos_inversores->retardo_aviso_max_ms=retardo_ms;
+		}
+	}
+}
 
-	// se apuntan las estructuras al area de datos conrrespondientes de los bufferes de trama
-	*inverter_caps= ff_response.data_plus_checksum[0];
-	return EXIT_SUCCESS;
+/*
+ * Hace en el hilo del bus una orden del ciclo (bus.h). Mientras hay ordenes pendientes solo este hilo
+ * usa el puerto serie, las tramas, el analizador, la captura, msgerror y clase_error
+ */
+void ejecuta_orden(struct bus *b, const struct orden_bus *o, struct resultado_bus *r){
+	r->inicio_ns=av_instante_ns();
+	switch (o->tipo){
+	case OB_MEDIDA:
+		r->rc=fi_get_medida(b->fd, o->numero, o->medida, &r->valor);
+		r->descarta=r->rc==-1;
+		break;
+	case OB_LIMITE:
+		cp_anota(&captura, BC_CALCULO, &o->calculo, sizeof(o->calculo));
+		if (o->n==0){
+			return;
+		}
+		r->rc=fi_set_powerlimit(b->fd, o->numeros, o->n, o->limite, &r->sin_respuesta);
+		r->transmitido_ns=fin_envio_ns;
+		break;
+	}
+	r->rtt_ms=(av_instante_ns()-r->inicio_ns)/1e6;
+	if (r->rc==-1){
+		r->clase=clase_error;
+		snprintf(r->mensaje, sizeof(r->mensaje), "%.*s", (int)sizeof(r->mensaje)-1, msgerror);
+	}
+}
 
+/*
+ * Espera a que el hilo del bus deje un resultado o llegue un aviso del medidor. Devuelve 1 si hay aviso
+ */
+int espera_resultado(struct bus *bus, const struct avisos *av){
+	struct pollfd pfd[2];
+	uint64_t n;
+
+	pfd[0].fd=bus->fd_resultados;
+	pfd[0].events=POLLIN;
+	pfd[1].fd=av->fd;     // -1: poll() lo ignora
+	pfd[1].events=POLLIN;
+	if (poll(pfd, 2, -1)==-1){
+		return 0; // EINTR
+	}
+	if (pfd[0].revents & POLLIN){
+		while (read(bus->fd_resultados, &n, sizeof(n))<0 && errno==EINTR);
+	}
+	return (pfd[1].revents & POLLIN)!=0;
 }
 
+/*
+ * Espera a que los hilos escritores escriban lo pendiente y los termina
+ */
+void termina_escritores(struct escritor *escritor, struct escritor *escritor_captura){
+	es_termina(escritor);
+	if (captura.fd>=0){
+		es_termina(escritor_captura);
+	}
+}
 
-int fi_set_powerlimit(int fd, unsigned char n_inverter, unsigned char p_rel){
+/*
+ * Anota en el estado del inversor i el resultado rc de su consulta de potencia del ciclo (y la clase
+ * del error si ha fallado) e informa de los cambios de estado. Cuando un inversor despierta se sondea enseguida
+ * a los que duermen, que al amanecer despiertan casi a la vez
+ */
+void anota_estado(struct vigilancia_inversor *vigilancia, int i, struct datos_inversor *inv, int rc,
+		enum clase_error clase, unsigned long ciclo, time_t ahora, struct escritor *escritor){
+	enum resultado_consulta resultado;
+	enum estado_inversor anterior=vigilancia[i].estado;
+	int k;
+
+	resultado=rc!=-1?RC_VALOR:clase==CE_SIN_DATOS?RC_SIN_DATOS:clase==CE_PLAZO?RC_SIN_RESPUESTA:RC_ERROR;
+	if (!ei_anota(&vigilancia[i], resultado, ciclo, ahora)){
+		return;
+	}
+	inv->estado=vigilancia[i].estado;
+	es_texto(escritor, "\nInversor %d: %s -> %s\n", inv->numero, nombres_estados_inversor[anterior],
+			nombres_estados_inversor[inv->estado]);
+	if (inv->estado==EI_DESPERTANDO){
+		for (k=0; k<num_inversores; k++){
+			ei_adelanta(&vigilancia[k], ciclo);
+		}
+	}
+}
 
-	int rc;
-	struct data_request_set_powerlimit {
-			unsigned char cmd_id;// codigo de comando de "remote control". Para poner limite de potencia es 0x01
-			unsigned char sep1;  // separador =0x7F
-			unsigned char p_rel; // porcentaje de la potencia total del inversor donde se pone el limite
-			unsigned char res1; // reservado =0x00
-			unsigned char sep2; // separador =0x7F
-			unsigned char res2; // reservado =0x00
-			unsigned char res3; // reservado =0x00
-			unsigned char sep3; // separador =0x7F
-			unsigned char res4; // reservado =0x00
-			unsigned char n_inverter; //numero del inversor al que se dirige el comando
+/*
+ * Reparte el limite lim_pot del regulador entre los inversores segun su potencia nominal y lo que
+ * generan (reparto.h) y devuelve el porcentaje a enviar a los que admiten limitacion
+ */
+int reparte_limite(const struct datos_inversores *datos_inversores, int lim_pot, int anterior, float banda){
+	struct reparto_inversor reparto[MAX_INVERSORES];
+	const struct datos_inversor *inv;
+	int i;
 
-		} *datos_enviados;
+	for (i=0; i<datos_inversores->num_inversores; i++){
+		inv=&datos_inversores->inversor[i];
+		reparto[i].nominal=potencias_nominales[i];
+		reparto[i].generada=inv->valido?inv->medida[MED_POTENCIA]:0;
+		reparto[i].limite=inv->lim_pot;
+		reparto[i].limitable=inv->valido && (inv->caps & 0x01);
+	}
+	return rp_reparte(reparto, datos_inversores->num_inversores, lim_pot, anterior, banda);
+}
 
-	struct data_response_set_powerlimit {
-			unsigned char cmd_id; // codigo de comando de "remote control". Para poner limite de potencia es 0x01
-			unsigned char sep1; // separador =0x7F
-			unsigned char p_rel; // porcentaje de la potencia total del inversor donde se pone el limite
-			unsigned char res1; // reservado =0x00
-			unsigned char sep2; // separador =0x7F
-			unsigned char res2; // reservado =0x00
-			unsigned char res3; // reservado =0x00
-			unsigned char sep3; // separador =0x7F
-			unsigned char res4; // reservado =0x00
-			unsigned char n_inverter; //numero del inversor al que se ha dirigido el comando
-		} *datos_devueltos;
+/*
+ * Calcula el limite con el consumo a usar y lo encarga al hilo del bus. dt es el tiempo desde el calculo anterior
+ */
+int regula_limite(struct bus *bus, struct limitador *lm, struct datos_inversores *datos_inversores, struct avisos *av,
+		float consumo, float generada){
+	int64_t ahora_ns=av_instante_ns();
+	int lim_pot, anterior=lm->limite;
+	struct calculo_captura calculo;
+
+	float dt=av->calculo_ns?(ahora_ns-av->calculo_ns)/1e9:1;
+
+	// tras una interrupcion (p.e. reapertura del puerto) el limite no salta por la rampa acumulada
+	lim_pot=lm_calcula(lm, consumo, generada, dt<1?dt:1);
+	av->calculo_ns=ahora_ns;
+	calculo.consumo=consumo;
+	calculo.generada=generada;
+	calculo.dt=dt<1?dt:1;
+	calculo.limite=lim_pot;
+	datos_inversores->lim_reparto=reparte_limite(datos_inversores, lim_pot, lim_pot==anterior?datos_inversores->lim_reparto:-1, lm->banda);
+	aplica_limite(bus, datos_inversores, av, datos_inversores->lim_reparto, &calculo, ahora_ns);
+	if (lim_pot>=anterior){
+		av->pendiente_ns=0; // la exportacion no se corrige bajando el limite (p.e. ya esta en el minimo)
+	}
+	if (generada>lim_pot*lm->potencia_nominal/100){
+		av->generada=lim_pot*lm->potencia_nominal/100;
+	}
+	return lim_pot;
+}
 
-	// se limpia el buffer para la trama de respuesta
-	ff_response.lenght=0x00;
-	ff_response.device=0x00;
-	ff_response.number=0x00;
-	ff_response.command=0x00;
-	memset(ff_response.data_plus_checksum, 0x00, sizeof(ff_response.data_plus_checksum));
+/*
+ * Lee los avisos pendientes. Devuelve 1 si el ultimo indica exportacion con la generacion estimada
+ */
+int lee_avisos(struct avisos *av, struct datos_inversores *datos_inversores){
+	struct aviso_consumo aviso;
+	int n;
 
-	// se ajusta y limpia el buffer para la trama de petición
-	ff_request.lenght=0x0A; // 0x09 + el numero de inversores a los que se dirige el comando (en nuestro caso "1")
-	ff_request.device=0x00; //
-	ff_request.number=0x00; // El comando 0x9F es de broadcast
-	ff_request.command=0x9F; // comando para ajustar el limite del inversor
-	memset(ff_request.data_plus_checksum, 0x00, sizeof(ff_request.data_plus_checksum));
+	if (av->fd==-1){
+		return 0;
+	}
+	n=av_recibe(av->fd, &aviso);
+	if (n==0){
+		return 0;
+	}
+	datos_inversores->avisos+=n;
+	av->recibido=1;
+	av->consumo=aviso.potencia_consumo;
+	if (av->consumo>=av->generada){
+		return 0;
+	}
+	if (av->pendiente_ns==0){
+		av->pendiente_ns=aviso.instante_ns;
+	}
+	return 1;
+}
 
-	// se apuntan las estructuras al area de datos conrrespondientes de los bufferes de trama
-	datos_enviados = (struct data_request_set_powerlimit *)&ff_request.data_plus_checksum;
-	datos_devueltos= (struct data_response_set_powerlimit *)&ff_response.data_plus_checksum;
+/*
+ * Busca la velocidad configurada en la tarjeta de interfaz: a cada velocidad, empezando por la actual,
+ * pide la version a los inversores hasta que uno responde. Devuelve los baudios o -1 si no responde
+ * ninguno (se deja la velocidad inicial)
+ */
+int sondea_velocidad(int fd){
+	struct data_response_get_version version;
+	struct termios tp;
+	int inicial=baudios_puerto;
+	int k, v, i;
+
+	for (v=0; v<NUM_VELOCIDADES && velocidades[v].baudios!=inicial; v++);
+	for (k=0; k<NUM_VELOCIDADES; k++){
+		pon_velocidad(velocidades[(v+k)%NUM_VELOCIDADES].baudios);
+		tcgetattr(fd, &tp);
+		cfsetspeed(&tp, velocidad_puerto);
+		tcsetattr(fd, TCSANOW, &tp);
+		tcflush(fd, TCIOFLUSH);
+		pt_descarta(&parser);
+		cp_anota(&captura, BC_APERTURA, &baudios_puerto, sizeof(uint32_t));
+		for (i=0; i<num_inversores; i++){
+			if (fi_get_version(fd, inversores[i], &version)==0){
+				return baudios_puerto;
+			}
+			if (clase_error==CE_DISPOSITIVO){
+				k=NUM_VELOCIDADES;
+				break;
+			}
+		}
+	}
+	pon_velocidad(inicial);
+	tcgetattr(fd, &tp);
+	cfsetspeed(&tp, velocidad_puerto);
+	tcsetattr(fd, TCSANOW, &tp);
+	return -1;
+}
 
-	datos_enviados->cmd_id=0x01;
-	datos_enviados->sep1=0x7F;
-	datos_enviados->p_rel=p_rel>100?100:p_rel; // carga valor porcentaje con límite en 100
-	datos_enviados->res1=0x00;
-	datos_enviados->sep2=0x7F;
-	datos_enviados->res2=0x00;
-	datos_enviados->res3=0x00;
-	datos_enviados->sep3=0x7F;
-	datos_enviados->res4=0x00;
-	datos_enviados->n_inverter=n_inverter;
+/*
+ * Temporizador de latencia en ms de un adaptador USB (sysfs), o -1 si el puerto no lo tiene
+ */
+int lee_latency_timer(const char *puerto){
+	char ruta[PATH_MAX], fichero[PATH_MAX+64];
+	const char *nombre;
+	FILE *f;
+	int ms=-1;
 
-	// envio de comando y respuesta
-	rc=send_command(fd, &ff_request, &ff_response);
-	if (rc==-1){
-		insstr("Error en función fi_set_powerlimit: ", msgerror);
+	if (realpath(puerto, ruta)==NULL){
 		return -1;
 	}
-	if (datos_devueltos->n_inverter!=0xFF){
-		sprintf(msgerror, "Error en función fi_set_powerlimit devolvió valor n_inverter distinto de 0xFF");
+	nombre=strrchr(ruta, '/');
+	snprintf(fichero, sizeof(fichero), "/sys/class/tty/%s/device/latency_timer", nombre?nombre+1:ruta);
+	f=fopen(fichero, "r");
+	if (f==NULL){
 		return -1;
 	}
-	else{
-		return datos_devueltos->p_rel;
+	if (fscanf(f, "%d", &ms)!=1){
+		ms=-1;
+	}
+	fclose(f);
+	return ms;
+}
+
+#define CONSULTAS_LATENCIA 5
+
+/*
+ * Presenta la configuracion del puerto y la latencia por byte medida con CONSULTAS_LATENCIA
+ * consultas de version al primer inversor que responde: el menor tiempo de ida y vuelta
+ * frente al tiempo de los bytes en la linea
+ */
+void informa_puerto(int fd, const char *puerto, int sondeada, int latencia){
+	struct data_response_get_version version;
+	struct timespec t0, t1;
+	double ms, minimo=0;
+	int i, n, bytes=0, timer;
+
+	for (i=0; i<num_inversores && bytes==0; i++){
+		for (n=0; n<CONSULTAS_LATENCIA; n++){
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			if (fi_get_version(fd, inversores[i], &version)==-1){
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			ms=(t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6;
+			if (n==0 || ms<minimo){
+				minimo=ms;
+			}
+			bytes=2*SIZE_HEADER_FRAME_PLUS_CHECKSUM+ff_response.lenght;
+		}
+	}
+	timer=lee_latency_timer(puerto);
+	printf("Serial port: %d baud%s, raw, VMIN 1 VTIME 0, low latency %s",
+			baudios_puerto, sondeada?" (probed)":"", !baja_latencia?"off":latencia?"on":"not supported by the driver");
+	if (timer>=0){
+		printf(", latency_timer %d ms", timer);
+	}
+	if (bytes){
+		printf("\nVersion query: %d bytes, round trip %.2f ms: %.0f us/byte (line %.0f us/byte, %.2f ms of driver and inverter latency)",
+				bytes, minimo, minimo*1e3/bytes, ns_transmision(1)/1e3, minimo-ns_transmision(bytes)/1e6);
+	}
+	printf("\n");
+}
+
+/*
+ * Lee la version y las capacidades de un inversor la primera vez que responde; despues se usan
+ * las guardadas aunque se vuelva a abrir el puerto. Si lo ha encontrado la busqueda de inversores
+ * (descubierto no NULL) se usan su version y capacidades sin consultarle. Al inversor que admite
+ * limitacion se le pone el limite en curso (100% al arrancar). Devuelve -1 si no responde
+ */
+int identifica_inversor(int fd, struct datos_inversor *inv, const struct inversor_descubierto *descubierto, int lim_pot,
+		struct escritor *escritor){
+	struct data_response_get_version versions;
+	unsigned int sin_respuesta;
+
+	if (inv->identificado){
+		return 0;
+	}
+	if (descubierto!=NULL && descubierto->con_caps){
+		pinta_version(inv->numero, &descubierto->version, escritor);
+		inv->caps=descubierto->caps;
+	}
+	else {
+		if (fi_get_version(fd, inv->numero, &versions)==-1){
+			es_texto(escritor, "Inversor %d: %s\n", inv->numero, msgerror);
+			return -1;
+		}
+		pinta_version(inv->numero, &versions, escritor);
+		if (fi_get_inverter_caps(fd, inv->numero, &inv->caps)==-1){
+			es_texto(escritor, "Error en fi_get_invertercaps:%s\n", msgerror);
+			return -1;
+		}
+	}
+	inv->identificado=1;
+	if((inv->caps & 0x01)==0){
+		es_texto(escritor, "Inversor %d NO capacitado para aceptar comandos de reduccion de potencia\n", inv->numero);
+		return 0;
+	}
+	es_texto(escritor, "Inversor %d capacitado para aceptar comandos de reduccion de potencia\n", inv->numero);
+	inv->lim_pot=lim_pot;
+	if (fi_set_powerlimit(fd, &inv->numero, 1, inv->lim_pot, &sin_respuesta)==-1){
+		es_texto(escritor, "Error en fi_set_powerlimit:%s\n", msgerror);
+		inv->lim_pot=-1; // se vuelve a enviar en el siguiente calculo del limite
+	}
+	else if (sin_respuesta){
+		inv->lim_pot=-1;
+	}
+	return 0;
+}
+
+/*
+ * Espera al siguiente segundo del temporizador. Devuelve 0 al vencer el segundo
+ * o 1 si antes llega un aviso del medidor. Mientras, atiende a los clientes del servidor
+ * de metricas; si el segundo vence a la vez, el tic va primero
+ */
+int espera_ciclo(struct reloj *reloj, const struct avisos *av, struct servidor *sv){
+	struct pollfd pfd[3+MAX_CLIENTES_SERVIDOR];
+	int n, k;
+
+	while (1){
+		pfd[0].fd=reloj->fd;
+		pfd[0].events=POLLIN;
+		pfd[1].fd=av->fd;     // -1: poll() lo ignora
+		pfd[1].events=POLLIN;
+		k=sv_pollfd(sv, pfd+2, MAX_CLIENTES_SERVIDOR+1);
+		n=poll(pfd, 2+k, -1);
+		if (n==-1){
+			continue; // EINTR
+		}
+		if (pfd[0].revents & POLLIN){
+			rj_tic(reloj);
+			return 0;
+		}
+		if (pfd[1].revents & POLLIN){
+			return 1;
+		}
+		sv_atiende(sv, pfd+2, k);
 	}
 }
 
@@ -772,66 +1741,162 @@ int main(int argc, char *argv[]) {
 	int fd=0;
 	int rc;
 
-	char ficheroDatosInversor[255]="datosinversor.txt";
+	char ficheroDatosInversor[255]="datosinversor.bin";
 	int fdatos; // file descriptor ficehro de datos del inversor
-	struct stat file_info; //esctura para información de ficehro de datos de inversor
-	char linea[1024+1]; //linea de registro de datos de inversor
+	struct codificador_registro_bin codificador; // ultima muestra escrita en el registro binario
+	char ficheroHistorico[255]="historico.bin";
+	struct historico historico; // energia de cada cuarto de hora de los ultimos DIAS_HISTORICO dias
+	struct muestra_bin muestra; // muestra de cada segundo del registro binario
+	char linea[1024+1]; //linea de resumen de cada minuto
+	static struct escritor escritor; // escritura diferida de consola, registro binario e historico
+	static struct escritor escritor_captura; // escritura diferida de la captura, que alimenta el hilo del bus
+	static struct bus bus; // hilo del bus: el puerto serie en el ciclo de control
+	struct orden_bus orden;
+	struct resultado_bus resultado;
+	struct resultado_bus potencia[MAX_INVERSORES]; // resultado de la consulta de potencia de cada inversor en el ciclo
+	int consultado[MAX_INVERSORES];
+	int64_t inicio_ciclo_ns;
+	char consola[TAMANO_HUECO_ESCRITOR]; // linea de estado de cada segundo
+	int n_consola;
+	int segundos_fsync=0; // 0: sin fsync del registro binario
+	int sondear_velocidad=0; // opcion -b auto: buscar la velocidad de la tarjeta de interfaz
+	int descubrir=0; // opcion -D: buscar los inversores del bus y terminar
+	char *fichero_captura=NULL; // opcion -C: captura del trafico del puerto serie
+	struct inversor_descubierto descubiertos[MAX_INVERSORES]; // inversores que han respondido a la busqueda
+	int num_descubiertos, k;
+	const struct dia_historico *dia_cerrado;
 
 	time_t segundo_actual=0;
-	time_t segundo_anterior=0;
-	int segundos_intervalo;
 	struct tm *loc_time;
 	char buf[150]; //buffer para string de tiempo
 
-	struct data_response_get_version versions;
-	unsigned char inverter_caps;
 	int lim_pot=100; // limite de potencia puesto al inversor (en porcentaje de la potencia nominal)
 	//float energia_diaria_generada;
-	float tension_DC;
-	float corriente_DC;
-	float energia_diaria_generada_anterior;
-
-
-
-	float pot_max,pot_min;// potencia generada maxima y minima en intervalo 15 minuto
-	float pot_med=0; // potencia generada media en 15 minuto
-	int lim_pot_para_media=0; //acumula los limites (porcentuales) de potencia en el intervalo para luego calcular la media del intervalo (15min, 900 segundos)
+	float energia_diaria_generada_anterior=0;
+	int i;
+	int validos; // inversores que han respondido correctamente en el ciclo
+	float potencia_total, energia_total;
+	struct datos_inversor *inv;
+	struct planificador planificador; // consultas de telemetria de cada ciclo
+	unsigned int mascara; // inversores que han respondido en el ciclo (un bit por inversor)
+	enum medida metrica;
+	char *opcion_m=NULL;
+	struct limitador limitador; // regulador del limite de potencia
+	char *opcion_k=NULL;
+	char *opcion_p=NULL; // potencias nominales de los inversores
+	struct avisos avisos={-1}; // avisos de lectura de consumo del medidor
+	char *ruta_avisos=NULL;
+	static struct servidor servidor={-1}; // servidor local de metricas (opcion -H)
+	char *direccion_servidor=NULL;
+	float consumo; // potencia consumida con la que se calcula el limite
+	int presupuesto_ms=PRESUPUESTO_CICLO_MS;
+
+
+
+	static struct agregador agregador; // estadisticas de las muestras por ventanas (opcion -w)
+	char *opcion_w=NULL;
+	int cerradas; // ventanas cerradas en el ciclo (un bit por ventana)
+	int ventana_cuarto=-1; // ventana de 15 minutos, la de la linea de cada minuto
+	const struct resumen_ventana *cuarto;
+	const struct resultado_serie *rs;
+	char nombre_ventana[16];
+	int v;
 
 
 	printf ("%s", identificacion);
 
 	int index; //apunta a non-option arguments de getopt()
 	int opt;
-	int num_inversor=1;
 	int control_potencia=0;
 	int flag_l = 0; // opcion de limitacion de potencia
 	int flag_p = 0; // opcion de declaracion de potencia nominal del inversor
+	int ciclos_medida = 0; // opcion de medida de rendimiento: numero de ciclos a medir
 
 	    // Shut GetOpt error messages down (return '?'):
 	    opterr = 0;
 	    // Retrieve the options:
-	    while ( (opt = getopt(argc, argv, "hi:lp:d")) != -1 ) {  // for each option...
+	    while ( (opt = getopt(argc, argv, "hi:lp:dB:Dm:t:k:n:N:F:b:uH:w:C:")) != -1 ) {  // for each option...
 	        switch ( opt ) {
         		case 'd': // identificador de inversor en red RS422
         			flag_d=1;
         			break;
-	        	case 'i': // identificador de inversor en red RS422
-	        		num_inversor=atoi(optarg);
+	        	case 'i': // identificadores de inversores en red RS422
+	        		if (lee_lista_inversores(optarg)){
+	        			printf("\nInvalid inverter number");
+	        			return -1;
+	        		}
 	        		break;
 	       	    case 'l': // limitada potencia generada para no exportar a red
 	       	    	flag_l=1;
 	       	    	control_potencia = 1;
 	       	    	break;
-	            case 'p': //potencia nominal del inversor
+	            case 'p': //potencia nominal de cada inversor
 	            	flag_p=1;
-	            	potencia_nominal_inversor = atoi(optarg);
+	            	opcion_p = optarg;
 	                break;
+	            case 'm': // periodo y prioridad de las metricas de telemetria
+	            	opcion_m = optarg;
+	            	break;
+	            case 'k': // parametros del regulador del limite
+	            	opcion_k = optarg;
+	            	break;
+	            case 'n': // avisos de consumo del medidor con reaccion inmediata
+	            case 'N': // avisos de consumo del medidor solo para medir el retardo
+	            	ruta_avisos = optarg;
+	            	avisos.inmediato = opt=='n';
+	            	break;
+	            case 't': // tiempo de bus por ciclo
+	            	presupuesto_ms = atoi(optarg);
+	            	break;
+	            case 'b': // velocidad del puerto serie
+	            	if (strcmp(optarg, "auto")==0){
+	            		sondear_velocidad=1;
+	            	}
+	            	else if (pon_velocidad(atoi(optarg))){
+	            		printf("\nInvalid baud rate %s", optarg);
+	            		return -1;
+	            	}
+	            	break;
+	            case 'u': // perfil de baja latencia del puerto serie
+	            	baja_latencia=1;
+	            	break;
+	            case 'w': // ventanas de estadisticas
+	            	opcion_w = optarg;
+	            	break;
+	            case 'H': // servidor local de metricas
+	            	direccion_servidor = optarg;
+	            	break;
+	            case 'F': // fsync del registro binario
+	            	segundos_fsync = atoi(optarg);
+	            	break;
+	            case 'B': // medida de rendimiento
+	            	ciclos_medida = atoi(optarg);
+	            	break;
+	            case 'D': // busqueda de inversores
+	            	descubrir = 1;
+	            	break;
+	            case 'C': // captura del puerto serie
+	            	fichero_captura = optarg;
+	            	break;
 	            case 'h': // help
-	               	printf("\nUse: fronius-mon [-i num_inv] [[-l] [-p pot_inv]] [-d] [dev_file]");
-					printf("\n-i number of inverter in rs422 network/connetion. 1 is the default");
+	               	printf("\nUse: fronius-mon [-i num_inv] [[-l] [-p pot_inv]] [-k controller_options] [-n|-N socket] [-m metric=period[:priority],...] [-t budget_ms] [-b baud|auto] [-u] [-H [ip:]port|socket] [-w windows] [-F fsync_s] [-C capture_file] [-d] [-B cycles] [-D] [dev_file]");
+					printf("\n-i numbers of inverters in rs422 network/connetion, e.g. 1 or 1,3-5. 1 is the default");
 					printf("\n-l limit generating power to avoid export of energy to grid. Requires -p option");
-					printf("\n-p nominal power of inverter in watts");
+					printf("\n-p nominal power of the inverters in watts, one value for all or one per inverter of -i, e.g. 4000,4000,2500");
+					printf("\n-k limit controller parameters, e.g. kp=0.1,ki=0.05,margin=50,up=20,down=1000,band=2");
+					printf("\n-n unix datagram socket where the meter notifies each consumption reading; export is answered at once");
+					printf("\n-N as -n but the limit is only updated every second (measures the delay for comparison)");
+					printf("\n-m polling period in seconds and priority of telemetry metrics energy, dcv and dci. Default energy=5:1,dcv=10:2,dci=10:2");
+					printf("\n-t bus time budget per 1 s cycle in ms. 800 is the default");
+					printf("\n-b serial rate of the interface card: 2400, 4800, 9600 or 19200 (the default), or auto to probe them");
+					printf("\n-u low latency profile of the serial driver (ASYNC_LOW_LATENCY)");
+					printf("\n-H serve /metrics (Prometheus text) and /history (CSV) over HTTP on a local TCP port (127.0.0.1 unless ip is given) or unix socket");
+					printf("\n-w statistics windows aligned to local midnight, e.g. 5m,15m,1h,1d. Must include 15m. 1m,15m,1h,1d is the default");
+					printf("\n-F fsync the binary log at most every fsync_s seconds. 0 (never) is the default");
+					printf("\n-C capture the raw serial traffic with timestamps, the controller inputs and the samples to capture_file (fronius-util replay)");
 					printf("\n-d display frames for debug");
+					printf("\n-B run cycles of queries back to back, report round trip times and exit");
+					printf("\n-D list the inverters on the bus with their versions and caps (two broadcast queries) and exit");
 					printf("\n dev_file device for rs422. Default is /dev/ttyUSB0");
 					printf("\n");
 					return -1;
@@ -842,23 +1907,54 @@ int main(int argc, char *argv[]) {
 	        }
 	    }
 
-	    if (num_inversor<=0){
-	    	printf("\nInvalid inverter number");
-	    	return -1;
-	    }
 	    if (flag_l==1 && flag_p==0 ){
 	    	printf("\nOption -l requires option -p");
 	    	return -1;
 	    }
-	    if (potencia_nominal_inversor<=0){
-	    	printf("\nInvalid inverter nominal power");
+	    if (lee_potencias_nominales(opcion_p)){
+	    	printf("\nInvalid inverter nominal power %s (one value, or one per inverter of -i)", opcion_p);
 	    	return -1;
 	    }
+	    if (ciclos_medida<0){
+	    	printf("\nInvalid number of cycles");
+	    	return -1;
+	    }
+	    if (segundos_fsync<0){
+	    	printf("\nInvalid fsync period");
+	    	return -1;
+	    }
+	    if (presupuesto_ms<=0 || presupuesto_ms>1000){
+	    	printf("\nInvalid bus time budget");
+	    	return -1;
+	    }
+	    pl_inicia(&planificador, num_inversores, presupuesto_ms);
+	    if (opcion_m!=NULL && pl_configura(&planificador, opcion_m)){
+	    	printf("\nInvalid metric configuration %s", opcion_m);
+	    	return -1;
+	    }
+	    lm_inicia(&limitador, potencia_nominal_total);
+	    if (opcion_k!=NULL && lm_configura(&limitador, opcion_k)){
+	    	printf("\nInvalid controller parameters %s", opcion_k);
+	    	return -1;
+	    }
+	    if (ag_inicia(&agregador, opcion_w, 0) || ag_busca(&agregador, 15)==-1){
+	    	printf("\nInvalid statistics windows %s", opcion_w);
+	    	return -1;
+	    }
+	    fi_inicia_medidas();
 
 	    for (index = optind; index < argc; index++){
 	        portname1=argv[index];
 	    }
-	    printf("\ndev_file:%s  num_inversor:%d power_limitation:%s  Inverter_nominal_power:%d\n", portname1, num_inversor, control_potencia==1?"true":"false" , potencia_nominal_inversor);
+	    printf("\ndev_file:%s  num_inversores:%d (", portname1, num_inversores);
+	    for (i=0; i<num_inversores; i++){
+	    	printf("%s%d", i?",":"", inversores[i]);
+	    }
+	    printf(") power_limitation:%s  Inverter_nominal_power:", control_potencia==1?"true":"false");
+	    for (i=0; i<num_inversores; i++){
+	    	printf("%s%d", i?",":"", potencias_nominales[i]);
+	    }
+	    printf("\n");
 
 	/*
      * accede o crea area de memoria compartida con medidor de potencia importada
@@ -868,47 +1964,143 @@ int main(int argc, char *argv[]) {
 	shmid = shmget(SHM_KEY_DATOS_PUBLICADOS, sizeof (struct datos_publicados), IPC_CREAT | 0666);
 	datos_publicados = shmat(shmid, NULL, 0);
 
-#if 1
-	// Abre fichero datos de inversor y pone cabecera si necesario (fichero vacio)
-	fdatos = open(ficheroDatosInversor, O_CREAT|O_APPEND|O_RDWR,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-	fstat (fdatos, &file_info);
-	if (file_info.st_size==0){
-		sprintf(linea, "dia\x09hora\x09Pot. med\x09energia\x09Pot. max\x09Pot. min\x09limite\n");
-	 	write(fdatos, linea, strlen(linea));
-	    sprintf(linea, "   \x09    \x09  (w)   \x09 (w*s)  \x09 (w)   \x09  (w)   \x09(porc)\n");
-	    write(fdatos, linea, strlen(linea));
+	/*
+	 * area de memoria compartida con los datos de cada inversor
+	 */
+	struct publicacion *publicacion;
+	publicacion = abre_shm(SHM_KEY_DATOS_INVERSORES, sizeof (struct publicacion));
+	if (publicacion==NULL){
+		printf("%s\n", msgerror);
+		return -1;
+	}
+	/*
+	 * area de memoria compartida con las estadisticas del bus (fronius-util stats)
+	 */
+	estadisticas = abre_shm(SHM_KEY_ESTADISTICAS, sizeof (struct estadisticas));
+	if (estadisticas==NULL){
+		printf("%s\n", msgerror);
+		return -1;
+	}
+	est_inicia(estadisticas, inversores, num_inversores, time(NULL));
+	/*
+	 * anillo de memoria compartida con las muestras de cada segundo (lectores sin perdidas)
+	 */
+	struct anillo_muestras *anillo;
+	anillo = abre_shm(SHM_KEY_MUESTRAS, sizeof (struct anillo_muestras));
+	if (anillo==NULL){
+		printf("%s\n", msgerror);
+		return -1;
+	}
+	an_inicia(anillo);
+
+	// los datos del ciclo se preparan en memoria propia y se publican juntos al final de cada ciclo
+	struct datos_inversores estado_inversores;
+	struct datos_inversores *datos_inversores=&estado_inversores;
+	struct vigilancia_inversor vigilancia[MAX_INVERSORES]; // estado de cada inversor (produciendo, en reposo...)
+	memset(datos_inversores, 0, sizeof(struct datos_inversores));
+	datos_inversores->num_inversores=num_inversores;
+	datos_inversores->lim_reparto=100;
+	for (i=0; i<num_inversores; i++){
+		datos_inversores->inversor[i].numero=inversores[i];
+		datos_inversores->inversor[i].lim_pot=100;
+		ei_inicia(&vigilancia[i], time(NULL));
+		datos_inversores->inversor[i].estado=vigilancia[i].estado;
+	}
+
+	// Abre fichero binario de datos de inversor (lo crea con su cabecera si no existe)
+	fdatos = rb_abre(ficheroDatosInversor, &codificador);
+	if (fdatos<0){
+		printf("Error opening %s: %s\n", ficheroDatosInversor, errno?strerror(errno):"invalid format");
+		return -1;
 	}
-#endif
+
+	// Abre el historico de varios dias (lo crea si no existe y recupera el dia en curso tras un corte)
+	rc=hs_abre(ficheroHistorico, &historico);
+	if (rc<0){
+		printf("Error opening %s: %s\n", ficheroHistorico, errno?strerror(errno):"invalid format");
+		return -1;
+	}
+	if (rc>0){
+		printf("%s: %d days recovered\n", ficheroHistorico, rc);
+	}
+
+	// Captura del puerto serie: la escribe un hilo escritor propio, porque en el ciclo de control la
+	// alimenta el hilo del bus y cada cola del escritor es de un solo productor
+	if (fichero_captura!=NULL){
+		if (cp_abre(&captura, fichero_captura, &escritor_captura)<0){
+			printf("Error opening %s: %s\n", fichero_captura, strerror(errno));
+			return -1;
+		}
+		if (es_inicia(&escritor_captura, -1, NULL, captura.fd, 0)){
+			printf("Error starting writer thread\n");
+			return -1;
+		}
+		n_consola=snprintf(consola, sizeof(consola), "nominal=%d k=%s", potencia_nominal_total,
+				opcion_k!=NULL?opcion_k:"");
+		cp_anota(&captura, BC_CONFIGURACION, consola, n_consola);
+	}
+
+	// Hilo de escritura: desde aqui la salida del ciclo va por la cola del escritor
+	if (es_inicia(&escritor, fdatos, &codificador, -1, segundos_fsync)){
+		printf("Error starting writer thread\n");
+		return -1;
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0); // los mensajes que siguen con printf() (errores) salen en su linea
 
 	/*
-	 * Temporizador de cada segundo
+	 * Temporizador de cada segundo (CLOCK_MONOTONIC alineado con el inicio de segundo de tiempo real)
 	 */
-	int fd_timer_segundo; //
-	fd_timer_segundo = timerfd_create(CLOCK_REALTIME, 0);
-	struct timeval tiempo;
-	struct itimerspec ts;
-	uint64_t numExp=0;
+	struct reloj reloj;
+	unsigned long tics_perdidos=0;
+	int eventos; // cambios de minuto, cuarto de hora y dia desde el ciclo anterior
+	if (rj_inicia(&reloj)){
+		printf("Error %d creating the 1 s timer: %s\n", errno, strerror(errno));
+		return -1;
+	}
+
 	/*
-	 * alinea el inicio del temporizador con el inicio de segundo de tiempo real
+	 * Socket de avisos de consumo del medidor
 	 */
+	if (ruta_avisos!=NULL){
+		avisos.fd=av_abre_receptor(ruta_avisos);
+		if (avisos.fd==-1){
+			printf("Error %d opening notification socket %s: %s\n", errno, ruta_avisos, strerror(errno));
+			return -1;
+		}
+	}
 
-	/* obtiene el tiempo actual en segundos y nanosegundos*/
-	 gettimeofday(&tiempo, NULL);
-	 /* ajusta salto de temporizador con el siguiente segunto en tiempo absoluto*/
-	ts.it_value.tv_sec=tiempo.tv_sec+1;
-	ts.it_value.tv_nsec=0;
-	/* ajusta salto periodico a 1s */
-	ts.it_interval.tv_sec=1;
-	ts.it_interval.tv_nsec=0;
-	timerfd_settime(fd_timer_segundo, TFD_TIMER_ABSTIME, &ts, NULL);
+	/*
+	 * Servidor local de metricas, atendido en la espera de cada ciclo
+	 */
+	if (direccion_servidor!=NULL){
+		if (sv_abre(&servidor, direccion_servidor)){
+			printf("Error %d opening metrics endpoint %s: %s\n", errno, direccion_servidor, strerror(errno));
+			return -1;
+		}
+		sv_publica_historico(&servidor, &historico, time(NULL));
+	}
 
 	int cerrar_ps=0; //señala si puerto serie debe cerrarse (0) o si permanece abierto (1)
+	int iniciado=0; // se han leido la energia inicial y empezado el primer cuarto de hora
+	int64_t inicio_fallo_ns[MAX_INVERSORES]={0}; // primer fallo de cada inversor que respondia (0: responde)
+	int64_t ahora_ns;
+	float recuperacion_ms;
 	while (1){ //Bucle de apertura
 
 		// se asegura el cierre del puerto serie
 		if(cerrar_ps && fd!=0 ){ // nunca cierra el fichero con file descriptor=0, esto es file input, Esto ocurre la primera vez
 			close(fd);
-			usleep(3000000); //Espera 3 segundos
+			estadisticas->reconexiones++;
+			// la recuperacion de los inversores que respondian incluye la reapertura
+			for (i=0; i<num_inversores; i++){
+				inv=&datos_inversores->inversor[i];
+				if (inv->valido && inicio_fallo_ns[i]==0){
+					inicio_fallo_ns[i]=av_instante_ns();
+				}
+				inv->valido=0;
+				inv->lim_pot=-1; // se vuelve a enviar el limite en curso (no el 100%) cuando responda
+			}
+			usleep(1000000); //Espera 1 segundo a que el adaptador se recupere
 		}
 		// abre fichero de puerto serie
 		// para tener permiso si es usuario no root asegurar que pertenece al grupo dialout
@@ -925,172 +2117,453 @@ int main(int argc, char *argv[]) {
 		}
 		else {
 			cerrar_ps=0;
-			configura_puerto_serie(fd);
-			printf ("fd:%d. Listening inverter %d", fd, num_inversor);
-
-			// obtiene datos de inversor
-			rc=fi_get_version(fd, num_inversor, &versions);
-			if (rc==-1){
-				printf("%s\r", msgerror);
-				cerrar_ps=1;
-				continue;
+			rc=configura_puerto_serie(fd);
+			pt_inicia(&parser);
+			cp_anota(&captura, BC_APERTURA, &baudios_puerto, sizeof(uint32_t));
+			printf ("fd:%d. Listening %d inverter(s)\n", fd, num_inversores);
+			if (sondear_velocidad){
+				// hasta que responde algun inversor no se conoce la velocidad de la tarjeta
+				if (sondea_velocidad(fd)>0){
+					sondear_velocidad=0;
+					informa_puerto(fd, portname1, 1, rc);
+				}
+				else {
+					printf("No inverter answers at any rate; using %d baud\n", baudios_puerto);
+				}
 			}
 			else {
-				printf("Serie inversor: %d, version IFC:%d.%d.%d Version SW:%d.%d.%d.%d\n",
-						versions.type_inverter,
-						versions.IFC_Major, versions.IFC_Minor,versions.IFC_Release,
-						versions.SW_Major, versions.SW_Minor, versions.SW_Release, versions.SW_Build);
-				rc=fi_get_inverter_caps(fd, num_inversor, &inverter_caps);
-				if (rc==-1)				{
-					printf("Error en fi_get_invertercaps:%s\n", msgerror);
-					cerrar_ps=1;
-					continue;
+				informa_puerto(fd, portname1, 0, rc);
+			}
+
+			if (descubrir){
+				rc=descubre_inversores(fd, descubiertos, MAX_INVERSORES);
+				pinta_descubiertos(descubiertos, rc, &escritor);
+				close(fd);
+				cp_vacia(&captura);
+				termina_escritores(&escritor, &escritor_captura);
+				return rc>0?0:-1;
+			}
+
+			// identifica los inversores que no se han identificado en una apertura anterior: primero se
+			// buscan todos a la vez y solo se pregunta uno a uno a los que no han respondido a la busqueda
+			num_descubiertos=0;
+			for (i=0; i<num_inversores && datos_inversores->inversor[i].identificado; i++);
+			if (i<num_inversores){
+				num_descubiertos=descubre_inversores(fd, descubiertos, MAX_INVERSORES);
+				if (num_descubiertos==-1){
+					printf("%s\n", msgerror);
+					num_descubiertos=0;
 				}
-				else {
-					if((inverter_caps & 0x01)==0){
-						printf("Inversor NO capacitado para aceptar comandos de reduccion de potencia\n");
-					}
-					else{
-						printf("Inversor capacitado para aceptar comandos de reduccion de potencia\n");
-						lim_pot=100;
-						rc=fi_set_powerlimit(fd, num_inversor,lim_pot); // asegura que inicialmente está al 100%
-						if (rc==-1){
-							printf("Error en fi_set_powerlimit:%s\n", msgerror);
-							cerrar_ps=1;
-							continue;
-						}
+				inversores_bus=num_descubiertos;
+				for (k=0; k<num_descubiertos; k++){
+					for (i=0; i<num_inversores && inversores[i]!=descubiertos[k].numero; i++);
+					if (i==num_inversores){
+						printf("Inversor %d en el bus pero no en la opcion -i\n", descubiertos[k].numero);
 					}
 				}
 			}
+			for (i=0; i<num_inversores; i++){
+				inv=&datos_inversores->inversor[i];
+				for (k=0; k<num_descubiertos && descubiertos[k].numero!=inv->numero; k++);
+				if (identifica_inversor(fd, inv, k<num_descubiertos?&descubiertos[k]:NULL, datos_inversores->lim_reparto, &escritor)==-1 &&
+						clase_error==CE_DISPOSITIVO){
+					break;
+				}
+			}
+			if (i<num_inversores){
+				cerrar_ps=1;
+				continue;
+			}
 		}
 
-		//se espera al vencimiento del temporizador, se obtiene y guarda la energia inicial y su tiempo
-		read(fd_timer_segundo, &numExp, sizeof(uint64_t));
-		segundo_anterior= time(NULL);
-		rc=fi_get_day_energy(fd, num_inversor, &datos_publicados->energia_generada_dia);
-		if (rc==-1){
-			printf("Error en fi_get_day_energy:%s\n", msgerror);
-			cerrar_ps=1;
-			continue;
+		if (ciclos_medida>0){
+			rc=medida_rendimiento(fd, ciclos_medida);
+			close(fd);
+			cp_vacia(&captura);
+			termina_escritores(&escritor, &escritor_captura);
+			if (captura.fd>=0){
+				printf("captura: %lu bloques, %lu entregas perdidas\n", captura.bloques, captura.descartes);
+			}
+			return rc;
+		}
+
+		// tras una reapertura se continua con el limite, el regulador y los acumulados del cuarto de hora
+		if (!iniciado){
+			//se espera al vencimiento del temporizador, se obtiene y guarda la energia inicial y su tiempo
+			rj_tic(&reloj);
+			energia_total=0;
+			for (i=0; i<num_inversores; i++){
+				inv=&datos_inversores->inversor[i];
+				rc=fi_get_medida(fd, inv->numero, MED_ENERGIA_DIA, &inv->medida[MED_ENERGIA_DIA]);
+				if (rc==-1){
+					printf("Error en lectura de energia inversor %d:%s\n", inv->numero, msgerror);
+					if (clase_error==CE_DISPOSITIVO){
+						break;
+					}
+				}
+				energia_total+=inv->medida[MED_ENERGIA_DIA];
+			}
+			if (i<num_inversores){
+				cerrar_ps=1;
+				continue;
+			}
+			datos_publicados->energia_generada_dia=energia_total;
+			energia_diaria_generada_anterior=datos_publicados->energia_generada_dia;
+			ag_inicia(&agregador, opcion_w, reloj.minuto);
+			ventana_cuarto=ag_busca(&agregador, 15);
+			iniciado=1;
 		}
-		energia_diaria_generada_anterior=datos_publicados->energia_generada_dia;
-		pot_max=0;
-		pot_min=FLT_MAX;
-		pot_med=0;
-		lim_pot_para_media=0;
 
 
 
+		// desde aqui el puerto serie lo usa el hilo del bus
+		if (bs_inicia(&bus, fd, ejecuta_orden)){
+			printf("Error starting bus thread\n");
+			return -1;
+		}
+
 		while (1){ // bucle de lectura y ajuste de potencia
 
 			/*
-			* la ejecucion queda suspendida en la función read() hasta que el temporizador se dispare (alcance el nuevo segundo)
+			* la ejecucion queda suspendida hasta que el temporizador se dispare (alcance el nuevo segundo).
+			* Mientras, un aviso del medidor que indique exportacion se atiende en el momento
 			*/
-			read(fd_timer_segundo, &numExp, sizeof(uint64_t));
+			while (espera_ciclo(&reloj, &avisos, &servidor)){
+				if (lee_avisos(&avisos, datos_inversores) && avisos.inmediato && control_potencia==1){
+					lim_pot=regula_limite(&bus, &limitador, datos_inversores, &avisos, avisos.consumo, avisos.generada);
+				}
+			}
+			pl_nuevo_ciclo(&planificador);
+			inicio_ciclo_ns=av_instante_ns();
 			//  se toma el tiempo
 			segundo_actual = time(NULL);
 			loc_time = localtime (&segundo_actual); // Converting current time to local time
-
-			rc=fi_get_power(fd, num_inversor, &datos_publicados->potencia_generada);
-			if (rc==-1){
-				printf("Error en fi_get_power:%s\n", msgerror);
-				datos_publicados->potencia_generada=0;
+			eventos = rj_eventos(&reloj, segundo_actual);
+			est_anota_tiempo(estadisticas->retraso_tic, &estadisticas->retraso_tic_max_us, reloj.retraso_us);
+			estadisticas->retraso_tic_total_us+=reloj.retraso_us;
+			estadisticas->tics=reloj.tics;
+			estadisticas->tics_perdidos=reloj.tics_perdidos;
+			estadisticas->realineaciones=reloj.realineaciones;
+			estadisticas->minutos_saltados=reloj.minutos_saltados;
+			if (reloj.tics_perdidos!=tics_perdidos){
+				es_texto(&escritor, "\n%lu 1 s ticks lost (cycle longer than 1 s)\n", reloj.tics_perdidos-tics_perdidos);
+				tics_perdidos=reloj.tics_perdidos;
+			}
+			cerradas=ag_avanza(&agregador, reloj.minuto);
+
+			// primero la potencia de todos los inversores, que es lo que necesita el limitador: se encargan
+			// todas al hilo del bus y, mientras responden, un aviso con exportacion se atiende en el momento.
+			// a los inversores dormidos (reposo o desconectados) solo se les consulta cuando les toca sondeo
+			memset(&orden, 0, sizeof(orden));
+			orden.tipo=OB_MEDIDA;
+			orden.prioridad=PO_POTENCIA;
+			orden.medida=MED_POTENCIA;
+			orden.plazo_ns=inicio_ciclo_ns+1000000000LL;
+			for (i=0; i<num_inversores; i++){
+				consultado[i]=0;
+				if (!ei_toca(&vigilancia[i], planificador.ciclo)){
+					continue;
+				}
+				orden.inversor=i;
+				orden.numero=datos_inversores->inversor[i].numero;
+				consultado[i]=bs_encarga(&bus, &orden)==0;
+			}
+			// se espera a que el bus quede libre: la identificacion de un inversor que responde por
+			// primera vez usa el puerto desde este hilo
+			while (bs_pendientes(&bus)){
+				if (!bs_resultado(&bus, CR_CONTROL, &resultado)){
+					if (espera_resultado(&bus, &avisos) && lee_avisos(&avisos, datos_inversores) && avisos.inmediato && control_potencia==1){
+						lim_pot=regula_limite(&bus, &limitador, datos_inversores, &avisos, avisos.consumo, avisos.generada);
+					}
+					continue;
+				}
+				if (resultado.orden.tipo==OB_LIMITE){
+					atiende_limite(datos_inversores, &avisos, &resultado, &escritor);
+				}
+				else {
+					potencia[resultado.orden.inversor]=resultado;
+				}
+			}
+			validos=0;
+			potencia_total=0;
+			for (i=0; i<num_inversores; i++){
+				inv=&datos_inversores->inversor[i];
+				if (!consultado[i] || potencia[i].vencida){
+					continue;
+				}
+				rc=potencia[i].rc;
+				if (rc==-1 && potencia[i].clase==CE_DISPOSITIVO){
+					es_texto(&escritor, "\nError en lectura de potencia inversor %d:%s\n", inv->numero, potencia[i].mensaje);
+					break; // al cerrar el puerto se anota el fallo de los inversores que respondian
+				}
+				anota_estado(vigilancia, i, inv, rc, potencia[i].clase, planificador.ciclo, segundo_actual, &escritor);
+				if (rc==-1){
+					// los fallos de un inversor que duerme o esta despertando son lo esperado: solo cambia su estado
+					if (vigilancia[i].estado==EI_PRODUCIENDO){
+						es_texto(&escritor, "\nError en lectura de potencia inversor %d:%s\n", inv->numero, potencia[i].mensaje);
+					}
+					if (inv->valido && inicio_fallo_ns[i]==0){
+						inicio_fallo_ns[i]=av_instante_ns();
+					}
+					inv->valido=0;
+					if (potencia[i].clase!=CE_TRAMA){
+						inv->lim_pot=-1; // desconocido (puede haberse reiniciado): se vuelve a enviar cuando responda
+					}
+					continue;
+				}
+				inv->medida[MED_POTENCIA]=potencia[i].valor;
+				if (!inv->identificado && identifica_inversor(fd, inv, NULL, datos_inversores->lim_reparto, &escritor)==-1){
+					continue;
+				}
+				inv->valido=1;
+				if (inicio_fallo_ns[i]){
+					// recuperacion: del primer fallo a la primera lectura correcta
+					ahora_ns=av_instante_ns();
+					recuperacion_ms=(ahora_ns-inicio_fallo_ns[i])/1e6;
+					inicio_fallo_ns[i]=0;
+					if (recuperacion_ms<RECUPERACION_MAXIMA_MS){
+						datos_inversores->recuperaciones++;
+						datos_inversores->recuperacion_ms=recuperacion_ms;
+						datos_inversores->recuperacion_total_ms+=recuperacion_ms;
+						if (recuperacion_ms>datos_inversores->recuperacion_max_ms){
+							datos_inversores->recuperacion_max_ms=recuperacion_ms;
+						}
+					}
+					else {
+						datos_inversores->caidas++;
+					}
+				}
+				inv->instante=segundo_actual;
+				potencia_total+=inv->medida[MED_POTENCIA];
+				validos++;
+			}
+			datos_publicados->potencia_generada=potencia_total;
+			datos_inversores->potencia_generada_total=potencia_total;
+			avisos.generada=potencia_total;
+			if (i<num_inversores){
+				// error del puerto serie: se vuelve a abrir
 				cerrar_ps=1;
 				break;
 			}
 
+			// con avisos, el consumo del ultimo aviso es el mas reciente
+			lee_avisos(&avisos, datos_inversores);
+			consumo=avisos.recibido?avisos.consumo:datos_publicados->potencia_consumo;
+
 			//TODO quitar esta variable. Emplear datos_instantaneos->potencia
 			int potencia_importada;
-			potencia_importada=datos_publicados->potencia_consumo - datos_publicados->potencia_generada;
+			potencia_importada=consumo - datos_publicados->potencia_generada;
 
-			if (control_potencia==1){
-				if (potencia_importada<0 ){
-					lim_pot=(datos_publicados->potencia_consumo*100)/potencia_nominal_inversor;
-					lim_pot=lim_pot<10?10:lim_pot;  //evita poner limite por debajo del 10% para evitar parada de inversor
-				}
-				else{ //incremento lento (1%) de la potencia generada hasta llegar a 100%
-					lim_pot=lim_pot>=100-1?100:lim_pot+1;
+			if (control_potencia==1 && validos>0){
+				// el limite es un porcentaje comun de la potencia nominal de todos los inversores.
+				// solo se envia a los inversores que no lo tienen ya aplicado
+				lim_pot=regula_limite(&bus, &limitador, datos_inversores, &avisos, consumo, datos_publicados->potencia_generada);
+			}
+
+			// telemetria: las consultas vencidas que caben en lo que queda de presupuesto del ciclo, por prioridad.
+			// la energia del dia se lee siempre al empezar cada minuto para el registro y los cuartos de hora
+			if (eventos & EV_MINUTO){
+				pl_fuerza(&planificador, MED_ENERGIA_DIA);
+			}
+			mascara=0;
+			for (i=0; i<num_inversores; i++){
+				if (datos_inversores->inversor[i].valido){
+					mascara|=1u<<i;
 				}
-				rc=fi_set_powerlimit(fd, num_inversor,lim_pot);
-				if (rc==-1){
-					printf("Error en fi_set_powerlimit:%s\n", msgerror);
-					cerrar_ps=1;
+			}
+			// se encargan todas las que caben de una vez, con el final del presupuesto del ciclo como plazo.
+			// un 0x9F decidido mientras tanto (aviso de exportacion) pasa por delante de las que esperan
+			orden.prioridad=PO_TELEMETRIA;
+			orden.plazo_ns=inicio_ciclo_ns+presupuesto_ms*1000000LL;
+			while (pl_siguiente(&planificador, mascara, &i, &metrica)){
+				orden.inversor=i;
+				orden.numero=datos_inversores->inversor[i].numero;
+				orden.medida=metrica;
+				if (bs_encarga(&bus, &orden)){
 					break;
 				}
+				pl_encarga(&planificador, i, metrica);
 			}
-
-			rc=fi_get_day_energy(fd, num_inversor, &datos_publicados->energia_generada_dia);
-			if (rc==-1){
-				printf("Error en fi_get_day_energy:%s\n", msgerror);
-				cerrar_ps=1;
+			while (bs_pendientes(&bus)){
+				if (bs_resultado(&bus, CR_CONTROL, &resultado)){
+					atiende_limite(datos_inversores, &avisos, &resultado, &escritor);
+					continue;
+				}
+				if (!bs_resultado(&bus, CR_PUBLICACION, &resultado)){
+					if (espera_resultado(&bus, &avisos) && lee_avisos(&avisos, datos_inversores) && avisos.inmediato && control_potencia==1){
+						lim_pot=regula_limite(&bus, &limitador, datos_inversores, &avisos, avisos.consumo, avisos.generada);
+					}
+					continue;
+				}
+				i=resultado.orden.inversor;
+				metrica=resultado.orden.medida;
+				inv=&datos_inversores->inversor[i];
+				if (resultado.vencida){
+					pl_descarta(&planificador, i, metrica);
+					continue;
+				}
+				pl_registra(&planificador, i, metrica, resultado.rc!=-1, resultado.rtt_ms);
+				if (resultado.rc==-1){
+					es_texto(&escritor, "\nError en consulta %s inversor %d:%s\n", medidas[metrica].nombre, inv->numero, resultado.mensaje);
+					if (resultado.clase==CE_DISPOSITIVO){
+						cerrar_ps=1;
+						continue;
+					}
+					if (inicio_fallo_ns[i]==0){
+						inicio_fallo_ns[i]=av_instante_ns();
+					}
+					inv->valido=0;
+					continue;
+				}
+				inv->medida[metrica]=resultado.valor;
+			}
+			if (cerrar_ps){
 				break;
 			}
+			datos_inversores->consultas_omitidas+=pl_fin_ciclo(&planificador);
 
-			rc=fi_get_dc_voltage(fd, num_inversor, &tension_DC);
-			if (rc==-1){
-				printf("Error en fi_get_dc_voltage:%s\n", msgerror);
-				cerrar_ps=1;
-				break;
+			// la energia del dia de un inversor que no responde se mantiene con su ultimo valor
+			energia_total=0;
+			for (i=0; i<num_inversores; i++){
+				energia_total+=datos_inversores->inversor[i].medida[MED_ENERGIA_DIA];
 			}
-			rc=fi_get_dc_current(fd, num_inversor, &corriente_DC);
-			if (rc==-1){
-				printf("Error en fi_get_dc_current:%s\n", msgerror);
-				cerrar_ps=1;
-				break;
+			datos_publicados->energia_generada_dia=energia_total;
+			datos_inversores->energia_generada_dia_total=energia_total;
+
+			// se comprueba si todas las consultas han cabido en el segundo
+			datos_inversores->ciclo_ms=pl_ms_ciclo(&planificador);
+			datos_inversores->ciclos++;
+			estadisticas->ciclos++;
+			estadisticas->ciclo_total_us+=datos_inversores->ciclo_ms*1000;
+			est_anota_tiempo(estadisticas->ciclo, &estadisticas->ciclo_max_us, datos_inversores->ciclo_ms*1000);
+			if (datos_inversores->ciclo_ms>=1000){
+				datos_inversores->ciclos_excedidos++;
+				estadisticas->ciclos_excedidos++;
+				es_texto(&escritor, "\nEl bus no admite las consultas de los %d inversores en el segundo: ciclo de %d ms (%lu ciclos excedidos)\n",
+						num_inversores, datos_inversores->ciclo_ms, datos_inversores->ciclos_excedidos);
 			}
 
-			pot_max=datos_publicados->potencia_generada>pot_max?datos_publicados->potencia_generada:pot_max;
-			pot_min=datos_publicados->potencia_generada<pot_min?datos_publicados->potencia_generada:pot_min;
-			lim_pot_para_media+=lim_pot;
-
 			strftime (buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S%z", loc_time);
-			printf("\r%s Pot gen.: %5.1fW  Lim gen.: %5dW  Pot imp.: %5dW  Pot con.: %5.1fW  Energia diaria: %5.1fWh  DC: %3.1fV %.3fA %5.1fW",
+			n_consola=snprintf(consola, sizeof(consola), "\r%s Pot gen.: %5.1fW  Lim gen.: %5dW  Pot imp.: %5dW  Pot con.: %5.1fW  Energia diaria: %5.1fWh",
 					buf,
 					datos_publicados->potencia_generada,
-					(lim_pot*potencia_nominal_inversor)/100,
+					(lim_pot*potencia_nominal_total)/100,
 					potencia_importada,
 					datos_publicados->potencia_consumo,
-					datos_publicados->energia_generada_dia,
-					tension_DC,
-					corriente_DC,
-					(tension_DC*corriente_DC)
+					datos_publicados->energia_generada_dia
 					);
+			for (i=0; i<num_inversores; i++){
+				inv=&datos_inversores->inversor[i];
+				if (!inv->valido){
+					// sin valores del ciclo: su estado en lugar de los ultimos valores leidos
+					if (n_consola<(int)sizeof(consola)){
+						n_consola+=snprintf(consola+n_consola, sizeof(consola)-n_consola, "  [%d] %s", inv->numero,
+								nombres_estados_inversor[inv->estado]);
+					}
+					continue;
+				}
+				if (num_inversores>1 && n_consola<(int)sizeof(consola)){
+					n_consola+=snprintf(consola+n_consola, sizeof(consola)-n_consola, "  [%d] %5.1fW", inv->numero, inv->medida[MED_POTENCIA]);
+				}
+				if (n_consola<(int)sizeof(consola)){
+					n_consola+=snprintf(consola+n_consola, sizeof(consola)-n_consola, "  DC: %3.1fV %.3fA %5.1fW",
+						inv->medida[MED_TENSION_DC],
+						inv->medida[MED_CORRIENTE_DC],
+						(inv->medida[MED_TENSION_DC]*inv->medida[MED_CORRIENTE_DC])
+						);
+				}
+			}
+			es_pon(&escritor, ES_CONSOLA, consola, n_consola<(int)sizeof(consola)?n_consola:sizeof(consola)-1);
 
-			fflush(stdout);
+			// registro de la muestra de cada segundo (lo escribe el hilo escritor) y anillo de los lectores
+			compone_muestra(&muestra, segundo_actual, datos_publicados, datos_inversores, lim_pot, control_potencia);
+			es_pon(&escritor, ES_MUESTRA, &muestra, sizeof(muestra));
+			cp_anota(&captura, BC_MUESTRA, &muestra, sizeof(muestra));
+			cp_vacia(&captura); // la captura del ciclo pasa al escritor junto con su muestra
+			an_escribe(anillo, &muestra);
+			ag_anota(&agregador, &muestra);
 
 			int intervalo_15min;
 			intervalo_15min=loc_time->tm_hour*4+(loc_time->tm_min/15);
 			datos_publicados->entradaregistrodiario[intervalo_15min].energia_generada=datos_publicados->energia_generada_dia-energia_diaria_generada_anterior;
-
-			segundos_intervalo = segundo_actual - segundo_anterior;
-			if (segundos_intervalo > 0){
-				pot_med = datos_publicados->entradaregistrodiario[intervalo_15min].energia_generada * 3600 / segundos_intervalo;
-				lim_pot_para_media=lim_pot_para_media/segundos_intervalo;
+			dia_cerrado=hs_actualiza(&historico, segundo_actual, datos_inversores, datos_publicados->entradaregistrodiario[intervalo_15min].energia_consumida);
+			if (dia_cerrado!=NULL){
+				es_pon(&escritor, ES_SINCRONIZA, dia_cerrado, sizeof(*dia_cerrado));
 			}
 
-			// Registrar cuando las lecturas completan un minuto
-			//la segunda condicion es para evitar que el primer tiempo tras arrancar el programa coincida con segundo=0 lo que provoca una division por 0.
-			if (loc_time->tm_sec==0 && segundo_anterior!=0){
-				sprintf(linea, "%s %4.1f %6.1f %3d %4.1f %4.1f %3d\n", buf, pot_med, datos_publicados->entradaregistrodiario[intervalo_15min].energia_generada, segundos_intervalo,  pot_max, pot_min, lim_pot_para_media);
-				printf("\n%s", linea);
-				write(fdatos, linea, strlen(linea));
-				printf("intervalo_15min:%d energia gen:%5.1f energia con:%5.1f \n",
+			// Registrar cuando las lecturas completan un minuto (una vez por minuto aunque el tic del segundo 0 llegue tarde):
+			// potencia media, maxima y minima y limite medio del cuarto de hora (el terminado si acaba de cerrarse)
+			if (eventos & EV_MINUTO){
+				cuarto=cerradas & (1<<ventana_cuarto)?&agregador.ventana[ventana_cuarto].cerrada:&agregador.ventana[ventana_cuarto].en_curso;
+				rs=cuarto->serie;
+				sprintf(linea, "%s %4.1f %6.1f %3u %4.1f %4.1f %3d\n", buf, rs[SE_POTENCIA].media, datos_publicados->entradaregistrodiario[intervalo_15min].energia_generada,
+						rs[SE_POTENCIA].n, rs[SE_POTENCIA].maximo, rs[SE_POTENCIA].minimo, (int)lrintf(rs[SE_LIMITE].media));
+				es_texto(&escritor, "\n%s", linea);
+				es_texto(&escritor, "intervalo_15min:%d energia gen:%5.1f energia con:%5.1f \n",
 						intervalo_15min,
 						datos_publicados->entradaregistrodiario[intervalo_15min].energia_generada,
 						datos_publicados->entradaregistrodiario[intervalo_15min].energia_consumida);
 
 			}
 
-			// acciones cada en el segundo que se cumple cada 1/4 de hora (15min)
-			if (loc_time->tm_min%15==0 && loc_time->tm_sec==0){
+			// resumen del dia terminado (los inversores ponen a cero su energia del dia al despertar)
+			if (eventos & EV_DIA){
+				es_texto(&escritor, "\nDay closed: generated %.1fWh. Ticks lost:%lu realigned:%lu minutes skipped:%lu\n",
+						datos_publicados->energia_generada_dia, reloj.tics_perdidos, reloj.realineaciones, reloj.minutos_saltados);
+			}
+
+			// estadisticas de las ventanas de 15 minutos o mas que se han cerrado (la de 1 minuto ya va en la linea de cada minuto)
+			for (v=0; v<agregador.num_ventanas; v++){
+				if ((cerradas & (1<<v))==0 || agregador.ventana[v].minutos<15 || agregador.ventana[v].cerrada.serie[SE_POTENCIA].n==0){
+					continue;
+				}
+				rs=agregador.ventana[v].cerrada.serie;
+				es_texto(&escritor, "Window %s: power %.1f sd %.1f min %.0f p50 %.0f p90 %.0f p99 %.0f max %.0f W  limit %.1f%%  import %.1f sd %.1f min %.0f max %.0f W  dc %.1fV %.2fA\n",
+						ag_nombre_ventana(agregador.ventana[v].minutos, nombre_ventana, sizeof(nombre_ventana)),
+						rs[SE_POTENCIA].media, rs[SE_POTENCIA].desviacion, rs[SE_POTENCIA].minimo, rs[SE_POTENCIA].p50,
+						rs[SE_POTENCIA].p90, rs[SE_POTENCIA].p99, rs[SE_POTENCIA].maximo, rs[SE_LIMITE].media,
+						rs[SE_IMPORTADA].media, rs[SE_IMPORTADA].desviacion, rs[SE_IMPORTADA].minimo, rs[SE_IMPORTADA].maximo,
+						rs[SE_TENSION_DC].media, rs[SE_CORRIENTE_DC].media);
+			}
+
+			// acciones al empezar cada 1/4 de hora (15min)
+			if (eventos & EV_CUARTO){
 				energia_diaria_generada_anterior = datos_publicados->energia_generada_dia;
-				segundo_anterior=segundo_actual;
-				pot_max=0;
-				pot_min=FLT_MAX;
-				lim_pot_para_media=0;
+			}
+
+			// publicacion de la instantanea completa del ciclo
+			datos_inversores->instante=segundo_actual;
+			datos_inversores->potencia_consumo=datos_publicados->potencia_consumo;
+			datos_inversores->lim_pot=lim_pot;
+			datos_inversores->escritura_descartes=escritor.descartes;
+			datos_inversores->escritura_max_pendientes=escritor.max_pendientes;
+			datos_inversores->escritura_errores=escritor.errores;
+			datos_inversores->escritura_max_ms=escritor.max_ms;
+			datos_inversores->ordenes_bus=bus.hechas;
+			datos_inversores->ordenes_vencidas=bus.vencidas;
+			datos_inversores->ordenes_adelantadas=bus.adelantos;
+			datos_inversores->num_ventanas=agregador.num_ventanas;
+			for (v=0; v<agregador.num_ventanas; v++){
+				datos_inversores->ventana_en_curso[v]=agregador.ventana[v].en_curso;
+				datos_inversores->ventana_cerrada[v]=agregador.ventana[v].cerrada;
+			}
+			memcpy(datos_inversores->entradaregistrodiario, datos_publicados->entradaregistrodiario,
+					sizeof(datos_inversores->entradaregistrodiario)<sizeof(datos_publicados->entradaregistrodiario)?
+					sizeof(datos_inversores->entradaregistrodiario):sizeof(datos_publicados->entradaregistrodiario));
+			pub_escribe(publicacion, datos_inversores);
+
+			// respuestas del servidor de metricas ya compuestas para la espera del siguiente ciclo
+			sv_publica_metricas(&servidor, datos_inversores, estadisticas);
+			if (eventos & EV_MINUTO){
+				sv_publica_historico(&servidor, &historico, segundo_actual);
 			}
 
 		} // final bucle de lecturas y ajuste potencia
+
+		// antes de cerrar el puerto se termina el hilo del bus, que devuelve sin hacer lo que le quede.
+		// los limites y los valores de todos los inversores se dan por desconocidos al cerrar
+		bs_termina(&bus);
+		while (bs_resultado(&bus, CR_CONTROL, &resultado) || bs_resultado(&bus, CR_PUBLICACION, &resultado));
 	}// fin bucle de apertura
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,320 @@
+/*
+ ============================================================================
+ Name        : historico.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Historico de varios dias de la energia de cada cuarto de hora
+ ============================================================================
+ */
+
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "historico.h"
+
+/*
+ * Dias desde 1970-01-01 de una fecha del calendario gregoriano
+ */
+static int32_t dias_desde_1970(int anio, int mes, int dia){
+	int era, ade, mde, dde;
+
+	anio-=mes<=2;
+	era=(anio>=0?anio:anio-399)/400;
+	ade=anio-era*400;
+	mde=(mes+9)%12;
+	dde=365*ade+ade/4-ade/100+(153*mde+2)/5+dia-1;
+	return era*146097+dde-719468;
+}
+
+/*
+ * Dia (fecha local) al que pertenece un instante
+ */
+int32_t hs_dia_de(time_t instante){
+	struct tm t;
+
+	localtime_r(&instante, &t);
+	return dias_desde_1970(t.tm_year+1900, t.tm_mon+1, t.tm_mday);
+}
+
+/*
+ * Instante de las 0h locales de un dia
+ */
+time_t hs_instante_de(int32_t dia){
+	time_t utc=(time_t)dia*86400;
+	struct tm t;
+
+	gmtime_r(&utc, &t);
+	t.tm_isdst=-1;
+	return mktime(&t);
+}
+
+/*
+ * Suma de control (FNV-1a) de un dia sin los campos dia y suma
+ */
+static uint32_t hs_suma(const struct dia_historico *d){
+	const unsigned char *p=(const unsigned char *)d+offsetof(struct dia_historico, numero);
+	const unsigned char *fin=(const unsigned char *)(d+1);
+	uint32_t suma=2166136261u^(uint32_t)d->dia;
+
+	while (p<fin){
+		suma=(suma^*p++)*16777619u;
+	}
+	return suma;
+}
+
+/*
+ * Escribe en el fichero las paginas de un dia
+ */
+static void hs_sincroniza(struct dia_historico *d){
+	uintptr_t pagina=(uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t inicio=(uintptr_t)d & ~(pagina-1);
+
+	d->suma=hs_suma(d);
+	msync((void *)inicio, (uintptr_t)(d+1)-inicio, MS_SYNC);
+}
+
+static int hs_valida(const struct cabecera_historico *c, size_t tamano){
+	return tamano>=sizeof(*c) &&
+			memcmp(c->magic, MAGIC_HISTORICO, sizeof(c->magic))==0 &&
+			c->version==VERSION_HISTORICO &&
+			c->tamano_dia==sizeof(struct dia_historico) &&
+			c->dias==DIAS_HISTORICO &&
+			c->inversores==MAX_INVERSORES &&
+			tamano==c->tamano_cabecera+(size_t)c->dias*c->tamano_dia;
+}
+
+/*
+ * Tras un corte de alimentacion el dia en curso puede no coincidir con su suma de control:
+ * los valores que no son energias posibles se ponen a 0 y los totales del dia se recalculan
+ */
+static void hs_recupera(struct dia_historico *d){
+	int i, q;
+
+	d->consumida_dia=0;
+	for (q=0; q<INTERVALOS_DIA; q++){
+		if (!isfinite(d->consumida[q]) || d->consumida[q]<0){
+			d->consumida[q]=0;
+		}
+		d->consumida_dia+=d->consumida[q];
+	}
+	for (i=0; i<MAX_INVERSORES; i++){
+		d->generada_dia[i]=0;
+		for (q=0; q<INTERVALOS_DIA; q++){
+			if (!isfinite(d->generada[i][q]) || d->generada[i][q]<0){
+				d->generada[i][q]=0;
+			}
+			d->generada_dia[i]+=d->generada[i][q];
+		}
+	}
+}
+
+/*
+ * Abre para escribir el fichero de historico, creandolo si no existe.
+ * Se comprueban todos los dias: los que no estan en su entrada se vacian y los que no
+ * coinciden con su suma de control se recuperan. Devuelve el numero de dias recuperados
+ * o vaciados, o -1 si el fichero no es valido
+ */
+int hs_abre(const char *fichero, struct historico *h){
+	int fd;
+	struct stat info;
+	size_t tamano=sizeof(struct cabecera_historico)+(size_t)DIAS_HISTORICO*sizeof(struct dia_historico);
+	void *base;
+	int n, recuperados=0;
+	struct dia_historico *d;
+
+	memset(h, 0, sizeof(*h));
+	fd=open(fichero, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd<0){
+		return -1;
+	}
+	fstat(fd, &info);
+	if (info.st_size==0 && ftruncate(fd, tamano)){
+		close(fd);
+		return -1;
+	}
+	base=mmap(NULL, tamano, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base==MAP_FAILED){
+		return -1;
+	}
+	h->cabecera=base;
+	h->dias=(struct dia_historico *)((char *)base+sizeof(struct cabecera_historico));
+	h->tamano=tamano;
+	h->escritura=1;
+	h->dia_actual=-1;
+	h->cuarto_actual=-1;
+
+	if (info.st_size==0){
+		memcpy(h->cabecera->magic, MAGIC_HISTORICO, sizeof(h->cabecera->magic));
+		h->cabecera->version=VERSION_HISTORICO;
+		h->cabecera->tamano_cabecera=sizeof(struct cabecera_historico);
+		h->cabecera->tamano_dia=sizeof(struct dia_historico);
+		h->cabecera->dias=DIAS_HISTORICO;
+		h->cabecera->inversores=MAX_INVERSORES;
+		h->cabecera->creacion=(uint32_t)time(NULL);
+		for (n=0; n<DIAS_HISTORICO; n++){
+			h->dias[n].dia=-1;
+		}
+		msync(base, tamano, MS_SYNC);
+		return 0;
+	}
+	if (!hs_valida(h->cabecera, info.st_size)){
+		munmap(base, tamano);
+		memset(h, 0, sizeof(*h));
+		return -1;
+	}
+	for (n=0; n<DIAS_HISTORICO; n++){
+		d=&h->dias[n];
+		if (d->dia==-1 || d->suma==hs_suma(d)){
+			continue;
+		}
+		if (d->dia<0 || d->dia%DIAS_HISTORICO!=n){
+			memset(d, 0, sizeof(*d));
+			d->dia=-1;
+		}
+		else {
+			hs_recupera(d);
+			d->suma=hs_suma(d);
+		}
+		recuperados++;
+	}
+	if (recuperados){
+		msync(base, tamano, MS_SYNC);
+	}
+	return recuperados;
+}
+
+/*
+ * Mapea para lectura el fichero de historico (procesos de visualizacion)
+ */
+int hs_mapea(const char *fichero, struct historico *h){
+	int fd;
+	struct stat info;
+	void *base;
+
+	memset(h, 0, sizeof(*h));
+	fd=open(fichero, O_RDONLY);
+	if (fd<0){
+		return -1;
+	}
+	fstat(fd, &info);
+	if ((size_t)info.st_size<sizeof(struct cabecera_historico)){
+		close(fd);
+		return -1;
+	}
+	base=mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base==MAP_FAILED){
+		return -1;
+	}
+	if (!hs_valida(base, info.st_size)){
+		munmap(base, info.st_size);
+		return -1;
+	}
+	h->cabecera=base;
+	h->dias=(struct dia_historico *)((char *)base+h->cabecera->tamano_cabecera);
+	h->tamano=info.st_size;
+	return 0;
+}
+
+void hs_cierra(struct historico *h){
+	if (h->cabecera==NULL){
+		return;
+	}
+	if (h->escritura && h->dia_actual!=-1){
+		hs_sincroniza(&h->dias[h->dia_actual%DIAS_HISTORICO]);
+	}
+	munmap(h->cabecera, h->tamano);
+	memset(h, 0, sizeof(*h));
+}
+
+/*
+ * Anota la energia del cuarto de hora en curso a partir de la energia del dia de cada inversor
+ * y de la energia consumida en el cuarto segun el medidor. Se llama en cada ciclo.
+ * Tras arrancar a mitad de un cuarto ya anotado se continua desde lo anotado. El inicio del cuarto de
+ * un inversor solo se toma de una lectura valida: uno que no responde al arrancar no anota nada hasta
+ * que responde, en vez de llevar al cuarto en curso toda la energia del dia.
+ * Al cambiar de cuarto de hora se pone la suma de control del dia y se devuelve para que el
+ * llamante lo lleve al fichero con msync() (fuera del ciclo si no quiere esperar); si no, NULL
+ */
+struct dia_historico *hs_actualiza(struct historico *h, time_t instante, const struct datos_inversores *datos, float consumida_cuarto){
+	struct dia_historico *d, *cerrado=NULL;
+	const struct datos_inversor *inv;
+	struct tm t;
+	int32_t dia;
+	int cuarto, i;
+	float generada;
+
+	localtime_r(&instante, &t);
+	dia=dias_desde_1970(t.tm_year+1900, t.tm_mon+1, t.tm_mday);
+	cuarto=t.tm_hour*4+t.tm_min/15;
+	d=&h->dias[dia%DIAS_HISTORICO];
+
+	if (dia!=h->dia_actual || cuarto!=h->cuarto_actual){
+		if (h->dia_actual!=-1){
+			cerrado=&h->dias[h->dia_actual%DIAS_HISTORICO];
+			cerrado->suma=hs_suma(cerrado);
+		}
+		if (d->dia!=dia){
+			// dia nuevo: ocupa la entrada del mismo dia de hace DIAS_HISTORICO dias
+			memset(d, 0, sizeof(*d));
+			d->dia=dia;
+			d->suma=hs_suma(d);
+		}
+		for (i=0; i<datos->num_inversores; i++){
+			inv=&datos->inversor[i];
+			if (h->dia_actual==-1){
+				h->sin_base[i]=1;
+			}
+			else if (!h->sin_base[i]){
+				h->inicio_cuarto[i]=inv->medida[MED_ENERGIA_DIA];
+			}
+		}
+		h->dia_actual=dia;
+		h->cuarto_actual=cuarto;
+	}
+
+	for (i=0; i<datos->num_inversores; i++){
+		inv=&datos->inversor[i];
+		d->numero[i]=inv->numero;
+		if (!inv->valido){
+			continue;
+		}
+		if (h->sin_base[i]){
+			// primera lectura valida desde el arranque: se continua desde lo anotado en el cuarto
+			h->inicio_cuarto[i]=inv->medida[MED_ENERGIA_DIA]-d->generada[i][cuarto];
+			h->sin_base[i]=0;
+		}
+		generada=inv->medida[MED_ENERGIA_DIA]-h->inicio_cuarto[i];
+		if (generada<0){
+			// el inversor ha puesto a cero su energia del dia (p.e. al despertar)
+			h->inicio_cuarto[i]=inv->medida[MED_ENERGIA_DIA]-d->generada[i][cuarto];
+			continue;
+		}
+		d->generada_dia[i]+=generada-d->generada[i][cuarto];
+		d->generada[i][cuarto]=generada;
+	}
+	if (consumida_cuarto>=0){
+		d->consumida_dia+=consumida_cuarto-d->consumida[cuarto];
+		d->consumida[cuarto]=consumida_cuarto;
+	}
+	return cerrado;
+}
+
+/*
+ * Dia guardado en el historico o NULL si no esta (no se ha registrado o ya se ha sobrescrito).
+ * Un lector concurrente debe comprobar que dia no ha cambiado despues de copiar los datos
+ */
+const struct dia_historico *hs_dia(const struct historico *h, int32_t dia){
+	const struct dia_historico *d;
+
+	if (dia<0){
+		return NULL;
+	}
+	d=&h->dias[dia%DIAS_HISTORICO];
+	return d->dia==dia?d:NULL;
+}
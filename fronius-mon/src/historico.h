@@ -0,0 +1,75 @@
+/*
+ ============================================================================
+ Name        : historico.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Historico de varios dias de la energia de cada cuarto de
+               hora. Fichero mapeado con mmap() con un anillo de
+               DIAS_HISTORICO dias: el dia d ocupa la entrada
+               d % DIAS_HISTORICO, de modo que cualquier dia, semana,
+               mes o año se localiza sin busquedas. Cada dia lleva su
+               suma de control para recuperarlo tras un corte de
+               alimentacion.
+ ============================================================================
+ */
+
+#ifndef HISTORICO_H_
+#define HISTORICO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "publicacion.h"
+
+#define MAGIC_HISTORICO   "FRMONHIS"
+#define VERSION_HISTORICO 1
+#define DIAS_HISTORICO    400 // mas de un año
+
+/*
+ * Cabecera del fichero (32 bytes)
+ */
+struct cabecera_historico{
+	char magic[8];            // "FRMONHIS"
+	uint16_t version;         // VERSION_HISTORICO
+	uint16_t tamano_cabecera; // sizeof(struct cabecera_historico)
+	uint32_t tamano_dia;      // sizeof(struct dia_historico)
+	uint16_t dias;            // DIAS_HISTORICO
+	uint16_t inversores;      // MAX_INVERSORES
+	uint32_t creacion;        // instante de creacion del fichero (s desde 1970 UTC)
+	uint8_t  relleno[8];
+};
+
+/*
+ * Energia de un dia. Los inversores estan en el orden de la opcion -i
+ */
+struct dia_historico{
+	int32_t dia;                                     // dias desde 1970-01-01 de la fecha local; -1 entrada vacia
+	uint32_t suma;                                   // suma de control del resto del dia (hs_suma)
+	uint8_t numero[MAX_INVERSORES];                  // numero de cada inversor en la red RS422 (0: no hay)
+	float generada_dia[MAX_INVERSORES];              // Wh generados en el dia por cada inversor
+	float consumida_dia;                             // Wh consumidos en el dia
+	float generada[MAX_INVERSORES][INTERVALOS_DIA];  // Wh generados en cada cuarto de hora
+	float consumida[INTERVALOS_DIA];                 // Wh consumidos en cada cuarto de hora (del medidor)
+};
+
+struct historico{
+	struct cabecera_historico *cabecera;
+	struct dia_historico *dias;
+	size_t tamano;
+	int escritura;                          // abierto para escribir (fronius-mon)
+	int32_t dia_actual;
+	int cuarto_actual;
+	float inicio_cuarto[MAX_INVERSORES];    // energia del dia de cada inversor al empezar el cuarto
+	uint8_t sin_base[MAX_INVERSORES];       // sin lectura valida desde el arranque: inicio_cuarto desconocido
+};
+
+int32_t hs_dia_de(time_t instante);
+time_t hs_instante_de(int32_t dia);
+int hs_abre(const char *fichero, struct historico *h);
+int hs_mapea(const char *fichero, struct historico *h);
+void hs_cierra(struct historico *h);
+struct dia_historico *hs_actualiza(struct historico *h, time_t instante, const struct datos_inversores *datos, float consumida_cuarto);
+const struct dia_historico *hs_dia(const struct historico *h, int32_t dia);
+
+#endif /* HISTORICO_H_ */
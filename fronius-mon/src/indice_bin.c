@@ -0,0 +1,333 @@
+/*
+ ============================================================================
+ Name        : indice_bin.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Indice disperso del registro binario y consultas por rangos
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "indice_bin.h"
+
+#define ENTRADAS_ESCRITURA_INDICE 256 // entradas calculadas que se escriben de una vez
+
+const char *nombres_campos_indice[NUM_CAMPOS_INDICE]={"power", "import", "export", "limit", "dcv", "dci"};
+
+static inline float valor_campo(const struct muestra_bin *m, int campo){
+	switch (campo){
+	case CI_GENERADA:
+		return m->potencia_generada;
+	case CI_IMPORTADA:
+		return m->potencia_importada;
+	case CI_EXPORTADA:
+		return m->potencia_importada<0?-m->potencia_importada:0;
+	case CI_LIMITE:
+		return m->limite;
+	case CI_TENSION_DC:
+		return m->tension_dc/10.0f;
+	default:
+		return m->corriente_dc/100.0f;
+	}
+}
+
+static void vacia_resumen(struct resumen_campo *r){
+	int c;
+
+	for (c=0; c<NUM_CAMPOS_INDICE; c++){
+		r[c].suma=0;
+		r[c].minimo=FLT_MAX;
+		r[c].maximo=-FLT_MAX;
+	}
+}
+
+static inline void suma_muestra(struct resumen_campo *r, const struct muestra_bin *m){
+	float v;
+	int c;
+
+	for (c=0; c<NUM_CAMPOS_INDICE; c++){
+		v=valor_campo(m, c);
+		r[c].suma+=v;
+		if (v<r[c].minimo){
+			r[c].minimo=v;
+		}
+		if (v>r[c].maximo){
+			r[c].maximo=v;
+		}
+	}
+}
+
+static void suma_resumen(struct resumen_campo *r, const struct resumen_campo *otro){
+	int c;
+
+	for (c=0; c<NUM_CAMPOS_INDICE; c++){
+		r[c].suma+=otro[c].suma;
+		if (otro[c].minimo<r[c].minimo){
+			r[c].minimo=otro[c].minimo;
+		}
+		if (otro[c].maximo>r[c].maximo){
+			r[c].maximo=otro[c].maximo;
+		}
+	}
+}
+
+/*
+ * Resumen de un bloque completo de muestras. maximo_anterior es el de la entrada anterior (0 si es la primera)
+ */
+static void resume_bloque(const struct muestra_bin *m, struct entrada_indice_bin *e, uint32_t maximo_anterior){
+	int i;
+
+	memset(e, 0, sizeof(*e));
+	e->primero=m[0].instante;
+	e->minimo=UINT32_MAX;
+	vacia_resumen(e->campo);
+	for (i=0; i<MUESTRAS_BLOQUE_INDICE; i++){
+		if (m[i].instante<e->minimo){
+			e->minimo=m[i].instante;
+		}
+		if (m[i].instante>e->maximo){
+			e->maximo=m[i].instante;
+		}
+		suma_muestra(e->campo, &m[i]);
+	}
+	e->maximo_anterior=e->maximo>maximo_anterior?e->maximo:maximo_anterior;
+}
+
+/*
+ * Calcula las entradas de hasta max bloques completos del registro a partir del que empieza en
+ * *posicion, que queda tras el ultimo calculado. Devuelve el numero de entradas
+ */
+static size_t calcula_entradas(const struct indice_bin *ix, size_t *posicion, struct entrada_indice_bin *entradas, size_t max,
+		uint32_t maximo_anterior){
+	static struct muestra_bin muestras[MUESTRAS_BLOQUE_INDICE];
+	size_t n, siguiente;
+
+	for (n=0; n<max && rb_lee_bloque(&ix->registro, *posicion, muestras, &siguiente)==MUESTRAS_BLOQUE_INDICE; n++){
+		resume_bloque(muestras, &entradas[n], maximo_anterior);
+		entradas[n].posicion=*posicion;
+		entradas[n].longitud=siguiente-*posicion;
+		maximo_anterior=entradas[n].maximo_anterior;
+		*posicion=siguiente;
+	}
+	return n;
+}
+
+/*
+ * Indice en memoria, si no se puede escribir el fichero de indice
+ */
+static int indice_en_memoria(struct indice_bin *ix){
+	struct entrada_indice_bin *entradas;
+	size_t capacidad=0;
+	uint32_t maximo_anterior=0;
+
+	ix->entradas=NULL;
+	ix->num_entradas=0;
+	ix->posicion_final=0;
+	do {
+		if (ix->num_entradas==capacidad){
+			capacidad=capacidad?capacidad*2:ENTRADAS_ESCRITURA_INDICE;
+			entradas=realloc(ix->entradas, capacidad*sizeof(struct entrada_indice_bin));
+			if (entradas==NULL){
+				free(ix->entradas);
+				ix->entradas=NULL;
+				ix->num_entradas=0;
+				return -1;
+			}
+			ix->entradas=entradas;
+		}
+		if (ix->num_entradas){
+			maximo_anterior=ix->entradas[ix->num_entradas-1].maximo_anterior;
+		}
+		ix->num_entradas+=calcula_entradas(ix, &ix->posicion_final, ix->entradas+ix->num_entradas,
+				capacidad-ix->num_entradas, maximo_anterior);
+	} while (ix->num_entradas==capacidad);
+	ix->fichero=0;
+	return 0;
+}
+
+/*
+ * Mapea el registro binario y su indice (fichero.idx), creando el indice o añadiendole los bloques
+ * completados desde la ultima vez. Si el indice es de otro registro (p.e. el registro se ha vuelto a
+ * crear) se rehace. Si no se puede escribir el fichero de indice se calcula en memoria.
+ * Devuelve -1 si el registro no es valido
+ */
+int ib_abre(const char *fichero, struct indice_bin *ix){
+	char ruta[4096];
+	struct cabecera_indice_bin cabecera;
+	struct entrada_indice_bin entradas[ENTRADAS_ESCRITURA_INDICE], ultima;
+	struct stat info;
+	size_t bloques, n, posicion, siguiente;
+	uint32_t maximo_anterior=0;
+	void *base;
+	int fd;
+
+	memset(ix, 0, sizeof(*ix));
+	if (rb_mapea(fichero, &ix->registro)){
+		return -1;
+	}
+	snprintf(ruta, sizeof(ruta), "%s.idx", fichero);
+	fd=open(ruta, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd<0){
+		return indice_en_memoria(ix);
+	}
+	fstat(fd, &info);
+	bloques=0;
+	posicion=0;
+	if (read(fd, &cabecera, sizeof(cabecera))==sizeof(cabecera) &&
+			memcmp(cabecera.magic, MAGIC_INDICE_BIN, sizeof(cabecera.magic))==0 &&
+			cabecera.version==VERSION_INDICE_BIN &&
+			cabecera.tamano_cabecera==sizeof(cabecera) &&
+			cabecera.tamano_entrada==sizeof(struct entrada_indice_bin) &&
+			cabecera.muestras_bloque==MUESTRAS_BLOQUE_INDICE &&
+			cabecera.creacion_registro==ix->registro.cabecera->creacion){
+		bloques=(info.st_size-sizeof(cabecera))/sizeof(struct entrada_indice_bin);
+	}
+	if (bloques>0){
+		// la ultima entrada tiene que seguir siendo un bloque completo del registro; si no, no es el indexado
+		if (pread(fd, &ultima, sizeof(ultima), sizeof(cabecera)+(bloques-1)*sizeof(ultima))==sizeof(ultima) &&
+				rb_lee_bloque(&ix->registro, ultima.posicion, NULL, &siguiente)==MUESTRAS_BLOQUE_INDICE &&
+				siguiente-ultima.posicion==ultima.longitud){
+			maximo_anterior=ultima.maximo_anterior;
+			posicion=siguiente;
+		}
+		else {
+			bloques=0;
+		}
+	}
+	if (bloques==0){
+		memset(&cabecera, 0, sizeof(cabecera));
+		memcpy(cabecera.magic, MAGIC_INDICE_BIN, sizeof(cabecera.magic));
+		cabecera.version=VERSION_INDICE_BIN;
+		cabecera.tamano_cabecera=sizeof(cabecera);
+		cabecera.tamano_entrada=sizeof(struct entrada_indice_bin);
+		cabecera.muestras_bloque=MUESTRAS_BLOQUE_INDICE;
+		cabecera.creacion_registro=ix->registro.cabecera->creacion;
+		if (ftruncate(fd, 0) || pwrite(fd, &cabecera, sizeof(cabecera), 0)!=sizeof(cabecera)){
+			close(fd);
+			return indice_en_memoria(ix);
+		}
+	}
+
+	// bloques completados desde la ultima vez (se descarta una entrada a medias)
+	while ((n=calcula_entradas(ix, &posicion, entradas, ENTRADAS_ESCRITURA_INDICE, maximo_anterior))>0){
+		maximo_anterior=entradas[n-1].maximo_anterior;
+		if (pwrite(fd, entradas, n*sizeof(entradas[0]), sizeof(cabecera)+bloques*sizeof(entradas[0]))!=(ssize_t)(n*sizeof(entradas[0]))){
+			close(fd);
+			return indice_en_memoria(ix);
+		}
+		bloques+=n;
+	}
+	if (ftruncate(fd, sizeof(cabecera)+bloques*sizeof(struct entrada_indice_bin))){
+		close(fd);
+		return indice_en_memoria(ix);
+	}
+
+	ix->tamano=sizeof(cabecera)+bloques*sizeof(struct entrada_indice_bin);
+	base=mmap(NULL, ix->tamano, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base==MAP_FAILED){
+		ix->tamano=0;
+		return indice_en_memoria(ix);
+	}
+	ix->entradas=(struct entrada_indice_bin *)((char *)base+sizeof(cabecera));
+	ix->num_entradas=bloques;
+	ix->posicion_final=posicion;
+	ix->fichero=1;
+	return 0;
+}
+
+void ib_cierra(struct indice_bin *ix){
+	if (ix->fichero){
+		munmap((char *)ix->entradas-sizeof(struct cabecera_indice_bin), ix->tamano);
+	}
+	else {
+		free(ix->entradas);
+	}
+	rb_desmapea(&ix->registro);
+	memset(ix, 0, sizeof(*ix));
+}
+
+static void suma_muestras(const struct muestra_bin *m, size_t n, time_t inicio, time_t fin, time_t cubeta,
+		struct agregado_indice *agregados){
+	struct agregado_indice *a;
+	size_t i;
+
+	for (i=0; i<n; i++){
+		if (m[i].instante<inicio || m[i].instante>=fin){
+			continue;
+		}
+		a=&agregados[(m[i].instante-inicio)/cubeta];
+		a->muestras++;
+		suma_muestra(a->campo, &m[i]);
+	}
+}
+
+/*
+ * Agrega las muestras con instante en [inicio, fin) en cubetas de cubeta segundos desde inicio
+ * (0: una sola cubeta). agregados debe tener sitio para todas las cubetas. Se recorre el registro
+ * desde el primer bloque que puede tener muestras del rango hasta el primero que empieza despues:
+ * las muestras fuera de orden de mas adelante (reloj atrasado al arrancar) no se cuentan.
+ * Devuelve el numero de cubetas o -1 si el rango no es valido
+ */
+int ib_consulta(struct indice_bin *ix, time_t inicio, time_t fin, time_t cubeta, struct agregado_indice *agregados){
+	static struct muestra_bin muestras[MUESTRAS_BLOQUE_INDICE];
+	const struct entrada_indice_bin *e;
+	size_t bajo, alto, medio, b, n, siguiente;
+	int cubetas, i;
+
+	if (fin<=inicio || cubeta<0){
+		return -1;
+	}
+	if (cubeta==0){
+		cubeta=fin-inicio;
+	}
+	cubetas=(fin-inicio+cubeta-1)/cubeta;
+	for (i=0; i<cubetas; i++){
+		agregados[i].muestras=0;
+		vacia_resumen(agregados[i].campo);
+	}
+	ix->bloques_resumidos=0;
+	ix->bloques_leidos=0;
+
+	// primer bloque cuyo maximo (o el de alguno anterior) llega al inicio: los anteriores quedan antes del rango
+	bajo=0;
+	alto=ix->num_entradas;
+	while (bajo<alto){
+		medio=bajo+(alto-bajo)/2;
+		if (ix->entradas[medio].maximo_anterior<inicio){
+			bajo=medio+1;
+		}
+		else {
+			alto=medio;
+		}
+	}
+	for (b=bajo; b<ix->num_entradas; b++){
+		e=&ix->entradas[b];
+		if (e->minimo>=fin){
+			return cubetas;
+		}
+		if (e->minimo>=inicio && e->maximo<fin && (e->minimo-inicio)/cubeta==(e->maximo-inicio)/cubeta){
+			// el bloque entero cae en una cubeta: basta su resumen
+			agregados[(e->minimo-inicio)/cubeta].muestras+=MUESTRAS_BLOQUE_INDICE;
+			suma_resumen(agregados[(e->minimo-inicio)/cubeta].campo, e->campo);
+			ix->bloques_resumidos++;
+		}
+		else if (e->maximo>=inicio){
+			n=rb_lee_bloque(&ix->registro, e->posicion, muestras, &siguiente);
+			suma_muestras(muestras, n, inicio, fin, cubeta, agregados);
+			ix->bloques_leidos++;
+		}
+	}
+	// muestras del ultimo bloque, todavia incompleto
+	n=rb_lee_bloque(&ix->registro, ix->posicion_final, muestras, &siguiente);
+	suma_muestras(muestras, n, inicio, fin, cubeta, agregados);
+	return cubetas;
+}
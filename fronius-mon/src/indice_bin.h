@@ -0,0 +1,103 @@
+/*
+ ============================================================================
+ Name        : indice_bin.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Indice disperso del registro binario de muestras, en un
+               fichero junto al registro (datosinversor.bin.idx), para
+               consultar cualquier rango de fechas sin recorrer años de
+               muestras.
+               Cada entrada resume un bloque del registro: donde empieza,
+               instantes primero, minimo y maximo, y suma, minimo y
+               maximo de cada campo.
+               Una consulta busca el primer bloque por busqueda binaria,
+               suma los resumenes de los bloques que caen enteros en una
+               cubeta y solo decodifica los bloques que cortan el
+               principio o el final de una cubeta.
+               El indice se pone al dia al abrirlo con los bloques que
+               se han completado desde la vez anterior.
+ ============================================================================
+ */
+
+#ifndef INDICE_BIN_H_
+#define INDICE_BIN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "registro_bin.h"
+
+#define MAGIC_INDICE_BIN   "FRMONIDX"
+#define VERSION_INDICE_BIN 1
+#define MUESTRAS_BLOQUE_INDICE MUESTRAS_BLOQUE_BIN // una entrada por bloque del registro
+
+enum campo_indice{
+	CI_GENERADA,      // potencia generada (W)
+	CI_IMPORTADA,     // potencia importada (W, negativa si se exporta)
+	CI_EXPORTADA,     // potencia exportada (W, 0 si se importa)
+	CI_LIMITE,        // limite de potencia (%)
+	CI_TENSION_DC,    // V
+	CI_CORRIENTE_DC,  // A
+	NUM_CAMPOS_INDICE
+};
+
+extern const char *nombres_campos_indice[NUM_CAMPOS_INDICE];
+
+/*
+ * Cabecera del fichero de indice (32 bytes)
+ */
+struct cabecera_indice_bin{
+	char magic[8];            // "FRMONIDX"
+	uint16_t version;         // VERSION_INDICE_BIN
+	uint16_t tamano_cabecera; // sizeof(struct cabecera_indice_bin)
+	uint16_t tamano_entrada;  // sizeof(struct entrada_indice_bin)
+	uint16_t muestras_bloque; // MUESTRAS_BLOQUE_INDICE
+	uint32_t creacion_registro; // creacion de la cabecera del registro indexado (detecta un registro nuevo)
+	uint8_t  relleno[12];
+};
+
+struct resumen_campo{
+	double suma;
+	float minimo;
+	float maximo;
+};
+
+/*
+ * Resumen de un bloque de muestras
+ */
+struct entrada_indice_bin{
+	uint32_t primero;         // instante de la primera muestra del bloque
+	uint32_t minimo;          // instante menor del bloque
+	uint32_t maximo;          // instante mayor del bloque
+	uint32_t maximo_anterior; // instante mayor de este bloque y todos los anteriores (no decrece: busqueda binaria)
+	uint64_t posicion;        // comienzo del bloque en el registro (bytes tras la cabecera)
+	uint32_t longitud;        // bytes del bloque
+	uint32_t relleno;
+	struct resumen_campo campo[NUM_CAMPOS_INDICE];
+};
+
+/*
+ * Agregado de una cubeta de una consulta
+ */
+struct agregado_indice{
+	uint64_t muestras;
+	struct resumen_campo campo[NUM_CAMPOS_INDICE];
+};
+
+struct indice_bin{
+	struct mapa_registro_bin registro;
+	struct entrada_indice_bin *entradas;
+	size_t num_entradas;
+	size_t posicion_final;    // comienzo del ultimo bloque del registro, todavia incompleto
+	int fichero;              // 1: entradas del fichero de indice; 0: indice en memoria (sin permiso de escritura)
+	size_t tamano;            // bytes mapeados del fichero de indice
+	unsigned long bloques_resumidos; // bloques de la ultima consulta sumados con su resumen
+	unsigned long bloques_leidos;    // bloques de la ultima consulta que se han decodificado
+};
+
+int ib_abre(const char *fichero, struct indice_bin *ix);
+void ib_cierra(struct indice_bin *ix);
+int ib_consulta(struct indice_bin *ix, time_t inicio, time_t fin, time_t cubeta, struct agregado_indice *agregados);
+
+#endif /* INDICE_BIN_H_ */
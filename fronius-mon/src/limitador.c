@@ -0,0 +1,133 @@
+/*
+ ============================================================================
+ Name        : limitador.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Regulador del limite de potencia para no exportar a red
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "limitador.h"
+
+#define INTEGRAL_MAXIMA 25.0f // antisaturacion: maximo valor absoluto del termino integral (%)
+#define HOLGURA_LIMITE  5.0f  // el limite actua si la potencia generada esta a menos de este % del limite
+
+void lm_inicia(struct limitador *lm, float potencia_nominal){
+	memset(lm, 0, sizeof(*lm));
+	lm->potencia_nominal=potencia_nominal;
+	lm->kp=0.1f;
+	lm->ki=0.05f;
+	lm->margen=50;
+	lm->subida=20;
+	lm->bajada=1000;
+	lm->banda=2;
+	lm->limite=100;
+}
+
+/*
+ * Vuelve al limite del 100% sin memoria del integral, p.e. tras reabrir el puerto
+ */
+void lm_reinicia(struct limitador *lm){
+	lm->integral=0;
+	lm->limite=100;
+}
+
+/*
+ * Ajusta los parametros a partir de la opcion -k, p.e. "kp=0.5,ki=0.2,up=10,band=3".
+ * Nombres: kp, ki, margin (W), up y down (%/s), band (%).
+ * Devuelve -1 si la opcion no es valida
+ */
+int lm_configura(struct limitador *lm, const char *opcion){
+	static const struct{
+		const char *nombre;
+		size_t desplazamiento;
+	} parametros[]={
+			{"kp",     offsetof(struct limitador, kp)},
+			{"ki",     offsetof(struct limitador, ki)},
+			{"margin", offsetof(struct limitador, margen)},
+			{"up",     offsetof(struct limitador, subida)},
+			{"down",   offsetof(struct limitador, bajada)},
+			{"band",   offsetof(struct limitador, banda)},
+	};
+	const char *p=opcion;
+	const char *igual;
+	char *fin;
+	float valor;
+	size_t i;
+
+	while (*p){
+		igual=strchr(p, '=');
+		if (igual==NULL){
+			return -1;
+		}
+		for (i=0; i<sizeof(parametros)/sizeof(parametros[0]); i++){
+			if (strlen(parametros[i].nombre)==(size_t)(igual-p) && strncmp(parametros[i].nombre, p, igual-p)==0){
+				break;
+			}
+		}
+		if (i==sizeof(parametros)/sizeof(parametros[0])){
+			return -1;
+		}
+		p=igual+1;
+		valor=strtof(p, &fin);
+		if (fin==p || valor<0){
+			return -1;
+		}
+		*(float *)((char *)lm+parametros[i].desplazamiento)=valor;
+		p=fin;
+		if (*p==',') p++;
+		else if (*p) return -1;
+	}
+	if (lm->subida<=0 || lm->bajada<=0){
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Calcula el limite (% de la potencia nominal) a partir de la potencia consumida y generada
+ * medidas en el ciclo; dt son los segundos desde el calculo anterior.
+ *
+ * El limite que hace que la generacion iguale al consumo menos el margen es la prealimentacion;
+ * el PI corrige lo que la generacion real se aparta de ella (rendimiento, errores de medida).
+ * El integral solo acumula mientras el limite esta actuando o hay exportacion y nunca en el sentido
+ * en que la salida ya esta saturada, de modo que no se carga mientras no hay sol.
+ * La subida y la bajada estan limitadas por las rampas. El limite solo cambia si el objetivo se
+ * aparta mas que la banda muerta, salvo para llegar al 100% o al minimo o para bajar exportando.
+ * Devuelve el limite a aplicar, igual al anterior si no hay que enviar nada
+ */
+int lm_calcula(struct limitador *lm, float consumo, float generada, float dt){
+	float error, objetivo, salida, maximo, minimo;
+	int nuevo;
+	int actuando;
+
+	error=(consumo-generada-lm->margen)*100/lm->potencia_nominal;
+	objetivo=(consumo-lm->margen)*100/lm->potencia_nominal+lm->kp*error+lm->integral;
+
+	actuando=generada*100/lm->potencia_nominal>=lm->limite-HOLGURA_LIMITE;
+	if ((actuando || error<0) && !(objetivo>=100 && error>0) && !(objetivo<=LIMITE_MINIMO && error<0)){
+		lm->integral+=lm->ki*error*dt;
+		lm->integral=lm->integral>INTEGRAL_MAXIMA?INTEGRAL_MAXIMA:lm->integral<-INTEGRAL_MAXIMA?-INTEGRAL_MAXIMA:lm->integral;
+	}
+
+	objetivo=objetivo>100?100:objetivo<LIMITE_MINIMO?LIMITE_MINIMO:objetivo;
+
+	maximo=lm->limite+lm->subida*dt;
+	minimo=lm->limite-lm->bajada*dt;
+	salida=objetivo>maximo?maximo:objetivo<minimo?minimo:objetivo;
+	nuevo=(int)(salida+0.5f);
+
+	if (nuevo==lm->limite){
+		return lm->limite;
+	}
+	if (objetivo-lm->limite>=lm->banda || lm->limite-objetivo>=lm->banda ||
+			nuevo==100 || nuevo==LIMITE_MINIMO || (generada>consumo && nuevo<lm->limite)){
+		lm->limite=nuevo;
+		lm->cambios++;
+	}
+	return lm->limite;
+}
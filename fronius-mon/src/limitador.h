@@ -0,0 +1,42 @@
+/*
+ ============================================================================
+ Name        : limitador.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Regulador del limite de potencia para no exportar a red.
+               Prealimentacion con la potencia consumida mas un PI sobre
+               la potencia importada, con antisaturacion, rampas de subida
+               y bajada y banda muerta: el limite solo cambia (y solo se
+               envia un 0x9F) cuando el cambio la supera.
+               No hace ninguna operacion de E/S, de modo que el mismo
+               codigo se usa en fronius-mon y en la reproduccion de trazas.
+ ============================================================================
+ */
+
+#ifndef LIMITADOR_H_
+#define LIMITADOR_H_
+
+#define LIMITE_MINIMO 10 // por debajo del 10% el inversor se para
+
+struct limitador{
+	// configuracion (opcion -k)
+	float potencia_nominal; // potencia nominal de todos los inversores limitados (W)
+	float kp;               // ganancia proporcional (% de limite por % de error)
+	float ki;               // ganancia integral (% de limite por % de error y segundo)
+	float margen;           // potencia importada que se procura mantener (W)
+	float subida;           // maxima subida del limite (%/s)
+	float bajada;           // maxima bajada del limite (%/s)
+	float banda;            // cambio minimo del limite para aplicarlo (%)
+
+	// estado
+	float integral;         // termino integral (%)
+	int limite;             // limite aplicado (% de la potencia nominal)
+	unsigned long cambios;  // veces que ha cambiado el limite aplicado
+};
+
+void lm_inicia(struct limitador *lm, float potencia_nominal);
+void lm_reinicia(struct limitador *lm);
+int lm_configura(struct limitador *lm, const char *opcion);
+int lm_calcula(struct limitador *lm, float consumo, float generada, float dt);
+
+#endif /* LIMITADOR_H_ */
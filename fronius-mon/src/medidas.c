@@ -0,0 +1,66 @@
+/*
+ ============================================================================
+ Name        : medidas.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Tabla de descriptores de los comandos de medida
+ ============================================================================
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "medidas.h"
+
+/*
+ * Potencias de 10 para los exponentes de los valores de medida (-3 .. 9)
+ */
+static const float potencias_10[]={1e-3f, 1e-2f, 1e-1f, 1.0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f};
+
+const struct descriptor_medida medidas[NUM_MEDIDAS]={
+		[MED_POTENCIA]        ={"power",        0x10, "W",  1.0f, decodifica_valor},
+		[MED_ENERGIA_TOTAL]   ={"energy_total", 0x11, "Wh", 1.0f, decodifica_valor},
+		[MED_ENERGIA_DIA]     ={"energy",       0x12, "Wh", 1.0f, decodifica_valor},
+		[MED_ENERGIA_ANUAL]   ={"energy_year",  0x13, "Wh", 1.0f, decodifica_valor},
+		[MED_CORRIENTE_AC]    ={"iac",          0x14, "A",  1.0f, decodifica_valor},
+		[MED_TENSION_AC]      ={"vac",          0x15, "V",  1.0f, decodifica_valor},
+		[MED_FRECUENCIA_AC]   ={"fac",          0x16, "Hz", 1.0f, decodifica_valor},
+		[MED_CORRIENTE_DC]    ={"dci",          0x17, "A",  1.0f, decodifica_valor},
+		[MED_TENSION_DC]      ={"dcv",          0x18, "V",  1.0f, decodifica_valor},
+		[MED_POTENCIA_MAX_DIA]={"pmax_day",     0x1A, "W",  1.0f, decodifica_valor},
+};
+
+/*
+ * Valor de medida de 3 bytes: msb, lsb y exponente decimal con signo.
+ * De noche el inversor se despierta unos segundos y responde pero con longitud de datos = 0
+ * (por ejemplo: 128128128 0 1 1 16  18), por lo que se comprueba la longitud antes de decodificar.
+ * Devuelve -1 si la longitud no es la esperada
+ */
+int decodifica_valor(const unsigned char *datos, int longitud, float *valor){
+	signed char exp;
+
+	if (longitud!=3){
+		return -1;
+	}
+	exp=(signed char)datos[2];
+	if (exp>=-3 && exp<=9){
+		*valor=(256*datos[0]+datos[1])*potencias_10[exp+3];
+	}
+	else {
+		*valor=(256*datos[0]+datos[1])*powf(10, exp);
+	}
+	return 0;
+}
+
+/*
+ * Indice de la medida con el nombre indicado (los longitud primeros caracteres) o -1 si no existe
+ */
+int busca_medida(const char *nombre, int longitud){
+	int m;
+	for (m=0; m<NUM_MEDIDAS; m++){
+		if ((int)strlen(medidas[m].nombre)==longitud && strncmp(medidas[m].nombre, nombre, longitud)==0){
+			return m;
+		}
+	}
+	return -1;
+}
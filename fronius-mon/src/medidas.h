@@ -0,0 +1,42 @@
+/*
+ ============================================================================
+ Name        : medidas.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Tabla de descriptores de los comandos de medida del
+               Fronius Interface Protocol ("get value"). Añadir una
+               medida consiste en añadir una fila a la tabla.
+ ============================================================================
+ */
+
+#ifndef MEDIDAS_H_
+#define MEDIDAS_H_
+
+enum medida{
+	MED_POTENCIA,
+	MED_ENERGIA_TOTAL,
+	MED_ENERGIA_DIA,
+	MED_ENERGIA_ANUAL,
+	MED_CORRIENTE_AC,
+	MED_TENSION_AC,
+	MED_FRECUENCIA_AC,
+	MED_CORRIENTE_DC,
+	MED_TENSION_DC,
+	MED_POTENCIA_MAX_DIA,
+	NUM_MEDIDAS
+};
+
+struct descriptor_medida{
+	const char *nombre;     // nombre en opciones y presentacion
+	unsigned char comando;  // codigo de comando
+	const char *unidad;
+	float escala;           // factor que se aplica al valor decodificado
+	int (*decodifica)(const unsigned char *datos, int longitud, float *valor);
+};
+
+extern const struct descriptor_medida medidas[NUM_MEDIDAS];
+
+int decodifica_valor(const unsigned char *datos, int longitud, float *valor);
+int busca_medida(const char *nombre, int longitud);
+
+#endif /* MEDIDAS_H_ */
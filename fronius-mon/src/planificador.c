@@ -0,0 +1,213 @@
+/*
+ ============================================================================
+ Name        : planificador.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Planificador de las consultas de telemetria
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "planificador.h"
+
+#define RTT_INICIAL_MS 30.0 // estimacion inicial del tiempo de ida y vuelta de una consulta
+#define PESO_RTT       0.2  // peso de cada nueva medida en la media movil
+
+static const struct metrica_planificada metricas_por_defecto[NUM_MEDIDAS]={
+		[MED_ENERGIA_DIA] ={5,  1},
+		[MED_TENSION_DC]  ={10, 2},
+		[MED_CORRIENTE_DC]={10, 2},
+};
+
+void pl_inicia(struct planificador *pl, int num_inversores, int presupuesto_ms){
+	int m;
+
+	memset(pl, 0, sizeof(*pl));
+	memcpy(pl->metrica, metricas_por_defecto, sizeof(pl->metrica));
+	pl->num_inversores=num_inversores;
+	pl->presupuesto_ms=presupuesto_ms;
+	for (m=0; m<NUM_MEDIDAS; m++){
+		pl->rtt_ms[m]=RTT_INICIAL_MS;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &pl->inicio_ciclo);
+}
+
+/*
+ * Ajusta periodo y prioridad a partir de la opcion -m, p.e. "energy=60,dcv=5:3,vac=30".
+ * Un periodo 0 deja de consultar la medida. La potencia no se planifica: se lee en todos los ciclos.
+ * Devuelve -1 si la opcion no es valida
+ */
+int pl_configura(struct planificador *pl, const char *opcion){
+	const char *p=opcion;
+	const char *igual;
+	char *fin;
+	int m;
+
+	while (*p){
+		igual=strchr(p, '=');
+		if (igual==NULL){
+			return -1;
+		}
+		m=busca_medida(p, igual-p);
+		if (m==-1 || m==MED_POTENCIA){
+			return -1;
+		}
+		p=igual+1;
+		pl->metrica[m].periodo=strtol(p, &fin, 10);
+		if (fin==p || pl->metrica[m].periodo<0){
+			return -1;
+		}
+		p=fin;
+		if (*p==':'){
+			p++;
+			pl->metrica[m].prioridad=strtol(p, &fin, 10);
+			if (fin==p || pl->metrica[m].prioridad<0){
+				return -1;
+			}
+			p=fin;
+		}
+		if (*p==',') p++;
+		else if (*p) return -1;
+	}
+	return 0;
+}
+
+/*
+ * Milisegundos transcurridos desde el inicio del ciclo
+ */
+int pl_ms_ciclo(const struct planificador *pl){
+	struct timespec ahora;
+	clock_gettime(CLOCK_MONOTONIC, &ahora);
+	return (ahora.tv_sec-pl->inicio_ciclo.tv_sec)*1000+(ahora.tv_nsec-pl->inicio_ciclo.tv_nsec)/1000000;
+}
+
+/*
+ * Se llama al comienzo de cada ciclo de un segundo, antes de las consultas obligatorias
+ */
+void pl_nuevo_ciclo(struct planificador *pl){
+	pl->ciclo++;
+	clock_gettime(CLOCK_MONOTONIC, &pl->inicio_ciclo);
+	memset(pl->encargada, 0, sizeof(pl->encargada));
+	pl->encargadas_ms=0;
+}
+
+/*
+ * Obliga a consultar una metrica de todos los inversores en el ciclo actual
+ */
+void pl_fuerza(struct planificador *pl, enum medida m){
+	int i;
+	for (i=0; i<pl->num_inversores; i++){
+		pl->forzada[i][m]=1;
+	}
+}
+
+/*
+ * Elige la siguiente consulta del ciclo entre los inversores de la mascara: primero las forzadas,
+ * despues las vencidas de mayor prioridad y, a igual prioridad, la mas atrasada.
+ * Las no forzadas solo se eligen si su tiempo de ida y vuelta estimado cabe en lo que queda de presupuesto.
+ * Devuelve 1 si hay consulta o 0 si no queda ninguna para este ciclo
+ */
+int pl_siguiente(struct planificador *pl, unsigned int mascara, int *inversor, enum medida *m){
+	int i, k;
+	int elegido_i=-1, elegido_m=-1;
+	int restante;
+
+	restante=pl->presupuesto_ms-pl_ms_ciclo(pl)-pl->encargadas_ms;
+	for (i=0; i<pl->num_inversores; i++){
+		if ((mascara & (1u<<i))==0){
+			continue;
+		}
+		for (k=0; k<NUM_MEDIDAS; k++){
+			if (pl->encargada[i][k]){
+				continue;
+			}
+			if (pl->forzada[i][k]){
+				*inversor=i;
+				*m=k;
+				return 1;
+			}
+			if (pl->metrica[k].periodo==0 || pl->proxima[i][k]>pl->ciclo || pl->rtt_ms[k]>restante){
+				continue;
+			}
+			if (elegido_i==-1 ||
+					pl->metrica[k].prioridad<pl->metrica[elegido_m].prioridad ||
+					(pl->metrica[k].prioridad==pl->metrica[elegido_m].prioridad && pl->proxima[i][k]<pl->proxima[elegido_i][elegido_m])){
+				elegido_i=i;
+				elegido_m=k;
+			}
+		}
+	}
+	if (elegido_i==-1){
+		return 0;
+	}
+	*inversor=elegido_i;
+	*m=elegido_m;
+	return 1;
+}
+
+/*
+ * Anota que la consulta elegida se ha encargado al hilo del bus: no se vuelve a elegir y su tiempo
+ * estimado se descuenta del presupuesto hasta que se registra su resultado
+ */
+void pl_encarga(struct planificador *pl, int inversor, enum medida m){
+	pl->encargada[inversor][m]=1;
+	pl->encargadas_ms+=pl->rtt_ms[m];
+}
+
+/*
+ * Libera una consulta encargada
+ */
+static void termina_encargo(struct planificador *pl, int inversor, enum medida m){
+	if (pl->encargada[inversor][m]){
+		pl->encargada[inversor][m]=0;
+		pl->encargadas_ms-=pl->rtt_ms[m];
+		if (pl->encargadas_ms<0){
+			pl->encargadas_ms=0;
+		}
+	}
+}
+
+/*
+ * Registra el resultado de una consulta. Si ha ido bien se programa la siguiente segun el periodo
+ * de la metrica y se actualiza la estimacion del tiempo de ida y vuelta; si no, se reintenta en el siguiente ciclo
+ */
+void pl_registra(struct planificador *pl, int inversor, enum medida m, int ok, double rtt_ms){
+	termina_encargo(pl, inversor, m);
+	pl->forzada[inversor][m]=0;
+	if (ok){
+		pl->rtt_ms[m]=(1-PESO_RTT)*pl->rtt_ms[m]+PESO_RTT*rtt_ms;
+		pl->proxima[inversor][m]=pl->ciclo+pl->metrica[m].periodo;
+	}
+	else {
+		pl->proxima[inversor][m]=pl->ciclo+1;
+	}
+}
+
+/*
+ * Devuelve una consulta encargada que el hilo del bus no ha hecho (plazo vencido): sigue pendiente,
+ * y forzada si lo estaba, y cuenta como omitida al cerrar el ciclo si no se vuelve a elegir
+ */
+void pl_descarta(struct planificador *pl, int inversor, enum medida m){
+	termina_encargo(pl, inversor, m);
+}
+
+/*
+ * Cierra el ciclo contando las consultas vencidas que no han cabido (pasan al siguiente ciclo).
+ * Devuelve el numero de consultas omitidas en este ciclo
+ */
+unsigned long pl_fin_ciclo(struct planificador *pl){
+	int i, k;
+	unsigned long omitidas=0;
+
+	for (i=0; i<pl->num_inversores; i++){
+		for (k=0; k<NUM_MEDIDAS; k++){
+			if ((pl->metrica[k].periodo && pl->proxima[i][k]<=pl->ciclo) || pl->forzada[i][k]){
+				pl->omitidas[k]++;
+				omitidas++;
+			}
+		}
+	}
+	return omitidas;
+}
@@ -0,0 +1,59 @@
+/*
+ ============================================================================
+ Name        : planificador.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Planificador de las consultas de telemetria de cada ciclo
+               de un segundo. Cada metrica tiene su periodo y prioridad y
+               solo se consulta si cabe en el tiempo de bus que queda en
+               el ciclo segun el tiempo de ida y vuelta medido.
+               Las consultas elegidas se pueden encargar todas a la vez
+               al hilo del bus: cuentan en el presupuesto hasta que llega
+               su resultado.
+ ============================================================================
+ */
+
+#ifndef PLANIFICADOR_H_
+#define PLANIFICADOR_H_
+
+#include <time.h>
+
+#include "publicacion.h"
+#include "medidas.h"
+
+#define PRESUPUESTO_CICLO_MS 800 // tiempo de bus por ciclo que se puede ocupar por defecto
+
+/*
+ * Planificacion de cada medida de telemetria (la potencia y el limite se atienden en todos los ciclos)
+ */
+struct metrica_planificada{
+	int periodo;        // ciclos (segundos) entre consultas. 0: no se consulta
+	int prioridad;      // 0 es la mas alta
+};
+
+struct planificador{
+	struct metrica_planificada metrica[NUM_MEDIDAS];
+	int num_inversores;
+	int presupuesto_ms;                             // tiempo de bus disponible en cada ciclo
+	unsigned long ciclo;                            // ciclo actual
+	struct timespec inicio_ciclo;
+	double rtt_ms[NUM_MEDIDAS];                     // media movil del tiempo de ida y vuelta de cada medida
+	unsigned long proxima[MAX_INVERSORES][NUM_MEDIDAS]; // ciclo en que vence la proxima consulta
+	unsigned char forzada[MAX_INVERSORES][NUM_MEDIDAS]; // consulta a realizar en este ciclo aunque no quepa
+	unsigned char encargada[MAX_INVERSORES][NUM_MEDIDAS]; // consulta encargada al hilo del bus (bus.h) sin resultado todavia
+	double encargadas_ms;                           // tiempo de ida y vuelta estimado de las encargadas
+	unsigned long omitidas[NUM_MEDIDAS];            // consultas vencidas que no han cabido en su ciclo
+};
+
+void pl_inicia(struct planificador *pl, int num_inversores, int presupuesto_ms);
+int pl_configura(struct planificador *pl, const char *opcion);
+void pl_nuevo_ciclo(struct planificador *pl);
+void pl_fuerza(struct planificador *pl, enum medida m);
+int pl_siguiente(struct planificador *pl, unsigned int mascara, int *inversor, enum medida *m);
+void pl_encarga(struct planificador *pl, int inversor, enum medida m);
+void pl_registra(struct planificador *pl, int inversor, enum medida m, int ok, double rtt_ms);
+void pl_descarta(struct planificador *pl, int inversor, enum medida m);
+unsigned long pl_fin_ciclo(struct planificador *pl);
+int pl_ms_ciclo(const struct planificador *pl);
+
+#endif /* PLANIFICADOR_H_ */
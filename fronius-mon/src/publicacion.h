@@ -0,0 +1,158 @@
+/*
+ ============================================================================
+ Name        : publicacion.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Datos que fronius-mon publica en memoria compartida
+               ademas de los de struct datos_publicados (registro.h),
+               para los procesos de visualizacion y analisis.
+               Se publican como instantanea completa de cada ciclo
+               protegida por un numero de secuencia (seqlock): el
+               escritor nunca espera y los lectores obtienen siempre
+               una copia coherente.
+ ============================================================================
+ */
+
+#ifndef PUBLICACION_H_
+#define PUBLICACION_H_
+
+#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "registro.h"
+#include "medidas.h"
+#include "agregador.h"
+
+#define SHM_KEY_DATOS_INVERSORES 0x00465231 // area de datos por inversor
+
+#define INTERVALOS_DIA 96 // cuartos de hora del registro diario
+
+#define MAX_INVERSORES 16 // maximo numero de inversores en la misma red RS422
+
+/*
+ * Ultimos valores leidos de cada inversor
+ */
+struct datos_inversor{
+	unsigned char numero;        // numero del inversor en la red RS422
+	unsigned char caps;          // capacidades (comando 0xBD). Bit 0: admite limitacion de potencia
+	unsigned char identificado;  // version y capacidades leidas (no se vuelven a leer al reabrir el puerto)
+	unsigned char estado;        // enum estado_inversor (estado_inversor.h): produciendo, despertando, reposo o desconectado
+	int valido;                  // 1 si las lecturas del ultimo ciclo son correctas
+	int lim_pot;                 // limite aplicado (porcentaje de la potencia nominal)
+	time_t instante;             // momento de la ultima lectura correcta
+	float medida[NUM_MEDIDAS];   // ultimo valor leido de cada medida, en la unidad de su descriptor (medidas.h). Antiguo si no es valido
+};
+
+/*
+ * Instantanea de cada ciclo
+ */
+struct datos_inversores{
+	time_t instante;                  // momento del ciclo
+	float potencia_consumo;           // potencia consumida leida en el ciclo (la escribe el medidor en datos_publicados)
+	int lim_pot;                      // limite comun aplicado (porcentaje de la potencia nominal)
+	int lim_reparto;                  // limite enviado a los inversores limitables tras el reparto (porcentaje de la nominal de cada uno)
+	unsigned long tramas_limite;      // tramas 0x9F enviadas por el limitador (una por cambio para todos los inversores)
+	int num_inversores;
+	float potencia_generada_total;    // suma de la potencia de los inversores (igual que datos_publicados->potencia_generada)
+	float energia_generada_dia_total; // suma de la energia del dia de los inversores
+	int ciclo_ms;                     // duracion del ultimo ciclo de consultas
+	unsigned long ciclos;             // ciclos de consultas realizados
+	unsigned long ciclos_excedidos;   // ciclos que no han cabido en el segundo
+	unsigned long consultas_omitidas; // consultas de telemetria aplazadas por no caber en el presupuesto del ciclo
+	unsigned long avisos;             // avisos de consumo recibidos del medidor (opcion -n)
+	unsigned long avisos_exportacion; // avisos con exportacion que han requerido bajar el limite
+	float retardo_aviso_ms;           // del ultimo aviso con exportacion al 0x9F en la linea
+	float retardo_aviso_max_ms;
+	double retardo_aviso_total_ms;    // suma de los retardos, para la media
+	unsigned long limites_transmitidos; // tramas 0x9F enviadas por el hilo del bus
+	float retardo_limite_ms;          // de la ultima decision del limite al final de su 0x9F en la linea
+	float retardo_limite_max_ms;
+	double retardo_limite_total_ms;   // suma de los retardos, para la media
+	unsigned long ordenes_bus;        // ordenes hechas por el hilo del bus
+	unsigned long ordenes_vencidas;   // ordenes devueltas sin hacer (plazo vencido o inversor que no responde)
+	unsigned long ordenes_adelantadas; // ordenes servidas antes que otras de menor prioridad que esperaban
+	unsigned long escritura_descartes;     // escrituras perdidas por cola del hilo escritor llena
+	unsigned long escritura_max_pendientes; // maximo de escrituras en la cola del hilo escritor
+	unsigned long escritura_errores;       // escrituras fallidas en el hilo escritor
+	float escritura_max_ms;                // lote mas lento del hilo escritor
+	unsigned long recuperaciones;     // inversores que han vuelto a responder tras un fallo
+	unsigned long caidas;             // faltas de respuesta de mas de RECUPERACION_MAXIMA_MS
+	float recuperacion_ms;            // del primer fallo a la primera lectura correcta, la ultima
+	float recuperacion_max_ms;
+	double recuperacion_total_ms;     // suma, para la media
+	int num_ventanas;                 // ventanas de estadisticas (opcion -w)
+	struct resumen_ventana ventana_en_curso[MAX_VENTANAS]; // estadisticas de la ventana en curso (percentiles del minuto anterior)
+	struct resumen_ventana ventana_cerrada[MAX_VENTANAS];  // estadisticas de la ultima ventana completa
+	struct datos_inversor inversor[MAX_INVERSORES];
+	struct entradaregistrodiario entradaregistrodiario[INTERVALOS_DIA]; // copia del registro diario de datos_publicados
+};
+
+/*
+ * Area de memoria compartida SHM_KEY_DATOS_INVERSORES.
+ * secuencia es impar mientras el escritor copia una nueva instantanea; secuencia/2 es la generacion
+ */
+struct publicacion{
+	uint32_t secuencia;
+	uint32_t reservado;
+	struct datos_inversores datos;
+};
+
+#define REINTENTOS_LECTURA_PUBLICACION 1000
+
+/*
+ * Publica una nueva instantanea. Solo hay un escritor (fronius-mon) y nunca espera a los lectores
+ */
+static inline void pub_escribe(struct publicacion *pub, const struct datos_inversores *datos){
+	uint32_t secuencia=pub->secuencia;
+
+	__atomic_store_n(&pub->secuencia, secuencia+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&pub->datos, datos, sizeof(*datos));
+	__atomic_store_n(&pub->secuencia, secuencia+2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Obtiene una copia coherente de la ultima instantanea sin bloquear al escritor.
+ * Devuelve la generacion de la instantanea (0 si todavia no se ha publicado ninguna)
+ * o -1 si no ha sido posible tras REINTENTOS_LECTURA_PUBLICACION intentos
+ */
+static inline long pub_lee(const struct publicacion *pub, struct datos_inversores *copia){
+	uint32_t antes, despues;
+	int intentos;
+
+	for (intentos=0; intentos<REINTENTOS_LECTURA_PUBLICACION; intentos++){
+		antes=__atomic_load_n(&pub->secuencia, __ATOMIC_ACQUIRE);
+		if (antes & 1){
+			sched_yield(); // el escritor esta copiando
+			continue;
+		}
+		memcpy(copia, &pub->datos, sizeof(*copia));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		despues=__atomic_load_n(&pub->secuencia, __ATOMIC_RELAXED);
+		if (antes==despues){
+			return antes/2;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Conecta en modo solo lectura con el area publicada por fronius-mon. Devuelve NULL si no existe
+ */
+static inline const struct publicacion *pub_conecta(void){
+	int shmid;
+	void *area;
+
+	shmid=shmget(SHM_KEY_DATOS_INVERSORES, 0, 0);
+	if (shmid==-1){
+		return NULL;
+	}
+	area=shmat(shmid, NULL, SHM_RDONLY);
+	return area==(void *)-1?NULL:(const struct publicacion *)area;
+}
+
+#endif /* PUBLICACION_H_ */
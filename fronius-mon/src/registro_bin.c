@@ -0,0 +1,378 @@
+/*
+ ============================================================================
+ Name        : registro_bin.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Escritura y lectura del registro binario de muestras
+ ============================================================================
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "registro_bin.h"
+
+#define MUESTRAS_ESCRITURA_BIN 64 // muestras que se codifican y escriben de una vez
+
+static inline uint32_t zigzag(int32_t v){
+	return ((uint32_t)v<<1)^(uint32_t)(v>>31);
+}
+
+static inline int32_t deszigzag(uint32_t v){
+	return (int32_t)(v>>1)^-(int32_t)(v&1);
+}
+
+static inline unsigned char *pon_varint(unsigned char *p, uint32_t v){
+	while (v>=0x80){
+		*p++=(unsigned char)(v|0x80);
+		v>>=7;
+	}
+	*p++=(unsigned char)v;
+	return p;
+}
+
+static inline int32_t consumo(const struct muestra_bin *m){
+	return (int32_t)m->potencia_generada+m->potencia_importada;
+}
+
+/*
+ * Lee en *diferencia un varint zigzag. Devuelve -1 si se sale de los datos o tiene mas de 5 bytes
+ */
+static inline int lee_diferencia(const unsigned char *datos, size_t longitud, size_t *posicion, int32_t *diferencia){
+	uint32_t v=0;
+	int desplazamiento;
+
+	for (desplazamiento=0; desplazamiento<35 && *posicion<longitud; desplazamiento+=7){
+		v|=(uint32_t)(datos[*posicion]&0x7F)<<desplazamiento;
+		if (!(datos[(*posicion)++]&0x80)){
+			*diferencia=deszigzag(v);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Decodifica la muestra que empieza en *posicion respecto a la anterior y avanza *posicion.
+ * Devuelve -1, sin avanzar, si la muestra esta incompleta
+ */
+static int decodifica(const unsigned char *datos, size_t longitud, size_t *posicion, const struct muestra_bin *anterior,
+		struct muestra_bin *m){
+	size_t p=*posicion;
+	unsigned char control;
+	int32_t d;
+
+	if (p>=longitud){
+		return -1;
+	}
+	control=datos[p++];
+	*m=*anterior;
+	m->instante++;
+	if (control & CAMBIA_INSTANTE){
+		if (lee_diferencia(datos, longitud, &p, &d)){
+			return -1;
+		}
+		m->instante=anterior->instante+(uint32_t)d;
+	}
+	if (control & CAMBIA_ENERGIA){
+		if (lee_diferencia(datos, longitud, &p, &d)){
+			return -1;
+		}
+		m->energia_dia=anterior->energia_dia+(uint32_t)d;
+	}
+	if (control & CAMBIA_GENERADA){
+		if (lee_diferencia(datos, longitud, &p, &d)){
+			return -1;
+		}
+		m->potencia_generada=(uint16_t)(anterior->potencia_generada+d);
+	}
+	d=0;
+	if ((control & CAMBIA_CONSUMO) && lee_diferencia(datos, longitud, &p, &d)){
+		return -1;
+	}
+	m->potencia_importada=(int16_t)(consumo(anterior)+d-m->potencia_generada);
+	if (control & CAMBIA_TENSION){
+		if (lee_diferencia(datos, longitud, &p, &d)){
+			return -1;
+		}
+		m->tension_dc=(uint16_t)(anterior->tension_dc+d);
+	}
+	if (control & CAMBIA_CORRIENTE){
+		if (lee_diferencia(datos, longitud, &p, &d)){
+			return -1;
+		}
+		m->corriente_dc=(uint16_t)(anterior->corriente_dc+d);
+	}
+	if (control & CAMBIA_LIMITE){
+		if (p>=longitud){
+			return -1;
+		}
+		m->limite=datos[p++];
+	}
+	if (control & CAMBIA_ESTADO){
+		if (p>=longitud){
+			return -1;
+		}
+		m->estado=datos[p++];
+	}
+	*posicion=p;
+	return 0;
+}
+
+/*
+ * Decodifica el bloque que empieza en posicion. muestras (puede ser NULL) debe tener sitio para
+ * MUESTRAS_BLOQUE_BIN; en *ultima (puede ser NULL) queda la ultima muestra decodificada y en
+ * *siguiente la posicion tras ella. Devuelve el numero de muestras: menos de MUESTRAS_BLOQUE_BIN
+ * si el bloque es el ultimo, todavia incompleto, y 0 si en posicion no empieza un bloque
+ */
+static size_t lee_bloque(const unsigned char *datos, size_t longitud, size_t posicion, struct muestra_bin *muestras,
+		struct muestra_bin *ultima, size_t *siguiente){
+	struct muestra_bin anterior, m;
+	size_t n;
+
+	*siguiente=posicion;
+	if (posicion>longitud || longitud-posicion<sizeof(anterior)){
+		return 0;
+	}
+	memcpy(&anterior, datos+posicion, sizeof(anterior));
+	if (anterior.reservado!=MARCA_BLOQUE_BIN){
+		return 0;
+	}
+	anterior.reservado=0;
+	*siguiente=posicion+sizeof(anterior);
+	if (muestras){
+		muestras[0]=anterior;
+	}
+	for (n=1; n<MUESTRAS_BLOQUE_BIN && decodifica(datos, longitud, siguiente, &anterior, &m)==0; n++){
+		if (muestras){
+			muestras[n]=m;
+		}
+		anterior=m;
+	}
+	if (ultima){
+		*ultima=anterior;
+	}
+	return n;
+}
+
+static int cabecera_valida(const struct cabecera_registro_bin *cabecera, size_t tamano){
+	return memcmp(cabecera->magic, MAGIC_REGISTRO_BIN, sizeof(cabecera->magic))==0 &&
+			cabecera->version==VERSION_REGISTRO_BIN &&
+			cabecera->tamano_cabecera>=sizeof(struct cabecera_registro_bin) &&
+			cabecera->tamano_cabecera<=tamano &&
+			cabecera->tamano_muestra==sizeof(struct muestra_bin) &&
+			cabecera->muestras_bloque==MUESTRAS_BLOQUE_BIN;
+}
+
+/*
+ * Abre para añadir muestras el fichero de registro binario, creandolo con su cabecera si esta vacio.
+ * Recorre los bloques hasta el ultimo para dejar en *codificador la ultima muestra escrita. Si la
+ * ultima muestra quedo a medias (p.e. por un corte de alimentacion) se recorta el fichero
+ * hasta la ultima muestra completa. Devuelve el descriptor o -1 si el fichero no es valido
+ */
+int rb_abre(const char *fichero, struct codificador_registro_bin *codificador){
+	int fd;
+	struct stat info;
+	struct cabecera_registro_bin cabecera;
+	const unsigned char *base;
+	size_t longitud, posicion, fin, n;
+
+	memset(codificador, 0, sizeof(*codificador));
+	fd=open(fichero, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd<0){
+		return -1;
+	}
+	fstat(fd, &info);
+	if (info.st_size==0){
+		memset(&cabecera, 0, sizeof(cabecera));
+		memcpy(cabecera.magic, MAGIC_REGISTRO_BIN, sizeof(cabecera.magic));
+		cabecera.version=VERSION_REGISTRO_BIN;
+		cabecera.tamano_cabecera=sizeof(struct cabecera_registro_bin);
+		cabecera.tamano_muestra=sizeof(struct muestra_bin);
+		cabecera.muestras_bloque=MUESTRAS_BLOQUE_BIN;
+		cabecera.creacion=(uint32_t)time(NULL);
+		if (write(fd, &cabecera, sizeof(cabecera))!=sizeof(cabecera)){
+			close(fd);
+			return -1;
+		}
+	}
+	else {
+		if (read(fd, &cabecera, sizeof(cabecera))!=sizeof(cabecera) || !cabecera_valida(&cabecera, info.st_size)){
+			close(fd);
+			return -1;
+		}
+		base=mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (base==MAP_FAILED){
+			close(fd);
+			return -1;
+		}
+		longitud=info.st_size-cabecera.tamano_cabecera;
+		posicion=fin=n=0;
+		while (posicion<longitud){
+			n=lee_bloque(base+cabecera.tamano_cabecera, longitud, posicion, NULL, &codificador->anterior, &fin);
+			if (n<MUESTRAS_BLOQUE_BIN){
+				break;
+			}
+			posicion=fin;
+		}
+		munmap((void *)base, info.st_size);
+		codificador->en_bloque=n%MUESTRAS_BLOQUE_BIN;
+		if (fin<longitud){
+			ftruncate(fd, cabecera.tamano_cabecera+fin);
+		}
+	}
+	lseek(fd, 0, SEEK_END);
+	return fd;
+}
+
+/*
+ * Codifica la muestra en salida (sitio para MAX_BYTES_MUESTRA_BIN) respecto a la anterior, o
+ * completa si abre bloque. Devuelve los bytes escritos en salida
+ */
+size_t rb_codifica(struct codificador_registro_bin *codificador, const struct muestra_bin *muestra, unsigned char *salida){
+	const struct muestra_bin *a=&codificador->anterior;
+	struct muestra_bin primera;
+	unsigned char *p=salida+1;
+	unsigned char control=0;
+
+	if (codificador->en_bloque==0){
+		primera=*muestra;
+		primera.reservado=MARCA_BLOQUE_BIN;
+		memcpy(salida, &primera, sizeof(primera));
+		p=salida+sizeof(primera);
+	}
+	else {
+		if (muestra->instante!=a->instante+1){
+			control|=CAMBIA_INSTANTE;
+			p=pon_varint(p, zigzag((int32_t)(muestra->instante-a->instante)));
+		}
+		if (muestra->energia_dia!=a->energia_dia){
+			control|=CAMBIA_ENERGIA;
+			p=pon_varint(p, zigzag((int32_t)(muestra->energia_dia-a->energia_dia)));
+		}
+		if (muestra->potencia_generada!=a->potencia_generada){
+			control|=CAMBIA_GENERADA;
+			p=pon_varint(p, zigzag((int32_t)muestra->potencia_generada-a->potencia_generada));
+		}
+		if (consumo(muestra)!=consumo(a)){
+			control|=CAMBIA_CONSUMO;
+			p=pon_varint(p, zigzag(consumo(muestra)-consumo(a)));
+		}
+		if (muestra->tension_dc!=a->tension_dc){
+			control|=CAMBIA_TENSION;
+			p=pon_varint(p, zigzag((int32_t)muestra->tension_dc-a->tension_dc));
+		}
+		if (muestra->corriente_dc!=a->corriente_dc){
+			control|=CAMBIA_CORRIENTE;
+			p=pon_varint(p, zigzag((int32_t)muestra->corriente_dc-a->corriente_dc));
+		}
+		if (muestra->limite!=a->limite){
+			control|=CAMBIA_LIMITE;
+			*p++=muestra->limite;
+		}
+		if (muestra->estado!=a->estado){
+			control|=CAMBIA_ESTADO;
+			*p++=muestra->estado;
+		}
+		salida[0]=control;
+	}
+	codificador->anterior=*muestra;
+	codificador->anterior.reservado=0;
+	codificador->en_bloque=(codificador->en_bloque+1)%MUESTRAS_BLOQUE_BIN;
+	return p-salida;
+}
+
+/*
+ * Añade n muestras al final del fichero. Si la escritura falla se recorta lo que haya llegado a
+ * escribirse y el codificador vuelve a su estado anterior, para que las muestras siguientes no
+ * se codifiquen respecto a muestras perdidas. Devuelve -1 si falla
+ */
+int rb_escribe(int fd, struct codificador_registro_bin *codificador, const struct muestra_bin *muestras, size_t n){
+	unsigned char bufer[MUESTRAS_ESCRITURA_BIN*MAX_BYTES_MUESTRA_BIN];
+	struct codificador_registro_bin copia;
+	size_t i, longitud, escritos;
+	off_t inicio;
+	ssize_t rc;
+
+	while (n>0){
+		copia=*codificador;
+		inicio=lseek(fd, 0, SEEK_CUR);
+		for (i=0, longitud=0; i<n && i<MUESTRAS_ESCRITURA_BIN; i++){
+			longitud+=rb_codifica(codificador, &muestras[i], bufer+longitud);
+		}
+		muestras+=i;
+		n-=i;
+		for (escritos=0; escritos<longitud; escritos+=rc){
+			rc=write(fd, bufer+escritos, longitud-escritos);
+			if (rc<0 && errno==EINTR){
+				rc=0;
+			}
+			else if (rc<0){
+				*codificador=copia;
+				if (escritos && inicio>=0 && ftruncate(fd, inicio)==0){
+					lseek(fd, inicio, SEEK_SET);
+				}
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Mapea en memoria para lectura un fichero de registro binario. Las muestras se leen bloque a
+ * bloque con rb_lee_bloque()
+ */
+int rb_mapea(const char *fichero, struct mapa_registro_bin *mapa){
+	int fd;
+	struct stat info;
+	void *base;
+
+	memset(mapa, 0, sizeof(*mapa));
+	fd=open(fichero, O_RDONLY);
+	if (fd<0){
+		return -1;
+	}
+	fstat(fd, &info);
+	if ((size_t)info.st_size<sizeof(struct cabecera_registro_bin)){
+		close(fd);
+		return -1;
+	}
+	base=mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base==MAP_FAILED){
+		return -1;
+	}
+	mapa->cabecera=base;
+	if (!cabecera_valida(mapa->cabecera, info.st_size)){
+		munmap(base, info.st_size);
+		memset(mapa, 0, sizeof(*mapa));
+		return -1;
+	}
+	mapa->tamano=info.st_size;
+	mapa->bloques=(const unsigned char *)base+mapa->cabecera->tamano_cabecera;
+	mapa->longitud=info.st_size-mapa->cabecera->tamano_cabecera;
+	return 0;
+}
+
+/*
+ * Decodifica en muestras (sitio para MUESTRAS_BLOQUE_BIN; NULL solo para saltarlo) el bloque que
+ * empieza en la posicion posicion (0: el primero) y deja en *siguiente la posicion tras su ultima muestra completa.
+ * Devuelve el numero de muestras: si es menor que MUESTRAS_BLOQUE_BIN el bloque es el ultimo
+ * del fichero, todavia incompleto
+ */
+size_t rb_lee_bloque(const struct mapa_registro_bin *mapa, size_t posicion, struct muestra_bin *muestras, size_t *siguiente){
+	return lee_bloque(mapa->bloques, mapa->longitud, posicion, muestras, NULL, siguiente);
+}
+
+void rb_desmapea(struct mapa_registro_bin *mapa){
+	if (mapa->cabecera){
+		munmap((void *)mapa->cabecera, mapa->tamano);
+	}
+	memset(mapa, 0, sizeof(*mapa));
+}
@@ -0,0 +1,104 @@
+/*
+ ============================================================================
+ Name        : registro_bin.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Registro binario de muestras de cada segundo.
+               Fichero de solo añadir con una cabecera seguida de
+               bloques de MUESTRAS_BLOQUE_BIN muestras. Cada bloque
+               empieza con su primera muestra completa y sigue con las
+               demas codificadas respecto a la anterior: un byte de
+               control con un bit por campo que cambia y la diferencia
+               de cada uno de esos campos en varint zigzag. La potencia
+               importada se guarda como consumo (generada+importada). Como casi
+               todos los campos cambian poco de un segundo a otro la
+               muestra ocupa de media unos pocos bytes.
+               Los lectores mapean el fichero con mmap() y decodifican
+               bloque a bloque; el indice (indice_bin.h) guarda donde
+               empieza cada bloque.
+ ============================================================================
+ */
+
+#ifndef REGISTRO_BIN_H_
+#define REGISTRO_BIN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAGIC_REGISTRO_BIN   "FRMONBIN"
+#define VERSION_REGISTRO_BIN 1
+#define MUESTRAS_BLOQUE_BIN  1024   // muestras por bloque (unos 17 minutos)
+#define MARCA_BLOQUE_BIN     0xB10C // reservado de la primera muestra de cada bloque
+#define MAX_BYTES_MUESTRA_BIN 25    // control, 2 varint de 32 bits, 4 de 16 bits, limite y estado
+
+/*
+ * Cabecera del fichero (32 bytes)
+ */
+struct cabecera_registro_bin{
+	char magic[8];            // "FRMONBIN"
+	uint16_t version;         // VERSION_REGISTRO_BIN
+	uint16_t tamano_cabecera; // sizeof(struct cabecera_registro_bin)
+	uint16_t tamano_muestra;  // sizeof(struct muestra_bin)
+	uint16_t muestras_bloque; // MUESTRAS_BLOQUE_BIN
+	uint32_t creacion;        // instante de creacion del fichero (s desde 1970 UTC)
+	uint8_t  relleno[12];
+};
+
+/*
+ * Muestra de cada segundo (20 bytes). Los valores son la suma de todos los inversores
+ * salvo la tension DC, que es la media de los inversores que han respondido
+ */
+struct muestra_bin{
+	uint32_t instante;           // s desde 1970 UTC
+	uint32_t energia_dia;        // energia generada en el dia (decimas de Wh)
+	uint16_t potencia_generada;  // W
+	int16_t  potencia_importada; // W (negativa si se exporta)
+	uint16_t tension_dc;         // decimas de V
+	uint16_t corriente_dc;       // centesimas de A
+	uint8_t  limite;             // limite de potencia (porcentaje de la nominal)
+	uint8_t  estado;             // ESTADO_MUESTRA_*
+	uint16_t reservado;
+};
+
+#define ESTADO_MUESTRA_VALIDA    0x01 // algun inversor ha respondido en el ciclo
+#define ESTADO_MUESTRA_LIMITADA  0x02 // limitacion de potencia activa
+
+/*
+ * Bits del byte de control de una muestra codificada: campo distinto del de la muestra anterior.
+ * Para el instante el bit indica que la diferencia no es de 1 s
+ */
+#define CAMBIA_INSTANTE    0x01
+#define CAMBIA_ENERGIA     0x02
+#define CAMBIA_GENERADA    0x04
+#define CAMBIA_CONSUMO     0x08 // generada+importada: con el contador quieto la importada solo sigue a la generada
+#define CAMBIA_TENSION     0x10
+#define CAMBIA_CORRIENTE   0x20
+#define CAMBIA_LIMITE      0x40 // sigue el byte tal cual
+#define CAMBIA_ESTADO      0x80 // sigue el byte tal cual
+
+/*
+ * Estado del que añade muestras: la siguiente se codifica respecto a la anterior
+ */
+struct codificador_registro_bin{
+	struct muestra_bin anterior; // ultima muestra escrita
+	unsigned int en_bloque;      // muestras escritas del bloque en curso (0: la siguiente abre bloque)
+};
+
+/*
+ * Fichero mapeado para lectura
+ */
+struct mapa_registro_bin{
+	const struct cabecera_registro_bin *cabecera;
+	const unsigned char *bloques; // primer bloque
+	size_t longitud;              // bytes desde el primer bloque hasta el final del fichero
+	size_t tamano;
+};
+
+int rb_abre(const char *fichero, struct codificador_registro_bin *codificador);
+size_t rb_codifica(struct codificador_registro_bin *codificador, const struct muestra_bin *muestra, unsigned char *salida);
+int rb_escribe(int fd, struct codificador_registro_bin *codificador, const struct muestra_bin *muestras, size_t n);
+int rb_mapea(const char *fichero, struct mapa_registro_bin *mapa);
+size_t rb_lee_bloque(const struct mapa_registro_bin *mapa, size_t posicion, struct muestra_bin *muestras, size_t *siguiente);
+void rb_desmapea(struct mapa_registro_bin *mapa);
+
+#endif /* REGISTRO_BIN_H_ */
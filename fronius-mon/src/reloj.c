@@ -0,0 +1,136 @@
+/*
+ ============================================================================
+ Name        : reloj.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Tic de un segundo y eventos de minuto, cuarto de hora y dia
+ ============================================================================
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "reloj.h"
+
+#define NS_SEGUNDO 1000000000L
+
+/*
+ * Minutos desde 1970 de la hora local de un instante
+ */
+static int64_t minuto_local(time_t instante){
+	struct tm t;
+
+	localtime_r(&instante, &t);
+	return ((int64_t)instante+t.tm_gmtoff)/60;
+}
+
+/*
+ * Programa el proximo tic en el siguiente inicio de segundo de tiempo real, y los siguientes cada segundo
+ */
+static int alinea(struct reloj *r){
+	struct timespec monotonico, real;
+	struct itimerspec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &monotonico);
+	clock_gettime(CLOCK_REALTIME, &real);
+	r->proximo.tv_sec=monotonico.tv_sec+1;
+	r->proximo.tv_nsec=monotonico.tv_nsec-real.tv_nsec;
+	if (r->proximo.tv_nsec<0){
+		r->proximo.tv_sec--;
+		r->proximo.tv_nsec+=NS_SEGUNDO;
+	}
+	ts.it_value=r->proximo;
+	ts.it_interval.tv_sec=1;
+	ts.it_interval.tv_nsec=0;
+	return timerfd_settime(r->fd, TFD_TIMER_ABSTIME, &ts, NULL);
+}
+
+/*
+ * Crea el temporizador y lo alinea con el segundo de tiempo real. Devuelve -1 si no es posible
+ */
+int rj_inicia(struct reloj *r){
+	memset(r, 0, sizeof(*r));
+	r->fd=timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (r->fd==-1){
+		return -1;
+	}
+	if (alinea(r)){
+		close(r->fd);
+		r->fd=-1;
+		return -1;
+	}
+	r->minuto=minuto_local(time(NULL));
+	return 0;
+}
+
+/*
+ * Atiende el vencimiento del temporizador (r->fd legible, o espera a que lo sea).
+ * Anota el retraso del tic y los tics agrupados, y si el tic se ha desfasado del segundo
+ * de tiempo real (salto o deriva de NTP) lo vuelve a alinear.
+ * Devuelve el numero de vencimientos desde el anterior tic o -1 si hay error
+ */
+int rj_tic(struct reloj *r){
+	uint64_t vencimientos;
+	struct timespec ahora, real;
+	int64_t retraso, fase;
+
+	while (read(r->fd, &vencimientos, sizeof(vencimientos))!=sizeof(vencimientos)){
+		if (errno!=EINTR){
+			return -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ahora);
+	clock_gettime(CLOCK_REALTIME, &real);
+
+	retraso=(ahora.tv_sec-r->proximo.tv_sec)*NS_SEGUNDO+(ahora.tv_nsec-r->proximo.tv_nsec);
+	if (retraso<0){
+		retraso=0;
+	}
+	r->tics++;
+	r->tics_perdidos+=vencimientos-1;
+	r->retraso_us=retraso/1000;
+	r->retraso_total_us+=r->retraso_us;
+	if (r->retraso_us>r->retraso_max_us){
+		r->retraso_max_us=r->retraso_us;
+	}
+	r->proximo.tv_sec+=vencimientos;
+
+	// el vencimiento deberia coincidir con el inicio de un segundo de tiempo real
+	fase=((real.tv_nsec-retraso)%NS_SEGUNDO+NS_SEGUNDO)%NS_SEGUNDO;
+	if (fase>DESFASE_MAXIMO_NS && fase<NS_SEGUNDO-DESFASE_MAXIMO_NS){
+		r->realineaciones++;
+		alinea(r);
+	}
+	return (int)vencimientos;
+}
+
+/*
+ * Eventos de cambio de minuto, cuarto de hora y dia locales ocurridos desde la llamada anterior.
+ * Cada cambio se da una sola vez aunque el tic llegue tarde o se hayan saltado minutos.
+ * Si el reloj retrocede un minuto (p.e. un ajuste de NTP justo en el cambio de minuto) no se
+ * repiten los eventos; si retrocede mas (cambio de hora de otoño, ajuste manual) se continua
+ * desde la nueva hora
+ */
+int rj_eventos(struct reloj *r, time_t instante){
+	int64_t minuto=minuto_local(instante);
+	int eventos=0;
+
+	if (minuto<=r->minuto){
+		if (minuto<r->minuto-1){
+			r->minuto=minuto;
+		}
+		return 0;
+	}
+	eventos=EV_MINUTO;
+	if (minuto/15!=r->minuto/15){
+		eventos|=EV_CUARTO;
+	}
+	if (minuto/1440!=r->minuto/1440){
+		eventos|=EV_DIA;
+	}
+	r->minutos_saltados+=minuto-r->minuto-1;
+	r->minuto=minuto;
+	return eventos;
+}
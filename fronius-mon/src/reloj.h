@@ -0,0 +1,48 @@
+/*
+ ============================================================================
+ Name        : reloj.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Tic de un segundo sobre CLOCK_MONOTONIC alineado con el
+               inicio de cada segundo de tiempo real, y eventos de cambio
+               de minuto, cuarto de hora y dia de la hora local.
+               Un ciclo que se alarga o un salto del reloj de tiempo real
+               (NTP) no hace perder los eventos: cada uno se da una sola
+               vez en el primer tic despues del cambio, aunque ese tic
+               llegue tarde. Los tics perdidos y el retraso de cada tic
+               se cuentan.
+ ============================================================================
+ */
+
+#ifndef RELOJ_H_
+#define RELOJ_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define EV_MINUTO 0x01 // ha empezado un minuto nuevo
+#define EV_CUARTO 0x02 // ha empezado un cuarto de hora nuevo
+#define EV_DIA    0x04 // ha empezado un dia nuevo (medianoche local)
+
+#define DESFASE_MAXIMO_NS 20000000 // desfase con el segundo de tiempo real a partir del cual se realinea el tic
+
+struct reloj{
+	int fd;                    // timerfd de CLOCK_MONOTONIC
+	struct timespec proximo;   // vencimiento del proximo tic (CLOCK_MONOTONIC)
+	int64_t minuto;            // ultimo minuto local visto (minutos desde 1970 en hora local)
+
+	// contadores
+	unsigned long tics;
+	unsigned long tics_perdidos;    // vencimientos agrupados en uno por un ciclo largo
+	unsigned long realineaciones;   // reprogramaciones por salto o deriva del reloj de tiempo real
+	unsigned long minutos_saltados; // minutos sin tic (ciclo muy largo o salto del reloj adelante)
+	uint32_t retraso_us;            // del ultimo tic respecto a su vencimiento
+	uint32_t retraso_max_us;
+	double retraso_total_us;
+};
+
+int rj_inicia(struct reloj *r);
+int rj_tic(struct reloj *r);
+int rj_eventos(struct reloj *r, time_t instante);
+
+#endif /* RELOJ_H_ */
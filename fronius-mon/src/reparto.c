@@ -0,0 +1,66 @@
+/*
+ ============================================================================
+ Name        : reparto.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Reparto del limite de la instalacion entre los inversores
+ ============================================================================
+ */
+
+#include "reparto.h"
+#include "limitador.h"
+
+#define FRACCION_LIMITADO 0.9f // un inversor que genera menos de esta fraccion de su limite no esta limitado por el
+#define TOLERANCIA_W      0.5f // redondeo de la potencia permitida
+
+/*
+ * Potencia que generarian los inversores con el porcentaje p: los limitables a lo sumo su capacidad,
+ * que es la nominal si el limite les frena y lo que generan si no; los demas lo que generan
+ */
+static float potencia_con(const struct reparto_inversor *inv, int n, int p){
+	float total=0, capacidad, tope;
+	int i;
+
+	for (i=0; i<n; i++){
+		if (!inv[i].limitable){
+			total+=inv[i].generada;
+			continue;
+		}
+		if (inv[i].limite<0 || inv[i].generada>=FRACCION_LIMITADO*inv[i].limite*inv[i].nominal/100){
+			capacidad=inv[i].nominal;
+		}
+		else {
+			capacidad=inv[i].generada;
+		}
+		tope=p*inv[i].nominal/100;
+		total+=tope<capacidad?tope:capacidad;
+	}
+	return total;
+}
+
+/*
+ * Convierte el limite del regulador (% de la potencia nominal de los n inversores) en el porcentaje
+ * comun para los limitables: el mayor con el que la potencia generada estimada no pasa de la permitida,
+ * entre LIMITE_MINIMO y 100. Si los inversores generan en proporcion a su nominal coincide con limite.
+ * anterior es el porcentaje enviado en el reparto anterior con el mismo limite del regulador (-1 si el
+ * limite ha cambiado): si el nuevo difiere menos de banda se mantiene, para no enviar un 0x9F en cada
+ * ciclo por las variaciones de lo que genera cada inversor
+ */
+int rp_reparte(const struct reparto_inversor *inv, int n, int limite, int anterior, float banda){
+	float permitida, nominal=0;
+	int i, p;
+
+	for (i=0; i<n; i++){
+		nominal+=inv[i].nominal;
+	}
+	permitida=limite*nominal/100+TOLERANCIA_W;
+	for (p=100; p>LIMITE_MINIMO; p--){
+		if (potencia_con(inv, n, p)<=permitida){
+			break;
+		}
+	}
+	if (anterior>=0 && p!=100 && p!=LIMITE_MINIMO && p-anterior<banda && anterior-p<banda){
+		return anterior;
+	}
+	return p;
+}
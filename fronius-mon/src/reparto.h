@@ -0,0 +1,34 @@
+/*
+ ============================================================================
+ Name        : reparto.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Reparto del limite de la instalacion entre los inversores.
+               El regulador (limitador.h) da un limite en % de la potencia
+               nominal de todos los inversores; aqui se convierte en el
+               porcentaje que se envia a los que admiten limitacion,
+               teniendo en cuenta la potencia nominal de cada uno y lo que
+               genera: un inversor que produce claramente menos que su
+               limite (sombras, orientacion) no lo aprovecha y su parte
+               pasa a los demas, y lo que generan los que no admiten
+               limitacion se descuenta del total.
+               El resultado es un unico porcentaje para todos, de modo
+               que el limite de todos los inversores va en una sola trama
+               0x9F (un porcentaje seguido de los numeros de inversor).
+               Como el regulador, no hace ninguna operacion de E/S.
+ ============================================================================
+ */
+
+#ifndef REPARTO_H_
+#define REPARTO_H_
+
+struct reparto_inversor{
+	float nominal;  // potencia nominal (W)
+	float generada; // potencia generada en el ultimo ciclo (W; 0 si no ha respondido)
+	int limite;     // limite aplicado (%; -1 si no se conoce)
+	int limitable;  // recibe el 0x9F: responde y admite limitacion
+};
+
+int rp_reparte(const struct reparto_inversor *inv, int n, int limite, int anterior, float banda);
+
+#endif /* REPARTO_H_ */
@@ -0,0 +1,557 @@
+/*
+ ============================================================================
+ Name        : servidor.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Servidor HTTP local de metricas atendido desde el bucle del ciclo
+ ============================================================================
+ */
+
+#define _GNU_SOURCE // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "servidor.h"
+#include "estado_inversor.h"
+
+static const char respuesta_no_encontrado[]=
+		"HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nnot found\n";
+static const char respuesta_no_disponible[]=
+		"HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/plain\r\nContent-Length: 12\r\nConnection: close\r\n\r\nno data yet\n";
+static const char respuesta_erronea[]=
+		"HTTP/1.0 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: 12\r\nConnection: close\r\n\r\nbad request\n";
+
+static int64_t instante_ns(void){
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec*1000000000+t.tv_nsec;
+}
+
+/*
+ * Abre el socket de escucha no bloqueante. direccion es una ruta de socket Unix (empieza por /)
+ * o [ip:]puerto TCP; sin ip solo se escucha en 127.0.0.1. Devuelve -1 (con errno) si no es posible
+ */
+int sv_abre(struct servidor *sv, const char *direccion){
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+	const char *puerto;
+	char ip[INET_ADDRSTRLEN];
+	int i, activo=1;
+
+	memset(sv, 0, sizeof(*sv));
+	sv->fd=-1;
+	for (i=0; i<MAX_CLIENTES_SERVIDOR; i++){
+		sv->cliente[i].fd=-1;
+	}
+	if (direccion[0]=='/'){
+		memset(&un, 0, sizeof(un));
+		un.sun_family=AF_UNIX;
+		if (strlen(direccion)>=sizeof(un.sun_path)){
+			errno=ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(un.sun_path, direccion);
+		sv->fd=socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+		if (sv->fd==-1){
+			return -1;
+		}
+		unlink(direccion);
+		if (bind(sv->fd, (struct sockaddr *)&un, sizeof(un))){
+			goto error;
+		}
+	}
+	else {
+		memset(&in, 0, sizeof(in));
+		in.sin_family=AF_INET;
+		in.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+		puerto=strrchr(direccion, ':');
+		if (puerto!=NULL){
+			if (puerto-direccion>=(int)sizeof(ip)){
+				errno=EINVAL;
+				return -1;
+			}
+			memcpy(ip, direccion, puerto-direccion);
+			ip[puerto-direccion]='\0';
+			if (inet_pton(AF_INET, ip, &in.sin_addr)!=1){
+				errno=EINVAL;
+				return -1;
+			}
+			puerto++;
+		}
+		else {
+			puerto=direccion;
+		}
+		i=atoi(puerto);
+		if (i<=0 || i>65535){
+			errno=EINVAL;
+			return -1;
+		}
+		in.sin_port=htons(i);
+		sv->fd=socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+		if (sv->fd==-1){
+			return -1;
+		}
+		setsockopt(sv->fd, SOL_SOCKET, SO_REUSEADDR, &activo, sizeof(activo));
+		if (bind(sv->fd, (struct sockaddr *)&in, sizeof(in))){
+			goto error;
+		}
+	}
+	if (listen(sv->fd, MAX_CLIENTES_SERVIDOR)){
+		goto error;
+	}
+	return 0;
+
+error:
+	i=errno;
+	close(sv->fd);
+	sv->fd=-1;
+	errno=i;
+	return -1;
+}
+
+static void cierra_cliente(struct servidor *sv, struct cliente_servidor *c, int completa){
+	close(c->fd);
+	c->fd=-1;
+	if (c->compuesta!=NULL){
+		c->compuesta->usuarios--;
+		c->compuesta=NULL;
+	}
+	if (completa){
+		sv->peticiones++;
+	}
+	else {
+		sv->rechazadas++;
+	}
+}
+
+/*
+ * Descriptores a vigilar en la espera: el de escucha si queda hueco para otro cliente
+ * y los de los clientes (lectura de la peticion o escritura de la respuesta).
+ * Cierra antes los clientes que han agotado su plazo. Devuelve el numero de descriptores
+ */
+int sv_pollfd(struct servidor *sv, struct pollfd *pfd, int max){
+	struct cliente_servidor *c;
+	int64_t ahora_ns;
+	int i, n=0, libres=0;
+
+	if (sv->fd==-1){
+		return 0;
+	}
+	ahora_ns=instante_ns();
+	for (i=0; i<MAX_CLIENTES_SERVIDOR && n<max; i++){
+		c=&sv->cliente[i];
+		if (c->fd==-1){
+			libres++;
+			continue;
+		}
+		if (ahora_ns-c->inicio_ns>(int64_t)PLAZO_CLIENTE_SERVIDOR_MS*1000000){
+			cierra_cliente(sv, c, 0);
+			libres++;
+			continue;
+		}
+		pfd[n].fd=c->fd;
+		pfd[n].events=c->respuesta==NULL?POLLIN:POLLOUT;
+		pfd[n].revents=0;
+		n++;
+	}
+	if (libres && n<max){
+		pfd[n].fd=sv->fd;
+		pfd[n].events=POLLIN;
+		pfd[n].revents=0;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Elige la respuesta cuando la peticion esta completa (linea en blanco tras la cabecera)
+ */
+static void elige_respuesta(struct servidor *sv, struct cliente_servidor *c){
+	struct respuesta_servidor *r=NULL;
+	char *ruta, *fin;
+
+	c->peticion[c->leidos]='\0';
+	if (strncmp(c->peticion, "GET ", 4)!=0){
+		c->respuesta=respuesta_erronea;
+		c->longitud=sizeof(respuesta_erronea)-1;
+		return;
+	}
+	ruta=c->peticion+4;
+	fin=strpbrk(ruta, " ?\r\n");
+	if (fin!=NULL){
+		*fin='\0';
+	}
+	if (strcmp(ruta, "/metrics")==0 || strcmp(ruta, "/")==0){
+		r=sv->metricas_actual;
+	}
+	else if (strcmp(ruta, "/history")==0){
+		r=sv->historico_actual;
+	}
+	else {
+		c->respuesta=respuesta_no_encontrado;
+		c->longitud=sizeof(respuesta_no_encontrado)-1;
+		return;
+	}
+	if (r==NULL){
+		c->respuesta=respuesta_no_disponible;
+		c->longitud=sizeof(respuesta_no_disponible)-1;
+		return;
+	}
+	r->usuarios++;
+	c->compuesta=r;
+	c->respuesta=r->datos+r->inicio;
+	c->longitud=r->longitud;
+}
+
+static void atiende_cliente(struct servidor *sv, struct cliente_servidor *c){
+	ssize_t rc;
+	size_t n;
+
+	if (c->respuesta==NULL){
+		rc=recv(c->fd, c->peticion+c->leidos, sizeof(c->peticion)-1-c->leidos, 0);
+		if (rc==0 || (rc==-1 && errno!=EAGAIN && errno!=EINTR)){
+			cierra_cliente(sv, c, 0);
+			return;
+		}
+		if (rc<0){
+			return;
+		}
+		c->leidos+=rc;
+		c->peticion[c->leidos]='\0';
+		if (strstr(c->peticion, "\r\n\r\n")==NULL && strstr(c->peticion, "\n\n")==NULL &&
+				c->leidos<sizeof(c->peticion)-1){
+			return;
+		}
+		elige_respuesta(sv, c);
+	}
+	// se envia lo que admita el socket sin esperar; el resto, en la siguiente atencion
+	n=c->longitud-c->enviados;
+	if (n>ENVIO_MAXIMO_SERVIDOR){
+		n=ENVIO_MAXIMO_SERVIDOR;
+	}
+	rc=send(c->fd, c->respuesta+c->enviados, n, MSG_DONTWAIT|MSG_NOSIGNAL);
+	if (rc==-1){
+		if (errno!=EAGAIN && errno!=EINTR){
+			cierra_cliente(sv, c, 0);
+		}
+		return;
+	}
+	c->enviados+=rc;
+	if (c->enviados==c->longitud){
+		cierra_cliente(sv, c, 1);
+	}
+}
+
+/*
+ * Atiende los descriptores de sv_pollfd() que poll() ha marcado: acepta conexiones nuevas,
+ * lee peticiones y envia respuestas, sin bloquear nunca
+ */
+void sv_atiende(struct servidor *sv, const struct pollfd *pfd, int n){
+	struct cliente_servidor *c;
+	int i, k, fd;
+
+	for (k=0; k<n; k++){
+		if (pfd[k].revents==0){
+			continue;
+		}
+		if (pfd[k].fd==sv->fd){
+			for (i=0; i<MAX_CLIENTES_SERVIDOR; i++){
+				c=&sv->cliente[i];
+				if (c->fd!=-1){
+					continue;
+				}
+				fd=accept4(sv->fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+				if (fd==-1){
+					break;
+				}
+				memset(c, 0, sizeof(*c));
+				c->fd=fd;
+				c->inicio_ns=instante_ns();
+			}
+			continue;
+		}
+		for (i=0; i<MAX_CLIENTES_SERVIDOR && sv->cliente[i].fd!=pfd[k].fd; i++);
+		if (i==MAX_CLIENTES_SERVIDOR){
+			continue;
+		}
+		if (pfd[k].revents & (POLLERR|POLLNVAL)){
+			cierra_cliente(sv, &sv->cliente[i], 0);
+			continue;
+		}
+		atiende_cliente(sv, &sv->cliente[i]);
+	}
+}
+
+/*
+ * Respuesta en la que componer: la que no es la actual si ningun cliente la esta enviando
+ */
+static struct respuesta_servidor *libre(struct respuesta_servidor *r, const struct respuesta_servidor *actual){
+	int i;
+
+	for (i=0; i<2; i++){
+		if (&r[i]!=actual && r[i].usuarios==0){
+			r[i].longitud=0;
+			r[i].truncada=0;
+			return &r[i];
+		}
+	}
+	return NULL;
+}
+
+static void agrega(struct respuesta_servidor *r, const char *formato, ...){
+	size_t disponible=sizeof(r->datos)-CABECERA_RESPUESTA_SERVIDOR-r->longitud;
+	va_list args;
+	int n;
+
+	if (r->truncada){
+		return;
+	}
+	va_start(args, formato);
+	n=vsnprintf(r->datos+CABECERA_RESPUESTA_SERVIDOR+r->longitud, disponible, formato, args);
+	va_end(args);
+	if (n<0 || (size_t)n>=disponible){
+		// se queda con las lineas completas anteriores
+		r->truncada=1;
+		while (r->longitud>0 && r->datos[CABECERA_RESPUESTA_SERVIDOR+r->longitud-1]!='\n'){
+			r->longitud--;
+		}
+		return;
+	}
+	r->longitud+=n;
+}
+
+/*
+ * Pone la cabecera HTTP delante del cuerpo
+ */
+static void cierra_respuesta(struct respuesta_servidor *r, const char *tipo){
+	char cabecera[CABECERA_RESPUESTA_SERVIDOR];
+	int n;
+
+	n=snprintf(cabecera, sizeof(cabecera), "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+			tipo, r->longitud);
+	r->inicio=CABECERA_RESPUESTA_SERVIDOR-n;
+	memcpy(r->datos+r->inicio, cabecera, n);
+	r->longitud+=n;
+}
+
+static void metrica(struct respuesta_servidor *r, const char *nombre, const char *tipo, const char *ayuda){
+	agrega(r, "# HELP %s %s\n# TYPE %s %s\n", nombre, ayuda, nombre, tipo);
+}
+
+/*
+ * Compone /metrics con la instantanea del ciclo. Se llama una vez por ciclo, despues de publicarla
+ */
+void sv_publica_metricas(struct servidor *sv, const struct datos_inversores *datos, const struct estadisticas *e){
+	struct respuesta_servidor *r;
+	const struct datos_inversor *inv;
+	static const struct{
+		const char *nombre;
+		size_t desplazamiento;
+		const char *ayuda;
+	} estadisticos[]={
+			{"samples", offsetof(struct resultado_serie, n),          "Samples in the last complete window"},
+			{"mean",    offsetof(struct resultado_serie, media),      "Mean in the last complete window"},
+			{"stddev",  offsetof(struct resultado_serie, desviacion), "Standard deviation in the last complete window"},
+			{"min",     offsetof(struct resultado_serie, minimo),     "Minimum in the last complete window"},
+			{"p50",     offsetof(struct resultado_serie, p50),        "Approximate median in the last complete window"},
+			{"p90",     offsetof(struct resultado_serie, p90),        "Approximate 90th percentile in the last complete window"},
+			{"p99",     offsetof(struct resultado_serie, p99),        "Approximate 99th percentile in the last complete window"},
+			{"max",     offsetof(struct resultado_serie, maximo),     "Maximum in the last complete window"},
+	};
+	const struct resumen_ventana *rv;
+	char nombre[64], ventana[16];
+	float valor;
+	struct tm t;
+	int64_t inicio_ns=instante_ns();
+	int i, m, s, k, cuarto, estado;
+
+	if (sv->fd==-1){
+		return;
+	}
+	r=libre(sv->metricas, sv->metricas_actual);
+	if (r==NULL){
+		sv->composiciones_omitidas++;
+		return;
+	}
+	localtime_r(&datos->instante, &t);
+	cuarto=t.tm_hour*4+t.tm_min/15;
+
+	metrica(r, "fronius_timestamp_seconds", "gauge", "Time of the last cycle");
+	agrega(r, "fronius_timestamp_seconds %lld\n", (long long)datos->instante);
+	metrica(r, "fronius_generated_power_watts", "gauge", "Power generated by all inverters");
+	agrega(r, "fronius_generated_power_watts %.1f\n", datos->potencia_generada_total);
+	metrica(r, "fronius_consumed_power_watts", "gauge", "Power consumed as read by the meter");
+	agrega(r, "fronius_consumed_power_watts %.1f\n", datos->potencia_consumo);
+	metrica(r, "fronius_generated_energy_today_wh", "gauge", "Energy generated today by all inverters");
+	agrega(r, "fronius_generated_energy_today_wh %.1f\n", datos->energia_generada_dia_total);
+	metrica(r, "fronius_quarter_generated_energy_wh", "gauge", "Energy generated in the current quarter of an hour");
+	agrega(r, "fronius_quarter_generated_energy_wh %.1f\n", datos->entradaregistrodiario[cuarto].energia_generada);
+	metrica(r, "fronius_quarter_consumed_energy_wh", "gauge", "Energy consumed in the current quarter of an hour");
+	agrega(r, "fronius_quarter_consumed_energy_wh %.1f\n", datos->entradaregistrodiario[cuarto].energia_consumida);
+	metrica(r, "fronius_power_limit_percent", "gauge", "Common power limit in percent of the nominal power");
+	agrega(r, "fronius_power_limit_percent %d\n", datos->lim_pot);
+	metrica(r, "fronius_power_limit_sent_percent", "gauge", "Limit sent to the inverters after sharing it by nominal power and output");
+	agrega(r, "fronius_power_limit_sent_percent %d\n", datos->lim_reparto);
+	metrica(r, "fronius_power_limit_frames_total", "counter", "0x9F frames sent by the limiter, one for all the inverters per change");
+	agrega(r, "fronius_power_limit_frames_total %lu\n", datos->tramas_limite);
+	metrica(r, "fronius_cycle_duration_seconds", "gauge", "Bus time of the last cycle");
+	agrega(r, "fronius_cycle_duration_seconds %.3f\n", datos->ciclo_ms/1e3);
+	metrica(r, "fronius_cycles_total", "counter", "Query cycles");
+	agrega(r, "fronius_cycles_total %lu\n", datos->ciclos);
+	metrica(r, "fronius_cycle_overruns_total", "counter", "Cycles longer than 1 s");
+	agrega(r, "fronius_cycle_overruns_total %lu\n", datos->ciclos_excedidos);
+	metrica(r, "fronius_deferred_queries_total", "counter", "Telemetry queries deferred by the cycle budget");
+	agrega(r, "fronius_deferred_queries_total %lu\n", datos->consultas_omitidas);
+	metrica(r, "fronius_meter_notifications_total", "counter", "Consumption notifications from the meter");
+	agrega(r, "fronius_meter_notifications_total %lu\n", datos->avisos);
+	metrica(r, "fronius_export_notifications_total", "counter", "Notifications with export answered by lowering the limit");
+	agrega(r, "fronius_export_notifications_total %lu\n", datos->avisos_exportacion);
+	metrica(r, "fronius_limit_delay_seconds", "gauge", "From the last limit decision to the end of its 0x9F on the line");
+	agrega(r, "fronius_limit_delay_seconds %.4f\n", datos->retardo_limite_ms/1e3);
+	metrica(r, "fronius_limit_delay_max_seconds", "gauge", "Largest delay from a limit decision to its 0x9F on the line");
+	agrega(r, "fronius_limit_delay_max_seconds %.4f\n", datos->retardo_limite_max_ms/1e3);
+	metrica(r, "fronius_bus_orders_total", "counter", "Orders done by the bus thread");
+	agrega(r, "fronius_bus_orders_total %lu\n", datos->ordenes_bus);
+	metrica(r, "fronius_bus_orders_expired_total", "counter", "Orders returned undone: deadline expired or inverter not answering");
+	agrega(r, "fronius_bus_orders_expired_total %lu\n", datos->ordenes_vencidas);
+	metrica(r, "fronius_bus_orders_ahead_total", "counter", "Orders served while lower priority orders were waiting");
+	agrega(r, "fronius_bus_orders_ahead_total %lu\n", datos->ordenes_adelantadas);
+	metrica(r, "fronius_recoveries_total", "counter", "Inverters answering again after a failure");
+	agrega(r, "fronius_recoveries_total %lu\n", datos->recuperaciones);
+	metrica(r, "fronius_outages_total", "counter", "Inverters silent for longer than the recovery limit");
+	agrega(r, "fronius_outages_total %lu\n", datos->caidas);
+	metrica(r, "fronius_writer_dropped_total", "counter", "Writes dropped because the writer queue was full");
+	agrega(r, "fronius_writer_dropped_total %lu\n", datos->escritura_descartes);
+	metrica(r, "fronius_writer_errors_total", "counter", "Failed writes of the writer thread");
+	agrega(r, "fronius_writer_errors_total %lu\n", datos->escritura_errores);
+	if (e!=NULL){
+		metrica(r, "fronius_ticks_lost_total", "counter", "1 s ticks merged by a long cycle");
+		agrega(r, "fronius_ticks_lost_total %llu\n", (unsigned long long)e->tics_perdidos);
+		metrica(r, "fronius_tick_delay_max_seconds", "gauge", "Largest delay of a tick after its expiry");
+		agrega(r, "fronius_tick_delay_max_seconds %.6f\n", e->retraso_tic_max_us/1e6);
+		metrica(r, "fronius_tick_delay_p99_seconds", "gauge", "99th percentile of the tick delay");
+		agrega(r, "fronius_tick_delay_p99_seconds %.6f\n", est_percentil(e->retraso_tic, e->retraso_tic_max_us, 0.99)/1e6);
+	}
+	metrica(r, "fronius_http_requests_total", "counter", "Responses of this endpoint sent in full");
+	agrega(r, "fronius_http_requests_total %lu\n", sv->peticiones);
+	metrica(r, "fronius_http_rejected_total", "counter", "Connections of this endpoint closed by timeout or error");
+	agrega(r, "fronius_http_rejected_total %lu\n", sv->rechazadas);
+	metrica(r, "fronius_http_render_seconds", "gauge", "Time to render the previous metrics response");
+	agrega(r, "fronius_http_render_seconds %.6f\n", sv->composicion_us/1e6);
+
+	for (k=0; k<(int)(sizeof(estadisticos)/sizeof(estadisticos[0])); k++){
+		snprintf(nombre, sizeof(nombre), "fronius_window_%s", estadisticos[k].nombre);
+		metrica(r, nombre, "gauge", estadisticos[k].ayuda);
+		for (i=0; i<datos->num_ventanas; i++){
+			rv=&datos->ventana_cerrada[i];
+			ag_nombre_ventana(rv->minutos, ventana, sizeof(ventana));
+			for (s=0; s<NUM_SERIES; s++){
+				if (estadisticos[k].desplazamiento==offsetof(struct resultado_serie, n)){
+					valor=rv->serie[s].n;
+				}
+				else {
+					valor=*(const float *)((const char *)&rv->serie[s]+estadisticos[k].desplazamiento);
+				}
+				agrega(r, "%s{window=\"%s\",series=\"%s\"} %g\n", nombre, ventana, nombres_series[s], valor);
+			}
+		}
+	}
+
+	metrica(r, "fronius_inverter_up", "gauge", "1 if the inverter answered in the last cycle");
+	for (i=0; i<datos->num_inversores; i++){
+		agrega(r, "fronius_inverter_up{inverter=\"%d\"} %d\n", datos->inversor[i].numero, datos->inversor[i].valido);
+	}
+	metrica(r, "fronius_inverter_state", "gauge", "1 for the current state of the inverter (producing, waking, standby or offline)");
+	for (i=0; i<datos->num_inversores; i++){
+		for (estado=0; estado<NUM_ESTADOS_INVERSOR; estado++){
+			agrega(r, "fronius_inverter_state{inverter=\"%d\",state=\"%s\"} %d\n", datos->inversor[i].numero,
+					nombres_estados_inversor[estado], datos->inversor[i].estado==estado);
+		}
+	}
+	metrica(r, "fronius_inverter_last_read_timestamp_seconds", "gauge", "Time of the last good reading of the inverter");
+	for (i=0; i<datos->num_inversores; i++){
+		agrega(r, "fronius_inverter_last_read_timestamp_seconds{inverter=\"%d\"} %lld\n", datos->inversor[i].numero,
+				(long long)datos->inversor[i].instante);
+	}
+	metrica(r, "fronius_inverter_power_limit_percent", "gauge", "Power limit applied to the inverter (-1 unknown)");
+	for (i=0; i<datos->num_inversores; i++){
+		agrega(r, "fronius_inverter_power_limit_percent{inverter=\"%d\"} %d\n", datos->inversor[i].numero, datos->inversor[i].lim_pot);
+	}
+	metrica(r, "fronius_inverter_measurement", "gauge", "Last value read of each inverter measurement (stale while fronius_inverter_up is 0)");
+	for (i=0; i<datos->num_inversores; i++){
+		inv=&datos->inversor[i];
+		for (m=0; m<NUM_MEDIDAS; m++){
+			agrega(r, "fronius_inverter_measurement{inverter=\"%d\",name=\"%s\",unit=\"%s\"} %g\n",
+					inv->numero, medidas[m].nombre, medidas[m].unidad, inv->medida[m]);
+		}
+	}
+	cierra_respuesta(r, "text/plain; version=0.0.4");
+	sv->metricas_actual=r;
+	sv->composicion_us=(instante_ns()-inicio_ns)/1000;
+}
+
+/*
+ * Compone /history: energia de cada cuarto de hora de los ultimos DIAS_RESPUESTA_HISTORICO dias
+ * hasta el cuarto en curso. Se llama al arrancar y al empezar cada minuto
+ */
+void sv_publica_historico(struct servidor *sv, const struct historico *h, time_t instante){
+	struct respuesta_servidor *r;
+	const struct dia_historico *d;
+	struct tm t;
+	int32_t hoy, dia;
+	int i, q, n, cuarto;
+	time_t base;
+	float total;
+
+	if (sv->fd==-1 || h->cabecera==NULL){
+		return;
+	}
+	r=libre(sv->historico, sv->historico_actual);
+	if (r==NULL){
+		sv->composiciones_omitidas++;
+		return;
+	}
+	localtime_r(&instante, &t);
+	hoy=hs_dia_de(instante);
+	cuarto=t.tm_hour*4+t.tm_min/15;
+
+	// los inversores son los del dia en curso (columnas fijas para todo el CSV)
+	d=hs_dia(h, hoy);
+	for (n=0; d!=NULL && n<MAX_INVERSORES && d->numero[n]; n++);
+	agrega(r, "date,time,generated_wh");
+	for (i=0; i<n; i++){
+		agrega(r, ",inverter_%d_wh", d->numero[i]);
+	}
+	agrega(r, ",consumed_wh\n");
+	for (dia=hoy-DIAS_RESPUESTA_HISTORICO+1; dia<=hoy; dia++){
+		d=hs_dia(h, dia);
+		if (d==NULL){
+			continue;
+		}
+		base=hs_instante_de(dia);
+		localtime_r(&base, &t);
+		for (q=0; q<(dia==hoy?cuarto+1:INTERVALOS_DIA); q++){
+			total=0;
+			for (i=0; i<MAX_INVERSORES; i++){
+				total+=d->generada[i][q];
+			}
+			agrega(r, "%04d-%02d-%02d,%02d:%02d,%.1f", t.tm_year+1900, t.tm_mon+1, t.tm_mday, q/4, q%4*15, total);
+			for (i=0; i<n; i++){
+				agrega(r, ",%.1f", d->generada[i][q]);
+			}
+			agrega(r, ",%.1f\n", d->consumida[q]);
+		}
+	}
+	cierra_respuesta(r, "text/csv");
+	sv->historico_actual=r;
+}
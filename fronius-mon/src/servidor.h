@@ -0,0 +1,78 @@
+/*
+ ============================================================================
+ Name        : servidor.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Servidor HTTP local de metricas (opcion -H) atendido desde
+               el mismo bucle de espera del ciclo, sin hilos.
+               /metrics devuelve los valores del ultimo ciclo en formato
+               de texto de Prometheus y /history la energia de cada
+               cuarto de hora de ayer y de hoy en CSV.
+               Las respuestas se componen una sola vez (al final de cada
+               ciclo o de cada minuto) y se sirven tal cual a cualquier
+               numero de clientes con sockets no bloqueantes: un cliente
+               lento o un exceso de clientes nunca retrasa el tic.
+ ============================================================================
+ */
+
+#ifndef SERVIDOR_H_
+#define SERVIDOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <poll.h>
+
+#include "publicacion.h"
+#include "historico.h"
+#include "estadisticas.h"
+
+#define MAX_CLIENTES_SERVIDOR 16          // conexiones simultaneas; las demas esperan en la cola de listen()
+#define CABECERA_RESPUESTA_SERVIDOR 160   // bytes reservados para la cabecera HTTP al principio de cada respuesta
+#define TAMANO_PETICION_SERVIDOR 1024     // bytes de la peticion que se leen (el resto se ignora)
+#define TAMANO_RESPUESTA_SERVIDOR 65536   // cabecera HTTP y cuerpo de cada respuesta
+#define PLAZO_CLIENTE_SERVIDOR_MS 2000    // un cliente que no termina en este plazo se cierra
+#define DIAS_RESPUESTA_HISTORICO 2        // dias del historico en /history (hoy y los anteriores)
+#define ENVIO_MAXIMO_SERVIDOR 16384       // bytes enviados a un cliente en cada atencion
+
+/*
+ * Respuesta ya compuesta. Hay dos de cada tipo: se compone la nueva en la que no esta
+ * enviando ningun cliente, y los clientes en curso terminan con la que empezaron
+ */
+struct respuesta_servidor{
+	char datos[TAMANO_RESPUESTA_SERVIDOR];
+	size_t inicio, longitud; // la cabecera HTTP se pone delante del cuerpo ya compuesto
+	int truncada;            // el cuerpo no ha cabido entero
+	int usuarios;            // clientes que la estan enviando
+};
+
+struct cliente_servidor{
+	int fd;                              // -1: libre
+	char peticion[TAMANO_PETICION_SERVIDOR];
+	size_t leidos;
+	const char *respuesta;               // NULL mientras se lee la peticion
+	size_t longitud, enviados;
+	struct respuesta_servidor *compuesta; // respuesta compuesta en uso (NULL si es una respuesta fija)
+	int64_t inicio_ns;                   // CLOCK_MONOTONIC de la conexion
+};
+
+struct servidor{
+	int fd;                              // socket de escucha (-1 si no hay servidor)
+	struct cliente_servidor cliente[MAX_CLIENTES_SERVIDOR];
+	struct respuesta_servidor metricas[2], historico[2];
+	struct respuesta_servidor *metricas_actual, *historico_actual; // las que reciben los clientes nuevos
+
+	// contadores
+	unsigned long peticiones;            // respuestas enviadas completas
+	unsigned long rechazadas;            // conexiones cerradas sin respuesta completa (plazo o error)
+	unsigned long composiciones_omitidas; // ciclos sin nueva respuesta por estar las dos en uso
+	uint32_t composicion_us;             // duracion de la ultima composicion de /metrics
+};
+
+int sv_abre(struct servidor *sv, const char *direccion);
+int sv_pollfd(struct servidor *sv, struct pollfd *pfd, int max);
+void sv_atiende(struct servidor *sv, const struct pollfd *pfd, int n);
+void sv_publica_metricas(struct servidor *sv, const struct datos_inversores *datos, const struct estadisticas *e);
+void sv_publica_historico(struct servidor *sv, const struct historico *h, time_t instante);
+
+#endif /* SERVIDOR_H_ */
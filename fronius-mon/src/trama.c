@@ -0,0 +1,209 @@
+/*
+ ============================================================================
+ Name        : trama.c
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Analizador incremental de tramas del
+               Fronius Interface Protocol
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "trama.h"
+
+#define MASK_RING_BUFFER (SIZE_RING_BUFFER-1)
+
+/*
+ * Deja el analizador vacio y buscando inicio de trama
+ */
+void pt_inicia(struct parser_trama *p){
+	memset(p, 0, sizeof(*p));
+	p->estado=PT_START;
+}
+
+/*
+ * Posicion del byte mas antiguo que todavia es necesario conservar en el bufer circular:
+ * el inicio de la trama en curso (para poder resincronizar si se descarta) o el siguiente byte a analizar
+ */
+static unsigned int pt_base(const struct parser_trama *p){
+	if (p->estado==PT_START && p->n_start==0){
+		return p->lectura;
+	}
+	return p->inicio;
+}
+
+/*
+ * Descarta los bytes pendientes de analizar y la trama en curso conservando los contadores
+ */
+void pt_descarta(struct parser_trama *p){
+	p->bytes_descartados+=p->escritura-pt_base(p);
+	p->lectura=p->escritura;
+	p->estado=PT_START;
+	p->n_start=0;
+}
+
+/*
+ * Devuelve un puntero al hueco contiguo libre del bufer circular y su tamaño en *n
+ * para que read() escriba directamente en él. Tras la lectura se llama a pt_confirma()
+ */
+unsigned char *pt_hueco(struct parser_trama *p, int *n){
+	unsigned int libre;
+	unsigned int posicion;
+
+	libre=SIZE_RING_BUFFER-(p->escritura-pt_base(p));
+	posicion=p->escritura & MASK_RING_BUFFER;
+	if (libre > SIZE_RING_BUFFER-posicion){
+		libre=SIZE_RING_BUFFER-posicion;
+	}
+	*n=(int)libre;
+	return &p->anillo[posicion];
+}
+
+/*
+ * Da por recibidos n bytes escritos en el hueco obtenido con pt_hueco()
+ */
+void pt_confirma(struct parser_trama *p, int n){
+	if (n>0){
+		p->escritura+=n;
+	}
+}
+
+/*
+ * Copia en el bufer circular un trozo de bytes recibidos por otra via (p.e. reproduccion de capturas).
+ * Devuelve el numero de bytes admitidos, que puede ser menor que n si el bufer esta lleno
+ */
+int pt_alimenta(struct parser_trama *p, const unsigned char *datos, int n){
+	unsigned char *hueco;
+	int libre;
+	int copiados=0;
+
+	while (copiados<n){
+		hueco=pt_hueco(p, &libre);
+		if (libre==0){
+			break;
+		}
+		if (libre>n-copiados){
+			libre=n-copiados;
+		}
+		memcpy(hueco, datos+copiados, libre);
+		pt_confirma(p, libre);
+		copiados+=libre;
+	}
+	return copiados;
+}
+
+/*
+ * Descarta la trama en curso y reanuda la busqueda de inicio en el byte siguiente a su inicio
+ */
+static void pt_resincroniza(struct parser_trama *p){
+	p->lectura=p->inicio+1;
+	p->bytes_descartados++;
+	p->estado=PT_START;
+	p->n_start=0;
+}
+
+/*
+ * Analiza los bytes pendientes del bufer circular colocandolos en la trama apuntada por trama
+ * (debe ser la misma trama entre llamadas mientras no se complete).
+ * Devuelve:
+ *   1 si se ha completado una trama con longitud y checksum correctos
+ *   0 si se han agotado los bytes recibidos sin completar trama
+ *  -1 si se ha descartado una trama por longitud o checksum erroneos (se puede volver a llamar)
+ */
+int pt_extrae(struct parser_trama *p, struct fronius_frame *trama){
+	unsigned char c;
+
+	while (p->lectura != p->escritura){
+		c=p->anillo[p->lectura & MASK_RING_BUFFER];
+		p->lectura++;
+
+		switch (p->estado){
+		case PT_START:
+			if (c==START_BYTE){
+				if (p->n_start==0){
+					p->inicio=p->lectura-1;
+				}
+				p->n_start++;
+				if (p->n_start==SIZE_START){
+					trama->start[0]=trama->start[1]=trama->start[2]=START_BYTE;
+					p->estado=PT_LENGHT;
+				}
+			}
+			else {
+				p->bytes_descartados+=p->n_start+1;
+				p->n_start=0;
+			}
+			break;
+		case PT_LENGHT:
+			if (c==START_BYTE){
+				// byte de inicio de sobra: la longitud nunca puede valer 0x80
+				p->inicio++;
+				p->bytes_descartados++;
+				break;
+			}
+			if (c>MAX_SIZE_DATA_FIELD){
+				p->errores_longitud++;
+				pt_resincroniza(p);
+				return -1;
+			}
+			trama->lenght=c;
+			p->checksum=c;
+			p->estado=PT_DEVICE;
+			break;
+		case PT_DEVICE:
+			trama->device=c;
+			p->checksum+=c;
+			p->estado=PT_NUMBER;
+			break;
+		case PT_NUMBER:
+			trama->number=c;
+			p->checksum+=c;
+			p->estado=PT_COMMAND;
+			break;
+		case PT_COMMAND:
+			trama->command=c;
+			p->checksum+=c;
+			p->n_datos=0;
+			p->estado=trama->lenght>0?PT_DATOS:PT_CHECKSUM;
+			break;
+		case PT_DATOS:
+			trama->data_plus_checksum[p->n_datos++]=c;
+			p->checksum+=c;
+			if (p->n_datos==trama->lenght){
+				p->estado=PT_CHECKSUM;
+			}
+			break;
+		case PT_CHECKSUM:
+			trama->data_plus_checksum[trama->lenght]=c;
+			if (c!=p->checksum){
+				p->errores_checksum++;
+				pt_resincroniza(p);
+				return -1;
+			}
+			p->tramas++;
+			p->estado=PT_START;
+			p->n_start=0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * El checksum es la suma a 8 bits de todos los campos de la trama
+ * menos los 3 bytes de start y el propio checksum
+ */
+unsigned char fi_checksum(const struct fronius_frame *trama){
+	const unsigned char *puntero;
+	unsigned char checksum=0;
+	int bytes_a_sumar;
+
+	puntero=&trama->lenght;
+	for(bytes_a_sumar=(trama->lenght + 4);bytes_a_sumar>0; bytes_a_sumar--)
+	{
+		checksum+=*puntero;
+		puntero++;
+	}
+	return checksum;
+}
@@ -0,0 +1,82 @@
+/*
+ ============================================================================
+ Name        : trama.h
+ Author      : Juan Navarro
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Tramas del Fronius Interface Protocol y analizador
+               incremental de la secuencia de bytes recibida del
+               puerto serie
+ ============================================================================
+ */
+
+#ifndef TRAMA_H_
+#define TRAMA_H_
+
+#define SIZE_HEADER_FRAME               7 // tamaño de la trama sin el campo de datos y sin checksum
+#define SIZE_HEADER_FRAME_PLUS_CHECKSUM 8 // tamaño de la trama sin el campo de datos
+#define MAX_SIZE_DATA_FIELD 127 // tamaño maximo del campo de datos (sin checksum)
+
+#define START_BYTE       0x80 // byte de la secuencia de inicio de trama
+#define SIZE_START       3    // numero de bytes de la secuencia de inicio
+
+#define SIZE_RING_BUFFER 512  // tamaño del bufer circular de recepcion (potencia de 2)
+
+struct fronius_frame{
+		unsigned char start[3];  // start sequence  - 3 times 0x80
+		unsigned char lenght; // number  of bytes in data field
+		unsigned char device; // type device, eg  inverter, sensor box, etc
+		unsigned char number; // number of relevant device
+		unsigned char command;// Query, commnadd to be carried out
+		unsigned char data_plus_checksum[MAX_SIZE_DATA_FIELD+1]; 	//variable lenght value of queried command (max. 127 bytes)
+												//last byte is the checksum of all byes in frame except
+												//start and checksum
+
+};
+
+/*
+ * Estados del analizador de tramas
+ */
+enum estado_parser{
+	PT_START,    // buscando la secuencia 0x80 0x80 0x80
+	PT_LENGHT,
+	PT_DEVICE,
+	PT_NUMBER,
+	PT_COMMAND,
+	PT_DATOS,
+	PT_CHECKSUM
+};
+
+/*
+ * Analizador incremental de tramas.
+ * Los bytes se reciben en trozos de cualquier tamaño en un bufer circular y se van
+ * colocando directamente en los campos de la trama de destino a medida que se analizan.
+ * Ante una longitud invalida o un error de checksum se descarta la trama y la busqueda
+ * de inicio se reanuda en el byte siguiente al inicio de la trama descartada,
+ * de modo que un byte corrupto cuesta una trama y no desalinea las siguientes.
+ */
+struct parser_trama{
+	unsigned char anillo[SIZE_RING_BUFFER];
+	unsigned int escritura;   // bytes recibidos (posicion de escritura, sin enmascarar)
+	unsigned int lectura;     // bytes analizados (posicion de lectura, sin enmascarar)
+	unsigned int inicio;      // posicion del primer byte de la secuencia de inicio de la trama en curso
+	enum estado_parser estado;
+	int n_start;              // bytes 0x80 consecutivos encontrados
+	int n_datos;              // bytes del campo de datos ya recibidos
+	unsigned char checksum;   // checksum acumulado de la trama en curso
+
+	// contadores de diagnostico
+	unsigned long tramas;             // tramas completas y correctas
+	unsigned long errores_checksum;
+	unsigned long errores_longitud;
+	unsigned long bytes_descartados;  // bytes fuera de trama o de tramas descartadas
+};
+
+void pt_inicia(struct parser_trama *p);
+void pt_descarta(struct parser_trama *p);
+unsigned char *pt_hueco(struct parser_trama *p, int *n);
+void pt_confirma(struct parser_trama *p, int n);
+int pt_alimenta(struct parser_trama *p, const unsigned char *datos, int n);
+int pt_extrae(struct parser_trama *p, struct fronius_frame *trama);
+unsigned char fi_checksum(const struct fronius_frame *trama);
+
+#endif /* TRAMA_H_ */
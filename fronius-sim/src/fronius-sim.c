@@ -0,0 +1,461 @@
+/*
+ ============================================================================
+ Name        : fronius-sim.c
+ Author      : Juan Navarro
+ Version     :
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Simulador de una cadena de inversores Fronius que atiende
+               el Fronius Interface Protocol sobre un pseudo terminal,
+               para probar fronius-mon sin inversor real.
+               Emula el tiempo de las tramas en la linea, varios numeros
+               de inversor, errores de checksum, perdida de bytes y las
+               respuestas de longitud 0 que dan los inversores de noche.
+
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "../../fronius-mon/src/trama.h"
+
+#define MAX_INVERSORES_SIM 16
+
+/* VARIABLES GLOBALES */
+char *identificacion = "fronius-sim  Autor:Junavar";
+int baudios=19200;         // velocidad de la linea que se emula
+int retardo_ms=2;          // tiempo de proceso del inversor antes de responder
+int prob_checksum=0;       // probabilidad (%) de enviar una respuesta con checksum erroneo
+int prob_perdida=0;        // probabilidad (%) de perder un byte de una respuesta
+volatile sig_atomic_t modo_noche=0; // 0: produciendo, 1: respuestas de longitud 0, 2: sin respuesta
+int potencia_nominal=4000; // potencia nominal de cada inversor simulado
+int flag_d=0;              // pinta las tramas recibidas y enviadas
+
+struct inversor_sim{
+	unsigned char numero;
+	int lim_pot;          // limite (porcentaje) aplicado con el comando 0x9F
+	double potencia;      // potencia AC generada (W)
+	double energia_dia;   // energia generada en el dia (Wh)
+	double tension_dc;    // V
+	double corriente_dc;  // A
+	double potencia_max_dia; // maximo de potencia del dia (W)
+} inversores[MAX_INVERSORES_SIM];
+int num_inversores=0;
+
+struct timespec t_arranque, t_anterior;
+
+/*
+ * Tiempo en segundos entre dos instantes
+ */
+double diferencia(const struct timespec *a, const struct timespec *b){
+	return (b->tv_sec-a->tv_sec)+(b->tv_nsec-a->tv_nsec)/1e9;
+}
+
+/*
+ * Codifica un valor en el formato de los comandos de medida: msb, lsb, exponente decimal
+ */
+void codifica_valor(unsigned char *datos, double valor){
+	int exp=-3;
+	double mantisa;
+
+	if (valor<0) valor=0;
+	mantisa=valor*1000;
+	while (mantisa>65535 && exp<9){
+		mantisa/=10;
+		exp++;
+	}
+	datos[0]=((unsigned int)(mantisa+0.5)>>8)&0xFF;
+	datos[1]=(unsigned int)(mantisa+0.5)&0xFF;
+	datos[2]=(unsigned char)(signed char)exp;
+}
+
+/*
+ * SIGUSR1 pasa al modo de noche siguiente (0, 1, 2, 0...): anochecer y amanecer sin reiniciar
+ */
+void siguiente_modo_noche(int senal){
+	(void)senal;
+	modo_noche=(modo_noche+1)%3;
+}
+
+/*
+ * Evoluciona la produccion de todos los inversores hasta el instante actual.
+ * La potencia disponible oscila lentamente entre el 70% y el 80% de la nominal
+ * y la generada queda recortada por el limite aplicado.
+ */
+void actualiza_inversores(void){
+	struct timespec ahora;
+	double dt, t, disponible;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ahora);
+	dt=diferencia(&t_anterior, &ahora);
+	t=diferencia(&t_arranque, &ahora);
+	t_anterior=ahora;
+
+	for (i=0; i<num_inversores; i++){
+		disponible=potencia_nominal*(0.75+0.05*sin(t/30+i));
+		if (modo_noche){
+			disponible=0;
+		}
+		inversores[i].potencia=fmin(disponible, potencia_nominal*inversores[i].lim_pot/100.0);
+		inversores[i].energia_dia+=inversores[i].potencia*dt/3600;
+		inversores[i].tension_dc=modo_noche?0:350+10*sin(t/60);
+		inversores[i].corriente_dc=modo_noche?0:inversores[i].potencia/0.96/inversores[i].tension_dc;
+		inversores[i].potencia_max_dia=fmax(inversores[i].potencia_max_dia, inversores[i].potencia);
+	}
+}
+
+/*
+ * Valor que devuelve el inversor para un comando de medida. Las medidas AC y los acumulados
+ * que no se simulan se derivan de la potencia y de la energia del dia
+ */
+double valor_medida(const struct inversor_sim *inv, unsigned char comando){
+	switch (comando){
+	case 0x10: return inv->potencia;
+	case 0x11: return 12.5e6+inv->energia_dia;   // energia total
+	case 0x12: return inv->energia_dia;
+	case 0x13: return 1.8e6+inv->energia_dia;    // energia del año
+	case 0x14: return inv->potencia/230;         // corriente AC
+	case 0x15: return inv->potencia>0?230:0;     // tension AC
+	case 0x16: return inv->potencia>0?50:0;      // frecuencia AC
+	case 0x17: return inv->corriente_dc;
+	case 0x18: return inv->tension_dc;
+	default:   return inv->potencia_max_dia;     // 0x1A maximo de potencia del dia
+	}
+}
+
+struct inversor_sim *busca_inversor(unsigned char numero){
+	int i;
+	for (i=0; i<num_inversores; i++){
+		if (inversores[i].numero==numero){
+			return &inversores[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Prepara en respuesta la trama con la que contesta el inversor inv a la peticion.
+ * Devuelve 0 si el inversor no contesta
+ */
+int prepara_respuesta(struct inversor_sim *inv, const struct fronius_frame *peticion, struct fronius_frame *respuesta){
+	memset(respuesta, 0, sizeof(*respuesta));
+	respuesta->start[0]=respuesta->start[1]=respuesta->start[2]=START_BYTE;
+	respuesta->device=peticion->device;
+	respuesta->number=peticion->device==0x01 || peticion->command==0x9F?inv->numero:peticion->number; // a una peticion al numero 0 responde con el suyo
+	respuesta->command=peticion->command;
+
+	switch (peticion->command){
+	case 0x01: // version
+		respuesta->lenght=8;
+		respuesta->data_plus_checksum[0]=0xFE; // tipo de inversor
+		respuesta->data_plus_checksum[1]=2; respuesta->data_plus_checksum[2]=4; respuesta->data_plus_checksum[3]=0;
+		respuesta->data_plus_checksum[4]=1; respuesta->data_plus_checksum[5]=7; respuesta->data_plus_checksum[6]=3; respuesta->data_plus_checksum[7]=inv->numero;
+		break;
+	case 0x10: // potencia
+	case 0x11: // energia total
+	case 0x12: // energia del dia
+	case 0x13: // energia del año
+	case 0x14: // corriente AC
+	case 0x15: // tension AC
+	case 0x16: // frecuencia AC
+	case 0x17: // corriente DC
+	case 0x18: // tension DC
+	case 0x1A: // maximo de potencia del dia
+		if (modo_noche==2){
+			return 0;
+		}
+		if (modo_noche==1){
+			respuesta->lenght=0; // p.e. 128128128 0 1 1 16  18
+			break;
+		}
+		respuesta->lenght=3;
+		codifica_valor(respuesta->data_plus_checksum, valor_medida(inv, peticion->command));
+		break;
+	case 0xBD: // capacidades: admite limitacion de potencia
+		respuesta->lenght=1;
+		respuesta->data_plus_checksum[0]=0x01;
+		break;
+	case 0x9F: // limite de potencia (broadcast): se devuelven los datos con 0xFF en el numero de inversor
+		respuesta->lenght=10;
+		memcpy(respuesta->data_plus_checksum, peticion->data_plus_checksum, 9);
+		respuesta->data_plus_checksum[9]=0xFF;
+		break;
+	default: // comando desconocido
+		respuesta->command=0x0e;
+		respuesta->lenght=2;
+		respuesta->data_plus_checksum[0]=peticion->command;
+		respuesta->data_plus_checksum[1]=0x01;
+		break;
+	}
+	respuesta->data_plus_checksum[respuesta->lenght]=fi_checksum(respuesta);
+	return 1;
+}
+
+/*
+ * Aplica el comando 0x9F a los inversores a los que va dirigido
+ */
+void aplica_limite(const struct fronius_frame *peticion){
+	struct inversor_sim *inv;
+	int i;
+	int p_rel;
+
+	if (peticion->lenght<10 || peticion->data_plus_checksum[0]!=0x01){
+		return;
+	}
+	p_rel=peticion->data_plus_checksum[2]>100?100:peticion->data_plus_checksum[2];
+	for (i=9; i<peticion->lenght; i++){
+		inv=busca_inversor(peticion->data_plus_checksum[i]);
+		if (inv){
+			inv->lim_pot=p_rel;
+		}
+	}
+}
+
+/*
+ * Añade al bufer de salida una trama aplicando los errores configurados
+ */
+int serializa(unsigned char *salida, const struct fronius_frame *trama){
+	int n=SIZE_HEADER_FRAME_PLUS_CHECKSUM+trama->lenght;
+	int perdido;
+
+	memcpy(salida, trama, n);
+	if (prob_checksum && rand()%100<prob_checksum){
+		salida[n-1]^=0x5A;
+	}
+	if (prob_perdida && rand()%100<prob_perdida){
+		perdido=rand()%n;
+		memmove(salida+perdido, salida+perdido+1, n-perdido-1);
+		n--;
+	}
+	return n;
+}
+
+/*
+ * Velocidad a la que el cliente ha configurado el pseudo terminal (el lado esclavo comparte
+ * la configuracion con el maestro), o 0 si no es una de las de la tarjeta de interfaz
+ */
+int velocidad_cliente(int fd){
+	struct termios tp;
+
+	if (tcgetattr(fd, &tp)){
+		return 0;
+	}
+	switch (cfgetospeed(&tp)){
+	case B2400:  return 2400;
+	case B4800:  return 4800;
+	case B9600:  return 9600;
+	case B19200: return 19200;
+	default:     return 0;
+	}
+}
+
+/*
+ * Atiende una peticion completa: espera el tiempo que tardarian la peticion y la respuesta
+ * en la linea a la velocidad emulada y escribe la respuesta en el pseudo terminal
+ */
+void atiende(int fd, const struct fronius_frame *peticion){
+	static struct fronius_frame respuesta;
+	unsigned char salida[MAX_INVERSORES_SIM*sizeof(struct fronius_frame)];
+	int n=0;
+	int i;
+	int bytes_en_linea;
+
+	actualiza_inversores();
+
+	// a otra velocidad la tarjeta solo veria ruido
+	if (velocidad_cliente(fd)!=baudios){
+		if (flag_d){
+			printf("Peticion a %d baudios ignorada (linea a %d)\n", velocidad_cliente(fd), baudios);
+		}
+		return;
+	}
+
+	if ((peticion->command==0x9F && peticion->device==0x00) || (peticion->device==0x01 && peticion->number==0x00)){
+		if (peticion->command==0x9F){
+			aplica_limite(peticion);
+		}
+		// difusion: contesta cada uno de los inversores
+		for (i=0; i<num_inversores; i++){
+			if (prepara_respuesta(&inversores[i], peticion, &respuesta)){
+				n+=serializa(salida+n, &respuesta);
+			}
+		}
+	}
+	else if (peticion->device==0x01){
+		struct inversor_sim *inv=busca_inversor(peticion->number);
+		if (inv && prepara_respuesta(inv, peticion, &respuesta)){
+			n+=serializa(salida+n, &respuesta);
+		}
+	}
+
+	if (flag_d){
+		printf("Peticion: device %d number %d command 0x%02x lenght %d -> %d bytes de respuesta\n",
+				peticion->device, peticion->number, peticion->command, peticion->lenght, n);
+	}
+	if (n==0){
+		return;
+	}
+
+	// 10 bits por byte (start + 8 datos + stop)
+	bytes_en_linea=SIZE_HEADER_FRAME_PLUS_CHECKSUM+peticion->lenght+n;
+	usleep(retardo_ms*1000+(useconds_t)((long long)bytes_en_linea*10*1000000/baudios));
+	if (write(fd, salida, n)!=n){
+		printf("Escritura incompleta en pseudo terminal: %s\n", strerror(errno));
+	}
+}
+
+/*
+ * Interpreta una lista de inversores del tipo 1,3-5
+ */
+int lee_lista_inversores(const char *lista){
+	const char *p=lista;
+	char *fin;
+	long desde, hasta, n;
+
+	num_inversores=0;
+	while (*p){
+		desde=strtol(p, &fin, 10);
+		if (fin==p) return -1;
+		hasta=desde;
+		p=fin;
+		if (*p=='-'){
+			p++;
+			hasta=strtol(p, &fin, 10);
+			if (fin==p) return -1;
+			p=fin;
+		}
+		if (desde<1 || hasta>254 || desde>hasta) return -1;
+		for (n=desde; n<=hasta; n++){
+			if (num_inversores==MAX_INVERSORES_SIM) return -1;
+			inversores[num_inversores].numero=(unsigned char)n;
+			inversores[num_inversores].lim_pot=100;
+			num_inversores++;
+		}
+		if (*p==',') p++;
+		else if (*p) return -1;
+	}
+	return num_inversores>0?0:-1;
+}
+
+int main(int argc, char *argv[]) {
+	int fdm, fds;
+	char *nombre_esclavo;
+	char *enlace=NULL;
+	struct termios tp;
+	struct pollfd pfd;
+	struct parser_trama parser;
+	struct fronius_frame peticion;
+	unsigned char *hueco;
+	int libre;
+	int rc;
+	int opt;
+
+	printf("%s\n", identificacion);
+
+	lee_lista_inversores("1");
+	opterr = 0;
+	while ( (opt = getopt(argc, argv, "hb:i:c:x:n:r:p:L:s:d")) != -1 ) {
+		switch ( opt ) {
+			case 'b': baudios=atoi(optarg); break;
+			case 'i':
+				if (lee_lista_inversores(optarg)){
+					printf("Invalid inverter list %s\n", optarg);
+					return -1;
+				}
+				break;
+			case 'c': prob_checksum=atoi(optarg); break;
+			case 'x': prob_perdida=atoi(optarg); break;
+			case 'n': modo_noche=atoi(optarg); break;
+			case 'r': retardo_ms=atoi(optarg); break;
+			case 'p': potencia_nominal=atoi(optarg); break;
+			case 'L': enlace=optarg; break;
+			case 's': srand(atoi(optarg)); break;
+			case 'd': flag_d=1; break;
+			case 'h':
+				printf("\nUse: fronius-sim [-b baud] [-i inv_list] [-c pct] [-x pct] [-n mode] [-r ms] [-p pot_inv] [-L link] [-s seed] [-d]");
+				printf("\n-b baud rate emulated on the line (2400..19200). 19200 is the default");
+				printf("\n-i inverter numbers, e.g. 1,3-5. 1 is the default");
+				printf("\n-c percentage of replies sent with a wrong checksum");
+				printf("\n-x percentage of replies with one byte dropped");
+				printf("\n-n night mode: 0 producing, 1 zero-length replies, 2 no reply. SIGUSR1 switches to the next mode");
+				printf("\n-r processing delay of the inverter in ms. 2 is the default");
+				printf("\n-p nominal power of each inverter in watts");
+				printf("\n-L symbolic link to create pointing to the pseudo terminal");
+				printf("\n-s seed for error injection");
+				printf("\n-d display frames for debug");
+				printf("\n");
+				return -1;
+			case '?':
+				printf("\nOption -%c invalid. Use -h option for info\n", optopt);
+				return -1;
+		}
+	}
+	if (baudios<300){
+		printf("Invalid baud rate\n");
+		return -1;
+	}
+
+	fdm=posix_openpt(O_RDWR|O_NOCTTY);
+	if (fdm<0 || grantpt(fdm) || unlockpt(fdm) || (nombre_esclavo=ptsname(fdm))==NULL){
+		printf("error %d creating pseudo terminal: %s\n", errno, strerror(errno));
+		return -1;
+	}
+	// se mantiene abierto el esclavo para que el maestro no reciba POLLHUP cuando fronius-mon lo cierra
+	fds=open(nombre_esclavo, O_RDWR|O_NOCTTY);
+	tcgetattr(fds, &tp);
+	cfmakeraw(&tp);
+	tcsetattr(fds, TCSANOW, &tp);
+
+	if (enlace){
+		unlink(enlace);
+		if (symlink(nombre_esclavo, enlace)){
+			printf("error %d creating link %s: %s\n", errno, enlace, strerror(errno));
+			return -1;
+		}
+	}
+	printf("dev_file:%s%s%s  inverters:%d  baud:%d  checksum errors:%d%%  dropped bytes:%d%%  night mode:%d\n",
+			nombre_esclavo, enlace?" -> ":"", enlace?enlace:"", num_inversores, baudios, prob_checksum, prob_perdida, modo_noche);
+	fflush(stdout);
+
+	signal(SIGUSR1, siguiente_modo_noche);
+	clock_gettime(CLOCK_MONOTONIC, &t_arranque);
+	t_anterior=t_arranque;
+	pt_inicia(&parser);
+
+	pfd.fd=fdm;
+	pfd.events=POLLIN;
+	while (1){
+		rc=poll(&pfd, 1, -1);
+		if (rc==-1){
+			if (errno==EINTR) continue;
+			break;
+		}
+		hueco=pt_hueco(&parser, &libre);
+		rc=read(fdm, hueco, libre);
+		if (rc<=0){
+			continue;
+		}
+		pt_confirma(&parser, rc);
+		while ((rc=pt_extrae(&parser, &peticion))!=0){
+			if (rc==1){
+				atiende(fdm, &peticion);
+			}
+		}
+	}
+	printf("error %d reading pseudo terminal: %s\n", errno, strerror(errno));
+	close(fds);
+	close(fdm);
+	return -1;
+}
@@ -0,0 +1,1502 @@
+/*
+ ============================================================================
+ Name        : fronius-util.c
+ Author      : Juan Navarro
+ Version     :
+ Copyright   : Copyright Juan Navarro García. Todos los derechos reservados.
+ Descriptio  : Utilidades para consultar los datos que genera fronius-mon
+               (registro binario y memoria compartida) desde otros procesos
+
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <float.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "../../fronius-mon/src/registro_bin.h"
+#include "../../fronius-mon/src/publicacion.h"
+#include "../../fronius-mon/src/limitador.h"
+#include "../../fronius-mon/src/aviso.h"
+#include "../../fronius-mon/src/historico.h"
+#include "../../fronius-mon/src/estadisticas.h"
+#include "../../fronius-mon/src/anillo.h"
+#include "../../fronius-mon/src/indice_bin.h"
+#include "../../fronius-mon/src/trama.h"
+#include "../../fronius-mon/src/medidas.h"
+#include "../../fronius-mon/src/captura.h"
+#include "../../fronius-mon/src/estado_inversor.h"
+
+char *identificacion = "fronius-util  Autor:Junavar";
+
+/*
+ * Regenera a partir del registro binario el formato de texto de datosinversor.txt:
+ * una linea cada minuto con la potencia media, la energia, las muestras, la potencia maxima y minima
+ * y el limite medio del cuarto de hora en curso (el terminado si acaba de cerrarse), sacados de las
+ * muestras de cada segundo con la misma ventana de 15 minutos que la linea de cada minuto de fronius-mon
+ */
+int comando_txt(int argc, char *argv[]){
+	static struct muestra_bin muestras[MUESTRAS_BLOQUE_BIN];
+	static struct agregador agregador;
+	const struct resultado_serie *rs;
+	struct mapa_registro_bin mapa;
+	const struct muestra_bin *m;
+	struct tm loc_time;
+	time_t instante;
+	char buf[150];
+	size_t n, i, posicion=0;
+	int minuto_anterior=-1, cuarto_anterior=-1, cerradas;
+	int64_t minuto;
+	float energia, energia_anterior=0, energia_intervalo;
+
+	if (argc!=2){
+		printf("Use: fronius-util txt file.bin\n");
+		return -1;
+	}
+	if (rb_mapea(argv[1], &mapa)){
+		printf("Error: %s is not a fronius-mon binary log\n", argv[1]);
+		return -1;
+	}
+
+	printf("dia\thora\tPot. med\tenergia\tPot. max\tPot. min\tlimite\n");
+	printf("   \t    \t  (w)   \t (w*s)  \t (w)   \t  (w)   \t(porc)\n");
+
+	do {
+		n=rb_lee_bloque(&mapa, posicion, muestras, &posicion);
+		for (i=0; i<n; i++){
+			m=&muestras[i];
+			instante=m->instante;
+			localtime_r(&instante, &loc_time);
+			minuto=((int64_t)instante+loc_time.tm_gmtoff)/60;
+			energia=m->energia_dia/10.0;
+
+			if (minuto_anterior==-1){
+				ag_inicia(&agregador, "15m", minuto);
+				energia_anterior=energia;
+				minuto_anterior=loc_time.tm_min;
+				cuarto_anterior=loc_time.tm_hour*4+loc_time.tm_min/15;
+			}
+			cerradas=ag_avanza(&agregador, minuto);
+			ag_anota(&agregador, m);
+
+			// una linea con la primera muestra de cada minuto
+			if (loc_time.tm_min!=minuto_anterior){
+				minuto_anterior=loc_time.tm_min;
+				energia_intervalo=energia-energia_anterior;
+				rs=cerradas & 1?agregador.ventana[0].cerrada.serie:agregador.ventana[0].en_curso.serie;
+				strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S%z", &loc_time);
+				printf("%s %4.1f %6.1f %3u %4.1f %4.1f %3d\n", buf, rs[SE_POTENCIA].media, energia_intervalo,
+						rs[SE_POTENCIA].n, rs[SE_POTENCIA].maximo, rs[SE_POTENCIA].minimo, (int)lrintf(rs[SE_LIMITE].media));
+			}
+
+			// comienzo de cuarto de hora: la muestra cierra el intervalo anterior y abre el siguiente
+			if (loc_time.tm_hour*4+loc_time.tm_min/15!=cuarto_anterior){
+				cuarto_anterior=loc_time.tm_hour*4+loc_time.tm_min/15;
+				energia_anterior=energia;
+			}
+		}
+	} while (n==MUESTRAS_BLOQUE_BIN);
+	rb_desmapea(&mapa);
+	return 0;
+}
+
+/*
+ * Flujo de bytes de un fichero del corpus del analizador de tramas: bytes en hexadecimal separados
+ * por blancos y comentarios desde # hasta el final de la linea. La linea
+ * "# esperado: tramas=N checksum=N longitud=N" da lo que debe contar el analizador
+ */
+struct flujo_corpus{
+	char nombre[256];
+	unsigned char *bytes;
+	size_t n;
+	unsigned long tramas, checksum, longitud;
+	int con_esperado;
+};
+
+static int lee_flujo_corpus(const char *fichero, struct flujo_corpus *f){
+	FILE *fp;
+	char linea[512], *p, *fin;
+	unsigned char *nuevos;
+	size_t capacidad=0;
+	unsigned long valor;
+
+	memset(f, 0, sizeof(*f));
+	fp=fopen(fichero, "r");
+	if (fp==NULL){
+		return -1;
+	}
+	while (fgets(linea, sizeof(linea), fp)!=NULL){
+		p=strchr(linea, '#');
+		if (p!=NULL){
+			if (sscanf(p, "# esperado: tramas=%lu checksum=%lu longitud=%lu", &f->tramas, &f->checksum, &f->longitud)==3){
+				f->con_esperado=1;
+			}
+			*p='\0';
+		}
+		for (p=linea; ; p=fin){
+			valor=strtoul(p, &fin, 16);
+			if (fin==p){
+				break;
+			}
+			if (valor>0xFF){
+				fclose(fp);
+				free(f->bytes);
+				return -1;
+			}
+			if (f->n==capacidad){
+				capacidad=capacidad?capacidad*2:1024;
+				nuevos=realloc(f->bytes, capacidad);
+				if (nuevos==NULL){
+					fclose(fp);
+					free(f->bytes);
+					return -1;
+				}
+				f->bytes=nuevos;
+			}
+			f->bytes[f->n++]=(unsigned char)valor;
+		}
+		p+=strspn(p, " \t\r\n");
+		if (*p!='\0'){
+			fclose(fp);
+			free(f->bytes);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return f->con_esperado?0:-1;
+}
+
+/*
+ * Pasa un flujo por el analizador con pt_alimenta() en trozos de tamaño aleatorio (de 1 byte a mas
+ * que el bufer circular) y pt_extrae() tras cada trozo, como llegan los bytes de read(). Devuelve
+ * las tramas extraidas; las que no cumplen su checksum se cuentan en *malas
+ */
+static unsigned long analiza_en_trozos(struct parser_trama *p, const struct flujo_corpus *f, unsigned int *semilla,
+		unsigned long *malas){
+	static struct fronius_frame trama;
+	unsigned long tramas=0;
+	size_t posicion=0;
+	int trozo, admitidos, rc;
+
+	pt_inicia(p);
+	while (posicion<f->n){
+		trozo=1+rand_r(semilla)%(rand_r(semilla)%2?8:SIZE_RING_BUFFER+64);
+		if ((size_t)trozo>f->n-posicion){
+			trozo=f->n-posicion;
+		}
+		admitidos=pt_alimenta(p, f->bytes+posicion, trozo);
+		posicion+=admitidos;
+		while ((rc=pt_extrae(p, &trama))!=0){
+			if (rc==1){
+				tramas++;
+				if (fi_checksum(&trama)!=trama.data_plus_checksum[trama.lenght]){
+					(*malas)++;
+				}
+			}
+		}
+	}
+	return tramas;
+}
+
+/*
+ * Prueba y mide el analizador de tramas con el corpus de fronius-util/corpus: cada flujo se pasa
+ * rondas veces en trozos de tamaño aleatorio y debe dar siempre las tramas y los errores de checksum
+ * y de longitud esperados. Informa de los bytes por segundo del analizador
+ */
+int comando_bench_parser(int argc, char *argv[]){
+	static struct parser_trama p;
+	struct flujo_corpus flujos[64];
+	struct timespec inicio, fin;
+	char fichero[1024];
+	struct dirent **entradas;
+	unsigned int semilla=argc>3?(unsigned int)strtoul(argv[3], NULL, 10):1;
+	unsigned long rondas=argc>2?strtoul(argv[2], NULL, 10):2000;
+	unsigned long r, tramas, malas, fallos=0, bytes_total=0;
+	double segundos, segundos_total=0;
+	int n=0, i, j, num_entradas, distinto;
+
+	if (argc<2 || argc>4 || rondas==0){
+		printf("Use: fronius-util bench-parser corpus_dir [rounds] [seed]\n");
+		return -1;
+	}
+	num_entradas=scandir(argv[1], &entradas, NULL, alphasort);
+	if (num_entradas<0){
+		printf("Error opening %s\n", argv[1]);
+		return -1;
+	}
+	for (j=0; j<num_entradas; j++){
+		if (n<64 && strlen(entradas[j]->d_name)>4 && strcmp(entradas[j]->d_name+strlen(entradas[j]->d_name)-4, ".hex")==0){
+			snprintf(fichero, sizeof(fichero), "%s/%s", argv[1], entradas[j]->d_name);
+			if (lee_flujo_corpus(fichero, &flujos[n])==0){
+				snprintf(flujos[n].nombre, sizeof(flujos[n].nombre), "%s", entradas[j]->d_name);
+				n++;
+			}
+			else {
+				printf("Error: %s is not a corpus file (hex bytes and an \"# esperado:\" line)\n", fichero);
+			}
+		}
+		free(entradas[j]);
+	}
+	free(entradas);
+	if (n==0){
+		printf("Error: no corpus files in %s\n", argv[1]);
+		return -1;
+	}
+
+	printf("%lu rounds per stream in random chunks of 1 to %d bytes, seed %u\n", rondas, SIZE_RING_BUFFER+64, semilla);
+	printf("stream              bytes  frames  checksum  length  result   MB/s\n");
+	for (i=0; i<n; i++){
+		distinto=0;
+		malas=0;
+		clock_gettime(CLOCK_MONOTONIC, &inicio);
+		for (r=0; r<rondas; r++){
+			tramas=analiza_en_trozos(&p, &flujos[i], &semilla, &malas);
+			if (tramas!=flujos[i].tramas || p.errores_checksum!=flujos[i].checksum || p.errores_longitud!=flujos[i].longitud){
+				distinto++;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &fin);
+		segundos=(fin.tv_sec-inicio.tv_sec)+(fin.tv_nsec-inicio.tv_nsec)/1e9;
+		segundos_total+=segundos;
+		bytes_total+=flujos[i].n*rondas;
+		if (distinto || malas){
+			fallos++;
+		}
+		printf("%-16s %8zu  %6lu  %8lu  %6lu  %-7s %6.1f\n", flujos[i].nombre, flujos[i].n,
+				tramas, p.errores_checksum, p.errores_longitud, distinto || malas?"FAIL":"ok", flujos[i].n*rondas/segundos/1e6);
+		if (distinto){
+			printf("  expected frames:%lu checksum:%lu length:%lu, %d of %lu rounds differ\n",
+					flujos[i].tramas, flujos[i].checksum, flujos[i].longitud, distinto, rondas);
+		}
+		if (malas){
+			printf("  %lu frames returned with a wrong checksum\n", malas);
+		}
+		free(flujos[i].bytes);
+	}
+	printf("total: %lu bytes in %.3f s, %.1f MB/s. %lu stream(s) failed\n", bytes_total, segundos_total,
+			bytes_total/segundos_total/1e6, fallos);
+	return fallos?-1:0;
+}
+
+/*
+ * Presenta la ultima instantanea publicada por fronius-mon en memoria compartida
+ */
+int comando_snapshot(int argc, char *argv[]){
+	const struct publicacion *pub;
+	struct datos_inversores datos;
+	const struct datos_inversor *inv;
+	const struct resumen_ventana *rv;
+	const struct resultado_serie *r;
+	long generacion;
+	char buf[150], nombre[16];
+	time_t ventana_utc;
+	int i, m, v, s;
+
+	(void)argc;
+	(void)argv;
+	pub=pub_conecta();
+	if (pub==NULL){
+		printf("Error: fronius-mon shared memory not found\n");
+		return -1;
+	}
+	generacion=pub_lee(pub, &datos);
+	if (generacion<0){
+		printf("Error: no consistent snapshot could be read\n");
+		return -1;
+	}
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S%z", localtime(&datos.instante));
+	printf("generation:%ld time:%s\n", generacion, buf);
+	printf("power:%.1fW consumption:%.1fW day_energy:%.1fWh limit:%d%% sent:%d%% limit_frames:%lu cycle:%dms cycles:%lu exceeded:%lu postponed:%lu\n",
+			datos.potencia_generada_total, datos.potencia_consumo, datos.energia_generada_dia_total, datos.lim_pot,
+			datos.lim_reparto, datos.tramas_limite,
+			datos.ciclo_ms, datos.ciclos, datos.ciclos_excedidos, datos.consultas_omitidas);
+	if (datos.avisos){
+		printf("notifications:%lu export:%lu delay last:%.1fms mean:%.1fms max:%.1fms\n",
+				datos.avisos, datos.avisos_exportacion, datos.retardo_aviso_ms,
+				datos.avisos_exportacion?datos.retardo_aviso_total_ms/datos.avisos_exportacion:0, datos.retardo_aviso_max_ms);
+	}
+	if (datos.limites_transmitidos || datos.ordenes_bus){
+		printf("limit to line: frames:%lu delay last:%.1fms mean:%.1fms max:%.1fms bus orders:%lu expired:%lu ahead:%lu\n",
+				datos.limites_transmitidos, datos.retardo_limite_ms,
+				datos.limites_transmitidos?datos.retardo_limite_total_ms/datos.limites_transmitidos:0, datos.retardo_limite_max_ms,
+				datos.ordenes_bus, datos.ordenes_vencidas, datos.ordenes_adelantadas);
+	}
+	printf("recoveries:%lu last:%.0fms mean:%.0fms max:%.0fms outages:%lu\n",
+			datos.recuperaciones, datos.recuperacion_ms,
+			datos.recuperaciones?datos.recuperacion_total_ms/datos.recuperaciones:0, datos.recuperacion_max_ms, datos.caidas);
+	printf("writer: queued max:%lu dropped:%lu errors:%lu slowest batch:%.1fms\n",
+			datos.escritura_max_pendientes, datos.escritura_descartes, datos.escritura_errores, datos.escritura_max_ms);
+	for (v=0; v<datos.num_ventanas && v<MAX_VENTANAS; v++){
+		rv=&datos.ventana_cerrada[v];
+		ventana_utc=datos.ventana_en_curso[v].inicio*60;
+		strftime(buf, sizeof(buf), "%H:%M", gmtime(&ventana_utc)); // inicio en minutos de la hora local
+		printf("window %s: current from %s, %u samples, power mean %.1fW", ag_nombre_ventana(rv->minutos, nombre, sizeof(nombre)),
+				buf, datos.ventana_en_curso[v].serie[SE_POTENCIA].n, datos.ventana_en_curso[v].serie[SE_POTENCIA].media);
+		if (rv->serie[SE_POTENCIA].n==0){
+			printf("; none complete yet\n");
+			continue;
+		}
+		ventana_utc=rv->inicio*60;
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", gmtime(&ventana_utc));
+		printf("; last complete from %s:\n", buf);
+		for (s=0; s<NUM_SERIES; s++){
+			r=&rv->serie[s];
+			printf("  %-6s n:%-5u mean:%-8.2f sd:%-8.2f min:%-8.2f p50:%-8.2f p90:%-8.2f p99:%-8.2f max:%-8.2f %s\n", nombres_series[s],
+					r->n, r->media, r->desviacion, r->minimo, r->p50, r->p90, r->p99, r->maximo, unidades_series[s]);
+		}
+	}
+	for (i=0; i<datos.num_inversores && i<MAX_INVERSORES; i++){
+		inv=&datos.inversor[i];
+		printf("inverter:%d valid:%d state:%s limit:%d%%", inv->numero, inv->valido,
+				inv->estado<NUM_ESTADOS_INVERSOR?nombres_estados_inversor[inv->estado]:"?", inv->lim_pot);
+		if (!inv->valido){
+			printf(" read %lds ago", (long)(datos.instante-inv->instante)); // valores antiguos
+		}
+		for (m=0; m<NUM_MEDIDAS; m++){
+			printf(" %s:%g%s", medidas[m].nombre, inv->medida[m], medidas[m].unidad);
+		}
+		printf("\n");
+	}
+	return 0;
+}
+
+/*
+ * Medida del coste de escritor y lectores de la instantanea publicada con contencion:
+ * un hilo escritor publica sin pausa mientras varios hilos lectores leen sin pausa.
+ * Cada instantanea lleva la misma marca en todos los inversores para detectar copias mezcladas
+ */
+struct publicacion pub_medida;
+volatile int fin_medida;
+
+struct resultado_hilo{
+	unsigned long operaciones;
+	unsigned long fallidas;
+	unsigned long mezcladas;
+};
+
+void *hilo_escritor(void *arg){
+	struct resultado_hilo *r=arg;
+	static struct datos_inversores datos;
+	int i;
+
+	datos.num_inversores=MAX_INVERSORES;
+	while (!fin_medida){
+		for (i=0; i<MAX_INVERSORES; i++){
+			datos.inversor[i].medida[MED_POTENCIA]=(float)(r->operaciones&0xFFFF);
+		}
+		pub_escribe(&pub_medida, &datos);
+		r->operaciones++;
+	}
+	return NULL;
+}
+
+void *hilo_lector(void *arg){
+	struct resultado_hilo *r=arg;
+	struct datos_inversores copia;
+	int i;
+
+	while (!fin_medida){
+		if (pub_lee(&pub_medida, &copia)<0){
+			r->fallidas++;
+			continue;
+		}
+		for (i=1; i<MAX_INVERSORES; i++){
+			if (copia.inversor[i].medida[MED_POTENCIA]!=copia.inversor[0].medida[MED_POTENCIA]){
+				r->mezcladas++;
+				break;
+			}
+		}
+		r->operaciones++;
+	}
+	return NULL;
+}
+
+int comando_bench_snapshot(int argc, char *argv[]){
+	int lectores=argc>1?atoi(argv[1]):4;
+	int segundos=argc>2?atoi(argv[2]):2;
+	pthread_t escritor, *hilos;
+	struct resultado_hilo r_escritor={0}, *r_lectores;
+	unsigned long lecturas=0, fallidas=0, mezcladas=0;
+	int i;
+
+	if (lectores<0 || segundos<=0){
+		printf("Use: fronius-util bench-snapshot [readers] [seconds]\n");
+		return -1;
+	}
+	hilos=calloc(lectores, sizeof(pthread_t));
+	r_lectores=calloc(lectores, sizeof(struct resultado_hilo));
+	fin_medida=0;
+	pthread_create(&escritor, NULL, hilo_escritor, &r_escritor);
+	for (i=0; i<lectores; i++){
+		pthread_create(&hilos[i], NULL, hilo_lector, &r_lectores[i]);
+	}
+	sleep(segundos);
+	fin_medida=1;
+	pthread_join(escritor, NULL);
+	for (i=0; i<lectores; i++){
+		pthread_join(hilos[i], NULL);
+		lecturas+=r_lectores[i].operaciones;
+		fallidas+=r_lectores[i].fallidas;
+		mezcladas+=r_lectores[i].mezcladas;
+	}
+	printf("snapshot size: %zu bytes  readers: %d  seconds: %d\n", sizeof(struct datos_inversores), lectores, segundos);
+	printf("writer: %lu publications  %.0f ns/publication\n", r_escritor.operaciones, segundos*1e9/r_escritor.operaciones);
+	if (lectores){
+		printf("readers: %lu reads  %.0f ns/read per reader  failed:%lu  torn:%lu\n",
+				lecturas, lecturas?segundos*1e9*lectores/lecturas:0, fallidas, mezcladas);
+	}
+	free(hilos);
+	free(r_lectores);
+	return mezcladas?-1:0;
+}
+
+/*
+ * Sigue el anillo de muestras de fronius-mon: imprime cada muestra de cada segundo sin perder ninguna
+ * aunque se lea cada varios segundos. Con all empieza por la mas antigua del anillo
+ */
+int comando_follow(int argc, char *argv[]){
+	const struct anillo_muestras *anillo;
+	struct lector_anillo lector;
+	struct muestra_bin m;
+	uint64_t perdidas=0;
+	int periodo=argc>2?atoi(argv[2]):1;
+	time_t instante;
+	char buf[150];
+
+	if (argc>3 || (argc>1 && strcmp(argv[1], "all")!=0 && strcmp(argv[1], "new")!=0) || periodo<=0){
+		printf("Use: fronius-util follow [all|new] [period_s]\n");
+		return -1;
+	}
+	anillo=an_conecta();
+	if (anillo==NULL){
+		printf("Error: fronius-mon sample ring not found\n");
+		return -1;
+	}
+	an_lector(&lector, anillo, argc>1 && strcmp(argv[1], "all")==0);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("time\tpower(W)\timport(W)\tlimit(%%)\tdcv(V)\tdci(A)\tday(Wh)\n");
+	while (1){
+		while (an_lee(&lector, &m)){
+			if (lector.perdidas!=perdidas){
+				printf("# %llu samples lost\n", (unsigned long long)(lector.perdidas-perdidas));
+				perdidas=lector.perdidas;
+			}
+			instante=m.instante;
+			strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S%z", localtime(&instante));
+			printf("%s\t%u\t%d\t%u\t%.1f\t%.2f\t%.1f\n", buf, m.potencia_generada, m.potencia_importada,
+					m.limite, m.tension_dc/10.0, m.corriente_dc/100.0, m.energia_dia/10.0);
+		}
+		sleep(periodo);
+	}
+	return 0;
+}
+
+/*
+ * Medida del coste del productor del anillo con 0, 1, 2, 4... lectores leyendo sin pausa.
+ * Cada muestra lleva su posicion en instante y energia_dia para detectar copias mezcladas
+ */
+struct anillo_muestras anillo_medida;
+
+void *hilo_lector_anillo(void *arg){
+	struct resultado_hilo *r=arg;
+	struct lector_anillo lector;
+	struct muestra_bin m;
+
+	an_lector(&lector, &anillo_medida, 0);
+	while (!fin_medida){
+		if (an_lee(&lector, &m)){
+			if (m.instante!=m.energia_dia){
+				r->mezcladas++;
+			}
+			r->operaciones++;
+		}
+	}
+	r->fallidas=lector.perdidas;
+	return NULL;
+}
+
+int comando_bench_ring(int argc, char *argv[]){
+	int max_lectores=argc>1?atoi(argv[1]):8;
+	int segundos=argc>2?atoi(argv[2]):1;
+	pthread_t hilos[64];
+	struct resultado_hilo r[64];
+	struct muestra_bin m;
+	struct timespec inicio, fin, inicio_cpu, fin_cpu;
+	unsigned long escrituras, lecturas, perdidas, mezcladas=0;
+	double ns;
+	int lectores, i;
+
+	if (max_lectores<0 || max_lectores>64 || segundos<=0){
+		printf("Use: fronius-util bench-ring [max_readers] [seconds]\n");
+		return -1;
+	}
+	printf("ring: %d slots of %zu bytes (%zu bytes)\n", HUECOS_ANILLO, sizeof(struct hueco_anillo), sizeof(struct anillo_muestras));
+	printf("readers  cpu ns/write  writes      reads/reader  lost/reader\n");
+	for (lectores=0; lectores<=max_lectores; lectores=lectores?lectores*2:1){
+		an_inicia(&anillo_medida);
+		memset(r, 0, sizeof(r));
+		memset(&m, 0, sizeof(m));
+		fin_medida=0;
+		for (i=0; i<lectores; i++){
+			pthread_create(&hilos[i], NULL, hilo_lector_anillo, &r[i]);
+		}
+		// tiempo de CPU del productor: con menos nucleos que hilos el tiempo real incluiria el de los lectores
+		escrituras=0;
+		clock_gettime(CLOCK_MONOTONIC, &inicio);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &inicio_cpu);
+		do {
+			for (i=0; i<1024; i++){
+				m.instante=m.energia_dia=(uint32_t)escrituras++;
+				an_escribe(&anillo_medida, &m);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &fin);
+		} while ((fin.tv_sec-inicio.tv_sec)*1e9+(fin.tv_nsec-inicio.tv_nsec)<segundos*1e9);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &fin_cpu);
+		ns=(fin_cpu.tv_sec-inicio_cpu.tv_sec)*1e9+(fin_cpu.tv_nsec-inicio_cpu.tv_nsec);
+		fin_medida=1;
+		lecturas=perdidas=0;
+		for (i=0; i<lectores; i++){
+			pthread_join(hilos[i], NULL);
+			lecturas+=r[i].operaciones;
+			perdidas+=r[i].fallidas;
+			mezcladas+=r[i].mezcladas;
+		}
+		printf("%7d  %12.1f  %10lu  %12lu  %11lu\n", lectores, ns/escrituras, escrituras,
+				lectores?lecturas/lectores:0, lectores?perdidas/lectores:0);
+	}
+	printf("torn reads: %lu\n", mezcladas);
+	return mezcladas?-1:0;
+}
+
+/*
+ * Traza de reproduccion para el limitador: potencia consumida y potencia que los inversores
+ * podrian generar sin limite, una muestra por segundo
+ */
+struct traza{
+	float *consumo;
+	float *disponible;
+	size_t n;
+};
+
+/*
+ * Traza a partir del registro binario. El consumo es la generada mas la importada. La potencia
+ * disponible solo se conoce cuando no habia limite; mientras lo habia se toma la ultima conocida
+ * si es mayor que la generada, lo que es una cota inferior de la energia recortada
+ */
+static int traza_de_registro(const char *fichero, struct traza *t){
+	static struct muestra_bin muestras[MUESTRAS_BLOQUE_BIN];
+	struct mapa_registro_bin mapa;
+	const struct muestra_bin *m;
+	float ultima_libre=0;
+	size_t n, i, posicion=0, capacidad=0;
+
+	if (rb_mapea(fichero, &mapa)){
+		return -1;
+	}
+	t->consumo=t->disponible=NULL;
+	t->n=0;
+	do {
+		n=rb_lee_bloque(&mapa, posicion, muestras, &posicion);
+		if (t->n+n>capacidad){
+			capacidad=2*capacidad+n;
+			t->consumo=realloc(t->consumo, capacidad*sizeof(float));
+			t->disponible=realloc(t->disponible, capacidad*sizeof(float));
+		}
+		for (i=0; i<n; i++){
+			m=&muestras[i];
+			if (!(m->estado & ESTADO_MUESTRA_VALIDA)){
+				continue;
+			}
+			t->consumo[t->n]=(float)m->potencia_generada+m->potencia_importada;
+			if (m->limite>=100){
+				ultima_libre=m->potencia_generada;
+			}
+			t->disponible[t->n]=m->limite>=100||ultima_libre<m->potencia_generada?m->potencia_generada:ultima_libre;
+			t->n++;
+		}
+	} while (n==MUESTRAS_BLOQUE_BIN);
+	rb_desmapea(&mapa);
+	return 0;
+}
+
+/*
+ * Traza de texto: una linea por segundo con la potencia consumida y la disponible en W
+ */
+static int traza_de_texto(const char *fichero, struct traza *t){
+	FILE *f;
+	size_t capacidad=3600;
+	float consumo, disponible;
+
+	f=fopen(fichero, "r");
+	if (f==NULL){
+		return -1;
+	}
+	t->consumo=malloc(capacidad*sizeof(float));
+	t->disponible=malloc(capacidad*sizeof(float));
+	t->n=0;
+	while (fscanf(f, "%f %f", &consumo, &disponible)==2){
+		if (t->n==capacidad){
+			capacidad*=2;
+			t->consumo=realloc(t->consumo, capacidad*sizeof(float));
+			t->disponible=realloc(t->disponible, capacidad*sizeof(float));
+		}
+		t->consumo[t->n]=consumo;
+		t->disponible[t->n]=disponible;
+		t->n++;
+	}
+	fclose(f);
+	return t->n?0:-1;
+}
+
+/*
+ * Traza sintetica de un dia de 8 horas de sol con nubes y consumos de electrodomesticos:
+ * base con ruido, hervidor, horno con termostato y lavadora. Siempre la misma para una semilla
+ */
+static void traza_sintetica(float potencia_nominal, unsigned int semilla, struct traza *t){
+	size_t i, fin_hervidor=0, fin_horno=0, fin_lavadora=0, fin_nube=0;
+	float nube=1;
+
+	t->n=8*3600;
+	t->consumo=malloc(t->n*sizeof(float));
+	t->disponible=malloc(t->n*sizeof(float));
+	srand(semilla);
+	for (i=0; i<t->n; i++){
+		if (i>=fin_nube && rand()%600==0){
+			fin_nube=i+30+rand()%300;
+			nube=0.2f+0.5f*rand()/RAND_MAX;
+		}
+		t->disponible[i]=0.9f*potencia_nominal*sinf(M_PI*i/t->n)*(i<fin_nube?nube:1);
+
+		if (i>=fin_hervidor && rand()%2400==0) fin_hervidor=i+150+rand()%90;
+		if (i>=fin_horno && rand()%14400==0)   fin_horno=i+1800;
+		if (i>=fin_lavadora && rand()%10800==0) fin_lavadora=i+3600;
+		t->consumo[i]=250+rand()%60
+				+(i<fin_hervidor?2000:0)
+				+(i<fin_horno && (i/45)%2?1500:0)
+				+(i<fin_lavadora?(i%900<600?180:2000*(i%900<780)):0);
+	}
+}
+
+struct resultado_limitador{
+	double recortada;   // Wh que se podian generar y no se han generado
+	double exportada;   // Wh
+	double importada;   // Wh
+	unsigned long tramas; // comandos 0x9F enviados
+	unsigned long segundos_exportando;
+};
+
+/*
+ * Reproduce la traza con un retardo de un ciclo entre el calculo del limite y su efecto:
+ * la generacion de cada segundo es la disponible acotada por el limite calculado en el anterior.
+ * anterior!=0 usa el algoritmo original (limite igual al consumo al exportar, +1%/s si no,
+ * 0x9F todos los segundos); si no el regulador de limitador.c con un 0x9F solo cuando cambia
+ */
+static void reproduce_limitador(const struct traza *t, float potencia_nominal, const char *opcion_k,
+		int anterior, struct resultado_limitador *r){
+	struct limitador lm;
+	int limite=100, nuevo;
+	float generada;
+	size_t i;
+
+	memset(r, 0, sizeof(*r));
+	lm_inicia(&lm, potencia_nominal);
+	if (opcion_k!=NULL){
+		lm_configura(&lm, opcion_k);
+	}
+	for (i=0; i<t->n; i++){
+		generada=fminf(t->disponible[i], limite*potencia_nominal/100);
+		r->recortada+=(t->disponible[i]-generada)/3600;
+		if (generada>t->consumo[i]){
+			r->exportada+=(generada-t->consumo[i])/3600;
+			r->segundos_exportando++;
+		}
+		else {
+			r->importada+=(t->consumo[i]-generada)/3600;
+		}
+
+		if (anterior){
+			if (t->consumo[i]-generada<0){
+				nuevo=(int)(t->consumo[i]*100/potencia_nominal);
+				nuevo=nuevo<10?10:nuevo;
+			}
+			else {
+				nuevo=limite>=100-1?100:limite+1;
+			}
+			r->tramas++;
+		}
+		else {
+			nuevo=lm_calcula(&lm, t->consumo[i], generada, 1);
+			if (nuevo!=limite){
+				r->tramas++;
+			}
+		}
+		limite=nuevo;
+	}
+}
+
+/*
+ * Compara el algoritmo de limitacion original y el regulador sobre una traza
+ */
+int comando_bench_limiter(int argc, char *argv[]){
+	struct traza t;
+	struct resultado_limitador r[2];
+	float potencia_nominal;
+	const char *opcion_k=argc>3?argv[3]:NULL;
+	struct limitador lm;
+	int rc, i;
+
+	if (argc<3 || (potencia_nominal=atof(argv[2]))<=0){
+		printf("Use: fronius-util bench-limiter file.bin|file.txt|synthetic[:seed] nominal_w [controller_options]\n");
+		return -1;
+	}
+	lm_inicia(&lm, potencia_nominal);
+	if (opcion_k!=NULL && lm_configura(&lm, opcion_k)){
+		printf("Error: invalid controller options %s\n", opcion_k);
+		return -1;
+	}
+	if (strncmp(argv[1], "synthetic", 9)==0){
+		traza_sintetica(potencia_nominal, argv[1][9]==':'?atoi(argv[1]+10):1, &t);
+		rc=0;
+	}
+	else {
+		rc=traza_de_registro(argv[1], &t);
+		if (rc){
+			rc=traza_de_texto(argv[1], &t);
+		}
+	}
+	if (rc){
+		printf("Error: %s is not a binary log nor a text trace\n", argv[1]);
+		return -1;
+	}
+
+	reproduce_limitador(&t, potencia_nominal, NULL, 1, &r[0]);
+	reproduce_limitador(&t, potencia_nominal, opcion_k, 0, &r[1]);
+
+	printf("trace: %zu s  nominal: %.0f W  controller: kp=%g ki=%g margin=%gW up=%g%%/s down=%g%%/s band=%g%%\n",
+			t.n, potencia_nominal, lm.kp, lm.ki, lm.margen, lm.subida, lm.bajada, lm.banda);
+	printf("algorithm     curtailed(Wh)  exported(Wh)  imported(Wh)  export(s)  0x9F frames\n");
+	for (i=0; i<2; i++){
+		printf("%-12s  %13.1f  %12.1f  %12.1f  %9lu  %11lu\n", i?"controller":"original",
+				r[i].recortada, r[i].exportada, r[i].importada, r[i].segundos_exportando, r[i].tramas);
+	}
+	free(t.consumo);
+	free(t.disponible);
+	return 0;
+}
+
+/*
+ * Reproduccion de una captura de fronius-mon -C
+ */
+struct reproduccion{
+	struct parser_trama tx;           // peticiones enviadas
+	struct parser_trama rx;           // respuestas recibidas
+	struct limitador lm;
+	int configurado;                  // lm configurado (por la captura o por la linea de comandos)
+	int limite;                       // ultimo limite recalculado (-1: ninguno todavia)
+	float potencia[256];              // potencia (0x10) de cada inversor respondida en el ciclo
+	uint8_t respondido[256];
+	unsigned long bytes_tx, bytes_rx, tramas_tx, tramas_rx, tramas_error;
+	unsigned long calculos, muestras;
+	unsigned long limites_distintos;  // calculos cuyo limite no es el capturado
+	unsigned long potencias_distintas; // muestras cuya potencia generada no es la suma de las respuestas 0x10
+};
+
+/*
+ * Analiza las respuestas recibidas: cada respuesta correcta de potencia se decodifica con la tabla de medidas
+ */
+static void reproduce_rx(struct reproduccion *r, const unsigned char *datos, int longitud){
+	struct fronius_frame trama;
+	float valor;
+	int rc;
+
+	r->bytes_rx+=longitud;
+	while (longitud>0){
+		rc=pt_alimenta(&r->rx, datos, longitud);
+		datos+=rc;
+		longitud-=rc;
+		while ((rc=pt_extrae(&r->rx, &trama))!=0){
+			if (rc==-1){
+				r->tramas_error++;
+				continue;
+			}
+			r->tramas_rx++;
+			if (trama.device==0x01 && trama.command==medidas[MED_POTENCIA].comando &&
+					medidas[MED_POTENCIA].decodifica(trama.data_plus_checksum, trama.lenght, &valor)==0){
+				r->potencia[trama.number]=valor*medidas[MED_POTENCIA].escala;
+				r->respondido[trama.number]=1;
+			}
+		}
+	}
+}
+
+/*
+ * Las peticiones solo se cuentan. Antes de cada una fronius-mon descarta lo recibido y no analizado
+ */
+static void reproduce_tx(struct reproduccion *r, const unsigned char *datos, int longitud){
+	struct fronius_frame trama;
+	int rc;
+
+	r->bytes_tx+=longitud;
+	pt_descarta(&r->rx);
+	while (longitud>0){
+		rc=pt_alimenta(&r->tx, datos, longitud);
+		datos+=rc;
+		longitud-=rc;
+		while ((rc=pt_extrae(&r->tx, &trama))!=0){
+			if (rc==1){
+				r->tramas_tx++;
+			}
+		}
+	}
+}
+
+/*
+ * Configura el limitador como lo tenia fronius-mon: "nominal=W k=opciones"
+ */
+static int reproduce_configuracion(struct reproduccion *r, const unsigned char *datos, int longitud){
+	char texto[TAMANO_HUECO_ESCRITOR];
+	char *k;
+
+	if (longitud>=(int)sizeof(texto)){
+		return -1;
+	}
+	memcpy(texto, datos, longitud);
+	texto[longitud]=0;
+	k=strstr(texto, " k=");
+	if (strncmp(texto, "nominal=", 8)!=0 || k==NULL){
+		return -1;
+	}
+	lm_inicia(&r->lm, atof(texto+8));
+	if (k[3] && lm_configura(&r->lm, k+3)){
+		return -1;
+	}
+	r->configurado=1;
+	return 0;
+}
+
+/*
+ * Vuelve a pasar una captura de fronius-mon -C por el analizador de tramas, el limitador y el
+ * registro binario, a la velocidad capturada multiplicada por un factor o tan rapido como se pueda.
+ * Sirve de prueba de regresion (el limite recalculado y la potencia decodificada deben coincidir con
+ * los capturados) y de medida de rendimiento
+ */
+int comando_replay(int argc, char *argv[]){
+	static struct reproduccion r;
+	struct mapa_captura mapa;
+	struct bloque_captura bloque;
+	struct calculo_captura calculo;
+	struct muestra_bin muestra;
+	struct codificador_registro_bin codificador;
+	struct timespec inicio, fin, objetivo;
+	const unsigned char *datos;
+	const char *opcion_k=argc>4?argv[4]:NULL;
+	double factor=0, capturado_s=0, transcurrido_s, suma;
+	int64_t capturado_us=0, objetivo_ns;
+	time_t comienzo;
+	size_t posicion=0;
+	int fdatos=-1, limite, i;
+
+	if (argc<2 || argc>5 || (argc>2 && strcmp(argv[2], "max")!=0 && (factor=atof(argv[2]))<=0)){
+		printf("Use: fronius-util replay file.cap [max|speed] [out.bin|-] [controller_options]\n");
+		return -1;
+	}
+	if (cp_mapea(argv[1], &mapa)){
+		printf("Error: %s is not a capture file\n", argv[1]);
+		return -1;
+	}
+	if (argc>3 && strcmp(argv[3], "-")!=0 && (fdatos=rb_abre(argv[3], &codificador))<0){
+		printf("Error opening %s\n", argv[3]);
+		cp_desmapea(&mapa);
+		return -1;
+	}
+	memset(&r, 0, sizeof(r));
+	pt_inicia(&r.tx);
+	pt_inicia(&r.rx);
+	r.limite=-1;
+	if (opcion_k!=NULL){
+		// las opciones de la linea de comandos sustituyen a las capturadas: prueba de otro ajuste
+		lm_inicia(&r.lm, 0);
+		if (lm_configura(&r.lm, opcion_k)){
+			printf("Error: invalid controller options %s\n", opcion_k);
+			cp_desmapea(&mapa);
+			return -1;
+		}
+		r.configurado=1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &inicio);
+	while ((datos=cp_siguiente(&mapa, &posicion, &bloque))!=NULL){
+		capturado_us+=bloque.desfase_us;
+		if (factor>0){
+			objetivo_ns=(int64_t)(capturado_us*1000/factor);
+			objetivo.tv_sec=inicio.tv_sec+(objetivo_ns+inicio.tv_nsec)/1000000000;
+			objetivo.tv_nsec=(objetivo_ns+inicio.tv_nsec)%1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &objetivo, NULL);
+		}
+		switch (bloque.tipo){
+		case BC_TX:
+			reproduce_tx(&r, datos, bloque.longitud);
+			break;
+		case BC_RX:
+			reproduce_rx(&r, datos, bloque.longitud);
+			break;
+		case BC_APERTURA:
+			pt_inicia(&r.tx);
+			pt_inicia(&r.rx);
+			break;
+		case BC_CONFIGURACION:
+			if (opcion_k!=NULL){
+				// solo se toma la potencia nominal
+				r.lm.potencia_nominal=atof((const char *)datos+8);
+			}
+			else if (reproduce_configuracion(&r, datos, bloque.longitud)){
+				printf("Warning: invalid controller configuration in the capture\n");
+			}
+			break;
+		case BC_CALCULO:
+			if (bloque.longitud!=sizeof(calculo) || !r.configurado){
+				break;
+			}
+			memcpy(&calculo, datos, sizeof(calculo));
+			limite=lm_calcula(&r.lm, calculo.consumo, calculo.generada, calculo.dt);
+			if (limite!=calculo.limite){
+				r.limites_distintos++;
+			}
+			r.limite=limite;
+			r.calculos++;
+			break;
+		case BC_MUESTRA:
+			if (bloque.longitud!=sizeof(muestra)){
+				break;
+			}
+			memcpy(&muestra, datos, sizeof(muestra));
+			for (i=0, suma=0; i<256; i++){
+				if (r.respondido[i]){
+					suma+=r.potencia[i];
+				}
+			}
+			if (muestra.estado & ESTADO_MUESTRA_VALIDA &&
+					(suma>UINT16_MAX?UINT16_MAX:(uint16_t)(suma+0.5))!=muestra.potencia_generada){
+				r.potencias_distintas++;
+			}
+			memset(r.respondido, 0, sizeof(r.respondido));
+			if (r.limite>=0){
+				muestra.limite=r.limite;
+			}
+			if (fdatos>=0){
+				rb_escribe(fdatos, &codificador, &muestra, 1);
+			}
+			r.muestras++;
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &fin);
+	transcurrido_s=(fin.tv_sec-inicio.tv_sec)+(fin.tv_nsec-inicio.tv_nsec)/1e9;
+	capturado_s=capturado_us/1e6;
+
+	comienzo=mapa.cabecera->inicio_ns/1000000000;
+	printf("capture: %.1f s from %s", capturado_s, ctime(&comienzo));
+	printf("replay: %.3f s (x%.0f)  %.1f MB/s  %.0f frames/s\n", transcurrido_s, capturado_s/transcurrido_s,
+			(r.bytes_tx+r.bytes_rx)/transcurrido_s/1e6, (r.tramas_tx+r.tramas_rx)/transcurrido_s);
+	printf("bytes: tx %lu rx %lu  frames: tx %lu rx %lu, %lu discarded (checksum %lu, length %lu)\n",
+			r.bytes_tx, r.bytes_rx, r.tramas_tx, r.tramas_rx, r.tramas_error, r.rx.errores_checksum, r.rx.errores_longitud);
+	printf("limit: %lu calculations, %lu different from the captured ones%s\n", r.calculos, r.limites_distintos,
+			opcion_k!=NULL?" (controller options replaced)":"");
+	printf("samples: %lu, %lu with a generated power different from the 0x10 replies\n", r.muestras, r.potencias_distintas);
+	if (fdatos>=0){
+		close(fdatos);
+	}
+	cp_desmapea(&mapa);
+	return opcion_k==NULL && (r.limites_distintos || r.potencias_distintas)?-1:0;
+}
+
+/*
+ * Envia un aviso de lectura de consumo como lo haria el medidor
+ */
+int comando_notify(int argc, char *argv[]){
+	int fd;
+
+	if (argc!=3){
+		printf("Use: fronius-util notify socket consumption_w\n");
+		return -1;
+	}
+	fd=av_abre_emisor();
+	if (fd==-1 || av_envia(fd, argv[1], 0, atof(argv[2]))){
+		printf("Error: notification could not be sent to %s\n", argv[1]);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Retardo entre una caida de consumo notificada y el 0x9F que la corrige.
+ * Hace de medidor enviando una lectura cada periodo_ms: consumo alto durante 6 s para que el limite
+ * suba, y consumo bajo durante 2 s empezando en una fase aleatoria del segundo. fronius-mon (-n o -N)
+ * mide el retardo de cada escalon y lo publica; al final se presenta lo publicado
+ */
+int comando_bench_notify(int argc, char *argv[]){
+	const struct publicacion *pub;
+	struct datos_inversores antes, despues;
+	int escalones=argc>2?atoi(argv[2]):10;
+	float alto=argc>3?atof(argv[3]):20000;
+	float bajo=argc>4?atof(argv[4]):300;
+	int periodo_ms=200;
+	uint32_t secuencia=0;
+	unsigned long exportacion;
+	int fd, e, t;
+
+	if (argc<2 || escalones<=0){
+		printf("Use: fronius-util bench-notify socket [steps] [high_w] [low_w]\n");
+		return -1;
+	}
+	pub=pub_conecta();
+	fd=av_abre_emisor();
+	if (pub==NULL || fd==-1 || pub_lee(pub, &antes)<0){
+		printf("Error: fronius-mon is not running\n");
+		return -1;
+	}
+	srand(time(NULL));
+	for (e=0; e<escalones; e++){
+		for (t=0; t<6000; t+=periodo_ms){
+			av_envia(fd, argv[1], secuencia++, alto);
+			usleep(periodo_ms*1000);
+		}
+		usleep(rand()%1000*1000);
+		for (t=0; t<2000; t+=periodo_ms){
+			av_envia(fd, argv[1], secuencia++, bajo);
+			usleep(periodo_ms*1000);
+		}
+		printf("\rstep %d/%d", e+1, escalones);
+		fflush(stdout);
+	}
+	close(fd);
+	if (pub_lee(pub, &despues)<0){
+		printf("\nError: no consistent snapshot could be read\n");
+		return -1;
+	}
+	exportacion=despues.avisos_exportacion-antes.avisos_exportacion;
+	printf("\nnotifications sent:%u received:%lu export steps answered:%lu\n",
+			secuencia, despues.avisos-antes.avisos, exportacion);
+	if (exportacion){
+		printf("delay from notification to 0x9F on the line: mean %.1f ms  max %.1f ms (max since start)\n",
+				(despues.retardo_aviso_total_ms-antes.retardo_aviso_total_ms)/exportacion, despues.retardo_aviso_max_ms);
+	}
+	return 0;
+}
+
+/*
+ * Suma de la energia generada y consumida de n dias hasta el dia indicado, ambos incluidos.
+ * Devuelve el numero de dias que estan en el historico
+ */
+static int suma_dias(const struct historico *h, int32_t ultimo, int n, double *generada, double *consumida){
+	const struct dia_historico *d;
+	int i, dias=0;
+	int32_t dia;
+
+	*generada=*consumida=0;
+	for (dia=ultimo-n+1; dia<=ultimo; dia++){
+		d=hs_dia(h, dia);
+		if (d==NULL){
+			continue;
+		}
+		for (i=0; i<MAX_INVERSORES; i++){
+			*generada+=d->generada_dia[i];
+		}
+		*consumida+=d->consumida_dia;
+		dias++;
+	}
+	return dias;
+}
+
+/*
+ * Presenta el historico de varios dias: los totales de los ultimos dias y de la ultima semana,
+ * mes y año, o los cuartos de hora de una fecha
+ */
+int comando_history(int argc, char *argv[]){
+	static const struct{
+		const char *nombre;
+		int dias;
+	} periodos[]={{"week", 7}, {"month", 30}, {"year", 365}};
+	struct historico h;
+	const struct dia_historico *d;
+	struct tm fecha;
+	time_t instante;
+	int32_t hoy, dia;
+	double generada, consumida;
+	char buf[20];
+	int n, i, q, dias;
+
+	if (argc<2 || argc>3){
+		printf("Use: fronius-util history historico.bin [days|YYYY-MM-DD]\n");
+		return -1;
+	}
+	if (hs_mapea(argv[1], &h)){
+		printf("Error: %s is not a fronius-mon history file\n", argv[1]);
+		return -1;
+	}
+	hoy=hs_dia_de(time(NULL));
+
+	memset(&fecha, 0, sizeof(fecha));
+	if (argc==3 && sscanf(argv[2], "%d-%d-%d", &fecha.tm_year, &fecha.tm_mon, &fecha.tm_mday)==3){
+		fecha.tm_year-=1900;
+		fecha.tm_mon--;
+		fecha.tm_hour=12;
+		fecha.tm_isdst=-1;
+		d=hs_dia(&h, hs_dia_de(mktime(&fecha)));
+		if (d==NULL){
+			printf("%s is not in the history\n", argv[2]);
+			hs_cierra(&h);
+			return -1;
+		}
+		printf("time \tconsumed(Wh)");
+		for (i=0; i<MAX_INVERSORES && d->numero[i]; i++){
+			printf("\tinv%d(Wh)", d->numero[i]);
+		}
+		printf("\n");
+		for (q=0; q<INTERVALOS_DIA; q++){
+			printf("%02d:%02d\t%8.1f", q/4, q%4*15, d->consumida[q]);
+			for (i=0; i<MAX_INVERSORES && d->numero[i]; i++){
+				printf("\t%8.1f", d->generada[i][q]);
+			}
+			printf("\n");
+		}
+		hs_cierra(&h);
+		return 0;
+	}
+
+	n=argc==3?atoi(argv[2]):7;
+	printf("day       \tgenerated(Wh)\tconsumed(Wh)\tper inverter(Wh)\n");
+	for (dia=hoy-n+1; dia<=hoy; dia++){
+		d=hs_dia(&h, dia);
+		if (d==NULL){
+			continue;
+		}
+		instante=hs_instante_de(dia);
+		strftime(buf, sizeof(buf), "%Y-%m-%d", localtime(&instante));
+		for (i=0, generada=0; i<MAX_INVERSORES; i++){
+			generada+=d->generada_dia[i];
+		}
+		printf("%s\t%13.1f\t%12.1f\t", buf, generada, d->consumida_dia);
+		for (i=0; i<MAX_INVERSORES && d->numero[i]; i++){
+			printf(" [%d] %.1f", d->numero[i], d->generada_dia[i]);
+		}
+		printf("\n");
+	}
+	for (i=0; i<(int)(sizeof(periodos)/sizeof(periodos[0])); i++){
+		dias=suma_dias(&h, hoy, periodos[i].dias, &generada, &consumida);
+		printf("last %-5s generated:%.1fWh consumed:%.1fWh (%d days recorded)\n", periodos[i].nombre, generada, consumida, dias);
+	}
+	hs_cierra(&h);
+	return 0;
+}
+
+/*
+ * Fecha local YYYY-MM-DD[THH:MM[:SS]]. Devuelve -1 si no es valida
+ */
+static time_t lee_fecha(const char *texto){
+	struct tm fecha;
+	int n;
+
+	memset(&fecha, 0, sizeof(fecha));
+	n=sscanf(texto, "%d-%d-%dT%d:%d:%d", &fecha.tm_year, &fecha.tm_mon, &fecha.tm_mday,
+			&fecha.tm_hour, &fecha.tm_min, &fecha.tm_sec);
+	if (n!=3 && n!=5 && n!=6){
+		return -1;
+	}
+	fecha.tm_year-=1900;
+	fecha.tm_mon--;
+	fecha.tm_isdst=-1;
+	return mktime(&fecha);
+}
+
+/*
+ * Duracion de una cubeta: 30s, 15m, 1h, 1d, 1w. Devuelve -1 si no es valida
+ */
+static time_t lee_cubeta(const char *texto){
+	char *fin;
+	long n=strtol(texto, &fin, 10);
+
+	if (fin==texto || n<=0){
+		return -1;
+	}
+	switch (*fin){
+	case 'w':
+		n*=7;
+		/* fall through */
+	case 'd':
+		n*=24;
+		/* fall through */
+	case 'h':
+		n*=60;
+		/* fall through */
+	case 'm':
+		n*=60;
+		/* fall through */
+	case 's':
+		fin++;
+		break;
+	}
+	return *fin?-1:n;
+}
+
+#define MAX_CUBETAS_CONSULTA 100000
+
+/*
+ * Totales por cubetas de un rango de fechas del registro binario usando su indice
+ * (fichero.bin.idx, que se crea o pone al dia): energia generada, exportada e importada y
+ * minimo, medio y maximo de una serie. El rango incluye el principio y no el final
+ */
+int comando_query(int argc, char *argv[]){
+	struct indice_bin ix;
+	struct agregado_indice *agregados;
+	struct timespec t0, t1, t2;
+	time_t inicio, fin, cubeta=0, instante;
+	struct tm loc_time;
+	char buf[30];
+	int campo=CI_GENERADA, cubetas, i;
+	double exportada;
+
+	if (argc<4 || argc>6 || (inicio=lee_fecha(argv[2]))==-1 || (fin=lee_fecha(argv[3]))==-1 || fin<=inicio ||
+			(argc>4 && (cubeta=lee_cubeta(argv[4]))==-1)){
+		printf("Use: fronius-util query file.bin from to [bucket] [series]\n"
+				"  from, to: YYYY-MM-DD[THH:MM[:SS]] local time, to excluded\n"
+				"  bucket: 30s, 15m, 1h, 1d, 1w... (default: the whole range)\n"
+				"  series: power, import, export, limit, dcv, dci (default: power)\n");
+		return -1;
+	}
+	if (argc==6){
+		for (campo=0; campo<NUM_CAMPOS_INDICE && strcmp(argv[5], nombres_campos_indice[campo]); campo++);
+		if (campo==NUM_CAMPOS_INDICE){
+			printf("Error: unknown series %s\n", argv[5]);
+			return -1;
+		}
+	}
+	if ((fin-inicio+(cubeta?cubeta:1)-1)/(cubeta?cubeta:(fin-inicio))>MAX_CUBETAS_CONSULTA){
+		printf("Error: more than %d buckets\n", MAX_CUBETAS_CONSULTA);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (ib_abre(argv[1], &ix)){
+		printf("Error: %s is not a fronius-mon binary log\n", argv[1]);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	agregados=malloc(MAX_CUBETAS_CONSULTA*sizeof(*agregados));
+	if (agregados==NULL){
+		ib_cierra(&ix);
+		return -1;
+	}
+	cubetas=ib_consulta(&ix, inicio, fin, cubeta, agregados);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	if (cubeta==0){
+		cubeta=fin-inicio;
+	}
+
+	printf("from                    \tsamples\tgenerated(Wh)\texported(Wh)\timported(Wh)\t%s min\tmean\tmax\n",
+			nombres_campos_indice[campo]);
+	for (i=0; i<cubetas; i++){
+		const struct agregado_indice *a=&agregados[i];
+
+		instante=inicio+i*cubeta;
+		localtime_r(&instante, &loc_time);
+		strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S%z", &loc_time);
+		if (a->muestras==0){
+			printf("%s\t%7d\n", buf, 0);
+			continue;
+		}
+		// con una muestra por segundo la suma de potencias en W es la energia en W*s
+		exportada=a->campo[CI_EXPORTADA].suma;
+		printf("%s\t%7lu\t%13.1f\t%12.1f\t%12.1f\t%.1f\t%.1f\t%.1f\n", buf, (unsigned long)a->muestras,
+				a->campo[CI_GENERADA].suma/3600, exportada/3600, (a->campo[CI_IMPORTADA].suma+exportada)/3600,
+				a->campo[campo].minimo, a->campo[campo].suma/a->muestras, a->campo[campo].maximo);
+	}
+	printf("\nindex %s: %lu entries of %d samples, opened in %.2f ms (%s)\n", argv[1], (unsigned long)ix.num_entradas,
+			MUESTRAS_BLOQUE_INDICE, (t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6, ix.fichero?"file":"memory");
+	printf("query: %.3f ms, %lu blocks from the index, %lu blocks read\n",
+			(t2.tv_sec-t1.tv_sec)*1e3+(t2.tv_nsec-t1.tv_nsec)/1e6, ix.bloques_resumidos, ix.bloques_leidos);
+	free(agregados);
+	ib_cierra(&ix);
+	return 0;
+}
+
+/*
+ * Histograma de tiempos en formato Prometheus (segundos, cubetas acumuladas)
+ */
+static void prom_histograma(const char *nombre, const char *etiquetas, const uint32_t *h, uint64_t total_us){
+	uint64_t acumulado=0;
+	int b;
+
+	for (b=0; b<CUBETAS_TIEMPO-1; b++){
+		acumulado+=h[b];
+		printf("%s_bucket{%s%sle=\"%g\"} %llu\n", nombre, etiquetas, *etiquetas?",":"", (2u<<b)/1e6, (unsigned long long)acumulado);
+	}
+	acumulado+=h[b];
+	printf("%s_bucket{%s%sle=\"+Inf\"} %llu\n", nombre, etiquetas, *etiquetas?",":"", (unsigned long long)acumulado);
+	printf("%s_sum{%s} %g\n", nombre, etiquetas, total_us/1e6);
+	printf("%s_count{%s} %llu\n", nombre, etiquetas, (unsigned long long)acumulado);
+}
+
+/*
+ * Vuelca las estadisticas del bus de fronius-mon: tabla por inversor y comando o formato Prometheus
+ */
+int comando_stats(int argc, char *argv[]){
+	const struct estadisticas *e;
+	const struct estadistica_comando *ec;
+	static const struct{
+		const char *nombre;
+		size_t desplazamiento;
+	} contadores[]={
+		{"requests", offsetof(struct estadistica_comando, peticiones)},
+		{"retries", offsetof(struct estadistica_comando, reintentos)},
+		{"responses", offsetof(struct estadistica_comando, respuestas)},
+		{"error_replies", offsetof(struct estadistica_comando, errores_0e)},
+		{"timeouts", offsetof(struct estadistica_comando, plazos)},
+		{"header_errors", offsetof(struct estadistica_comando, errores_cabecera)},
+		{"checksum_errors", offsetof(struct estadistica_comando, errores_checksum)},
+		{"length_errors", offsetof(struct estadistica_comando, errores_longitud)},
+		{"device_errors", offsetof(struct estadistica_comando, errores_dispositivo)},
+	};
+	char etiquetas[64];
+	int prom, i, c, k;
+
+	prom=argc==2 && strcmp(argv[1], "prom")==0;
+	if (argc>2 || (argc==2 && !prom)){
+		printf("Use: fronius-util stats [prom]\n");
+		return -1;
+	}
+	e=est_conecta();
+	if (e==NULL){
+		printf("Error: fronius-mon statistics shared memory not found\n");
+		return -1;
+	}
+
+	if (prom){
+		printf("fronius_start_time_seconds %lld\n", (long long)e->inicio);
+		printf("fronius_reconnects_total %llu\n", (unsigned long long)e->reconexiones);
+		printf("fronius_cycles_total %llu\n", (unsigned long long)e->ciclos);
+		printf("fronius_cycle_overruns_total %llu\n", (unsigned long long)e->ciclos_excedidos);
+		printf("fronius_flushed_bytes_total %llu\n", (unsigned long long)e->bytes_vaciados);
+		prom_histograma("fronius_cycle_seconds", "", e->ciclo, e->ciclo_total_us);
+		printf("fronius_ticks_total %llu\n", (unsigned long long)e->tics);
+		printf("fronius_ticks_lost_total %llu\n", (unsigned long long)e->tics_perdidos);
+		printf("fronius_tick_realignments_total %llu\n", (unsigned long long)e->realineaciones);
+		printf("fronius_minutes_skipped_total %llu\n", (unsigned long long)e->minutos_saltados);
+		prom_histograma("fronius_tick_delay_seconds", "", e->retraso_tic, e->retraso_tic_total_us);
+	}
+	else {
+		printf("reconnects:%llu cycles:%llu overruns:%llu flushed_bytes:%llu cycle p50:%uus p99:%uus max:%uus\n",
+				(unsigned long long)e->reconexiones, (unsigned long long)e->ciclos, (unsigned long long)e->ciclos_excedidos,
+				(unsigned long long)e->bytes_vaciados, est_percentil(e->ciclo, e->ciclo_max_us, 0.5), est_percentil(e->ciclo, e->ciclo_max_us, 0.99), e->ciclo_max_us);
+		printf("ticks:%llu lost:%llu realigned:%llu minutes_skipped:%llu tick delay mean:%.0fus p50:%uus p99:%uus max:%uus\n",
+				(unsigned long long)e->tics, (unsigned long long)e->tics_perdidos, (unsigned long long)e->realineaciones,
+				(unsigned long long)e->minutos_saltados, e->tics?(double)e->retraso_tic_total_us/e->tics:0,
+				est_percentil(e->retraso_tic, e->retraso_tic_max_us, 0.5), est_percentil(e->retraso_tic, e->retraso_tic_max_us, 0.99),
+				e->retraso_tic_max_us);
+		printf("%4s %4s %8s %6s %8s %6s %6s %6s %6s %6s %6s %8s %8s %8s %8s (us)\n", "inv", "cmd", "req", "retry", "ok", "0x0e", "tmout",
+				"head", "cksum", "len", "dev", "mean", "p50", "p99", "max");
+	}
+	for (i=0; i<=MAX_INVERSORES; i++){
+		if (i<MAX_INVERSORES && e->numero[i]==0){
+			continue;
+		}
+		for (c=0; c<MAX_COMANDOS_ESTADISTICA && e->comando[c]; c++){
+			ec=&e->e[i][c];
+			if (ec->peticiones==0){
+				continue;
+			}
+			if (prom){
+				snprintf(etiquetas, sizeof(etiquetas), "inverter=\"%d\",command=\"0x%02x\"", i<MAX_INVERSORES?e->numero[i]:0, e->comando[c]);
+				for (k=0; k<(int)(sizeof(contadores)/sizeof(contadores[0])); k++){
+					printf("fronius_%s_total{%s} %llu\n", contadores[k].nombre, etiquetas,
+							(unsigned long long)*(const uint64_t *)((const char *)ec+contadores[k].desplazamiento));
+				}
+				prom_histograma("fronius_rtt_seconds", etiquetas, ec->tiempo, ec->tiempo_total_us);
+				continue;
+			}
+			printf("%4d 0x%02x %8llu %6llu %8llu %6llu %6llu %6llu %6llu %6llu %6llu %8.0f %8u %8u %8u\n",
+					i<MAX_INVERSORES?e->numero[i]:0, e->comando[c],
+					(unsigned long long)ec->peticiones, (unsigned long long)ec->reintentos, (unsigned long long)ec->respuestas,
+					(unsigned long long)ec->errores_0e, (unsigned long long)ec->plazos,
+					(unsigned long long)ec->errores_cabecera, (unsigned long long)ec->errores_checksum,
+					(unsigned long long)ec->errores_longitud, (unsigned long long)ec->errores_dispositivo,
+					ec->respuestas+ec->errores_0e?(double)ec->tiempo_total_us/(ec->respuestas+ec->errores_0e):0,
+					est_percentil(ec->tiempo, ec->tiempo_max_us, 0.5), est_percentil(ec->tiempo, ec->tiempo_max_us, 0.99), ec->tiempo_max_us);
+		}
+	}
+	shmdt(e);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+	if (argc<2 || strcmp(argv[1], "-h")==0){
+		printf("%s\n", identificacion);
+		printf("\nUse: fronius-util command [args]");
+		printf("\ntxt file.bin    print a binary log in the datosinversor.txt text format");
+		printf("\nbench-parser corpus_dir [rounds] [seed]  feed the frame parser corpus in random chunks, check the frame and error counts and measure bytes/s");
+		printf("\nhistory historico.bin [days|YYYY-MM-DD]  print daily, weekly, monthly and yearly energy or the quarters of a day");
+		printf("\nquery file.bin from to [bucket] [series]  energy and min/mean/max of a series per bucket over any date range, using an index");
+		printf("\nsnapshot        print the last consistent snapshot published by fronius-mon");
+		printf("\nstats [prom]    print per inverter and command counters and round trip times of fronius-mon (prom: Prometheus text format)");
+		printf("\nbench-snapshot [readers] [seconds]  measure snapshot writer and reader cost under contention");
+		printf("\nfollow [all|new] [period_s]  print every 1 s sample of the fronius-mon sample ring, reading every period_s seconds");
+		printf("\nbench-ring [max_readers] [seconds]  measure the sample ring producer cost with 0, 1, 2, 4... readers");
+		printf("\nnotify socket consumption_w  send a consumption notification as the meter does");
+		printf("\nbench-notify socket [steps] [high_w] [low_w]  measure the delay from a consumption drop to the 0x9F");
+		printf("\nbench-limiter trace nominal_w [controller_options]  replay a trace with the original and the new export limiter");
+		printf("\nreplay file.cap [max|speed] [out.bin|-] [controller_options]  replay a fronius-mon -C capture through the frame parser, the limiter and the binary log");
+		printf("\n");
+		return -1;
+	}
+	if (strcmp(argv[1], "txt")==0){
+		return comando_txt(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "bench-parser")==0){
+		return comando_bench_parser(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "history")==0){
+		return comando_history(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "query")==0){
+		return comando_query(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "snapshot")==0){
+		return comando_snapshot(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "stats")==0){
+		return comando_stats(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "bench-snapshot")==0){
+		return comando_bench_snapshot(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "follow")==0){
+		return comando_follow(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "bench-ring")==0){
+		return comando_bench_ring(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "notify")==0){
+		return comando_notify(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "bench-notify")==0){
+		return comando_bench_notify(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "bench-limiter")==0){
+		return comando_bench_limiter(argc-1, argv+1);
+	}
+	if (strcmp(argv[1], "replay")==0){
+		return comando_replay(argc-1, argv+1);
+	}
+	printf("Command %s invalid. Use -h option for info\n", argv[1]);
+	return -1;
+}